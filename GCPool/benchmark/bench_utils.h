@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Helpers shared by the GCPool benchmarks.
+
+inline uint64_t benchNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+struct LatencySummary {
+    size_t ops = 0;
+    double mean_ns = 0.0;
+    uint64_t p50_ns = 0;
+    uint64_t p90_ns = 0;
+    uint64_t p99_ns = 0;
+    uint64_t p999_ns = 0;
+    uint64_t max_ns = 0;
+};
+
+// Sorts samples in place.
+inline LatencySummary summarizeLatency(std::vector<uint64_t>& samples) {
+    LatencySummary summary;
+    if (samples.empty()) {
+        return summary;
+    }
+    std::sort(samples.begin(), samples.end());
+
+    auto at = [&samples](double q) {
+        size_t idx = static_cast<size_t>(q * (samples.size() - 1) + 0.5);
+        return samples[std::min(idx, samples.size() - 1)];
+    };
+
+    uint64_t total = 0;
+    for (uint64_t s : samples) {
+        total += s;
+    }
+    summary.ops = samples.size();
+    summary.mean_ns = static_cast<double>(total) / samples.size();
+    summary.p50_ns = at(0.50);
+    summary.p90_ns = at(0.90);
+    summary.p99_ns = at(0.99);
+    summary.p999_ns = at(0.999);
+    summary.max_ns = samples.back();
+    return summary;
+}
+
+inline void printLatencyHeader() {
+    printf("%-10s %-6s %7s %8s %9s %12s %10s %10s %10s %10s %12s\n",
+           "path", "op", "threads", "pool", "ops", "mean(ns)", "p50", "p90", "p99", "p99.9", "max");
+}
+
+inline void printLatencyRow(const char* path, const char* op, int threads, size_t pool,
+                            const LatencySummary& s) {
+    printf("%-10s %-6s %7d %8zu %9zu %12.1f %10lu %10lu %10lu %10lu %12lu\n",
+           path, op, threads, pool, s.ops, s.mean_ns,
+           (unsigned long)s.p50_ns, (unsigned long)s.p90_ns, (unsigned long)s.p99_ns,
+           (unsigned long)s.p999_ns, (unsigned long)s.max_ns);
+}
+
+// Parses "1,2,4,8".
+inline std::vector<size_t> parseSizeList(const char* arg) {
+    std::vector<size_t> values;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            values.push_back(std::strtoull(item.c_str(), nullptr, 10));
+        }
+    }
+    return values;
+}
@@ -0,0 +1,265 @@
+// Microbenchmark for the memory layout of the allocator's Block metadata.
+//
+//   block_layout_bench [--blocks 10000,100000] [--lookups N] [--rounds N]
+//
+// Compares the Block of src/gcpool_allocator.cpp (hot fields in the first
+// cache line, rarely used state out of line in BlockCold) with the layout it
+// replaced (stream_uses and the history chain inline, size and ptr spread over
+// two cache lines) on the two operations that touch the most blocks:
+//
+//   lookup  best-fit lower_bound in a std::set<Block*> ordered by (size, ptr),
+//           the BlockPool of one stream
+//   merge   the try_merge_blocks walk over chains of split blocks, checking
+//           each neighbour and folding the free ones into it
+//
+// The allocator translation unit is compiled into this binary, so the current
+// layout is gcpool::Native::Block itself and cannot drift from the allocator;
+// LegacyBlock is the old layout field for field. Both are allocated from a
+// SlabAllocator and linked in shuffled order, as blocks of a long running pool
+// end up. Runs on the CPU only.
+
+#include "../src/gcpool_allocator.cpp"
+
+#include "bench_utils.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <set>
+#include <vector>
+
+namespace {
+
+using gcpool::Native::Block;
+
+constexpr size_t kChainLength = 16;
+
+struct LegacyHistoryChain {
+  void* addr;
+  size_t real_size;
+  std::unique_ptr<LegacyHistoryChain> next;
+};
+
+// the Block layout before the hot/cold split
+struct LegacyBlock {
+  int device;
+  void* stream;
+  uint32_t stream_id;
+  gcpool::flat_hash_set<void*> stream_uses;
+  size_t size;
+  size_t requested_size;
+  size_t actual_size;
+  void* pool{nullptr};
+  void* ptr{nullptr};
+  bool allocated{false};
+  LegacyBlock* prev{nullptr};
+  LegacyBlock* next{nullptr};
+  int event_count{0};
+  int gc_count{0};
+  std::unique_ptr<LegacyHistoryChain> history;
+  LegacyHistoryChain* history_last{nullptr};
+  std::shared_ptr<void> vmm_segment;
+  void* self_last_event{nullptr};
+
+  explicit LegacyBlock(size_t size) : device(0), stream(nullptr), stream_id(0), size(size) {}
+
+  bool has_stream_uses() const { return !stream_uses.empty(); }
+};
+
+LegacyBlock* create_block(SlabAllocator<LegacyBlock>& slab, size_t size) {
+  return slab.create(size);
+}
+
+// the search key constructor: no stream registry or BlockEvent needed
+Block* create_block(SlabAllocator<Block>& slab, size_t size) {
+  return slab.create(nullptr, 0u, size);
+}
+
+bool has_history(const LegacyBlock* block) {
+  return block->history != nullptr;
+}
+
+bool has_history(const Block* block) {
+  return block->history() != nullptr;
+}
+
+template <typename BlockT>
+struct Comparison {
+  bool operator()(const BlockT* a, const BlockT* b) const {
+    if (a->size != b->size) {
+      return a->size < b->size;
+    }
+    return (uintptr_t)a->ptr < (uintptr_t)b->ptr;
+  }
+};
+
+struct BenchConfig {
+  std::vector<size_t> blocks = {10000, 100000};
+  size_t lookups = 1000000;
+  size_t rounds = 5;
+};
+
+// Creates `count` blocks with random sizes at increasing addresses and
+// returns them in address order; the slab slots are handed out in shuffled
+// order so neighbours in the address space are not neighbours in memory.
+template <typename BlockT>
+std::vector<BlockT*> make_blocks(SlabAllocator<BlockT>& slab, size_t count, std::mt19937_64& rng) {
+  std::vector<BlockT*> slots;
+  slots.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    slots.push_back(create_block(slab, 0));
+  }
+  std::shuffle(slots.begin(), slots.end(), rng);
+
+  std::uniform_int_distribution<size_t> pages(1, 1024);
+  uintptr_t addr = 0x7f0000000000;
+  for (BlockT* block : slots) {
+    block->size = pages(rng) * 512;
+    block->ptr = reinterpret_cast<void*>(addr);
+    addr += block->size;
+  }
+  return slots;
+}
+
+template <typename BlockT>
+double run_lookup(size_t count, size_t lookups, std::mt19937_64& rng) {
+  SlabAllocator<BlockT> slab;
+  std::vector<BlockT*> blocks = make_blocks(slab, count, rng);
+  std::set<BlockT*, Comparison<BlockT>> pool(blocks.begin(), blocks.end());
+
+  std::uniform_int_distribution<size_t> sizes(1, 1024 * 512);
+  std::vector<BlockT*> keys;
+  keys.reserve(lookups);
+  for (size_t i = 0; i < lookups; i++) {
+    keys.push_back(create_block(slab, sizes(rng)));
+  }
+
+  size_t found = 0;
+  uint64_t t0 = benchNowNs();
+  for (BlockT* key : keys) {
+    auto it = pool.lower_bound(key);
+    // the same checks get_free_block makes on the candidate
+    if (it != pool.end() && !(*it)->allocated && (*it)->stream_id == key->stream_id) {
+      found += 1;
+    }
+  }
+  uint64_t t1 = benchNowNs();
+
+  for (BlockT* key : keys) {
+    slab.destroy(key);
+  }
+  for (BlockT* block : blocks) {
+    slab.destroy(block);
+  }
+  return found > 0 ? static_cast<double>(lookups) * 1e9 / (t1 - t0) : 0.0;
+}
+
+template <typename BlockT>
+bool try_merge(BlockT* dst, BlockT* src) {
+  if (!src || src->allocated || src->event_count > 0 || src->has_stream_uses()) {
+    return false;
+  }
+  // no block carries history here, but try_merge_blocks checks for it
+  if (has_history(src)) {
+    return false;
+  }
+  if (dst->prev == src) {
+    dst->ptr = src->ptr;
+    dst->prev = src->prev;
+    if (dst->prev) {
+      dst->prev->next = dst;
+    }
+  } else {
+    dst->next = src->next;
+    if (dst->next) {
+      dst->next->prev = dst;
+    }
+  }
+  dst->size += src->size;
+  return true;
+}
+
+// Splits the blocks into chains of kChainLength with every other block
+// allocated, then frees the allocated ones and merges each into its free
+// neighbours, as free_block does.
+template <typename BlockT>
+double run_merge(size_t count, size_t rounds, std::mt19937_64& rng) {
+  SlabAllocator<BlockT> slab;
+  uint64_t total_ns = 0;
+  size_t merges = 0;
+
+  for (size_t round = 0; round < rounds; round++) {
+    std::vector<BlockT*> blocks = make_blocks(slab, count, rng);
+    std::vector<BlockT*> freed;
+    for (size_t i = 0; i < blocks.size(); i++) {
+      bool first = i % kChainLength == 0;
+      bool last = i % kChainLength == kChainLength - 1 || i + 1 == blocks.size();
+      blocks[i]->prev = first ? nullptr : blocks[i - 1];
+      blocks[i]->next = last ? nullptr : blocks[i + 1];
+      blocks[i]->allocated = i % 2 == 1;
+      if (blocks[i]->allocated) {
+        freed.push_back(blocks[i]);
+      }
+    }
+    std::shuffle(freed.begin(), freed.end(), rng);
+
+    uint64_t t0 = benchNowNs();
+    for (BlockT* block : freed) {
+      block->allocated = false;
+      BlockT* prev = block->prev;
+      BlockT* next = block->next;
+      try_merge(block, prev);
+      try_merge(block, next);
+    }
+    total_ns += benchNowNs() - t0;
+    merges += freed.size();
+
+    for (BlockT* block : blocks) {
+      slab.destroy(block);
+    }
+  }
+  return total_ns > 0 ? static_cast<double>(merges) * 1e9 / total_ns : 0.0;
+}
+
+bool parse_args(int argc, char** argv, BenchConfig& config) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--blocks") && i + 1 < argc) {
+      config.blocks = parseSizeList(argv[++i]);
+    } else if (!strcmp(argv[i], "--lookups") && i + 1 < argc) {
+      config.lookups = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--rounds") && i + 1 < argc) {
+      config.rounds = std::strtoull(argv[++i], nullptr, 10);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv) {
+  BenchConfig config;
+  if (!parse_args(argc, argv, config)) {
+    fprintf(stderr, "usage: %s [--blocks 10000,100000] [--lookups N] [--rounds N]\n", argv[0]);
+    return 1;
+  }
+
+  printf("sizeof(Block): legacy %zu, current %zu (requested_size at offset %zu)\n",
+         sizeof(LegacyBlock), sizeof(Block), offsetof(Block, requested_size));
+  printf("%-8s %8s %16s %16s %8s\n", "op", "blocks", "legacy(op/s)", "current(op/s)", "speedup");
+
+  std::mt19937_64 rng(42);
+  for (size_t count : config.blocks) {
+    double legacy = run_lookup<LegacyBlock>(count, config.lookups, rng);
+    double current = run_lookup<Block>(count, config.lookups, rng);
+    printf("%-8s %8zu %16.0f %16.0f %7.2fx\n", "lookup", count, legacy, current, current / legacy);
+
+    legacy = run_merge<LegacyBlock>(count, config.rounds, rng);
+    current = run_merge<Block>(count, config.rounds, rng);
+    printf("%-8s %8zu %16.0f %16.0f %7.2fx\n", "merge", count, legacy, current, current / legacy);
+    fflush(stdout);
+  }
+  return 0;
+}
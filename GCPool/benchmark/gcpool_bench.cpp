@@ -0,0 +1,325 @@
+// Latency microbenchmark for the DeviceCachingAllocator malloc/free paths.
+//
+//   gcpool_bench [--iters N] [--cold-iters N] [--threads 1,2,4,8]
+//                [--pool-sizes 0,1000,10000] [--paths small,large,fused,realloc,stitch]
+//                [--same-size]
+//
+// Paths:
+//   small    hit in small_blocks (64 KiB requests)
+//   large    hit in large_blocks (64 MiB requests)
+//   fused    hit in free_fused_blocks (1 GiB request served by a cached fused block)
+//   realloc  realloc_block maps a fresh VMM segment (64 MiB, empty cache)
+//   stitch   get_fused_fragmented_blocks glues 4 x 256 MiB free blocks
+//
+// "pool" is the number of extra cached blocks parked in the measured pool on
+// the measured stream, so lookups walk a realistically sized set: every stream
+// has its own set, so blocks of another stream are never visited. small and
+// large are also swept over the number of threads, each on its own stream with
+// its own parked blocks.
+// Run with binnedPool=0 and binnedPool=1 to compare the std::set and the
+// size-class bins behind BlockPool. --same-size makes small and large request
+// the filler size (4 KiB, 2 MiB) instead, so every parked block sits in the
+// size class the measured malloc and free hit.
+//
+// Runs against a GPU, or on the CPU when linked with src/host_vmm_backend.cpp
+// (the simulated device defaults to 256 GiB here, see hostDeviceMemory).
+
+#include "cuda_gcpool_allocator.h"
+
+#include <cuda_runtime_api.h>
+
+#include "bench_utils.h"
+
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace alloc = gcpool;
+
+namespace {
+
+constexpr size_t MB = 1024 * 1024;
+constexpr size_t kSmallRequest = 64 * 1024;
+constexpr size_t kLargeRequest = 64 * MB;
+constexpr size_t kStitchPiece = 256 * MB;
+constexpr size_t kStitchPieces = 4;
+constexpr int kDevice = 0;
+
+struct BenchConfig {
+  size_t iters = 10000;
+  size_t cold_iters = 50;
+  std::vector<size_t> threads = {1, 2, 4, 8};
+  std::vector<size_t> pool_sizes = {0, 1000, 10000};
+  std::vector<std::string> paths = {"small", "large", "fused", "realloc", "stitch"};
+  bool same_size = false;
+};
+
+struct PathLatency {
+  std::vector<uint64_t> malloc_ns;
+  std::vector<uint64_t> free_ns;
+};
+
+cudaStream_t new_stream() {
+  cudaStream_t stream;
+  cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking);
+  return stream;
+}
+
+size_t reserved_bytes() {
+  auto stats = alloc::getDeviceStats(kDevice);
+  return stats.reserved_bytes[static_cast<size_t>(alloc::StatType::AGGREGATE)].current;
+}
+
+// Parks `count` free blocks of `block_size` in the pool by allocating twice as
+// many and freeing every other one, so neighbours cannot merge.
+struct PoolFiller {
+  std::vector<void*> held;
+
+  void fill(cudaStream_t stream, size_t count, size_t block_size) {
+    if (count == 0) {
+      return;
+    }
+    std::vector<void*> blocks;
+    blocks.reserve(2 * count);
+    for (size_t i = 0; i < 2 * count; i++) {
+      blocks.push_back(alloc::raw_alloc_with_stream(block_size, stream));
+    }
+    for (size_t i = 0; i < blocks.size(); i++) {
+      if (i % 2 == 0) {
+        alloc::raw_delete(blocks[i]);
+      } else {
+        held.push_back(blocks[i]);
+      }
+    }
+  }
+
+  void release() {
+    for (void* ptr : held) {
+      alloc::raw_delete(ptr);
+    }
+    held.clear();
+  }
+};
+
+// Leaves kStitchPieces free blocks interleaved with held ones and caps the
+// device at what is already reserved, so a request for all of them can only
+// be served by stitching.
+void make_fragmented(cudaStream_t stream, std::vector<void*>& held) {
+  std::vector<void*> blocks;
+  for (size_t i = 0; i < 2 * kStitchPieces; i++) {
+    blocks.push_back(alloc::raw_alloc_with_stream(kStitchPiece, stream));
+  }
+  for (size_t i = 0; i < blocks.size(); i++) {
+    if (i % 2 == 0) {
+      alloc::raw_delete(blocks[i]);
+    } else {
+      held.push_back(blocks[i]);
+    }
+  }
+
+  size_t device_free, device_total;
+  cudaMemGetInfo(&device_free, &device_total);
+  alloc::setMemoryFraction(static_cast<double>(reserved_bytes()) / device_total, kDevice);
+}
+
+void release_all(std::vector<void*>& held) {
+  for (void* ptr : held) {
+    alloc::raw_delete(ptr);
+  }
+  held.clear();
+  alloc::setMemoryFraction(1.0, kDevice);
+  alloc::emptyCache();
+}
+
+void timed_malloc_free(size_t size, cudaStream_t stream, PathLatency& latency) {
+  uint64_t t0 = benchNowNs();
+  void* ptr = alloc::raw_alloc_with_stream(size, stream);
+  uint64_t t1 = benchNowNs();
+  alloc::raw_delete(ptr);
+  uint64_t t2 = benchNowNs();
+  latency.malloc_ns.push_back(t1 - t0);
+  latency.free_ns.push_back(t2 - t1);
+}
+
+void hot_loop(size_t size, size_t iters, size_t pool, size_t filler_size, PathLatency& latency) {
+  cudaStream_t stream = new_stream();
+  PoolFiller filler;
+  filler.fill(stream, pool, filler_size);
+  latency.malloc_ns.reserve(iters);
+  latency.free_ns.reserve(iters);
+
+  // first request populates the pool, the rest hit it
+  alloc::raw_delete(alloc::raw_alloc_with_stream(size, stream));
+  for (size_t i = 0; i < iters; i++) {
+    timed_malloc_free(size, stream, latency);
+  }
+  filler.release();
+  cudaStreamDestroy(stream);
+}
+
+PathLatency run_hot(size_t size, size_t threads, size_t iters, size_t pool, size_t filler_size) {
+  std::vector<PathLatency> per_thread(threads);
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      cudaSetDevice(kDevice);
+      hot_loop(size, iters, pool, filler_size, per_thread[t]);
+    });
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+
+  PathLatency merged;
+  for (auto& l : per_thread) {
+    merged.malloc_ns.insert(merged.malloc_ns.end(), l.malloc_ns.begin(), l.malloc_ns.end());
+    merged.free_ns.insert(merged.free_ns.end(), l.free_ns.begin(), l.free_ns.end());
+  }
+  return merged;
+}
+
+PathLatency run_fused(cudaStream_t stream, size_t iters) {
+  PathLatency latency;
+  std::vector<void*> held;
+  make_fragmented(stream, held);
+
+  // the first request stitches, later ones reuse the cached fused block
+  alloc::raw_delete(alloc::raw_alloc_with_stream(kStitchPiece * kStitchPieces, stream));
+  auto before = alloc::getGCPoolStats(kDevice);
+  for (size_t i = 0; i < iters; i++) {
+    timed_malloc_free(kStitchPiece * kStitchPieces, stream, latency);
+  }
+  auto after = alloc::getGCPoolStats(kDevice);
+  if (after.num_fusions != before.num_fusions) {
+    fprintf(stderr, "warning: fused path stitched %ld times instead of hitting free_fused_blocks\n",
+            (long)(after.num_fusions - before.num_fusions));
+  }
+
+  release_all(held);
+  return latency;
+}
+
+PathLatency run_stitch(cudaStream_t stream, size_t iters) {
+  PathLatency latency;
+  auto before = alloc::getGCPoolStats(kDevice);
+  for (size_t i = 0; i < iters; i++) {
+    std::vector<void*> held;
+    make_fragmented(stream, held);
+    timed_malloc_free(kStitchPiece * kStitchPieces, stream, latency);
+    release_all(held);
+  }
+  auto after = alloc::getGCPoolStats(kDevice);
+  if (after.num_fusions - before.num_fusions != static_cast<int64_t>(iters)) {
+    fprintf(stderr, "warning: stitch path fused %ld times for %zu requests\n",
+            (long)(after.num_fusions - before.num_fusions), iters);
+  }
+  return latency;
+}
+
+PathLatency run_realloc(cudaStream_t stream, size_t iters) {
+  PathLatency latency;
+  for (size_t i = 0; i < iters; i++) {
+    alloc::emptyCache();
+    timed_malloc_free(kLargeRequest, stream, latency);
+  }
+  alloc::emptyCache();
+  return latency;
+}
+
+void report(const char* path, int threads, size_t pool, PathLatency& latency) {
+  auto m = summarizeLatency(latency.malloc_ns);
+  auto f = summarizeLatency(latency.free_ns);
+  printLatencyRow(path, "malloc", threads, pool, m);
+  printLatencyRow(path, "free", threads, pool, f);
+  fflush(stdout);
+}
+
+bool parse_args(int argc, char** argv, BenchConfig& config) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--iters") && i + 1 < argc) {
+      config.iters = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--cold-iters") && i + 1 < argc) {
+      config.cold_iters = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      config.threads = parseSizeList(argv[++i]);
+    } else if (!strcmp(argv[i], "--pool-sizes") && i + 1 < argc) {
+      config.pool_sizes = parseSizeList(argv[++i]);
+    } else if (!strcmp(argv[i], "--same-size")) {
+      config.same_size = true;
+    } else if (!strcmp(argv[i], "--paths") && i + 1 < argc) {
+      config.paths.clear();
+      std::stringstream ss(argv[++i]);
+      std::string item;
+      while (std::getline(ss, item, ',')) {
+        config.paths.push_back(item);
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv) {
+  BenchConfig config;
+  if (!parse_args(argc, argv, config)) {
+    fprintf(stderr,
+            "usage: %s [--iters N] [--cold-iters N] [--threads 1,2,4,8] "
+            "[--pool-sizes 0,1000,10000] [--paths small,large,fused,realloc,stitch] [--same-size]\n",
+            argv[0]);
+    return 1;
+  }
+
+  // only consulted by the host backend; a real device ignores it
+  setenv("hostDeviceMemory", "274877906944", 0);
+  setenv("vmmDefragment", "1", 0);
+
+  cudaSetDevice(kDevice);
+  alloc::init(1);
+  printLatencyHeader();
+
+  for (const auto& path : config.paths) {
+    const bool hot = (path == "small" || path == "large");
+    const size_t filler_size = (path == "small") ? 4096 : 2 * MB;
+
+    for (size_t pool : config.pool_sizes) {
+      if (hot) {
+        size_t size = (path == "small") ? kSmallRequest : kLargeRequest;
+        if (config.same_size) {
+          size = filler_size;
+        }
+        for (size_t threads : config.threads) {
+          auto latency = run_hot(size, threads, config.iters, pool, filler_size);
+          report(path.c_str(), static_cast<int>(threads), pool, latency);
+          alloc::emptyCache();
+        }
+        continue;
+      }
+
+      cudaStream_t stream = new_stream();
+      PoolFiller filler;
+      filler.fill(stream, pool, filler_size);
+
+      if (path == "fused") {
+        auto latency = run_fused(stream, config.iters);
+        report(path.c_str(), 1, pool, latency);
+      } else if (path == "realloc") {
+        auto latency = run_realloc(stream, config.cold_iters);
+        report(path.c_str(), 1, pool, latency);
+      } else if (path == "stitch") {
+        auto latency = run_stitch(stream, config.cold_iters);
+        report(path.c_str(), 1, pool, latency);
+      } else {
+        fprintf(stderr, "unknown path %s\n", path.c_str());
+      }
+
+      filler.release();
+      alloc::emptyCache();
+      cudaStreamDestroy(stream);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,181 @@
+// Throughput of concurrent malloc/free on one device as threads are added.
+//
+//   stream_scaling_bench [--iters N] [--threads 1,2,4,8,16] [--live N]
+//                        [--size BYTES] [--shared-stream] [--poll-stats]
+//
+// Every thread holds `live` blocks of `size` bytes and recycles them one at a
+// time: free the oldest, allocate a new one. Once the working set is carved
+// out of its segments each request is an exact fit whose neighbours are still
+// allocated, which DeviceCachingAllocator serves under the lock of the
+// thread's stream alone. With --shared-stream all threads allocate on one
+// stream and serialize on the same lock, the baseline the per-stream threads
+// should scale away from. --poll-stats adds a thread reading getDeviceStats
+// in a loop for the whole run, as a monitoring agent would.
+//
+// Runs against a GPU, or on the CPU when linked with src/host_vmm_backend.cpp
+// (the simulated device defaults to 256 GiB here, see hostDeviceMemory).
+
+#include "cuda_gcpool_allocator.h"
+
+#include <cuda_runtime_api.h>
+
+#include "bench_utils.h"
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace alloc = gcpool;
+
+namespace {
+
+constexpr int kDevice = 0;
+
+struct BenchConfig {
+  size_t iters = 200000;
+  std::vector<size_t> threads = {1, 2, 4, 8, 16};
+  size_t live = 32;
+  size_t size = 64 * 1024;
+  bool shared_stream = false;
+  bool poll_stats = false;
+};
+
+cudaStream_t new_stream() {
+  cudaStream_t stream;
+  cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking);
+  return stream;
+}
+
+// Aggregate malloc+free pairs per second over all threads.
+double run_threads(const BenchConfig& config, size_t threads) {
+  cudaStream_t shared = config.shared_stream ? new_stream() : nullptr;
+  std::atomic<size_t> ready{0};
+  std::atomic<bool> go{false};
+  std::atomic<bool> done{false};
+  std::vector<uint64_t> elapsed_ns(threads);
+  std::vector<std::thread> workers;
+
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      cudaSetDevice(kDevice);
+      cudaStream_t stream = shared ? shared : new_stream();
+      std::vector<void*> held;
+      held.reserve(config.live);
+      for (size_t i = 0; i < config.live; i++) {
+        held.push_back(alloc::raw_alloc_with_stream(config.size, stream));
+      }
+
+      ready.fetch_add(1);
+      while (!go.load()) {
+        std::this_thread::yield();
+      }
+      uint64_t t0 = benchNowNs();
+      for (size_t i = 0; i < config.iters; i++) {
+        void*& slot = held[i % config.live];
+        alloc::raw_delete(slot);
+        slot = alloc::raw_alloc_with_stream(config.size, stream);
+      }
+      elapsed_ns[t] = benchNowNs() - t0;
+
+      for (void* ptr : held) {
+        alloc::raw_delete(ptr);
+      }
+      if (!shared) {
+        cudaStreamDestroy(stream);
+      }
+    });
+  }
+
+  while (ready.load() < threads) {
+    std::this_thread::yield();
+  }
+  std::thread poller;
+  if (config.poll_stats) {
+    poller = std::thread([&]() {
+      while (!done.load()) {
+        alloc::getDeviceStats(kDevice);
+      }
+    });
+  }
+  go.store(true);
+  for (auto& w : workers) {
+    w.join();
+  }
+  done.store(true);
+  if (poller.joinable()) {
+    poller.join();
+  }
+  if (shared) {
+    cudaStreamDestroy(shared);
+  }
+  alloc::emptyCache();
+
+  // the slowest thread bounds the wall time of the whole batch
+  uint64_t wall_ns = 0;
+  for (uint64_t ns : elapsed_ns) {
+    wall_ns = std::max(wall_ns, ns);
+  }
+  return wall_ns > 0 ? static_cast<double>(threads * config.iters) * 1e9 / wall_ns : 0.0;
+}
+
+bool parse_args(int argc, char** argv, BenchConfig& config) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--iters") && i + 1 < argc) {
+      config.iters = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      config.threads = parseSizeList(argv[++i]);
+    } else if (!strcmp(argv[i], "--live") && i + 1 < argc) {
+      config.live = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+    } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+      config.size = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--shared-stream")) {
+      config.shared_stream = true;
+    } else if (!strcmp(argv[i], "--poll-stats")) {
+      config.poll_stats = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv) {
+  BenchConfig config;
+  if (!parse_args(argc, argv, config)) {
+    fprintf(stderr,
+            "usage: %s [--iters N] [--threads 1,2,4,8,16] [--live N] "
+            "[--size BYTES] [--shared-stream] [--poll-stats]\n",
+            argv[0]);
+    return 1;
+  }
+
+  // only consulted by the host backend; a real device ignores it
+  setenv("hostDeviceMemory", "274877906944", 0);
+  setenv("vmmDefragment", "1", 0);
+
+  cudaSetDevice(kDevice);
+  alloc::init(1);
+
+  printf("streams: %s, size %zu, live %zu, iters %zu per thread%s\n",
+         config.shared_stream ? "shared" : "one per thread", config.size, config.live, config.iters,
+         config.poll_stats ? ", polling stats" : "");
+  printf("%8s %16s %14s %9s\n", "threads", "pairs/s", "ns/pair", "speedup");
+
+  double base = 0.0;
+  for (size_t threads : config.threads) {
+    double rate = run_threads(config, threads);
+    if (base == 0.0) {
+      base = rate / threads;
+    }
+    // ns/pair is per thread; speedup is over one thread of the first row, so
+    // perfect scaling prints the thread count
+    printf("%8zu %16.0f %14.1f %8.2fx\n",
+           threads, rate, rate > 0.0 ? threads * 1e9 / rate : 0.0,
+           base > 0.0 ? rate / base : 0.0);
+    fflush(stdout);
+  }
+  return 0;
+}
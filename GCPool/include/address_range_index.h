@@ -0,0 +1,219 @@
+#pragma once
+
+#include "gcpool_compat.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Index of the allocated blocks by device address: a three level radix tree
+// over 2^kAlignBits byte slots of a 48-bit address space, with an occupancy
+// bitmap at every level. Answers both "which block starts at ptr" and "which
+// block contains ptr", the latter by finding the nearest occupied slot at or
+// below ptr through the bitmaps.
+//
+// Readers take no lock: nodes are only ever added and live until the index
+// is destroyed, and slots and bitmaps are atomics. Writers are serialized per
+// leaf by a small set of shard mutexes, so the bitmaps of one leaf always
+// agree with its slots once the writer is done.
+//
+// BlockT needs ptr and size members; ptr must be a multiple of
+// 2^kAlignBits. The index keeps its own copy of the size, so lookups never
+// touch the blocks themselves.
+template <typename BlockT, size_t kAlignBits = 9>
+class AddressRangeIndex {
+public:
+    static constexpr size_t kAlignment = size_t(1) << kAlignBits;
+    static constexpr size_t kAddressBits = 48;
+    static constexpr size_t kLeafBits = 9;
+    static constexpr size_t kMidBits = 15;
+    static constexpr size_t kRootBits = kAddressBits - kAlignBits - kLeafBits - kMidBits;
+    static constexpr size_t kShards = 64;
+
+    AddressRangeIndex() = default;
+    AddressRangeIndex(const AddressRangeIndex&) = delete;
+    AddressRangeIndex& operator=(const AddressRangeIndex&) = delete;
+
+    ~AddressRangeIndex() {
+        for (auto& child : root_) {
+            Mid* mid = child.load(std::memory_order_relaxed);
+            if (!mid) {
+                continue;
+            }
+            for (auto& leaf : mid->children) {
+                delete leaf.load(std::memory_order_relaxed);
+            }
+            delete mid;
+        }
+    }
+
+    // false if the address is misaligned or outside the indexed range
+    bool insert(BlockT* block) {
+        size_t key;
+        if (!toKey(block->ptr, key)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(shards_[(key >> kLeafBits) % kShards]);
+        Mid* mid = root_[rootIndex(key)].load(std::memory_order_acquire);
+        if (!mid) {
+            // mid nodes are shared between shards
+            Mid* fresh = new Mid();
+            if (root_[rootIndex(key)].compare_exchange_strong(mid, fresh, std::memory_order_acq_rel)) {
+                mid = fresh;
+                setBit(root_bits_, rootIndex(key));
+            } else {
+                delete fresh;
+            }
+        }
+        std::atomic<Leaf*>& child = mid->children[midIndex(key)];
+        Leaf* leaf = child.load(std::memory_order_acquire);
+        if (!leaf) {
+            leaf = new Leaf();
+            child.store(leaf, std::memory_order_release);
+        }
+        const size_t slot = leafIndex(key);
+        leaf->sizes[slot].store(block->size, std::memory_order_relaxed);
+        leaf->blocks[slot].store(block, std::memory_order_release);
+        setBit(leaf->bits, slot);
+        setBit(mid->bits, midIndex(key));
+        return true;
+    }
+
+    // removes and returns the block starting at ptr, nullptr if none
+    BlockT* erase(const void* ptr) {
+        size_t key;
+        if (!toKey(ptr, key)) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(shards_[(key >> kLeafBits) % kShards]);
+        Mid* mid = root_[rootIndex(key)].load(std::memory_order_acquire);
+        Leaf* leaf = mid ? mid->children[midIndex(key)].load(std::memory_order_acquire) : nullptr;
+        if (!leaf) {
+            return nullptr;
+        }
+        const size_t slot = leafIndex(key);
+        BlockT* block = leaf->blocks[slot].exchange(nullptr, std::memory_order_acq_rel);
+        if (!block) {
+            return nullptr;
+        }
+        clearBit(leaf->bits, slot);
+        if (lastSet(leaf->bits, kLeafSlots - 1) == kNone) {
+            clearBit(mid->bits, midIndex(key));
+        }
+        return block;
+    }
+
+    // the block starting at ptr, nullptr if none
+    BlockT* find(const void* ptr) const {
+        size_t key;
+        if (!toKey(ptr, key)) {
+            return nullptr;
+        }
+        const Leaf* leaf = findLeaf(key);
+        return leaf ? leaf->blocks[leafIndex(key)].load(std::memory_order_acquire) : nullptr;
+    }
+
+    // the block whose [ptr, ptr + size) contains ptr, nullptr if none
+    BlockT* findContaining(const void* ptr) const {
+        const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        if (addr >> kAddressBits) {
+            return nullptr;
+        }
+        size_t key = addr >> kAlignBits;
+        size_t r = rootIndex(key);
+        size_t m = midIndex(key);
+        size_t l = leafIndex(key);
+        // allocated blocks do not overlap, so only the nearest one at or
+        // below ptr can contain it
+        while (true) {
+            const Mid* mid = root_[r].load(std::memory_order_acquire);
+            while (mid && m != kNone) {
+                const Leaf* leaf = mid->children[m].load(std::memory_order_acquire);
+                // a leaf emptied by a concurrent erase may still be marked
+                // in its parent; keep looking below it
+                size_t slot = leaf ? lastSet(leaf->bits, l) : kNone;
+                while (slot != kNone) {
+                    BlockT* block = leaf->blocks[slot].load(std::memory_order_acquire);
+                    if (block) {
+                        const uintptr_t start = ((((r << kMidBits) | m) << kLeafBits) | slot) << kAlignBits;
+                        const size_t size = leaf->sizes[slot].load(std::memory_order_relaxed);
+                        return addr - start < size ? block : nullptr;
+                    }
+                    slot = slot ? lastSet(leaf->bits, slot - 1) : kNone;
+                }
+                m = m ? lastSet(mid->bits, m - 1) : kNone;
+                l = kLeafSlots - 1;
+            }
+            r = r ? lastSet(root_bits_, r - 1) : kNone;
+            if (r == kNone) {
+                return nullptr;
+            }
+            m = kMidSlots - 1;
+            l = kLeafSlots - 1;
+        }
+    }
+
+private:
+    static constexpr size_t kLeafSlots = size_t(1) << kLeafBits;
+    static constexpr size_t kMidSlots = size_t(1) << kMidBits;
+    static constexpr size_t kRootSlots = size_t(1) << kRootBits;
+    static constexpr size_t kNone = ~size_t(0);
+
+    struct Leaf {
+        std::atomic<BlockT*> blocks[kLeafSlots] = {};
+        std::atomic<size_t> sizes[kLeafSlots] = {};
+        // bit i set while blocks[i] is not null
+        std::atomic<uint64_t> bits[kLeafSlots / 64] = {};
+    };
+
+    struct Mid {
+        std::atomic<Leaf*> children[kMidSlots] = {};
+        // bit i set while children[i] holds a block
+        std::atomic<uint64_t> bits[kMidSlots / 64] = {};
+    };
+
+    static bool toKey(const void* ptr, size_t& key) {
+        const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        if ((addr >> kAddressBits) || (addr & ((uintptr_t(1) << kAlignBits) - 1))) {
+            return false;
+        }
+        key = addr >> kAlignBits;
+        return true;
+    }
+
+    static size_t rootIndex(size_t key) { return key >> (kLeafBits + kMidBits); }
+    static size_t midIndex(size_t key) { return (key >> kLeafBits) & (kMidSlots - 1); }
+    static size_t leafIndex(size_t key) { return key & (kLeafSlots - 1); }
+
+    const Leaf* findLeaf(size_t key) const {
+        const Mid* mid = root_[rootIndex(key)].load(std::memory_order_acquire);
+        return mid ? mid->children[midIndex(key)].load(std::memory_order_acquire) : nullptr;
+    }
+
+    static void setBit(std::atomic<uint64_t>* words, size_t i) {
+        words[i / 64].fetch_or(uint64_t(1) << (i % 64), std::memory_order_release);
+    }
+
+    static void clearBit(std::atomic<uint64_t>* words, size_t i) {
+        words[i / 64].fetch_and(~(uint64_t(1) << (i % 64)), std::memory_order_release);
+    }
+
+    // highest set bit <= pos, kNone if none
+    static size_t lastSet(const std::atomic<uint64_t>* words, size_t pos) {
+        size_t w = pos / 64;
+        uint64_t word = words[w].load(std::memory_order_acquire) & (~uint64_t(0) >> (63 - pos % 64));
+        while (!word) {
+            if (w == 0) {
+                return kNone;
+            }
+            word = words[--w].load(std::memory_order_acquire);
+        }
+        return w * 64 + 63 - gcpool::countLeadingZeros(word);
+    }
+
+    std::atomic<Mid*> root_[kRootSlots] = {};
+    // bit i set once root_[i] exists; mid nodes are never removed
+    std::atomic<uint64_t> root_bits_[kRootSlots / 64] = {};
+    std::mutex shards_[kShards];
+};
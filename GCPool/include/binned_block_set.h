@@ -0,0 +1,354 @@
+#pragma once
+
+#include "gcpool_compat.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Ordered set of the free blocks of one stream with the same order and
+// interface as the std::set<Block*, Comparison> of a BlockPool: (size, ptr),
+// with begin/end, lower_bound, insert, erase and count, and iterators that
+// stay valid until their own block is erased.
+//
+// Blocks are kept in size-class bins: every power of two is split into
+// 2^kSubBinBits classes, and a bin is a flat array of block pointers sorted by
+// (size, ptr). A two-level bitmap of the non-empty bins finds the next bin
+// that can hold a request with two count-trailing-zeros, so a best-fit lookup
+// is one bitmap probe plus a binary search in one bin, without the per-node
+// allocation and pointer chasing of a tree.
+//
+// A bin is cut into sorted chunks of at most kChunkMax pointers, so insert
+// and erase shift at most one chunk even when every cached block has the same
+// size and lands in one bin (a pool of identical 2 MiB granules); a bin of
+// fewer than kChunkMax blocks is a single vector. An iterator remembers its
+// block and where it last saw it, and finds the block again by key when other
+// inserts or erases moved it. The bins are only allocated by the first insert.
+//
+// BlockT needs size and ptr members.
+template <typename BlockT>
+class BinnedBlockSet {
+public:
+    static constexpr size_t kSubBinBits = 3;
+    static constexpr size_t kSubBins = size_t(1) << kSubBinBits;
+    static constexpr size_t kBins = (64 - kSubBinBits + 1) * kSubBins;
+    static constexpr size_t kWords = (kBins + 63) / 64;
+    // a full chunk is split in two halves
+    static constexpr size_t kChunkMax = 128;
+
+    static size_t binIndex(size_t size) {
+        if (size < kSubBins) {
+            return size;
+        }
+        const size_t exponent = 63 - gcpool::countLeadingZeros(static_cast<uint64_t>(size));
+        const size_t sub = (size >> (exponent - kSubBinBits)) & (kSubBins - 1);
+        return (exponent - kSubBinBits + 1) * kSubBins + sub;
+    }
+
+private:
+    struct Less {
+        bool operator()(const BlockT* a, const BlockT* b) const {
+            if (a->size != b->size) {
+                return a->size < b->size;
+            }
+            return reinterpret_cast<uintptr_t>(a->ptr) < reinterpret_cast<uintptr_t>(b->ptr);
+        }
+    };
+
+    using Chunk = std::vector<BlockT*>;
+    // chunks whose concatenation is sorted; all non-empty, except that an
+    // emptied bin keeps its last chunk so that a bin cycling between zero and
+    // one block does not allocate
+    using Bin = std::vector<Chunk>;
+
+    // position in a bin; chunk == bin.size() past its last block
+    struct Pos {
+        size_t chunk;
+        size_t idx;
+    };
+
+    // first non-empty bin >= bin, kBins if none
+    size_t nextBin(size_t bin) const {
+        if (bin >= kBins) {
+            return kBins;
+        }
+        size_t w = bin / 64;
+        uint64_t word = nonempty_[w] & (~uint64_t(0) << (bin % 64));
+        if (word) {
+            return w * 64 + gcpool::countTrailingZeros(word);
+        }
+        uint64_t rest = summary_ & (~uint64_t(0) << (w + 1));
+        if (!rest) {
+            return kBins;
+        }
+        w = gcpool::countTrailingZeros(rest);
+        return w * 64 + gcpool::countTrailingZeros(nonempty_[w]);
+    }
+
+    // last non-empty bin < bin, kBins if none
+    size_t prevBin(size_t bin) const {
+        if (bin == 0) {
+            return kBins;
+        }
+        size_t w = (bin - 1) / 64;
+        uint64_t word = nonempty_[w] & (~uint64_t(0) >> (63 - (bin - 1) % 64));
+        if (word) {
+            return w * 64 + 63 - gcpool::countLeadingZeros(word);
+        }
+        uint64_t rest = summary_ & ((uint64_t(1) << w) - 1);
+        if (!rest) {
+            return kBins;
+        }
+        w = 63 - gcpool::countLeadingZeros(rest);
+        return w * 64 + 63 - gcpool::countLeadingZeros(nonempty_[w]);
+    }
+
+    void markBin(size_t bin) {
+        nonempty_[bin / 64] |= uint64_t(1) << (bin % 64);
+        summary_ |= uint64_t(1) << (bin / 64);
+    }
+
+    void clearBin(size_t bin) {
+        nonempty_[bin / 64] &= ~(uint64_t(1) << (bin % 64));
+        if (!nonempty_[bin / 64]) {
+            summary_ &= ~(uint64_t(1) << (bin / 64));
+        }
+    }
+
+    // first block of bin not ordered before key
+    static Pos lowerBound(const Bin& bin, const BlockT* key) {
+        if (bin.size() == 1) {
+            const size_t idx = std::lower_bound(bin[0].begin(), bin[0].end(), key, Less()) - bin[0].begin();
+            return idx < bin[0].size() ? Pos{0, idx} : Pos{1, 0};
+        }
+        auto chunk = std::lower_bound(bin.begin(), bin.end(), key, [](const Chunk& c, const BlockT* k) {
+            return Less()(c.back(), k);
+        });
+        if (chunk == bin.end()) {
+            return {bin.size(), 0};
+        }
+        const size_t idx = std::lower_bound(chunk->begin(), chunk->end(), key, Less()) - chunk->begin();
+        return {static_cast<size_t>(chunk - bin.begin()), idx};
+    }
+
+    static bool holds(const Bin& bin, Pos pos, const BlockT* block) {
+        return pos.chunk < bin.size() && pos.idx < bin[pos.chunk].size() && bin[pos.chunk][pos.idx] == block;
+    }
+
+    // pos of block if it is still in bin, else of the first block ordered after it
+    static Pos locate(const Bin& bin, Pos hint, const BlockT* block) {
+        return holds(bin, hint, block) ? hint : lowerBound(bin, block);
+    }
+
+public:
+    class iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = BlockT*;
+        using difference_type = std::ptrdiff_t;
+        using pointer = BlockT* const*;
+        using reference = BlockT* const&;
+
+        iterator() = default;
+
+        reference operator*() const { return block_; }
+        pointer operator->() const { return &block_; }
+
+        iterator& operator++() {
+            const Bin& bin = set_->bins_[bin_];
+            Pos pos = locate(bin, pos_, block_);
+            if (holds(bin, pos, block_) && ++pos.idx == bin[pos.chunk].size()) {
+                pos = {pos.chunk + 1, 0};
+            }
+            if (pos.chunk < bin.size()) {
+                pos_ = pos;
+                block_ = bin[pos.chunk][pos.idx];
+            } else {
+                set_->moveTo(*this, set_->nextBin(bin_ + 1), false);
+            }
+            return *this;
+        }
+
+        iterator& operator--() {
+            Pos pos = bin_ < kBins ? locate(set_->bins_[bin_], pos_, block_) : Pos{0, 0};
+            if (pos.idx > 0) {
+                pos.idx -= 1;
+            } else if (pos.chunk > 0 && !set_->bins_[bin_][pos.chunk - 1].empty()) {
+                pos.chunk -= 1;
+                pos.idx = set_->bins_[bin_][pos.chunk].size() - 1;
+            } else {
+                set_->moveTo(*this, set_->prevBin(bin_), true);
+                return *this;
+            }
+            pos_ = pos;
+            block_ = set_->bins_[bin_][pos.chunk][pos.idx];
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+
+        iterator operator--(int) {
+            iterator tmp = *this;
+            --*this;
+            return tmp;
+        }
+
+        bool operator==(const iterator& other) const {
+            return bin_ == other.bin_ && (bin_ == kBins || block_ == other.block_);
+        }
+        bool operator!=(const iterator& other) const { return !(*this == other); }
+
+    private:
+        friend class BinnedBlockSet;
+
+        iterator(const BinnedBlockSet* set, size_t bin, Pos pos, BlockT* block)
+            : set_(set), bin_(bin), pos_(pos), block_(block) {}
+
+        const BinnedBlockSet* set_ = nullptr;
+        // kBins for end()
+        size_t bin_ = kBins;
+        // where block_ was last seen in its bin
+        Pos pos_{0, 0};
+        BlockT* block_ = nullptr;
+    };
+
+    using const_iterator = iterator;
+
+    // the comparator is fixed to BlockComparator order
+    template <typename Comparison>
+    explicit BinnedBlockSet(Comparison) {}
+
+    BinnedBlockSet(const BinnedBlockSet&) = delete;
+    BinnedBlockSet& operator=(const BinnedBlockSet&) = delete;
+
+    iterator begin() const {
+        iterator it = end();
+        moveTo(it, nextBin(0), false);
+        return it;
+    }
+
+    iterator end() const { return iterator(this, kBins, {0, 0}, nullptr); }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // first block not ordered before key
+    iterator lower_bound(const BlockT* key) const {
+        if (empty()) {
+            return end();
+        }
+        const size_t bin = binIndex(key->size);
+        const Pos pos = lowerBound(bins_[bin], key);
+        if (pos.chunk < bins_[bin].size()) {
+            return iterator(this, bin, pos, bins_[bin][pos.chunk][pos.idx]);
+        }
+        iterator it = end();
+        moveTo(it, nextBin(bin + 1), false);
+        return it;
+    }
+
+    size_t count(const BlockT* key) const {
+        if (empty()) {
+            return 0;
+        }
+        const Bin& bin = bins_[binIndex(key->size)];
+        return holds(bin, lowerBound(bin, key), key) ? 1 : 0;
+    }
+
+    std::pair<iterator, bool> insert(BlockT* block) {
+        if (!bins_) {
+            bins_.reset(new Bin[kBins]);
+        }
+        const size_t b = binIndex(block->size);
+        Bin& bin = bins_[b];
+        Pos pos = lowerBound(bin, block);
+        if (holds(bin, pos, block)) {
+            return {iterator(this, b, pos, block), false};
+        }
+        if (pos.chunk == bin.size()) {
+            // past the last block: append to the last chunk
+            if (bin.empty()) {
+                bin.emplace_back();
+                bin.back().reserve(kChunkMax);
+            }
+            pos = {bin.size() - 1, bin.back().size()};
+        }
+        Chunk& chunk = bin[pos.chunk];
+        chunk.insert(chunk.begin() + pos.idx, block);
+        if (chunk.size() > kChunkMax) {
+            const size_t half = chunk.size() / 2;
+            Chunk upper;
+            upper.reserve(kChunkMax);
+            upper.assign(chunk.begin() + half, chunk.end());
+            chunk.resize(half);
+            bin.insert(bin.begin() + pos.chunk + 1, std::move(upper));
+            if (pos.idx >= half) {
+                pos = {pos.chunk + 1, pos.idx - half};
+            }
+        }
+        markBin(b);
+        size_ += 1;
+        return {iterator(this, b, pos, block), true};
+    }
+
+    size_t erase(const BlockT* key) {
+        if (empty()) {
+            return 0;
+        }
+        const size_t b = binIndex(key->size);
+        const Pos pos = lowerBound(bins_[b], key);
+        if (!holds(bins_[b], pos, key)) {
+            return 0;
+        }
+        eraseAt(b, pos);
+        return 1;
+    }
+
+    iterator erase(iterator it) {
+        iterator next = std::next(it);
+        eraseAt(it.bin_, locate(bins_[it.bin_], it.pos_, it.block_));
+        return next;
+    }
+
+private:
+    // points it at the first (or last) block of bin, or at end() if bin == kBins
+    void moveTo(iterator& it, size_t bin, bool last) const {
+        it.bin_ = bin;
+        if (bin < kBins) {
+            const Bin& chunks = bins_[bin];
+            it.pos_ = last ? Pos{chunks.size() - 1, chunks.back().size() - 1} : Pos{0, 0};
+            it.block_ = chunks[it.pos_.chunk][it.pos_.idx];
+        } else {
+            it.pos_ = {0, 0};
+            it.block_ = nullptr;
+        }
+    }
+
+    void eraseAt(size_t b, Pos pos) {
+        Bin& bin = bins_[b];
+        Chunk& chunk = bin[pos.chunk];
+        chunk.erase(chunk.begin() + pos.idx);
+        if (chunk.empty()) {
+            if (bin.size() > 1) {
+                bin.erase(bin.begin() + pos.chunk);
+            } else {
+                clearBin(b);
+            }
+        }
+        size_ -= 1;
+    }
+
+    size_t size_ = 0;
+    // bit w is set if nonempty_[w] != 0
+    uint64_t summary_ = 0;
+    uint64_t nonempty_[kWords] = {};
+    std::unique_ptr<Bin[]> bins_;
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "cuda_gcpool_allocator.h"
+#include "cuda_gcpool_allocator.h"
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Export of the allocator timeline (getTimeline()) in the Chrome trace event
+// format, for chrome://tracing and ui.perfetto.dev.
+//
+// Every device is a process and every stream a thread of it; GC passes and
+// cache flushes, which are not tied to a stream, go to an "allocator" thread.
+//   - malloc, new segments, fusions, GC passes and cache flushes are complete
+//     ("X") events with their duration
+//   - the lifetime of each block, from alloc to free_completed (or to
+//     free_requested when the free was not recorded), is an async slice keyed
+//     by its address
+//   - segment allocs/frees, OOMs and snapshots are instant events
+//   - allocated bytes per device are a counter track
+// Timestamps are steady_clock microseconds, so the timelines of several
+// devices in one process line up.
+
+struct DeviceTimeline {
+    int device;
+    std::vector<gcpool::TimelineEvent> events;
+};
+
+void writeChromeTrace(std::ostream& out, const std::vector<DeviceTimeline>& timelines);
+
+// Writes the timelines of the given devices, or of every device when empty.
+// Returns false if the file cannot be written.
+bool dumpChromeTrace(const std::string& path, const std::vector<int>& devices = {});
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Insert-only map from small keys (pointers, handles) to values that live as
+// long as the registry, for per-key state looked up on hot paths. get() of a
+// known key is a few probes of an open-addressing table with no lock; a new
+// key takes a mutex, which also serializes growth.
+//
+// Values are created as Value(key, index), index being the number of keys
+// registered before this one, so it doubles as a dense id. Values never move
+// and are never removed. Outgrown tables are kept until the registry is
+// destroyed, since a reader may still be probing one.
+template <typename Key, typename Value>
+class ConcurrentRegistry {
+public:
+    ConcurrentRegistry() { table_.store(addTable(kInitialCapacity), std::memory_order_release); }
+    ConcurrentRegistry(const ConcurrentRegistry&) = delete;
+    ConcurrentRegistry& operator=(const ConcurrentRegistry&) = delete;
+
+    Value& get(Key key) {
+        if (Value* value = find(key)) {
+            return *value;
+        }
+        std::lock_guard<std::mutex> lock(insert_mutex_);
+        if (Value* value = find(key)) {
+            return *value;
+        }
+        Table* table = table_.load(std::memory_order_relaxed);
+        // at most 3/4 full, so probes stay short and always end at an empty slot
+        if ((values_.size() + 1) * 4 > table->capacity * 3) {
+            Table* grown = addTable(table->capacity * 2);
+            for (size_t i = 0; i < table->capacity; i++) {
+                if (Value* value = table->slots[i].value.load(std::memory_order_relaxed)) {
+                    place(*grown, table->slots[i].key, value);
+                }
+            }
+            table_.store(grown, std::memory_order_release);
+            table = grown;
+        }
+        values_.emplace_back(new Value(key, values_.size()));
+        Value* value = values_.back().get();
+        place(*table, key, value);
+        return *value;
+    }
+
+    // nullptr if key was never registered
+    Value* find(Key key) const {
+        const Table* table = table_.load(std::memory_order_acquire);
+        for (size_t i = hash(key) & (table->capacity - 1);; i = (i + 1) & (table->capacity - 1)) {
+            const Slot& slot = table->slots[i];
+            Value* value = slot.value.load(std::memory_order_acquire);
+            if (!value) {
+                return nullptr;
+            }
+            if (slot.key == key) {
+                return value;
+            }
+        }
+    }
+
+private:
+    static constexpr size_t kInitialCapacity = 64;
+
+    // key is written once, before value is published
+    struct Slot {
+        Key key{};
+        std::atomic<Value*> value{nullptr};
+    };
+
+    struct Table {
+        explicit Table(size_t capacity) : capacity(capacity), slots(new Slot[capacity]) {}
+        size_t capacity;
+        std::unique_ptr<Slot[]> slots;
+    };
+
+    // pointer keys are aligned, so their low bits are mixed in before masking
+    static size_t hash(Key key) {
+        uint64_t h = std::hash<Key>()(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<size_t>(h);
+    }
+
+    static void place(Table& table, Key key, Value* value) {
+        size_t i = hash(key) & (table.capacity - 1);
+        while (table.slots[i].value.load(std::memory_order_relaxed)) {
+            i = (i + 1) & (table.capacity - 1);
+        }
+        table.slots[i].key = key;
+        table.slots[i].value.store(value, std::memory_order_release);
+    }
+
+    Table* addTable(size_t capacity) {
+        tables_.emplace_back(new Table(capacity));
+        return tables_.back().get();
+    }
+
+    std::atomic<Table*> table_{nullptr};
+    std::mutex insert_mutex_;
+    std::vector<std::unique_ptr<Table>> tables_;
+    std::vector<std::unique_ptr<Value>> values_;
+};
@@ -18,24 +18,324 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
-#include <c10/util/intrusive_ptr.h>
-
-namespace c10 {
-namespace cuda {
-namespace CUDACachingAllocator {
-namespace Native {
-    namespace {
-        struct Block;
-    }
-}
-}
-}
-
-struct BlockSegment {
-    BlockSegment();
-    BlockSegment(c10::cuda::CUDACachingAllocator::Native::Block* block, size_t offset);
-
-    c10::cuda::CUDACachingAllocator::Native::Block* block;
-    size_t offset;
-};
-}
\ No newline at end of file
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <cuda_runtime_api.h>
+
+// The allocator core: DeviceCachingAllocator with the VMM stitching, built
+// as libgcpool without c10. PyTorch reaches it through the c10 adapter in
+// CUDACachingAllocator.cpp, other runtimes through this header or the C API
+// in gcpool.h. Errors are thrown as gcpool::Error, and as
+// gcpool::OutOfMemoryError when a request cannot be served.
+
+namespace gcpool {
+
+// The statistics, snapshot and trace types mirror the c10 ones field by
+// field so the adapter can convert them one to one.
+
+struct Stat {
+  int64_t current = 0;
+  int64_t peak = 0;
+  int64_t allocated = 0;
+  int64_t freed = 0;
+};
+
+enum struct StatType : uint64_t {
+  AGGREGATE = 0,
+  SMALL_POOL = 1,
+  LARGE_POOL = 2,
+  NUM_TYPES = 3 // remember to update this whenever a new stat type is added
+};
+
+typedef std::array<Stat, static_cast<size_t>(StatType::NUM_TYPES)> StatArray;
+
+// Struct containing memory allocator summary statistics for a device.
+struct DeviceStats {
+  // COUNT: allocations requested by client code
+  StatArray allocation;
+  // COUNT: number of allocated segments from cudaMalloc().
+  StatArray segment;
+  // COUNT: number of active memory blocks (allocated or used by stream)
+  StatArray active;
+  // COUNT: number of inactive, split memory blocks (unallocated but can't be
+  // released via cudaFree)
+  StatArray inactive_split;
+
+  // SUM: bytes allocated by this memory alocator
+  StatArray allocated_bytes;
+  // SUM: bytes reserved by this memory allocator (both free and used)
+  StatArray reserved_bytes;
+  // SUM: bytes within active memory blocks
+  StatArray active_bytes;
+  // SUM: bytes within inactive, split memory blocks
+  StatArray inactive_split_bytes;
+  // SUM: bytes requested by client code
+  StatArray requested_bytes;
+
+  // COUNT: total number of failed calls to CUDA malloc necessitating cache
+  // flushes.
+  int64_t num_alloc_retries = 0;
+
+  // COUNT: total number of OOMs (i.e. failed calls to CUDA after cache flush)
+  int64_t num_ooms = 0;
+
+  // COUNT: total number of oversize blocks allocated from pool
+  Stat oversize_allocations;
+
+  // COUNT: total number of oversize blocks requiring malloc
+  Stat oversize_segments;
+
+  // SIZE: maximum block size that is allowed to be split.
+  int64_t max_split_size = 0;
+};
+
+// Opaque context of an allocation, e.g. the stack trace of the framework.
+struct Context {
+  virtual ~Context() = default;
+};
+
+typedef std::shared_ptr<Context> (*CreateContextFn)(void);
+
+struct History {
+  void* addr;
+  size_t real_size; // unrounded, actually requested size
+  std::shared_ptr<Context> context; // per-watcher context
+};
+
+// Struct containing info of an allocation block (i.e. a fractional part of a
+// cudaMalloc)..
+struct BlockInfo {
+  int64_t size = 0;
+  int64_t requested_size = 0;
+  int32_t gc_counter = 0;
+  bool allocated = false;
+  bool active = false;
+  std::vector<History> history;
+};
+
+// Struct containing info of a memory segment (i.e. one contiguous cudaMalloc).
+struct SegmentInfo {
+  int64_t device = 0;
+  int64_t address = 0;
+  int64_t total_size = 0;
+  int64_t requested_size = 0;
+  int64_t allocated_size = 0;
+  int64_t active_size = 0;
+  cudaStream_t stream = 0;
+  bool is_large = false;
+  std::vector<BlockInfo> blocks;
+};
+
+struct TraceEntry {
+  enum Action {
+    ALLOC, // API made to the caching allocator for new memory
+    FREE_REQUESTED, // API call made to the caching allocator to free memory
+    FREE_COMPLETED, // The allocator might have to delay a free because
+                    // it is still in use on another stream via record_stream
+                    // This event is generated when a free actually completes.
+    SEGMENT_ALLOC, // a call to cudaMalloc to get more memory from the OS
+    SEGMENT_FREE, // a call to cudaFree to return memory to the OS (e.g. to
+                  // defragment or empty_caches)
+    SNAPSHOT, // a call to snapshot, used to correlate memory snapshots to trace
+              // events
+    OOM // the allocator threw an OutOfMemoryError (addr_ is the amount of
+        // free bytes reported by cuda)
+  };
+  TraceEntry(
+      Action action,
+      int64_t addr,
+      size_t size,
+      cudaStream_t stream,
+      std::shared_ptr<Context> context = nullptr)
+      : action_(action),
+        addr_(addr),
+        context_(std::move(context)),
+        stream_(stream),
+        size_(static_cast<int64_t>(size)) {}
+  Action action_;
+  int64_t addr_; // for OOM, this is the amount of free bytes reported by cuda
+  std::shared_ptr<Context> context_;
+  cudaStream_t stream_;
+  int64_t size_;
+};
+
+struct SnapshotInfo {
+  std::vector<SegmentInfo> segments;
+  std::vector<std::vector<TraceEntry>> device_traces;
+};
+
+// (device, bytes requested, bytes allowed or device total, device free)
+using OutOfMemoryObserver = std::function<void(
+    int64_t device,
+    int64_t allocated,
+    int64_t device_total,
+    int64_t device_free)>;
+
+// CUDA graph capture ids, as c10::cuda::CaptureId_t and MempoolId_t.
+using CaptureId_t = unsigned long long;
+using MempoolId_t = std::pair<CaptureId_t, CaptureId_t>;
+
+// Callbacks into the embedding framework. All are optional; set them with
+// setAllocatorHooks before the first allocation.
+struct AllocatorHooks {
+  // whether report_memory_usage wants every malloc and free; the
+  // thread-local magazines are bypassed while it does
+  bool (*memory_profiling_enabled)() = nullptr;
+  // a block of alloc_size bytes was allocated (> 0) or freed (< 0)
+  void (*report_memory_usage)(
+      void* ptr,
+      int64_t alloc_size,
+      int64_t total_allocated,
+      int64_t total_reserved,
+      int device) = nullptr;
+  void (*report_out_of_memory)(
+      int64_t alloc_size,
+      int64_t total_allocated,
+      int64_t total_reserved,
+      int device) = nullptr;
+  // asks the framework to drop memory it caches on top of the allocator;
+  // true if anything was freed
+  bool (*free_memory_callbacks)() = nullptr;
+};
+
+void init(int device_count);
+bool initialized();
+// allocates on the current device; the block is safe to use on stream
+void* raw_alloc_with_stream(size_t nbytes, cudaStream_t stream);
+void raw_delete(void* ptr);
+// ptr is also used on stream of device; it is not reused before that work is
+// done
+void recordStream(void* ptr, cudaStream_t stream, int device);
+void* getBaseAllocation(void* ptr, size_t* size);
+void emptyCache();
+void cacheInfo(int device, size_t* largestBlock);
+void setMemoryFraction(double fraction, int device);
+// for the current device
+void recordHistory(
+    bool enabled,
+    CreateContextFn context_recorder,
+    size_t alloc_trace_max_entries,
+    bool alloc_trace_record_context);
+// for the current device
+void attachOutOfMemoryObserver(OutOfMemoryObserver observer);
+DeviceStats getDeviceStats(int device);
+void resetAccumulatedStats(int device);
+void resetPeakStats(int device);
+SnapshotInfo snapshot();
+
+void notifyCaptureBegin(int device, CaptureId_t graph_id, MempoolId_t mempool_id);
+void notifyCaptureAboutToEnd(int device, CaptureId_t graph_id);
+void notifyCaptureEnded(int device, CaptureId_t graph_id);
+void notifyCaptureDestroy(int device, MempoolId_t mempool_id);
+
+// PYTORCH_CUDA_ALLOC_CONF syntax: max_split_size_mb, roundup_power2_divisions,
+// garbage_collection_threshold and backend
+void setAllocatorSettings(const std::string& env);
+void setAllocatorHooks(const AllocatorHooks& hooks);
+
+// Stitching and garbage-collection counters that have no slot in DeviceStats.
+struct GCPoolStats {
+    // number of fused blocks created by get_fused_fragmented_blocks
+    int64_t num_fusions = 0;
+    // bytes covered by those fused blocks
+    int64_t fused_bytes = 0;
+    // virtual address currently held by live fused blocks
+    int64_t total_fuse_size = 0;
+    // calls of garbage_collect_fused_blocks
+    int64_t num_gc_passes = 0;
+    // fused blocks and bytes reclaimed by those calls
+    int64_t gc_blocks = 0;
+    int64_t gc_bytes = 0;
+};
+
+GCPoolStats getGCPoolStats(int device);
+
+// The strategy of DeviceCachingAllocator::malloc that served a request, in
+// the order they are tried.
+enum class MallocPath : uint8_t {
+    THREAD_MAGAZINE = 0,      // try_malloc_magazine (hits only, not timed)
+    CACHED_BLOCK,             // get_free_block
+    CACHED_AFTER_CALLBACKS,   // trigger_free_memory_callbacks + get_free_block
+    NEW_SEGMENT,              // realloc_block
+    NEW_SEGMENT_AFTER_RELEASE,// release_available_cached_blocks + realloc_block
+    FUSED_BLOCKS,             // get_fused_fragmented_blocks(p, 1)
+    NEW_SEGMENT_AFTER_FLUSH,  // release_cached_blocks + realloc_block
+    FUSED_AFTER_FLUSH,        // get_fused_fragmented_blocks(p, 2)
+    FAILED,                   // nothing worked, malloc throws
+    NUM_PATHS
+};
+
+constexpr size_t kNumMallocPaths = static_cast<size_t>(MallocPath::NUM_PATHS);
+
+const char* mallocPathName(MallocPath path);
+
+// HDR-style latency histogram: every power of two is split into
+// 2^kSubBucketBits linear sub-buckets, so any recorded value is known to
+// within 1/2^kSubBucketBits. Covers up to 2^kMaxExponent ns (~18 minutes).
+struct LatencyHistogram {
+    static constexpr size_t kSubBucketBits = 3;
+    static constexpr size_t kSubBuckets = size_t(1) << kSubBucketBits;
+    static constexpr size_t kMaxExponent = 40;
+    static constexpr size_t kBuckets = (kMaxExponent - kSubBucketBits + 2) * kSubBuckets;
+
+    int64_t count = 0;
+    int64_t total_ns = 0;
+    int64_t max_ns = 0;
+    int64_t buckets[kBuckets] = {};
+
+    void record(uint64_t ns);
+    // upper bound of the bucket holding the q-th quantile, 0 < q <= 1
+    uint64_t percentile(double q) const;
+
+    static size_t bucketIndex(uint64_t ns);
+    static uint64_t bucketUpperBound(size_t index);
+};
+
+// Which strategy served each malloc and how long malloc took on it, measured
+// from acquiring the allocator lock to returning the block.
+struct MallocPathStats {
+    int64_t hits[kNumMallocPaths] = {};
+    LatencyHistogram latency[kNumMallocPaths];
+
+    const LatencyHistogram& operator[](MallocPath path) const { return latency[static_cast<size_t>(path)]; }
+};
+
+MallocPathStats getMallocPathStats(int device);
+
+// Also reset by resetAccumulatedStats.
+void resetMallocPathStats(int device);
+
+// One entry of the allocator timeline kept while recordHistory() is on: the
+// entries of the record_trace ring with the time they were recorded, plus
+// timed spans around the expensive paths. Times are steady_clock
+// (CLOCK_MONOTONIC) nanoseconds.
+struct TimelineEvent {
+    enum Kind : uint8_t {
+        TRACE,       // a TraceEntry, see action
+        MALLOC,      // DeviceCachingAllocator::malloc, see path
+        NEW_SEGMENT, // realloc_block mapped or cudaMalloc'ed a segment
+        FUSION,      // get_fused_fragmented_blocks stitched a block
+        GC_PASS,     // garbage_collect_fused_blocks
+        CACHE_FLUSH  // release_cached_blocks
+    };
+
+    Kind kind;
+    TraceEntry::Action action;
+    MallocPath path;
+    int64_t start_ns;
+    // 0 for TRACE entries
+    int64_t duration_ns;
+    int64_t addr;
+    int64_t size;
+    // nullptr for GC passes and cache flushes, which are not tied to a stream
+    cudaStream_t stream;
+};
+
+// Sorted by start_ns; empty unless recordHistory() is enabled.
+std::vector<TimelineEvent> getTimeline(int device);
+
+} // namespace gcpool
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+// Per-API call counters and latency histograms for the driver and runtime
+// calls the allocator makes. DRV_CALL / DRV_CALL_RET record every cuMem*
+// call they wrap; event and cudaMalloc/cudaFree call sites in the caching
+// allocator go through DRV_TIMED. Counters are process-wide and updated with
+// relaxed atomics, so they can be read at any time without the allocator lock.
+
+enum class DriverApi : int {
+    MEM_CREATE = 0,
+    MEM_RELEASE,
+    MEM_ADDRESS_RESERVE,
+    MEM_ADDRESS_FREE,
+    MEM_MAP,
+    MEM_UNMAP,
+    MEM_SET_ACCESS,
+    MALLOC,
+    FREE,
+    EVENT_CREATE,
+    EVENT_RECORD,
+    EVENT_QUERY,
+    EVENT_SYNCHRONIZE,
+    EVENT_DESTROY,
+    OTHER,
+    NUM_APIS
+};
+
+constexpr size_t kNumDriverApis = static_cast<size_t>(DriverApi::NUM_APIS);
+
+// bucket i counts calls that took [2^i, 2^(i+1)) ns; bucket 0 also takes 0 ns
+constexpr size_t kDriverCallHistogramBuckets = 40;
+
+struct DriverCallStat {
+    uint64_t count = 0;
+    uint64_t errors = 0;
+    // cudaEventQuery on an unfinished event; not counted as an error
+    uint64_t not_ready = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t histogram[kDriverCallHistogramBuckets] = {};
+};
+
+struct DriverCallStats {
+    DriverCallStat apis[kNumDriverApis];
+
+    const DriverCallStat& operator[](DriverApi api) const { return apis[static_cast<size_t>(api)]; }
+};
+
+const char* driverApiName(DriverApi api);
+
+// Maps the stringified call of a DRV_CALL site ("cuMemMap(ptr, ...)") to its
+// API. Call sites resolve this once and cache it.
+DriverApi driverApiFromCall(const char* call);
+
+// status is a CUresult or cudaError_t; 0 is success in both.
+void recordDriverCall(DriverApi api, uint64_t elapsed_ns, int status);
+
+DriverCallStats getDriverCallStats();
+
+void resetDriverCallStats();
+
+// Calls that allocate, map or free device memory (MEM_CREATE through FREE),
+// the same set on a GPU and on the host backend.
+uint64_t driverMemoryCalls(const DriverCallStats& stats);
+
+// Upper bound of the histogram bucket holding the q-th quantile (0 < q <= 1).
+uint64_t driverCallPercentileNs(const DriverCallStat& stat, double q);
+
+inline uint64_t driverCallNowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+template <typename Call>
+inline auto timedDriverCall(DriverApi api, Call&& call) -> decltype(call()) {
+    uint64_t t0 = driverCallNowNs();
+    auto result = call();
+    recordDriverCall(api, driverCallNowNs() - t0, static_cast<int>(result));
+    return result;
+}
+
+#define DRV_TIMED(api, call) timedDriverCall((api), [&]() { return (call); })
@@ -1,74 +1,92 @@
+#pragma once
+
+#include "granule_bitmap.h"
+#include "vmm_segment.h"
+
+#include <algorithm>
+#include <cstddef>
 #include <memory>
 #include <vector>
-#include <algorithm>
 
 class FragmentationMonitor {
 public:
-    FragmentationMonitor(size_t threshold) : fragmentationThreshold(threshold) {}
+    explicit FragmentationMonitor(float threshold) : fragmentationThreshold(threshold) {}
 
     void trackMemoryState(const std::vector<std::shared_ptr<VmmSegment>>& segments) {
-        freeBlocks.clear();
-        allocatedBlocks.clear();
+        totalFreeMemory = 0;
+        totalAllocatedMemory = 0;
+        largestContiguousFreeBlock = 0;
 
         for (const auto& segment : segments) {
-            for (const auto& phyBlock : segment->phy_blocks) {
-                if (phyBlock->free) {
-                    freeBlocks.push_back(phyBlock->block_size);
-                } else {
-                    allocatedBlocks.push_back(phyBlock->block_size);
-                }
-            }
+            const GranuleBitmap& freeMap = segment->free_map;
+            const size_t freeGranules = freeMap.count();
+            totalFreeMemory += freeGranules * segment->granul_size;
+            totalAllocatedMemory += (freeMap.size() - freeGranules) * segment->granul_size;
+            largestContiguousFreeBlock = std::max(largestContiguousFreeBlock,
+                                                  freeMap.longestRun(true) * segment->granul_size);
         }
     }
 
-    void evaluateFragmentation() {
-        size_t totalFreeMemory = std::accumulate(freeBlocks.begin(), freeBlocks.end(), 0);
-        size_t largestContiguousFreeBlock = *std::max_element(freeBlocks.begin(), freeBlocks.end());
+    // segments are the ones passed to trackMemoryState; they are stitched
+    // and re-sorted when the fragmentation ratio crosses the threshold
+    void evaluateFragmentation(std::vector<std::shared_ptr<VmmSegment>>& segments) {
+        if (totalFreeMemory == 0) {
+            // nothing free, so nothing fragmented
+            fragmentationRatio = 0.0f;
+            memoryUtilization = 1.0f;
+            return;
+        }
 
         fragmentationRatio = (totalFreeMemory - largestContiguousFreeBlock) / static_cast<float>(totalFreeMemory);
-        memoryUtilization = static_cast<float>(allocatedBlocks.size()) / (allocatedBlocks.size() + freeBlocks.size());
+        memoryUtilization = static_cast<float>(totalAllocatedMemory) / (totalAllocatedMemory + totalFreeMemory);
 
         if (fragmentationRatio > fragmentationThreshold) {
-            triggerOptimization();
+            triggerOptimization(segments);
         }
     }
 
+    float getFragmentationRatio() const { return fragmentationRatio; }
+    float getMemoryUtilization() const { return memoryUtilization; }
+
 private:
+    static bool byAddress(const std::shared_ptr<VmmSegment>& a, const std::shared_ptr<VmmSegment>& b) {
+        return a->segment_ptr < b->segment_ptr;
+    }
+
     void triggerOptimization(std::vector<std::shared_ptr<VmmSegment>>& segments) {
         // Sort segments by their starting address to facilitate stitching
-        std::sort(segments.begin(), segments.end(), [](const std::shared_ptr<VmmSegment>& a, const std::shared_ptr<VmmSegment>& b) {
-            return a->segment_ptr < b->segment_ptr;
-        });
-    
-        // Attempt to stitch adjacent segments
-        for (size_t i = 0; i < segments.size() - 1; ++i) {
+        std::sort(segments.begin(), segments.end(), byAddress);
+
+        // Attempt to stitch adjacent segments; fused segments are never merged
+        for (size_t i = 0; i + 1 < segments.size(); ++i) {
+            if (segments[i]->fused || segments[i + 1]->fused) {
+                continue;
+            }
             if (segments[i]->remerge(*segments[i + 1])) {
                 // Remove the merged segment
                 segments.erase(segments.begin() + i + 1);
                 --i; // Adjust index to recheck the current segment with the next one
             }
         }
-    
+
         // Compaction logic: move free blocks to create larger contiguous free spaces
-        for (auto& segment : segments) {
-            if (segment->free_blocks > 0) {
-                size_t freeBlockSize = segment->free_blocks * segment->granul_size;
-                auto newSegment = segment->split(freeBlockSize);
-                if (newSegment) {
-                    segments.push_back(newSegment);
-                }
+        const size_t count = segments.size();
+        for (size_t i = 0; i < count; ++i) {
+            VmmSegment& segment = *segments[i];
+            if (segment.fused || segment.free_blocks == 0 || segment.free_blocks >= segment.phy_blocks.size()) {
+                continue;
             }
+            segments.push_back(segment.split(segment.free_blocks * segment.granul_size));
         }
-    
+
         // Sort segments again after compaction
-        std::sort(segments.begin(), segments.end(), [](const std::shared_ptr<VmmSegment>& a, const std::shared_ptr<VmmSegment>& b) {
-            return a->segment_ptr < b->segment_ptr;
-        });
+        std::sort(segments.begin(), segments.end(), byAddress);
     }
 
-    size_t fragmentationThreshold;
-    float fragmentationRatio;
-    float memoryUtilization;
-    std::vector<size_t> freeBlocks;
-    std::vector<size_t> allocatedBlocks;
+    float fragmentationThreshold;
+    float fragmentationRatio = 0.0f;
+    float memoryUtilization = 1.0f;
+    size_t totalFreeMemory = 0;
+    size_t totalAllocatedMemory = 0;
+    size_t largestContiguousFreeBlock = 0;
 };
@@ -0,0 +1,88 @@
+#ifndef GCPOOL_H
+#define GCPOOL_H
+
+/*
+ * C API of the GCPool allocator for applications that do not use PyTorch.
+ *
+ * It drives the same DeviceCachingAllocator core as the c10 CUDACachingAllocator
+ * adapter, so stitching, garbage collection and the vmmDefragment /
+ * fragLimit / reuseLimit / defragLevel / autoGC knobs behave identically.
+ * The header only depends on the CUDA runtime. Functions are thread-safe;
+ * on failure they return a status and gcpoolGetLastError() describes it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cuda_runtime_api.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    GCPOOL_SUCCESS = 0,
+    GCPOOL_ERROR_NOT_INITIALIZED = 1,
+    GCPOOL_ERROR_INVALID_VALUE = 2,
+    GCPOOL_ERROR_OUT_OF_MEMORY = 3,
+    GCPOOL_ERROR_INTERNAL = 4
+} gcpoolStatus;
+
+typedef struct {
+    int64_t allocated_bytes;
+    int64_t peak_allocated_bytes;
+    int64_t reserved_bytes;
+    int64_t peak_reserved_bytes;
+    int64_t active_bytes;
+    int64_t num_allocations;
+    int64_t num_segments;
+    int64_t num_alloc_retries;
+    int64_t num_ooms;
+    int64_t num_fusions;
+    int64_t fused_bytes;
+    int64_t num_gc_passes;
+    int64_t gc_bytes;
+} gcpoolStats;
+
+typedef struct {
+    uint64_t address;
+    uint64_t total_size;
+    uint64_t allocated_size;
+    uint64_t active_size;
+    cudaStream_t stream;
+    int device;
+    int is_large;
+    int num_blocks;
+} gcpoolSegment;
+
+/* Sets up one allocator per device; later calls are no-ops. */
+gcpoolStatus gcpoolInit(int device_count);
+
+/* Allocates on the given device for use on stream (NULL is the default stream). */
+gcpoolStatus gcpoolMalloc(void** ptr, size_t size, int device, cudaStream_t stream);
+
+gcpoolStatus gcpoolFree(void* ptr);
+
+/* Releases cached, unused memory of all devices to the driver. */
+gcpoolStatus gcpoolEmptyCache(void);
+
+/* Caps the memory the allocator may reserve on device at fraction of its capacity. */
+gcpoolStatus gcpoolSetMemoryFraction(double fraction, int device);
+
+gcpoolStatus gcpoolGetStats(int device, gcpoolStats* stats);
+
+gcpoolStatus gcpoolResetPeakStats(int device);
+
+/*
+ * Writes up to capacity segments of all devices to segments and the total
+ * number of segments to count. Pass capacity 0 to query the count.
+ */
+gcpoolStatus gcpoolSnapshot(gcpoolSegment* segments, size_t capacity, size_t* count);
+
+/* Message of the last failed call on this thread, or "" if there was none. */
+const char* gcpoolGetLastError(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GCPOOL_H */
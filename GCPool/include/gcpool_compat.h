@@ -0,0 +1,122 @@
+#pragma once
+
+// The few c10 facilities the allocator core relies on, without c10: error
+// types and check macros, hash containers and bit helpers. The core and the
+// C API only include this; the c10 adapter (CUDACachingAllocator.cpp)
+// translates gcpool::Error into c10::Error at its boundary.
+
+#include <cuda_runtime_api.h>
+
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+namespace gcpool {
+
+class Error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class OutOfMemoryError : public Error {
+public:
+    using Error::Error;
+};
+
+template <typename K, typename V, typename Hash = std::hash<K>>
+using flat_hash_map = std::unordered_map<K, V, Hash>;
+
+template <typename K, typename Hash = std::hash<K>>
+using flat_hash_set = std::unordered_set<K, Hash>;
+
+namespace detail {
+
+inline void streamArgs(std::ostringstream&) {}
+
+template <typename T, typename... Args>
+inline void streamArgs(std::ostringstream& out, const T& value, const Args&... args) {
+    out << value;
+    streamArgs(out, args...);
+}
+
+template <typename... Args>
+inline std::string str(const Args&... args) {
+    std::ostringstream out;
+    streamArgs(out, args...);
+    return out.str();
+}
+
+[[noreturn]] inline void throwCheck(const char* cond, const char* file, int line, const std::string& msg) {
+    throw Error(str(file, ":", line, ": check failed: ", cond, msg.empty() ? "" : ". ", msg));
+}
+
+template <typename ErrorT>
+[[noreturn]] inline void throwWith(const std::string& msg) {
+    throw ErrorT(msg);
+}
+
+void warn(const char* file, int line, const std::string& msg);
+
+} // namespace detail
+
+inline int countLeadingZeros(uint64_t value) {
+    return value == 0 ? 64 : __builtin_clzll(value);
+}
+
+inline int countTrailingZeros(uint64_t value) {
+    return value == 0 ? 64 : __builtin_ctzll(value);
+}
+
+inline bool isPowerOf2_64(uint64_t value) {
+    return value && !(value & (value - 1));
+}
+
+inline uint64_t PowerOf2Floor(uint64_t value) {
+    return value == 0 ? 0 : uint64_t(1) << (63 - countLeadingZeros(value));
+}
+
+} // namespace gcpool
+
+#define GCPOOL_LIKELY(expr) (__builtin_expect(static_cast<bool>(expr), 1))
+#define GCPOOL_UNLIKELY(expr) (__builtin_expect(static_cast<bool>(expr), 0))
+
+#define GCPOOL_CHECK(cond, ...) \
+    do { \
+        if (GCPOOL_UNLIKELY(!(cond))) { \
+            ::gcpool::detail::throwCheck(#cond, __FILE__, __LINE__, ::gcpool::detail::str(__VA_ARGS__)); \
+        } \
+    } while (0)
+
+#define GCPOOL_CHECK_WITH(error_t, cond, ...) \
+    do { \
+        if (GCPOOL_UNLIKELY(!(cond))) { \
+            ::gcpool::detail::throwWith<::gcpool::error_t>(::gcpool::detail::str(__VA_ARGS__)); \
+        } \
+    } while (0)
+
+#define GCPOOL_ASSERT(cond, ...) GCPOOL_CHECK(cond, "internal assert. ", ##__VA_ARGS__)
+
+#ifdef NDEBUG
+#define GCPOOL_ASSERT_DEBUG_ONLY(cond, ...) \
+    do { \
+        if (false) { \
+            (void)(cond); \
+        } \
+    } while (0)
+#else
+#define GCPOOL_ASSERT_DEBUG_ONLY(cond, ...) GCPOOL_ASSERT(cond, ##__VA_ARGS__)
+#endif
+
+#define GCPOOL_WARN(...) ::gcpool::detail::warn(__FILE__, __LINE__, ::gcpool::detail::str(__VA_ARGS__))
+
+#define GCPOOL_CUDA_CHECK(expr) \
+    do { \
+        const cudaError_t gcpool_err = (expr); \
+        if (GCPOOL_UNLIKELY(gcpool_err != cudaSuccess)) { \
+            ::gcpool::detail::throwCheck(#expr, __FILE__, __LINE__, cudaGetErrorString(gcpool_err)); \
+        } \
+    } while (0)
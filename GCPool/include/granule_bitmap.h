@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Free/used state of the physical granules of a VMM segment, one bit per
+// granule in phy_blocks order (set = free). Counting, run finding and range
+// checks work on whole 64-bit words with popcount and count-trailing-zeros;
+// with AVX2 the scans also compare and count four words per instruction, so
+// the long uniform stretches of a large segment are skipped quickly.
+//
+// Bits past size() in the last word are kept zero.
+class GranuleBitmap {
+public:
+    GranuleBitmap() = default;
+
+    size_t size() const { return size_; }
+
+    // resizes to n granules, all set to value
+    void assign(size_t n, bool value) {
+        size_ = n;
+        words_.assign((n + 63) / 64, value ? ~uint64_t(0) : 0);
+        clearPadding();
+    }
+
+    // keeps the first min(n, size()) bits, new bits are clear
+    void resize(size_t n) {
+        size_ = n;
+        words_.resize((n + 63) / 64, 0);
+        clearPadding();
+    }
+
+    // bits [begin, end) as a bitmap of end - begin bits
+    GranuleBitmap slice(size_t begin, size_t end) const {
+        GranuleBitmap out;
+        out.assign(end - begin, false);
+        const size_t first = begin / 64;
+        const size_t shift = begin % 64;
+        for (size_t w = 0; w < out.words_.size(); w++) {
+            uint64_t word = words_[first + w] >> shift;
+            if (shift && first + w + 1 < words_.size()) {
+                word |= words_[first + w + 1] << (64 - shift);
+            }
+            out.words_[w] = word;
+        }
+        out.clearPadding();
+        return out;
+    }
+
+    // appends the bits of other after the last bit
+    void append(const GranuleBitmap& other) {
+        const size_t base = size_ / 64;
+        const size_t shift = size_ % 64;
+        resize(size_ + other.size_);
+        for (size_t w = 0; w < other.words_.size(); w++) {
+            words_[base + w] |= other.words_[w] << shift;
+            if (shift && base + w + 1 < words_.size()) {
+                words_[base + w + 1] |= other.words_[w] >> (64 - shift);
+            }
+        }
+    }
+
+    bool test(size_t i) const { return (words_[i / 64] >> (i % 64)) & 1; }
+
+    void set(size_t i, bool value) {
+        const uint64_t bit = uint64_t(1) << (i % 64);
+        if (value) {
+            words_[i / 64] |= bit;
+        } else {
+            words_[i / 64] &= ~bit;
+        }
+    }
+
+    // sets [begin, end) to value
+    void set(size_t begin, size_t end, bool value) {
+        if (begin >= end) {
+            return;
+        }
+        const size_t first = begin / 64;
+        const size_t last = (end - 1) / 64;
+        for (size_t w = first; w <= last; w++) {
+            uint64_t mask = rangeMask(w, begin, end);
+            words_[w] = value ? (words_[w] | mask) : (words_[w] & ~mask);
+        }
+    }
+
+    // number of set bits
+    size_t count() const { return popcountWords(words_.data(), words_.size()); }
+
+    // number of set bits in [begin, end)
+    size_t count(size_t begin, size_t end) const {
+        if (begin >= end) {
+            return 0;
+        }
+        const size_t first = begin / 64;
+        const size_t last = (end - 1) / 64;
+        if (first == last) {
+            return __builtin_popcountll(words_[first] & rangeMask(first, begin, end));
+        }
+        return __builtin_popcountll(words_[first] & rangeMask(first, begin, end)) +
+            popcountWords(words_.data() + first + 1, last - first - 1) +
+            __builtin_popcountll(words_[last] & rangeMask(last, begin, end));
+    }
+
+    // first i >= pos with test(i) == value, size() if none
+    size_t findNext(size_t pos, bool value) const {
+        if (pos >= size_) {
+            return size_;
+        }
+        // words made only of bits != value are skipped
+        const uint64_t skip = value ? 0 : ~uint64_t(0);
+        size_t w = pos / 64;
+        uint64_t word = (words_[w] ^ skip) & (~uint64_t(0) << (pos % 64));
+        while (!word) {
+            w = skipWords(w + 1, skip);
+            if (w >= words_.size()) {
+                return size_;
+            }
+            word = words_[w] ^ skip;
+        }
+        // the zero padding reads as a match when looking for clear bits
+        return std::min(size_, w * 64 + __builtin_ctzll(word));
+    }
+
+    bool any(size_t begin, size_t end) const { return findNext(begin, true) < std::min(end, size_); }
+    bool all(size_t begin, size_t end) const { return findNext(begin, false) >= std::min(end, size_); }
+
+    // length of the longest run of bits equal to value
+    size_t longestRun(bool value) const {
+        size_t longest = 0;
+        size_t pos = findNext(0, value);
+        while (pos < size_) {
+            size_t end = findNext(pos, !value);
+            longest = std::max(longest, end - pos);
+            pos = findNext(end, value);
+        }
+        return longest;
+    }
+
+private:
+    // bits of word w that fall into [begin, end)
+    static uint64_t rangeMask(size_t w, size_t begin, size_t end) {
+        uint64_t mask = ~uint64_t(0);
+        if (begin > w * 64) {
+            mask &= ~uint64_t(0) << (begin - w * 64);
+        }
+        if (end < (w + 1) * 64) {
+            mask &= ~uint64_t(0) >> ((w + 1) * 64 - end);
+        }
+        return mask;
+    }
+
+    void clearPadding() {
+        if (size_ % 64) {
+            words_.back() &= ~uint64_t(0) >> (64 - size_ % 64);
+        }
+    }
+
+    // first word >= w that is not equal to skip
+    size_t skipWords(size_t w, uint64_t skip) const {
+#if defined(__AVX2__)
+        const __m256i pattern = _mm256_set1_epi64x(static_cast<long long>(skip));
+        while (w + 4 <= words_.size()) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words_.data() + w));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, pattern)) != -1) {
+                break;
+            }
+            w += 4;
+        }
+#endif
+        while (w < words_.size() && words_[w] == skip) {
+            w++;
+        }
+        return w;
+    }
+
+    static size_t popcountWords(const uint64_t* words, size_t n) {
+        size_t total = 0;
+        size_t i = 0;
+#if defined(__AVX2__)
+        // nibble lookup table, summed per 64-bit lane with sad_epu8
+        const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                               0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low = _mm256_set1_epi8(0x0f);
+        __m256i sums = _mm256_setzero_si256();
+        for (; i + 4 <= n; i += 4) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + i));
+            __m256i counts = _mm256_add_epi8(
+                _mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+                _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+            sums = _mm256_add_epi64(sums, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+        }
+        alignas(32) uint64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), sums);
+        total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+        for (; i < n; i++) {
+            total += __builtin_popcountll(words[i]);
+        }
+        return total;
+    }
+
+    size_t size_ = 0;
+    std::vector<uint64_t> words_;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+
+// Host-memory stand-in for the CUDA driver VMM API (cuMemCreate,
+// cuMemAddressReserve, cuMemMap, cuMemSetAccess, ...) and for the runtime
+// calls made by the caching allocator (events, streams, cudaMalloc, IPC
+// handles, cudaMemGetInfo). Link src/host_vmm_backend.cpp in place of libcuda
+// and libcudart to run VmmSegment and DeviceCachingAllocator unmodified on a
+// machine without a GPU; host/ declares the same API for builds without the
+// CUDA toolkit.
+//
+// - Physical allocations are ranges of one sparse memfd per device. Pages are
+//   only committed if somebody touches them, so large simulated devices are
+//   cheap.
+// - A reserved virtual range is a PROT_NONE anonymous mapping. cuMemMap maps
+//   the memfd over it with MAP_FIXED, cuMemUnmap puts PROT_NONE back, so
+//   stitched (fused) views really alias the same pages.
+// - Streams and events are plain host objects. Host work is synchronous, so
+//   a recorded event is complete, unless hostEventLatency asks for it to
+//   report cudaErrorNotReady for the first N queries.
+// - cudaMalloc memory is a range of the same memfd, so an IPC handle is the
+//   exporting pid, the memfd and the range; cudaIpcOpenMemHandle maps it
+//   through /proc/<pid>/fd.
+//
+// Environment:
+//   hostDeviceCount   number of simulated devices (default 1)
+//   hostDeviceMemory  bytes of memory per simulated device (default 16 GiB)
+//   hostEventLatency  cudaEventQuery calls before an event completes (default 0)
+
+struct HostBackendDeviceInfo {
+    size_t total_bytes;
+    size_t used_bytes;
+    size_t peak_used_bytes;
+    size_t reserved_va_bytes;
+    size_t mapped_bytes;
+};
+
+// Number of calls made into the backend since start-up or the last reset.
+struct HostBackendCallCounts {
+    size_t mem_create;
+    size_t mem_release;
+    size_t address_reserve;
+    size_t address_free;
+    size_t mem_map;
+    size_t mem_unmap;
+    size_t set_access;
+    size_t malloc;
+    size_t free;
+    size_t event_record;
+    size_t event_query;
+
+    size_t driver_calls() const {
+        return mem_create + mem_release + address_reserve + address_free +
+               mem_map + mem_unmap + set_access;
+    }
+};
+
+// Overrides the environment settings. Must be called before the first
+// allocation on any device.
+void hostBackendConfigure(int device_count, size_t device_memory, int event_latency = 0);
+
+HostBackendDeviceInfo hostBackendDeviceInfo(int device);
+
+void hostBackendResetPeak(int device);
+
+HostBackendCallCounts hostBackendCallCounts();
+
+void hostBackendResetCallCounts();
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Lock-free multi-producer queue of intrusively linked objects, drained a
+// whole batch at a time. push() is one compare-and-swap onto a stack;
+// popAll() takes the entire stack with one exchange and reverses it, so the
+// batch comes out in push order and no node is ever popped alone (which is
+// what makes a Treiber stack prone to ABA).
+//
+// T needs a `T* T::*Next` member that the queue owns from push() until the
+// node is returned by popAll(). popAll() may be called from any number of
+// threads; each call gets a disjoint batch.
+template <typename T, T* T::*Next>
+class MpscQueue {
+public:
+    MpscQueue() = default;
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    // returns size() including node
+    size_t push(T* node) {
+        // counted before the node is visible, so popAll never takes it first
+        const size_t size = size_.fetch_add(1, std::memory_order_relaxed) + 1;
+        T* head = head_.load(std::memory_order_relaxed);
+        do {
+            node->*Next = head;
+        } while (!head_.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+        return size;
+    }
+
+    bool empty() const { return head_.load(std::memory_order_acquire) == nullptr; }
+
+    // nodes pushed and not yet popped; may count a node a push is still
+    // linking in, or one a popAll has taken but not yet counted out
+    size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+    // the nodes pushed so far, oldest first, linked through Next; nullptr if
+    // none
+    T* popAll() {
+        T* node = head_.exchange(nullptr, std::memory_order_acquire);
+        T* reversed = nullptr;
+        size_t count = 0;
+        while (node) {
+            T* next = node->*Next;
+            node->*Next = reversed;
+            reversed = node;
+            node = next;
+            count += 1;
+        }
+        size_.fetch_sub(count, std::memory_order_relaxed);
+        return reversed;
+    }
+
+private:
+    std::atomic<T*> head_{nullptr};
+    std::atomic<size_t> size_{0};
+};
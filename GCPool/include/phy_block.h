@@ -6,7 +6,22 @@
 #include "utils.h"
 #include "gcpool_logging.h"
 
-struct BlockSegment;
+namespace gcpool {
+namespace Native {
+    struct Block;
+}
+}
+
+// A block of the caching allocator that maps a physical block, and the index
+// of the physical block within that block's segment.
+struct BlockSegment {
+    BlockSegment() : block(nullptr), offset(0) {}
+    BlockSegment(gcpool::Native::Block* block_in, size_t offset_in)
+        : block(block_in), offset(offset_in) {}
+
+    gcpool::Native::Block* block;
+    size_t offset;
+};
 
 struct PhyBlock {
     PhyBlock(int device_id_in = -1, size_t block_size_in = granularitySize);
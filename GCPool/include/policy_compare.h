@@ -0,0 +1,47 @@
+#pragma once
+
+#include "trace_replay.h"
+
+#include <iosfwd>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Runs one allocation trace through several allocator policies and compares
+// the replay reports. The allocator reads its knobs (vmmDefragment, fragLimit,
+// reuseLimit, defragLevel, autoGC, reAlloc) from the environment once per
+// process, so every policy is replayed in a forked child with its own
+// environment. The calling process must not have initialized CUDA or the
+// caching allocator.
+
+struct AllocatorPolicy {
+    std::string name;
+    // environment variables set in the child before the allocator starts
+    std::vector<std::pair<std::string, std::string>> env;
+};
+
+struct PolicyRun {
+    AllocatorPolicy policy;
+    // false if the child crashed or could not report back
+    bool ok = false;
+    ReplayReport report;
+};
+
+// "native": the upstream splitting path (vmmDefragment=0)
+// "gcpool": VMM stitching (vmmDefragment=1) with the default knobs
+std::vector<AllocatorPolicy> defaultComparePolicies();
+
+// Parses "name:KEY=VALUE,KEY=VALUE". Returns false on a malformed spec.
+bool parseAllocatorPolicy(const std::string& spec, AllocatorPolicy& policy);
+
+// device_memory > 0 limits the replay device, see initReplayDevice().
+std::vector<PolicyRun> comparePolicies(const std::vector<ReplayEntry>& trace,
+                                       const ReplayOptions& options,
+                                       const std::vector<AllocatorPolicy>& policies,
+                                       size_t device_memory = 0);
+
+void printPolicyComparison(std::ostream& out, const std::vector<PolicyRun>& runs);
+
+// One row per sample step with reserved, allocated and reserved/allocated
+// for every policy.
+void writePolicySamplesCsv(std::ostream& out, const std::vector<PolicyRun>& runs);
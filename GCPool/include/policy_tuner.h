@@ -0,0 +1,62 @@
+#pragma once
+
+#include "policy_compare.h"
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Searches the stitching knobs read by get_free_block and
+// get_fused_fragmented_blocks (fragLimit, reuseLimit, defragLevel, autoGC)
+// for the configuration with the lowest peak reserved memory whose malloc p99
+// stays within a latency budget and that does not OOM more often than the
+// defaults. Every candidate is replayed with comparePolicies(), so the same
+// restriction applies: the calling process must not have initialized CUDA or
+// the caching allocator.
+//
+// The trace is either recorded offline (loadTrace) or taken from a warm-up
+// window of the live job: enable recordHistory(), run a few iterations, then
+// pass snapshot().device_traces[device] through replayEntriesFromTrace().
+
+struct TunerKnob {
+    // environment variable read by the allocator
+    std::string env;
+    std::string default_value;
+    // candidate values, default_value included
+    std::vector<std::string> values;
+};
+
+struct TunerOptions {
+    ReplayOptions replay;
+    // > 0 limits the replay device, see initReplayDevice()
+    size_t device_memory = 0;
+    // malloc p99 budget as a multiple of the p99 with default knobs
+    double max_p99_ratio = 1.5;
+    // absolute malloc p99 budget in ns; overrides max_p99_ratio when > 0
+    uint64_t max_p99_ns = 0;
+    // coordinate descent rounds over all knobs; stops early without progress
+    size_t max_rounds = 3;
+};
+
+struct TunerResult {
+    bool ok = false;
+    // stitching enabled plus one value per knob
+    AllocatorPolicy best;
+    PolicyRun best_run;
+    PolicyRun baseline;
+    uint64_t latency_budget_ns = 0;
+    std::vector<PolicyRun> evaluated;
+};
+
+// fragLimit 64 MB..2 GB, reuseLimit 1.5..20, defragLevel 0/2/3, autoGC 16..1000 GB.
+// Stitching is tried with time 1, 2 and 4, so levels 0 and 1 behave the same.
+std::vector<TunerKnob> defaultTunerKnobs();
+
+TunerResult tuneAllocatorKnobs(const std::vector<ReplayEntry>& trace,
+                               const TunerOptions& options,
+                               const std::vector<TunerKnob>& knobs = defaultTunerKnobs());
+
+void printTunerResult(std::ostream& out, const TunerResult& result);
+
+// Writes the best configuration as "export KEY=VALUE" lines.
+void writeTunerConfig(std::ostream& out, const TunerResult& result);
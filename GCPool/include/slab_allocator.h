@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Object pool for the allocator metadata that is created and destroyed on
+// every split, fuse and free (Block, BlockEvent). Objects live in slabs of
+// kObjectsPerSlab slots; a destroyed object's slot goes onto a LIFO free list
+// and is handed out first, so the hot paths reuse recently touched memory and
+// stop calling the global operator new once the slabs are warm. Slabs are
+// only returned to the heap when the SlabAllocator itself is destroyed.
+//
+// Not thread-safe: the owner serializes create() and destroy(), which the
+// caching allocator does with its per-device mutex.
+template <typename T, size_t kObjectsPerSlab = 256>
+class SlabAllocator {
+public:
+    SlabAllocator() = default;
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        if (!free_list_) {
+            grow();
+        }
+        Slot* slot = free_list_;
+        Slot* next = slot->next;
+        T* object;
+        try {
+            object = new (&slot->storage) T(std::forward<Args>(args)...);
+        } catch (...) {
+            // a throwing constructor may have written over the link
+            slot->next = next;
+            throw;
+        }
+        free_list_ = next;
+        live_ += 1;
+        return object;
+    }
+
+    void destroy(T* object) {
+        if (!object) {
+            return;
+        }
+        object->~T();
+        Slot* slot = reinterpret_cast<Slot*>(object);
+        slot->next = free_list_;
+        free_list_ = slot;
+        live_ -= 1;
+    }
+
+    // objects created and not yet destroyed
+    size_t live() const { return live_; }
+    size_t capacity() const { return slabs_.size() * kObjectsPerSlab; }
+
+private:
+    union Slot {
+        Slot* next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    void grow() {
+        slabs_.emplace_back(new Slot[kObjectsPerSlab]);
+        Slot* slab = slabs_.back().get();
+        // link back to front so the slab is handed out in address order
+        for (size_t i = kObjectsPerSlab; i-- > 0;) {
+            slab[i].next = free_list_;
+            free_list_ = &slab[i];
+        }
+    }
+
+    std::vector<std::unique_ptr<Slot[]>> slabs_;
+    Slot* free_list_ = nullptr;
+    size_t live_ = 0;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "cuda_gcpool_allocator.h"
+#include "driver_call_stats.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Offline replay of allocation traces recorded with recordHistory().
+//
+// A trace is stored as text, one TraceEntry per line:
+//     <action> <addr> <size> <stream>
+// where action is one of alloc, free_requested, free_completed,
+// segment_alloc, segment_free, snapshot, oom. Only alloc and free_requested
+// drive the replay; the other actions are outcomes of the recorded run and
+// are kept so the file can be diffed against a replayed trace.
+
+using ReplayAction = gcpool::TraceEntry::Action;
+
+struct ReplayEntry {
+    ReplayAction action;
+    int64_t addr;
+    size_t size;
+    uint64_t stream;
+};
+
+struct ReplayOptions {
+    int device = 0;
+    // sample reserved/allocated bytes every sample_interval replayed entries
+    size_t sample_interval = 1000;
+    // free what is still live and call emptyCache() when the trace ends
+    bool release_at_end = true;
+};
+
+struct ReplaySample {
+    size_t step;
+    int64_t reserved_bytes;
+    int64_t allocated_bytes;
+    // 1 - allocated / reserved
+    double fragmentation;
+};
+
+struct ReplayReport {
+    size_t num_allocs = 0;
+    size_t num_frees = 0;
+    size_t num_ooms = 0;
+    // frees whose address was never allocated in the replay
+    size_t num_unmatched_frees = 0;
+    int64_t peak_reserved_bytes = 0;
+    int64_t peak_allocated_bytes = 0;
+    double max_fragmentation = 0.0;
+    double elapsed_ms = 0.0;
+    // latency of the replayed raw_alloc calls, including failed ones
+    uint64_t malloc_p50_ns = 0;
+    uint64_t malloc_p99_ns = 0;
+    uint64_t malloc_max_ns = 0;
+    // replay steps (as in ReplaySample::step) whose allocation ran out of memory
+    std::vector<size_t> oom_steps;
+    gcpool::DeviceStats device_stats;
+    gcpool::GCPoolStats gcpool_stats;
+    gcpool::MallocPathStats malloc_paths;
+    // per-API latency as seen by the allocator, on a GPU or the host backend
+    DriverCallStats driver_latency;
+    std::vector<ReplaySample> samples;
+};
+
+const char* replayActionName(ReplayAction action);
+
+bool parseReplayAction(const std::string& name, ReplayAction* action);
+
+// Returns false if the file cannot be opened or a line is malformed.
+bool loadTrace(const std::string& path, std::vector<ReplayEntry>& trace);
+
+// Converts a trace recorded in this process, e.g. snapshot().device_traces[d].
+std::vector<ReplayEntry> replayEntriesFromTrace(const std::vector<gcpool::TraceEntry>& trace);
+
+void saveTrace(std::ostream& out, const std::vector<gcpool::TraceEntry>& trace);
+
+bool saveTrace(const std::string& path, const std::vector<gcpool::TraceEntry>& trace);
+
+void saveTrace(std::ostream& out, const std::vector<ReplayEntry>& trace);
+
+bool saveTrace(const std::string& path, const std::vector<ReplayEntry>& trace);
+
+// Initializes the allocator for devices 0..device. device_memory > 0 limits
+// the replay device to that many bytes: the host backend emulates a device of
+// that size, on a GPU the caching allocator is capped with setMemoryFraction().
+// Call it before the first allocation.
+void initReplayDevice(int device, size_t device_memory);
+
+// Feeds the trace through the caching allocator of options.device. The
+// allocator must already be initialized.
+ReplayReport replayTrace(const std::vector<ReplayEntry>& trace, const ReplayOptions& options);
+
+void printReplayReport(std::ostream& out, const ReplayReport& report);
+
+void writeReplaySamplesCsv(std::ostream& out, const ReplayReport& report);
@@ -4,6 +4,7 @@
 #include <cuda.h>
 #include <cuda_runtime.h>
 #include "gcpool_logging.h"
+#include "driver_call_stats.h"
 
 size_t getGranularitySize();
 
@@ -13,25 +14,31 @@ void gcpoolInfoInit();
 
 void getHostName(char* hostname, int maxlen, const char delim);
 
-#define DRV_CALL(call) 
-    { 
-        CUresult result = (call); 
-        if (CUDA_SUCCESS != result) { 
-            const char* errMsg; cuGetErrorString(result, &errMsg); 
-            ASSERT(0, "Error when exec " #call " %s-%d code:%d err:%s", __FUNCTION__, __LINE__, result, errMsg); 
-        } 
+#define DRV_CALL(call) \
+    { \
+        static const DriverApi drv_api = driverApiFromCall(#call); \
+        uint64_t drv_t0 = driverCallNowNs(); \
+        CUresult result = (call); \
+        recordDriverCall(drv_api, driverCallNowNs() - drv_t0, result); \
+        if (CUDA_SUCCESS != result) { \
+            const char* errMsg; cuGetErrorString(result, &errMsg); \
+            ASSERT(0, "Error when exec " #call " %s-%d code:%d err:%s", __FUNCTION__, __LINE__, result, errMsg); \
+        } \
     }
 
-#define DRV_CALL_RET(call, status_val) 
-    { 
-        if (CUDA_SUCCESS == status_val) { 
-            CUresult result = (call); 
-            if (CUDA_SUCCESS != result) { 
-                const char* errMsg; cuGetErrorString(result, &errMsg); 
-                WARN(0, "Error when exec " #call " %s-%d code:%d err:%s", __FUNCTION__, __LINE__, result, errMsg); 
-            } 
-            status_val = result; 
-        } 
+#define DRV_CALL_RET(call, status_val) \
+    { \
+        if (CUDA_SUCCESS == status_val) { \
+            static const DriverApi drv_api = driverApiFromCall(#call); \
+            uint64_t drv_t0 = driverCallNowNs(); \
+            CUresult result = (call); \
+            recordDriverCall(drv_api, driverCallNowNs() - drv_t0, result); \
+            if (CUDA_SUCCESS != result) { \
+                const char* errMsg; cuGetErrorString(result, &errMsg); \
+                WARN(0, "Error when exec " #call " %s-%d code:%d err:%s", __FUNCTION__, __LINE__, result, errMsg); \
+            } \
+            status_val = result; \
+        } \
     }
 
 static constexpr size_t granularitySize = 2097152;
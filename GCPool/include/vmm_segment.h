@@ -4,6 +4,7 @@
 #include <memory>
 #include <mutex>
 #include "vir_block.h"
+#include "granule_bitmap.h"
 
 struct VmmSegment {
     VmmSegment();
@@ -15,8 +16,12 @@ struct VmmSegment {
     void allocate_phy_blocks(size_t blocks, size_t block_size_in, int device_id_in);
     void release_resources();
     void* mapVirAddr();
+    // split and remerge carry free_map, free_blocks and used_blocks along
+    // with the granules; fused segments are never split or merged
     std::shared_ptr<VmmSegment> split(size_t keep_size);
     bool remerge(VmmSegment& segment);
+    // rebuilds free_map and free_blocks from PhyBlock::free
+    void init_free_map();
 
     std::vector<std::shared_ptr<PhyBlock>> phy_blocks;
     std::vector<std::shared_ptr<VirBlock>> vir_blocks;
@@ -26,6 +31,14 @@ struct VmmSegment {
     CUresult status;
     size_t free_blocks;
     size_t used_blocks;
+    // bit i set while phy_blocks[i] is free, initialised from PhyBlock::free;
+    // kept by the caching allocator together with free_blocks, which is its
+    // population count
+    GranuleBitmap free_map;
+    // fused segments only, one entry per granule: index of the entry of
+    // phy_blocks[i] in its mapped_blocks that points back at this segment's
+    // block
+    std::vector<size_t> mapped_slots;
     bool fused;
     bool released;
 };
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "trace_replay.h"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Synthetic allocation workloads modelled on training and inference jobs.
+// Every generator is deterministic for a given seed and emits alloc /
+// free_requested entries in the trace_replay.h format, so the result can be
+// fed to replayTrace() directly or written out with saveTrace().
+
+// Emits a well-formed allocation sequence: every free refers to a live
+// allocation and carries its size and stream.
+class WorkloadBuilder {
+public:
+    int64_t alloc(size_t size, uint64_t stream = 0);
+    void free(int64_t addr);
+    // frees everything that is still live, in allocation order
+    void freeAll();
+
+    size_t liveBytes() const { return live_bytes; }
+    std::vector<ReplayEntry> take();
+
+private:
+    struct LiveAlloc {
+        size_t size;
+        uint64_t stream;
+    };
+
+    int64_t next_addr = 1;
+    size_t live_bytes = 0;
+    std::unordered_map<int64_t, LiveAlloc> live;
+    std::vector<ReplayEntry> entries;
+};
+
+// Decoder-only transformer training step: persistent weights, gradients and
+// Adam state, per-layer activations saved for backward, and recomputation of
+// non-checkpointed layers when activation checkpointing is on.
+struct TransformerTrainingOptions {
+    uint64_t seed = 0;
+    size_t steps = 5;
+    size_t layers = 12;
+    size_t hidden = 2048;
+    size_t heads = 16;
+    size_t batch = 8;
+    size_t seq_len = 1024;
+    // each step draws seq_len * (1 +- seq_jitter)
+    double seq_jitter = 0.0;
+    size_t dtype_bytes = 2;
+    // keep the input of every Nth layer and recompute the rest; 0 keeps all
+    size_t checkpoint_every = 0;
+};
+
+// Autoregressive serving: requests arrive with log-normally distributed
+// prompt and output lengths, and every layer's K/V cache is re-allocated
+// larger as the sequence grows (the concat pattern of HF-style caches).
+struct LLMInferenceOptions {
+    uint64_t seed = 0;
+    size_t requests = 32;
+    size_t max_batch = 8;
+    size_t layers = 16;
+    size_t hidden = 4096;
+    size_t vocab = 32000;
+    size_t dtype_bytes = 2;
+    double prompt_len_mean = 512.0;
+    double prompt_len_sigma = 0.6;
+    double output_len_mean = 128.0;
+    double output_len_sigma = 0.5;
+    size_t max_seq_len = 4096;
+    // tokens added to the cache per re-allocation; 1 re-allocates every token
+    size_t kv_grow_tokens = 16;
+};
+
+// Mixture-of-experts training: tokens are routed to experts with Zipf
+// distributed popularity that changes per layer and step, so expert buffers
+// have highly skewed, varying sizes.
+struct MoETrainingOptions {
+    uint64_t seed = 0;
+    size_t steps = 10;
+    size_t layers = 12;
+    size_t experts = 16;
+    size_t top_k = 2;
+    size_t tokens = 8192;
+    size_t hidden = 2048;
+    size_t ffn_hidden = 8192;
+    size_t dtype_bytes = 2;
+    // Zipf exponent of expert popularity; 0 is uniform routing
+    double zipf_exponent = 1.2;
+};
+
+// Input pipeline with several loader streams staging variable sized batches,
+// a compute stream with per-batch temporaries and a communication stream that
+// allocates fixed-size gradient buckets.
+struct DataPipelineOptions {
+    uint64_t seed = 0;
+    size_t batches = 200;
+    size_t loader_streams = 3;
+    size_t prefetch_depth = 2;
+    size_t min_batch_bytes = 8 << 20;
+    size_t max_batch_bytes = 96 << 20;
+    // compute temporaries per batch, as a multiple of the batch size
+    double compute_factor = 3.0;
+    size_t comm_bucket_bytes = 25 << 20;
+    size_t comm_buckets = 4;
+};
+
+std::vector<ReplayEntry> generateTransformerTraining(const TransformerTrainingOptions& options);
+
+std::vector<ReplayEntry> generateLLMInference(const LLMInferenceOptions& options);
+
+std::vector<ReplayEntry> generateMoETraining(const MoETrainingOptions& options);
+
+std::vector<ReplayEntry> generateDataPipeline(const DataPipelineOptions& options);
+
+// Generates one of "transformer", "transformer_ckpt", "llm_inference", "moe"
+// or "pipeline" with default options and the given seed. Returns false for an
+// unknown name.
+bool generateWorkload(const std::string& name, uint64_t seed, std::vector<ReplayEntry>& trace);
@@ -0,0 +1,232 @@
+#include "chrome_trace.h"
+
+#include <cuda_runtime_api.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <ostream>
+#include <unordered_map>
+
+namespace {
+
+using gcpool::TimelineEvent;
+using gcpool::TraceEntry;
+
+// tid of the track for GC passes and cache flushes; streams start at 1
+constexpr int kAllocatorTid = 0;
+
+const char* span_name(TimelineEvent::Kind kind) {
+  switch (kind) {
+    case TimelineEvent::MALLOC:
+      return "malloc";
+    case TimelineEvent::NEW_SEGMENT:
+      return "new segment";
+    case TimelineEvent::FUSION:
+      return "fusion";
+    case TimelineEvent::GC_PASS:
+      return "gc pass";
+    case TimelineEvent::CACHE_FLUSH:
+      return "cache flush";
+    default:
+      return "trace";
+  }
+}
+
+const char* instant_name(TraceEntry::Action action) {
+  switch (action) {
+    case TraceEntry::SEGMENT_ALLOC:
+      return "segment alloc";
+    case TraceEntry::SEGMENT_FREE:
+      return "segment free";
+    case TraceEntry::SNAPSHOT:
+      return "snapshot";
+    case TraceEntry::OOM:
+      return "oom";
+    default:
+      return nullptr;
+  }
+}
+
+std::string hex(int64_t value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "0x%llx", static_cast<unsigned long long>(value));
+  return buf;
+}
+
+class ChromeTraceWriter {
+ public:
+  ChromeTraceWriter(std::ostream& out, int64_t origin_ns) : out(out), origin_ns(origin_ns) {}
+
+  // starts an event object with the fields every phase has
+  std::ostream& begin(const char* ph, const char* name, int pid, int tid, int64_t ts_ns) {
+    out << (first ? "\n" : ",\n") << "{\"ph\":\"" << ph << "\",\"name\":\"" << name
+        << "\",\"pid\":" << pid << ",\"tid\":" << tid << ",\"ts\":";
+    micros(ts_ns - origin_ns);
+    first = false;
+    return out;
+  }
+
+  void micros(int64_t ns) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", ns / 1000.0);
+    out << buf;
+  }
+
+  void metadata(const char* name, int pid, int tid, const std::string& value) {
+    out << (first ? "\n" : ",\n") << "{\"ph\":\"M\",\"name\":\"" << name << "\",\"pid\":" << pid
+        << ",\"tid\":" << tid << ",\"args\":{\"name\":\"" << value << "\"}}";
+    first = false;
+  }
+
+  std::ostream& out;
+
+ private:
+  int64_t origin_ns;
+  bool first = true;
+};
+
+void write_device(ChromeTraceWriter& w, const DeviceTimeline& timeline) {
+  const int pid = timeline.device;
+  std::ostream& out = w.out;
+
+  w.metadata("process_name", pid, kAllocatorTid, "cuda:" + std::to_string(pid));
+  w.metadata("thread_name", pid, kAllocatorTid, "allocator");
+  std::unordered_map<cudaStream_t, int> tids;
+  auto tid_of = [&](cudaStream_t stream) {
+    auto it = tids.find(stream);
+    if (it == tids.end()) {
+      it = tids.emplace(stream, static_cast<int>(tids.size()) + 1).first;
+      w.metadata("thread_name", pid, it->second,
+                 stream ? "stream " + hex(reinterpret_cast<int64_t>(stream)) : "default stream");
+    }
+    return it->second;
+  };
+
+  struct LiveBlock {
+    int tid;
+    int64_t size;
+  };
+  std::unordered_map<int64_t, LiveBlock> live;
+  // blocks whose free was requested but not yet completed: addr -> time
+  std::unordered_map<int64_t, int64_t> pending_frees;
+  int64_t allocated = 0;
+
+  auto end_block = [&](int64_t addr, int64_t ts_ns) {
+    auto it = live.find(addr);
+    w.begin("e", "block", pid, it->second.tid, ts_ns)
+        << ",\"cat\":\"block\",\"id\":\"" << hex(addr) << "\"}";
+    allocated -= it->second.size;
+    w.begin("C", "allocated bytes", pid, kAllocatorTid, ts_ns)
+        << ",\"args\":{\"allocated\":" << allocated << "}}";
+    live.erase(it);
+    pending_frees.erase(addr);
+  };
+
+  for (const auto& ev : timeline.events) {
+    if (ev.kind != TimelineEvent::TRACE) {
+      const bool on_stream = ev.kind != TimelineEvent::GC_PASS && ev.kind != TimelineEvent::CACHE_FLUSH;
+      const int tid = on_stream ? tid_of(ev.stream) : kAllocatorTid;
+      w.begin("X", span_name(ev.kind), pid, tid, ev.start_ns) << ",\"dur\":";
+      w.micros(ev.duration_ns);
+      out << ",\"args\":{\"size\":" << ev.size;
+      if (ev.addr != 0) {
+        out << ",\"addr\":\"" << hex(ev.addr) << "\"";
+      }
+      if (ev.kind == TimelineEvent::MALLOC) {
+        out << ",\"path\":\"" << gcpool::mallocPathName(ev.path) << "\"";
+      }
+      out << "}}";
+      continue;
+    }
+
+    const int tid = tid_of(ev.stream);
+    switch (ev.action) {
+      case TraceEntry::ALLOC: {
+        // the free of a reused address was never completed in the ring
+        auto pending = pending_frees.find(ev.addr);
+        if (pending != pending_frees.end()) {
+          end_block(ev.addr, pending->second);
+        }
+        live[ev.addr] = LiveBlock{tid, ev.size};
+        w.begin("b", "block", pid, tid, ev.start_ns)
+            << ",\"cat\":\"block\",\"id\":\"" << hex(ev.addr) << "\",\"args\":{\"size\":" << ev.size << "}}";
+        allocated += ev.size;
+        w.begin("C", "allocated bytes", pid, kAllocatorTid, ev.start_ns)
+            << ",\"args\":{\"allocated\":" << allocated << "}}";
+        break;
+      }
+      case TraceEntry::FREE_REQUESTED:
+        if (live.count(ev.addr)) {
+          pending_frees[ev.addr] = ev.start_ns;
+        }
+        break;
+      case TraceEntry::FREE_COMPLETED:
+        // skips blocks allocated before the oldest entry of the ring
+        if (live.count(ev.addr)) {
+          end_block(ev.addr, ev.start_ns);
+        }
+        break;
+      default: {
+        const char* name = instant_name(ev.action);
+        if (name) {
+          w.begin("i", name, pid, tid, ev.start_ns)
+              << ",\"s\":\"t\",\"args\":{\"addr\":\"" << hex(ev.addr) << "\",\"size\":" << ev.size << "}}";
+        }
+        break;
+      }
+    }
+  }
+
+  while (!pending_frees.empty()) {
+    auto it = pending_frees.begin();
+    end_block(it->first, it->second);
+  }
+}
+
+} // anonymous namespace
+
+void writeChromeTrace(std::ostream& out, const std::vector<DeviceTimeline>& timelines) {
+  int64_t origin_ns = std::numeric_limits<int64_t>::max();
+  for (const auto& timeline : timelines) {
+    if (!timeline.events.empty()) {
+      origin_ns = std::min(origin_ns, timeline.events.front().start_ns);
+    }
+  }
+  if (origin_ns == std::numeric_limits<int64_t>::max()) {
+    origin_ns = 0;
+  }
+
+  ChromeTraceWriter w(out, origin_ns);
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  for (const auto& timeline : timelines) {
+    write_device(w, timeline);
+  }
+  out << "\n]}\n";
+}
+
+bool dumpChromeTrace(const std::string& path, const std::vector<int>& devices) {
+  std::vector<int> selected = devices;
+  if (selected.empty()) {
+    int count = 0;
+    if (cudaGetDeviceCount(&count) != cudaSuccess) {
+      return false;
+    }
+    for (int device = 0; device < count; device++) {
+      selected.push_back(device);
+    }
+  }
+
+  std::vector<DeviceTimeline> timelines;
+  for (int device : selected) {
+    timelines.push_back({device, gcpool::getTimeline(device)});
+  }
+
+  std::ofstream out(path);
+  if (!out) {
+    return false;
+  }
+  writeChromeTrace(out, timelines);
+  return static_cast<bool>(out);
+}
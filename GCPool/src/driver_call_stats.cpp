@@ -0,0 +1,152 @@
+#include "driver_call_stats.h"
+
+#include <atomic>
+#include <cstring>
+
+namespace {
+
+// cudaErrorNotReady and CUDA_ERROR_NOT_READY share this value
+constexpr int kStatusNotReady = 600;
+
+struct AtomicDriverCallStat {
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> errors{0};
+  std::atomic<uint64_t> not_ready{0};
+  std::atomic<uint64_t> total_ns{0};
+  std::atomic<uint64_t> max_ns{0};
+  std::atomic<uint64_t> histogram[kDriverCallHistogramBuckets];
+
+  AtomicDriverCallStat() {
+    for (auto& bucket : histogram) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+AtomicDriverCallStat driver_call_stats[kNumDriverApis];
+
+struct ApiName {
+  DriverApi api;
+  const char* name;
+};
+
+const ApiName kApiNames[] = {
+    {DriverApi::MEM_CREATE, "cuMemCreate"},
+    {DriverApi::MEM_RELEASE, "cuMemRelease"},
+    {DriverApi::MEM_ADDRESS_RESERVE, "cuMemAddressReserve"},
+    {DriverApi::MEM_ADDRESS_FREE, "cuMemAddressFree"},
+    {DriverApi::MEM_MAP, "cuMemMap"},
+    {DriverApi::MEM_UNMAP, "cuMemUnmap"},
+    {DriverApi::MEM_SET_ACCESS, "cuMemSetAccess"},
+    {DriverApi::MALLOC, "cudaMalloc"},
+    {DriverApi::FREE, "cudaFree"},
+    {DriverApi::EVENT_CREATE, "cudaEventCreateWithFlags"},
+    {DriverApi::EVENT_RECORD, "cudaEventRecord"},
+    {DriverApi::EVENT_QUERY, "cudaEventQuery"},
+    {DriverApi::EVENT_SYNCHRONIZE, "cudaEventSynchronize"},
+    {DriverApi::EVENT_DESTROY, "cudaEventDestroy"},
+    {DriverApi::OTHER, "other"},
+};
+
+size_t histogram_bucket(uint64_t ns) {
+  size_t bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+  return bucket < kDriverCallHistogramBuckets ? bucket : kDriverCallHistogramBuckets - 1;
+}
+
+} // anonymous namespace
+
+const char* driverApiName(DriverApi api) {
+  for (const auto& entry : kApiNames) {
+    if (entry.api == api) {
+      return entry.name;
+    }
+  }
+  return "unknown";
+}
+
+DriverApi driverApiFromCall(const char* call) {
+  size_t len = strcspn(call, " (");
+  for (const auto& entry : kApiNames) {
+    if (strlen(entry.name) == len && strncmp(entry.name, call, len) == 0) {
+      return entry.api;
+    }
+  }
+  return DriverApi::OTHER;
+}
+
+void recordDriverCall(DriverApi api, uint64_t elapsed_ns, int status) {
+  auto& stat = driver_call_stats[static_cast<size_t>(api)];
+  stat.count.fetch_add(1, std::memory_order_relaxed);
+  if (status == kStatusNotReady) {
+    stat.not_ready.fetch_add(1, std::memory_order_relaxed);
+  } else if (status != 0) {
+    stat.errors.fetch_add(1, std::memory_order_relaxed);
+  }
+  stat.total_ns.fetch_add(elapsed_ns, std::memory_order_relaxed);
+  stat.histogram[histogram_bucket(elapsed_ns)].fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t prev_max = stat.max_ns.load(std::memory_order_relaxed);
+  while (elapsed_ns > prev_max &&
+         !stat.max_ns.compare_exchange_weak(prev_max, elapsed_ns, std::memory_order_relaxed)) {
+  }
+}
+
+DriverCallStats getDriverCallStats() {
+  DriverCallStats stats;
+  for (size_t i = 0; i < kNumDriverApis; i++) {
+    const auto& src = driver_call_stats[i];
+    auto& dst = stats.apis[i];
+    dst.count = src.count.load(std::memory_order_relaxed);
+    dst.errors = src.errors.load(std::memory_order_relaxed);
+    dst.not_ready = src.not_ready.load(std::memory_order_relaxed);
+    dst.total_ns = src.total_ns.load(std::memory_order_relaxed);
+    dst.max_ns = src.max_ns.load(std::memory_order_relaxed);
+    for (size_t b = 0; b < kDriverCallHistogramBuckets; b++) {
+      dst.histogram[b] = src.histogram[b].load(std::memory_order_relaxed);
+    }
+  }
+  return stats;
+}
+
+void resetDriverCallStats() {
+  for (auto& stat : driver_call_stats) {
+    stat.count.store(0, std::memory_order_relaxed);
+    stat.errors.store(0, std::memory_order_relaxed);
+    stat.not_ready.store(0, std::memory_order_relaxed);
+    stat.total_ns.store(0, std::memory_order_relaxed);
+    stat.max_ns.store(0, std::memory_order_relaxed);
+    for (auto& bucket : stat.histogram) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+uint64_t driverMemoryCalls(const DriverCallStats& stats) {
+  uint64_t total = 0;
+  for (size_t i = 0; i <= static_cast<size_t>(DriverApi::FREE); i++) {
+    total += stats.apis[i].count;
+  }
+  return total;
+}
+
+uint64_t driverCallPercentileNs(const DriverCallStat& stat, double q) {
+  uint64_t total = 0;
+  for (uint64_t n : stat.histogram) {
+    total += n;
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t rank = static_cast<uint64_t>(q * total + 0.5);
+  rank = rank == 0 ? 1 : rank;
+  uint64_t seen = 0;
+  for (size_t b = 0; b < kDriverCallHistogramBuckets; b++) {
+    seen += stat.histogram[b];
+    if (seen >= rank) {
+      uint64_t upper = (uint64_t(2) << b) - 1;
+      return upper < stat.max_ns ? upper : stat.max_ns;
+    }
+  }
+  return stat.max_ns;
+}
@@ -0,0 +1,5911 @@
+#include "cuda_gcpool_allocator.h"
+
+#include "address_range_index.h"
+#include "binned_block_set.h"
+#include "concurrent_registry.h"
+#include "driver_call_stats.h"
+#include "gcpool_compat.h"
+#include "mpsc_queue.h"
+#include "seqlock.h"
+#include "slab_allocator.h"
+
+#include <cuda_runtime_api.h>
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace gcpool {
+
+// Set once by setAllocatorHooks, normally from a static initializer of the
+// embedding framework, before the first allocation.
+static AllocatorHooks allocator_hooks;
+
+static bool memory_profiling_enabled() {
+  return allocator_hooks.memory_profiling_enabled &&
+      allocator_hooks.memory_profiling_enabled();
+}
+
+static void report_memory_usage(
+    void* ptr,
+    int64_t alloc_size,
+    int64_t total_allocated,
+    int64_t total_reserved,
+    int device) {
+  if (allocator_hooks.report_memory_usage) {
+    allocator_hooks.report_memory_usage(
+        ptr, alloc_size, total_allocated, total_reserved, device);
+  }
+}
+
+// Size pretty-printer
+static std::string format_size(uint64_t size) {
+  std::ostringstream os;
+  os.precision(2);
+  os << std::fixed;
+  if (size <= 1024) {
+    os << size << " bytes";
+  } else if (size <= 1048576) {
+    os << (size / 1024.0);
+    os << " KiB";
+  } else if (size <= 1073741824ULL) {
+    os << size / 1048576.0;
+    os << " MiB";
+  } else {
+    os << size / 1073741824.0;
+    os << " GiB";
+  }
+  return os.str();
+}
+
+namespace Native {
+
+//
+// Yet another caching allocator for CUDA device allocations.
+//
+// - Allocations are associated with a stream. Once freed, blocks can be
+//   re-allocated on the same stream, but not on any other stream.
+// - The allocator attempts to find the smallest cached block that will fit the
+//   requested size. If the block is larger than the requested size, it may be
+//   split. If no block is found, the allocator will delegate to cudaMalloc.
+// - If the cudaMalloc fails, the allocator will attempt to free one cached
+//   block of sufficient size that is not split and retry the allocation.
+//   If this also fails, the allocator will attempt to free all cached blocks
+//   that are not split and retry the allocation.
+// - Large (>1MB) and small allocations are stored in separate pools.
+//   Small requests are packed into 2MB buffers. Large requests will use the
+//   smallest available free block or allocate a new block using cudaMalloc.
+// - To reduce fragmentation, requests between 1MB and 10MB will allocate and
+//   split a 20MB block, if no free block of sufficient size is available.
+// - To further reduce fragmentation, blocks >= 200MB are not allowed to be
+//   split. These oversize cached blocks will still satisfy requests within
+//   20MB of the oversize cached block size.
+//
+// With this allocator, allocations and frees should logically be considered
+// "usages" of the memory segment associated with streams, just like kernel
+// launches. The programmer must insert the proper synchronization if memory
+// segments are used from multiple streams.
+//
+// The library provides a recordStream() function to help insert the correct
+// synchronization when allocations are used on multiple streams. This will
+// ensure that the block is not reused before each recorded stream completes
+// work.
+//
+
+/**
+ * Note [Interaction with CUDA graph capture]
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ * Graph capture performs a dry run of a region of execution, freezing all CUDA
+ * work (and virtual addresses used during that work) into a "graph." The graph
+ * may be "replayed" like a single giant kernel, with greatly reduced CPU
+ * overhead as well as modestly improved GPU performance.
+ *
+ * Because capture bakes in memory addresses, the memory used during capture
+ * must be available for the graph to use during replay. DeviceCachingAllocator
+ * assigns and frees memory eagerly and dynamically, so if we're not careful
+ * about managing graphs' memory, at replay time those memory addresses could be
+ * used by other tensors.
+ *
+ * To guarantee a graph's baked in addresses are safe to reuse in replay,
+ * DeviceAllocator satisfies allocations from a graph-private memory pool during
+ * capture, and doesn't begin cudaFreeing those addresses until the graph is
+ * destroyed.
+ *
+ * Within the private pool, allocations are freed and reassigned as usual during
+ * capture. Memory regions will be used in a consistent order during replay. So
+ * a private pool doesn't use memory more wastefully than the default pools
+ * during capture, but it does reserve its high-water mark of used memory away
+ * from the default pools as long as the capture(s) it served survive
+ * (regardless whether those captures are idle or replaying).
+ *
+ * CUDAGraph's requests for private pools are mediated by
+ * DeviceAllocator::notifyCaptureBegin,
+ *                  notifyCaptureAboutToEnd,
+ *                  notifyCaptureEnded,
+ *                  notifyCaptureDestroy.
+ */
+
+constexpr size_t kMinBlockSize =
+    512; // all sizes are rounded to at least 512 bytes
+constexpr size_t kSmallSize = 1048576; // largest "small" allocation is 1 MiB
+constexpr size_t kSmallBuffer =
+    2097152; // "small" allocations are packed in 2 MiB blocks
+constexpr size_t kLargeBuffer =
+    20971520; // "large" allocations may be packed in 20 MiB blocks
+constexpr size_t kMinLargeAlloc =
+    10485760; // allocations between 1 and 10 MiB may use kLargeBuffer
+constexpr size_t kRoundLarge = 2097152; // round up large allocations to 2 MiB
+constexpr size_t kGranularity   =  2097152; // round up large allocations to 2 MiB
+constexpr size_t kRoundUpPowerOfTwoIntervals = 16;
+
+// Not in the anonymous namespace: phy_block.h names it, see BlockSegment.
+struct Block;
+
+namespace {
+
+int device_count() {
+  static const int count = []() {
+    int n = 0;
+    GCPOOL_CUDA_CHECK(cudaGetDeviceCount(&n));
+    return n;
+  }();
+  return count;
+}
+
+// A stream a block was used on, recorded by recordStream with its device.
+struct StreamUse {
+  cudaStream_t stream;
+  int device;
+
+  bool operator==(const StreamUse& other) const {
+    return stream == other.stream && device == other.device;
+  }
+};
+
+struct StreamUseHash {
+  size_t operator()(const StreamUse& use) const noexcept {
+    return std::hash<cudaStream_t>()(use.stream) ^ static_cast<size_t>(use.device);
+  }
+};
+
+using stream_set = flat_hash_set<StreamUse, StreamUseHash>;
+
+using StatTypes = std::array<bool, static_cast<size_t>(StatType::NUM_TYPES)>;
+
+void update_stat(Stat& stat, int64_t amount) {
+  stat.current += amount;
+
+  GCPOOL_ASSERT_DEBUG_ONLY(
+      stat.current >= 0,
+      "Negative tracked stat in CUDA allocator (likely logic error).");
+
+  stat.peak = std::max(stat.current, stat.peak);
+  if (amount > 0) {
+    stat.allocated += amount;
+  }
+  if (amount < 0) {
+    stat.freed += -amount;
+  }
+}
+
+void reset_accumulated_stat(Stat& stat) {
+  stat.allocated = 0;
+  stat.freed = 0;
+}
+
+void reset_peak_stat(Stat& stat) {
+  stat.peak = stat.current;
+}
+
+template <typename Func>
+void for_each_selected_stat_type(const StatTypes& stat_types, Func f) {
+  for (size_t stat_type = 0; stat_type < stat_types.size(); ++stat_type) {
+    if (stat_types[stat_type]) {
+      f(stat_type);
+    }
+  }
+}
+
+void update_stat_array(
+    StatArray& stat_array,
+    int64_t amount,
+    const StatTypes& stat_types) {
+  for_each_selected_stat_type(
+      stat_types, [&stat_array, amount](size_t stat_type) {
+        update_stat(stat_array[stat_type], amount);
+      });
+}
+
+// Changes to a Stat made outside the allocator lock, applied later by
+// merge_stat. peak is the highest current reached since the last merge.
+struct StatDelta {
+  int64_t current = 0;
+  int64_t peak = 0;
+  int64_t allocated = 0;
+  int64_t freed = 0;
+
+  void update(int64_t amount) {
+    current += amount;
+    peak = std::max(peak, current);
+    if (amount > 0) {
+      allocated += amount;
+    } else {
+      freed += -amount;
+    }
+  }
+};
+
+void merge_stat(Stat& stat, const StatDelta& delta) {
+  stat.peak = std::max(stat.peak, stat.current + delta.peak);
+  stat.current += delta.current;
+  stat.allocated += delta.allocated;
+  stat.freed += delta.freed;
+}
+
+
+// Process-wide state of a stream, reached without a lock through
+// stream_registry().
+struct alignas(64) StreamEntry {
+  StreamEntry(cudaStream_t stream, size_t index)
+      : stream(stream), id(static_cast<uint32_t>(index)) {}
+
+  cudaStream_t stream;
+  // dense id, see get_stream_id
+  uint32_t id;
+  // Ids of the events recorded on the stream, from 1, in the order they were
+  // recorded: BlockEvent::record holds record_mutex around the record and
+  // the id it takes. Records on other streams never wait for it.
+  std::mutex record_mutex;
+  uint64_t last_event_id = 0; // guarded by record_mutex
+  // released events still pending on the stream, see BlockEvent::event_gc
+  std::mutex pending_mutex;
+  std::map<uint64_t, cudaEvent_t> pending_events;
+};
+
+ConcurrentRegistry<cudaStream_t, StreamEntry>& stream_registry() {
+  // leaked, so that streams can still be looked up during static destruction
+  static auto* registry = new ConcurrentRegistry<cudaStream_t, StreamEntry>();
+  return *registry;
+}
+
+cudaEvent_t acquire_block_event(int device);
+bool recycle_block_event(int device, cudaEvent_t event);
+
+class BlockEventPtr;
+
+struct BlockEvent {
+  BlockEvent(int device_in, cudaStream_t stream_in, bool record_event=false) {
+    device = device_in;
+    stream = stream_in;
+    event = acquire_block_event(device);
+    event_id = 0;
+    recorded = false;
+    released = false;
+    ref_as_sync = false;
+    if(record_event) record(stream);
+    
+  }
+
+  // allocated from the slab of the device
+  static BlockEventPtr create(int device, cudaStream_t stream, bool record_event = false);
+
+  void record(cudaStream_t stream_in) {
+
+    if(stream == stream_in)
+    {
+      StreamEntry& entry = stream_registry().get(stream);
+      // BlockEventOrderComparator and event_gc take a higher id of a stream
+      // to complete later, so ids are handed out in record order
+      std::lock_guard<std::mutex> lock(entry.record_mutex);
+      GCPOOL_CUDA_CHECK(DRV_TIMED(DriverApi::EVENT_RECORD, cudaEventRecord(event, stream)));
+      event_id = ++entry.last_event_id;
+      recorded = true;
+    }
+  }
+
+  void release_resources()
+  {
+    // an event that was never recorded is as good as a new one
+    if(!recorded && recycle_block_event(device, event)) {
+      return;
+    }
+    if(!ref_as_sync) {
+      GCPOOL_CUDA_CHECK(DRV_TIMED(DriverApi::EVENT_DESTROY, cudaEventDestroy(event)));
+    } else {
+      cudaError_t err = DRV_TIMED(DriverApi::EVENT_QUERY, cudaEventQuery(event));
+      if(err == cudaSuccess) {
+        GCPOOL_CUDA_CHECK(DRV_TIMED(DriverApi::EVENT_DESTROY, cudaEventDestroy(event)));
+      } else if(err == cudaErrorNotReady) {
+        cudaGetLastError();
+        event_gc(stream, event_id, event);
+      } else {
+        GCPOOL_CUDA_CHECK(err);
+        cudaGetLastError();
+        GCPOOL_CUDA_CHECK(DRV_TIMED(DriverApi::EVENT_DESTROY, cudaEventDestroy(event)));
+      }
+    }
+  }
+
+  ~BlockEvent() {
+    if (!released) {
+      this->release_resources();
+      released = true;
+    }
+  }
+
+  static void event_gc(cudaStream_t stream, uint64_t event_id, cudaEvent_t event)
+  {
+    StreamEntry& entry = stream_registry().get(stream);
+    std::lock_guard<std::mutex> lock(entry.pending_mutex);
+    auto& event_queue = entry.pending_events;
+    event_queue[event_id] = event;
+
+    if(event_queue.size() > 2000)
+    {
+      for(auto it = event_queue.begin(); it != std::prev(event_queue.end());) {
+        cudaEvent_t event = it->second;
+        cudaError_t err = DRV_TIMED(DriverApi::EVENT_QUERY, cudaEventQuery(event));
+        if(err == cudaSuccess) {
+          GCPOOL_CUDA_CHECK(DRV_TIMED(DriverApi::EVENT_DESTROY, cudaEventDestroy(event)));
+          it = event_queue.erase(it);
+        } else {
+          cudaGetLastError();
+          break;
+        }
+      }
+    }
+  }
+  
+  int device;
+  cudaStream_t stream;
+  cudaEvent_t event;
+  uint64_t event_id;
+  // references held by BlockEventPtr
+  size_t ref_count = 0;
+  bool recorded;
+  bool released;
+  bool ref_as_sync;
+};
+
+// Intrusive reference to a BlockEvent, in place of std::shared_ptr: the count
+// lives in the event, and the last reference returns it to the slab of its
+// device. Events are only referenced from blocks of their device, under that
+// device's allocator mutex, so the count is a plain integer.
+class BlockEventPtr {
+ public:
+  BlockEventPtr() = default;
+  BlockEventPtr(std::nullptr_t) {}
+
+  explicit BlockEventPtr(BlockEvent* event) : event_(event) {
+    retain();
+  }
+
+  BlockEventPtr(const BlockEventPtr& other) : event_(other.event_) {
+    retain();
+  }
+
+  BlockEventPtr(BlockEventPtr&& other) noexcept : event_(other.event_) {
+    other.event_ = nullptr;
+  }
+
+  BlockEventPtr& operator=(BlockEventPtr other) noexcept {
+    std::swap(event_, other.event_);
+    return *this;
+  }
+
+  ~BlockEventPtr() {
+    release();
+  }
+
+  BlockEvent* get() const {
+    return event_;
+  }
+
+  BlockEvent* operator->() const {
+    return event_;
+  }
+
+  BlockEvent& operator*() const {
+    return *event_;
+  }
+
+  explicit operator bool() const {
+    return event_ != nullptr;
+  }
+
+  size_t use_count() const {
+    return event_ ? event_->ref_count : 0;
+  }
+
+  bool unique() const {
+    return use_count() == 1;
+  }
+
+ private:
+  void retain() {
+    if (event_) {
+      event_->ref_count += 1;
+    }
+  }
+
+  void release();
+
+  BlockEvent* event_ = nullptr;
+};
+
+// BlockEvents of one device, and cudaEvents of events that were released
+// without ever being recorded, which are handed to new BlockEvents instead of
+// creating another. Only used under the mutex of the device's allocator.
+struct BlockEventSlab {
+  // bounds the cudaEvents kept for reuse
+  static constexpr size_t kMaxIdleEvents = 1024;
+
+  SlabAllocator<BlockEvent> events;
+  std::vector<cudaEvent_t> idle_events;
+};
+
+BlockEventSlab& block_event_slab(int device) {
+  // leaked like the EventPool, blocks are not freed at shutdown
+  static auto* slabs = new std::vector<BlockEventSlab>(device_count());
+  return (*slabs)[device];
+}
+
+cudaEvent_t acquire_block_event(int device) {
+  auto& idle_events = block_event_slab(device).idle_events;
+  if (!idle_events.empty()) {
+    cudaEvent_t event = idle_events.back();
+    idle_events.pop_back();
+    return event;
+  }
+  cudaEvent_t event;
+  GCPOOL_CUDA_CHECK(DRV_TIMED(DriverApi::EVENT_CREATE, cudaEventCreateWithFlags(&event, cudaEventDisableTiming)));
+  return event;
+}
+
+bool recycle_block_event(int device, cudaEvent_t event) {
+  auto& idle_events = block_event_slab(device).idle_events;
+  if (idle_events.size() >= BlockEventSlab::kMaxIdleEvents) {
+    return false;
+  }
+  idle_events.push_back(event);
+  return true;
+}
+
+BlockEventPtr BlockEvent::create(int device, cudaStream_t stream, bool record_event) {
+  return BlockEventPtr(block_event_slab(device).events.create(device, stream, record_event));
+}
+
+void BlockEventPtr::release() {
+  if (event_ && --event_->ref_count == 0) {
+    block_event_slab(event_->device).events.destroy(event_);
+  }
+  event_ = nullptr;
+}
+
+
+struct PrivatePool;
+typedef bool (*Comparison)(const Block*, const Block*);
+
+// The free blocks of one stream of a BlockPool, ordered by BlockComparator.
+// Backed by flat size-class bins (BinnedBlockSet), or by the upstream
+// std::set when binnedPool=0, so the two can be compared on the same binary.
+class BlockSet {
+ public:
+  using TreeSet = std::set<Block*, Comparison>;
+  using BinnedSet = BinnedBlockSet<Block>;
+
+  class iterator {
+   public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = Block*;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Block* const*;
+    using reference = Block* const&;
+
+    iterator() = default;
+    iterator(TreeSet::const_iterator it) : tree_it(it) {}
+    iterator(BinnedSet::iterator it) : binned_it(it), binned(true) {}
+
+    reference operator*() const {
+      return binned ? *binned_it : *tree_it;
+    }
+
+    iterator& operator++() {
+      if (binned) {
+        ++binned_it;
+      } else {
+        ++tree_it;
+      }
+      return *this;
+    }
+
+    iterator& operator--() {
+      if (binned) {
+        --binned_it;
+      } else {
+        --tree_it;
+      }
+      return *this;
+    }
+
+    iterator operator++(int) {
+      iterator tmp = *this;
+      ++*this;
+      return tmp;
+    }
+
+    iterator operator--(int) {
+      iterator tmp = *this;
+      --*this;
+      return tmp;
+    }
+
+    bool operator==(const iterator& other) const {
+      return binned ? binned_it == other.binned_it : tree_it == other.tree_it;
+    }
+
+    bool operator!=(const iterator& other) const {
+      return !(*this == other);
+    }
+
+   private:
+    friend class BlockSet;
+    TreeSet::const_iterator tree_it;
+    BinnedSet::iterator binned_it;
+    bool binned = false;
+  };
+
+  using const_iterator = iterator;
+
+  explicit BlockSet(Comparison comparator)
+      : binned(use_bins()), tree(comparator), bins(comparator) {}
+
+  iterator begin() const {
+    return binned ? iterator(bins.begin()) : iterator(tree.begin());
+  }
+
+  iterator end() const {
+    return binned ? iterator(bins.end()) : iterator(tree.end());
+  }
+
+  size_t size() const {
+    return binned ? bins.size() : tree.size();
+  }
+
+  bool empty() const {
+    return binned ? bins.empty() : tree.empty();
+  }
+
+  iterator lower_bound(Block* key) const {
+    return binned ? iterator(bins.lower_bound(key)) : iterator(tree.lower_bound(key));
+  }
+
+  size_t count(Block* key) const {
+    return binned ? bins.count(key) : tree.count(key);
+  }
+
+  std::pair<iterator, bool> insert(Block* block) {
+    if (binned) {
+      auto result = bins.insert(block);
+      return {iterator(result.first), result.second};
+    }
+    auto result = tree.insert(block);
+    return {iterator(result.first), result.second};
+  }
+
+  size_t erase(Block* key) {
+    return binned ? bins.erase(key) : tree.erase(key);
+  }
+
+  iterator erase(iterator it) {
+    return binned ? iterator(bins.erase(it.binned_it)) : iterator(tree.erase(it.tree_it));
+  }
+
+ private:
+  static bool use_bins() {
+    static const int binnedPool = ([]()->int{
+        const char* env = getenv("binnedPool");
+        if(env) return atoi(env);
+        else return 1;
+    })();
+    return binnedPool > 0;
+  }
+
+  const bool binned;
+  TreeSet tree;
+  BinnedSet bins;
+};
+
+struct BlockPool {
+  BlockPool(
+      Comparison comparator,
+      bool small,
+      PrivatePool* private_pool = nullptr)
+      : comparator(comparator), is_small(small), owner_PrivatePool(private_pool) {}
+
+  // free blocks of the stream with the given id
+  BlockSet& blocks(uint32_t stream_id) {
+    while (streams.size() <= stream_id) {
+      streams.emplace_back(comparator);
+    }
+    return streams[stream_id];
+  }
+
+  // in the set of block->stream_id
+  std::pair<BlockSet::iterator, bool> insert(Block* block);
+  size_t erase(Block* block);
+  size_t count(Block* block);
+
+  // indexed by Block::stream_id; a deque so that growing it leaves the sets
+  // of other streams in place
+  std::deque<BlockSet> streams;
+  const Comparison comparator;
+  const bool is_small;
+  PrivatePool* owner_PrivatePool;
+};
+
+// Contexts of the history records and trace entries of one device, interned
+// by id so that the records themselves are plain data. Each id holds one
+// reference per record that carries it; the last release drops the context.
+// Id 0 is no context. Only used with the device's allocator locked: under
+// ExclusiveLock, or under stats_mutex on the same-stream fast paths.
+class ContextTable {
+ public:
+  ContextTable() : slots_(1) {}
+
+  // a new reference to the id of context, 0 for nullptr
+  uint32_t intern(const std::shared_ptr<Context>& context) {
+    if (!context) {
+      return 0;
+    }
+    auto it = ids_.find(context.get());
+    if (it != ids_.end()) {
+      slots_[it->second].ref_count += 1;
+      return it->second;
+    }
+    uint32_t id;
+    if (!free_ids_.empty()) {
+      id = free_ids_.back();
+      free_ids_.pop_back();
+    } else {
+      id = static_cast<uint32_t>(slots_.size());
+      slots_.emplace_back();
+    }
+    slots_[id].context = context;
+    slots_[id].ref_count = 1;
+    ids_.emplace(context.get(), id);
+    return id;
+  }
+
+  void retain(uint32_t id) {
+    if (id) {
+      slots_[id].ref_count += 1;
+    }
+  }
+
+  void release(uint32_t id) {
+    if (id && --slots_[id].ref_count == 0) {
+      ids_.erase(slots_[id].context.get());
+      slots_[id].context.reset();
+      free_ids_.push_back(id);
+    }
+  }
+
+  const std::shared_ptr<Context>& get(uint32_t id) const {
+    return slots_[id].context;
+  }
+
+ private:
+  struct Slot {
+    std::shared_ptr<Context> context;
+    size_t ref_count = 0;
+  };
+
+  std::vector<Slot> slots_;
+  std::vector<uint32_t> free_ids_;
+  flat_hash_map<const Context*, uint32_t> ids_;
+};
+
+struct HistoryChain {
+  void* addr;
+  size_t real_size; // unrounded, actually requested size
+  uint32_t context_id; // in HistoryArena::contexts
+  HistoryChain* next; // when blocks are merged we keep records
+                      // of what used to be in the block
+};
+
+// History records of one device. Nodes come from a slab, so recording the
+// history of an allocation and trimming it allocate nothing once the slab is
+// warm. Only used under the mutex of the device's allocator.
+struct HistoryArena {
+  SlabAllocator<HistoryChain> nodes;
+  ContextTable contexts;
+
+  HistoryChain* create(void* addr, size_t real_size, uint32_t context_id, HistoryChain* next) {
+    return nodes.create(HistoryChain{addr, real_size, context_id, next});
+  }
+
+  void destroy(HistoryChain* node) {
+    contexts.release(node->context_id);
+    nodes.destroy(node);
+  }
+
+  void destroy_chain(HistoryChain* head) {
+    while (head) {
+      HistoryChain* next = head->next;
+      destroy(head);
+      head = next;
+    }
+  }
+};
+
+// Dense ids for the streams blocks are allocated on, so that per-stream pools
+// are arrays indexed by Block::stream_id instead of maps keyed by
+// cudaStream_t. Ids are process-wide and never reused.
+uint32_t get_stream_id(cudaStream_t stream) {
+  // a thread usually allocates on the same stream many times in a row
+  thread_local cudaStream_t last_stream = nullptr;
+  thread_local uint32_t last_id = std::numeric_limits<uint32_t>::max();
+  if (last_stream == stream && last_id != std::numeric_limits<uint32_t>::max()) {
+    return last_id;
+  }
+
+  last_id = stream_registry().get(stream).id;
+  last_stream = stream;
+  return last_id;
+}
+
+// Links of a block in one of the event-ordered lists of BlockEventOrderPool.
+struct EventOrderHook {
+  Block* prev{nullptr};
+  Block* next{nullptr};
+  const void* owner{nullptr}; // the list the block is on
+};
+
+// Per-block state that the pool lookups, splits and merges never read: the
+// extra streams a block was used on, its allocation history and, for fused
+// blocks, the links of the event-ordered free lists. Allocated on first use,
+// so the blocks that never need any of it carry only a null pointer.
+struct BlockCold {
+  stream_set stream_uses; // streams on which the block was used
+  HistoryChain* history{nullptr}; // from the HistoryArena of the device
+  HistoryChain* history_last{nullptr};
+  EventOrderHook release_order; // free_fused_blocks_in_release_order
+  EventOrderHook fragmented; // fragmented_free_fused_blocks
+};
+
+} // anonymous namespace
+
+// The fields read by the pool comparators and by split/merge (size, ptr,
+// prev/next, pool, stream_id, allocated, event_count) fill the first cache
+// line, so walking a BlockPool or a chain of split blocks touches one line
+// per block. Everything else follows, and the rarely used state lives out of
+// line in BlockCold.
+struct alignas(64) Block {
+  size_t size; // block size in bytes
+  void* ptr{nullptr}; // memory address
+  Block* prev{nullptr}; // prev block if split from a larger allocation
+  Block* next{nullptr}; // next block if split from a larger allocation
+  BlockPool* pool{nullptr}; // owning memory pool
+  cudaStream_t stream; // allocation stream
+  uint32_t stream_id; // dense id of stream, see get_stream_id
+  int device; // gpu
+  int event_count{0}; // number of outstanding CUDA events
+  bool allocated{false}; // in-use flag
+
+  size_t requested_size; // memory originally requested
+  size_t actual_size;
+  int gc_count{0}; // counter for prioritizing older / less useful blocks for
+                   // garbage collection
+  std::shared_ptr<VmmSegment> vmm_segment;
+  BlockEventPtr self_last_event;
+  std::unique_ptr<BlockCold> cold; // nullptr until first needed
+  Block* deferred_next{nullptr}; // DeviceCachingAllocator::deferred_frees
+
+  Block(
+      int device,
+      cudaStream_t stream,
+      size_t size,
+      BlockPool* pool,
+      void* ptr)
+      : size(size),
+        ptr(ptr),
+        pool(pool),
+        stream(stream),
+        stream_id(get_stream_id(stream)),
+        device(device),
+        requested_size(0),
+        actual_size(0),
+        self_last_event(BlockEvent::create(device, stream)) {}
+
+  // constructor for search key
+  Block(int device, cudaStream_t stream, size_t size)
+      : size(size),
+        stream(stream),
+        stream_id(get_stream_id(stream)),
+        device(device),
+        requested_size(0),
+        actual_size(0),
+        self_last_event(BlockEvent::create(device, stream)) {}
+
+  // constructor for the search key of the same-stream fast paths, which
+  // cannot take a BlockEvent from the slab
+  Block(cudaStream_t stream, uint32_t stream_id, size_t size)
+      : size(size),
+        stream(stream),
+        stream_id(stream_id),
+        device(-1),
+        requested_size(0),
+        actual_size(0) {}
+
+  bool is_split() const {
+    return (prev != nullptr) || (next != nullptr);
+  }
+
+  BlockCold& cold_ext() {
+    if (!cold) {
+      cold = std::make_unique<BlockCold>();
+    }
+    return *cold;
+  }
+
+  HistoryChain* history() const {
+    return cold ? cold->history : nullptr;
+  }
+
+  bool has_stream_uses() const {
+    return cold && !cold->stream_uses.empty();
+  }
+};
+
+static_assert(
+    offsetof(Block, requested_size) <= 64,
+    "the fields read by lookups and merges must fit the first cache line");
+
+namespace {
+
+// Orders the free blocks of one stream; BlockPool keeps a set per stream.
+static bool BlockComparator(const Block* a, const Block* b) {
+  if (a->size != b->size) {
+    return a->size < b->size;
+  }
+  return (uintptr_t)a->ptr < (uintptr_t)b->ptr;
+}
+
+std::pair<BlockSet::iterator, bool> BlockPool::insert(Block* block) {
+  return blocks(block->stream_id).insert(block);
+}
+
+size_t BlockPool::erase(Block* block) {
+  return blocks(block->stream_id).erase(block);
+}
+
+size_t BlockPool::count(Block* block) {
+  return blocks(block->stream_id).count(block);
+}
+
+struct BlockEventOrderComparator {
+  using BlockPtr=Block*;
+
+  bool operator()(const BlockPtr a, const BlockPtr b) const {
+    if(!a->self_last_event && !b->self_last_event) {
+      if(a->size != b->size) {
+        return a->size < b->size;
+      }
+  
+      return (uintptr_t)a->ptr < (uintptr_t)b->ptr;
+    }
+    
+    if(!a->self_last_event) {
+      return true;
+    }
+  
+    if(!b->self_last_event) {
+      return false;
+    }
+
+
+    if(a->self_last_event->event_id != b->self_last_event->event_id) {
+        return a->self_last_event->event_id < b->self_last_event->event_id;
+    }
+
+    
+    if(a->size != b->size) {
+      return a->size < b->size;
+    }
+  
+    return (uintptr_t)a->ptr < (uintptr_t)b->ptr;
+  }
+};
+
+// Free fused blocks of one stream, ordered like BlockEventOrderComparator:
+// by the id of their last event, oldest first, so garbage collection frees
+// from the front. Event ids of a stream only grow, so a block is nearly
+// always appended at the tail; one that arrives out of order is placed by
+// walking back from the tail. The links live in the block, at Hook in its
+// BlockCold, so insert, erase and membership tests are O(1).
+template <EventOrderHook BlockCold::*Hook>
+struct BlockEventOrderPool
+{
+  BlockEventOrderPool():pool_size(0) {}
+
+  bool contains(const Block* block) const {
+    return block->cold && (block->cold.get()->*Hook).owner == this;
+  }
+
+  bool empty() const {
+    return head == nullptr;
+  }
+
+  Block* front() const {
+    return head;
+  }
+
+  void insert(Block* block) {
+    if(contains(block)) {
+      return;
+    }
+
+    BlockEventOrderComparator before;
+    Block* prev = tail;
+    while(prev && before(block, prev)) {
+      prev = hook(prev).prev;
+    }
+
+    EventOrderHook& h = hook(block);
+    h.prev = prev;
+    h.next = prev ? hook(prev).next : head;
+    h.owner = this;
+    if(h.prev) {
+      hook(h.prev).next = block;
+    } else {
+      head = block;
+    }
+    if(h.next) {
+      hook(h.next).prev = block;
+    } else {
+      tail = block;
+    }
+    pool_size += block->size;
+  }
+
+  bool erase(Block* block) {
+    if(contains(block)) {
+      unlink(block);
+      return true;
+    } else {
+      GCPOOL_INFO(" warning block %p, block ptr %p of size %lu not found in pool", block, block->ptr, block->size);
+      return false;
+    }
+  }
+
+  void pop_front() {
+    unlink(head);
+  }
+
+  size_t pool_size;
+
+private:
+  static EventOrderHook& hook(Block* block) {
+    return block->cold_ext().*Hook;
+  }
+
+  void unlink(Block* block) {
+    EventOrderHook& h = hook(block);
+    if(h.prev) {
+      hook(h.prev).next = h.next;
+    } else {
+      head = h.next;
+    }
+    if(h.next) {
+      hook(h.next).prev = h.prev;
+    } else {
+      tail = h.prev;
+    }
+    h = EventOrderHook();
+    pool_size -= block->size;
+  }
+
+  Block* head{nullptr};
+  Block* tail{nullptr};
+};
+
+// Per-stream state indexed by Block::stream_id, grown on first use of a
+// stream. Growing a deque leaves the entries of other streams in place.
+template <typename T>
+struct PerStream {
+  T& operator[](uint32_t stream_id) {
+    if (entries.size() <= stream_id) {
+      entries.resize(stream_id + 1);
+    }
+    return entries[stream_id];
+  }
+
+  typename std::deque<T>::iterator begin() {
+    return entries.begin();
+  }
+
+  typename std::deque<T>::iterator end() {
+    return entries.end();
+  }
+
+  std::deque<T> entries;
+};
+
+struct AllocParams {
+  AllocParams(
+      int device,
+      size_t size,
+      cudaStream_t stream,
+      BlockPool* pool,
+      size_t alloc_size,
+      DeviceStats& stats)
+      : search_key(device, stream, size),
+        pool(pool),
+        alloc_size(alloc_size),
+        block(nullptr),
+        err(cudaSuccess) {}
+
+  int device() const {
+    return search_key.device;
+  }
+  cudaStream_t stream() const {
+    return search_key.stream;
+  }
+  size_t size() const {
+    return search_key.size;
+  }
+
+  Block search_key;
+  BlockPool* pool;
+  size_t alloc_size;
+  Block* block;
+  StatTypes stat_types = {false};
+  cudaError_t err;
+};
+
+int trimHistoryBefore(HistoryArena& arena, Block* block, void* point) {
+  if (!block->cold) {
+    return 0;
+  }
+  BlockCold& cold = *block->cold;
+  int n = 0;
+  while (cold.history && cold.history->addr < point) {
+    HistoryChain* next = cold.history->next;
+    arena.destroy(cold.history);
+    cold.history = next;
+    ++n;
+  }
+  if (!cold.history) {
+    cold.history_last = nullptr;
+  }
+  return n;
+}
+
+// Granule occupancy of a VMM segment: free_map has bit i set while
+// phy_blocks[i] is free, and free_blocks is its population count. A fused
+// segment also has one mapped_slots entry per granule. The helpers below and
+// the split/merge ones check that all of these still cover phy_blocks.
+void assert_granules_in_sync(const VmmSegment& segment) {
+  GCPOOL_ASSERT(segment.free_map.size() == segment.phy_blocks.size());
+  GCPOOL_ASSERT(
+      segment.fused ? segment.mapped_slots.size() == segment.phy_blocks.size()
+                    : segment.mapped_slots.empty());
+  GCPOOL_ASSERT_DEBUG_ONLY(segment.free_blocks == segment.free_map.count());
+}
+
+void mark_granule(VmmSegment& segment, size_t offset, bool free) {
+  if (segment.free_map.test(offset) == free) {
+    return;
+  }
+  segment.free_map.set(offset, free);
+  if (free) {
+    segment.free_blocks++;
+  } else {
+    segment.free_blocks--;
+  }
+  assert_granules_in_sync(segment);
+}
+
+void mark_granules(VmmSegment& segment, size_t begin, size_t end, bool free) {
+  segment.free_map.set(begin, end, free);
+  segment.free_blocks = segment.free_map.count();
+  assert_granules_in_sync(segment);
+}
+
+void mark_all_granules(VmmSegment& segment, bool free) {
+  segment.free_map.assign(segment.phy_blocks.size(), free);
+  segment.free_blocks = free ? segment.phy_blocks.size() : 0;
+  assert_granules_in_sync(segment);
+}
+
+// Splitting and merging segments moves the PhyBlock and VirBlock handles
+// between them instead of copying, so no granule's reference counts change
+// and a split or merge costs one pointer move per granule moved.
+// VmmSegment::split and remerge carry free_map, free_blocks and used_blocks
+// along, so the halves need no fixing up afterwards.
+
+// Moves granules [keep, n) of segment into a new segment.
+std::shared_ptr<VmmSegment> split_granules(VmmSegment& segment, size_t keep) {
+  auto remaining = segment.split(keep * segment.granul_size);
+  assert_granules_in_sync(segment);
+  assert_granules_in_sync(*remaining);
+  return remaining;
+}
+
+// One segment per run of free or of used granules, in address order. Runs
+// are peeled off the back, so every handle moves once.
+std::vector<std::shared_ptr<VmmSegment>> split_granule_runs(
+    std::shared_ptr<VmmSegment> segment,
+    const GranuleBitmap& free_map) {
+  std::vector<size_t> starts;
+  for (size_t start = 0; start < free_map.size();
+       start = free_map.findNext(start, !free_map.test(start))) {
+    starts.push_back(start);
+  }
+  std::vector<std::shared_ptr<VmmSegment>> runs(starts.size());
+  for (size_t r = starts.size(); r-- > 1;) {
+    runs[r] = split_granules(*segment, starts[r]);
+  }
+  runs[0] = std::move(segment);
+  return runs;
+}
+
+// Moves the granules of src onto dst if src directly follows or precedes
+// it in the address space; false otherwise.
+bool merge_granules(VmmSegment& dst, VmmSegment& src) {
+  if (!dst.remerge(src)) {
+    return false;
+  }
+  assert_granules_in_sync(dst);
+  return true;
+}
+
+// Every PhyBlock lists the blocks that map it in mapped_blocks: the block
+// owning its segment in slot 0, then the fused blocks stitched over it. A
+// fused block remembers its slot in each of its physical blocks in
+// VmmSegment::mapped_slots, so it is unmapped by swapping the last entry
+// into its slot, in O(1) per physical block.
+void map_fused_block(Block* block) {
+  VmmSegment& segment = *block->vmm_segment;
+  segment.mapped_slots.resize(segment.phy_blocks.size());
+  for (size_t offset = 0; offset < segment.phy_blocks.size(); offset++) {
+    auto& mapped = segment.phy_blocks[offset]->mapped_blocks;
+    segment.mapped_slots[offset] = mapped.size();
+    mapped.emplace_back(block, offset);
+  }
+  assert_granules_in_sync(segment);
+}
+
+void unmap_slot(PhyBlock& phy_block, size_t slot) {
+  auto& mapped = phy_block.mapped_blocks;
+  if (slot + 1 != mapped.size()) {
+    mapped[slot] = mapped.back();
+    mapped[slot].block->vmm_segment->mapped_slots[mapped[slot].offset] = slot;
+  }
+  mapped.pop_back();
+}
+
+void unmap_fused_block(Block* block) {
+  VmmSegment& segment = *block->vmm_segment;
+  assert_granules_in_sync(segment);
+  for (size_t offset = 0; offset < segment.phy_blocks.size(); offset++) {
+    // released by release_block while the fused block was still in use
+    if (segment.phy_blocks[offset]) {
+      unmap_slot(*segment.phy_blocks[offset], segment.mapped_slots[offset]);
+    }
+  }
+}
+
+// Note: cudaEventCreate when concurrently invoked from multiple threads can be
+// very expensive (at least on certain device/driver combinations). Thus, we a)
+// serialize event creation at a per-device level, and b) pool the events to
+// avoid constantly calling cudaEventCreate/cudaEventDestroy. This results in
+// significant improvements in multithreaded workloads with high allocation
+// rates.
+class EventPool {
+ public:
+  using Event = std::unique_ptr<cudaEvent_t, std::function<void(cudaEvent_t*)>>;
+  // TODO: Explicit device count
+  EventPool() : pools_(device_count()) {}
+
+  Event get(int device) {
+    GCPOOL_ASSERT(0 <= device);
+    GCPOOL_ASSERT(device < static_cast<int>(pools_.size()));
+    auto& pool = pools_[device];
+    auto destructor = [&pool](cudaEvent_t* event) {
+      std::lock_guard<std::mutex> g(pool.mutex_);
+      pool.event_pool_.push_back(std::unique_ptr<cudaEvent_t>(event));
+    };
+
+    // Try to acquire an event from the per-device pool.
+    {
+      std::lock_guard<std::mutex> g(pool.mutex_);
+      if (!pool.event_pool_.empty()) {
+        auto* event = pool.event_pool_.back().release();
+        pool.event_pool_.pop_back();
+        return Event(event, destructor);
+      }
+    }
+    // otherwise, allocate a new event that will be returned to the pool on
+    // destruction.
+    auto new_ptr = std::make_unique<cudaEvent_t>();
+    GCPOOL_CUDA_CHECK(DRV_TIMED(
+        DriverApi::EVENT_CREATE,
+        cudaEventCreateWithFlags(new_ptr.get(), cudaEventDisableTiming)));
+
+    return Event(new_ptr.release(), destructor);
+  }
+
+  void empty_cache() {
+    for (auto& pool : pools_) {
+      std::lock_guard<std::mutex> g(pool.mutex_);
+      pool.event_pool_.clear();
+    }
+  }
+
+ private:
+  struct PerDevicePool {
+    alignas(64) std::mutex mutex_;
+    std::vector<std::unique_ptr<cudaEvent_t>> event_pool_;
+  };
+  std::vector<PerDevicePool> pools_;
+};
+
+// CUDA graphs helper
+struct PrivatePool {
+  PrivatePool()
+      : use_count(1),
+        cudaMalloc_count(0),
+        large_blocks(BlockComparator, /*is_small=*/false, this),
+        small_blocks(BlockComparator, /*is_small=*/true, this) {}
+  PrivatePool(const PrivatePool&) = delete;
+  PrivatePool(PrivatePool&&) = delete;
+  PrivatePool& operator=(const PrivatePool&) = delete;
+  // Number of live graphs using this pool
+  int use_count;
+  // Number of unfreed cudaMallocs made for this pool. When use_count and
+  // cudaMalloc_count drop to zero, we can delete this PrivatePool from
+  // graph_pools.
+  int cudaMalloc_count;
+  // Instead of maintaining private BlockPools here, I could stuff all blocks
+  // (private or no) into the top-level large_blocks and small_blocks, and
+  // distinguish private blocks by adding a "pool id" check above the stream
+  // check in BlockComparator. BlockComparator is performance- critial though,
+  // I'd rather not add more logic to it.
+  BlockPool large_blocks;
+  BlockPool small_blocks;
+};
+
+struct MempoolIdHash {
+  std::size_t operator()(const MempoolId_t& mempool_id) const noexcept {
+    return mempool_id.first != 0 ? mempool_id.first : mempool_id.second;
+  }
+};
+
+cudaError_t cudaMallocMaybeCapturing(void** p, size_t size, cudaStream_t stream) {
+  cudaStreamCaptureStatus status = cudaStreamCaptureStatusNone;
+  GCPOOL_CUDA_CHECK(cudaStreamIsCapturing(stream, &status));
+  if (status == cudaStreamCaptureStatusNone) {
+    return DRV_TIMED(DriverApi::MALLOC, cudaMalloc(p, size));
+  }
+  // It's ok to capture cudaMallocs, as long as we never cudaFree those
+  // addresses before replay.
+  // Capturing cudaMalloc behaves nicely: it gives the graph new VA,
+  // but is ignored (won't leakily allocate new memory) in replays.
+  cudaStreamCaptureMode mode = cudaStreamCaptureModeRelaxed;
+  GCPOOL_CUDA_CHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  const cudaError_t err = DRV_TIMED(DriverApi::MALLOC, cudaMalloc(p, size));
+  GCPOOL_CUDA_CHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  return err;
+}
+
+} // anonymous namespace
+} // namespace Native
+
+// Environment config parser
+// Defined here, rather than its own .cpp file,
+// because parseArgs needs to know kLargeBuffer.
+// Defined outside namespace Native because it's not Native-specific.
+class CachingAllocatorConfig {
+ public:
+  static size_t max_split_size() {
+    return instance().m_max_split_size;
+  }
+  static double garbage_collection_threshold() {
+    return instance().m_garbage_collection_threshold;
+  }
+
+  // This is used to round-up allocation size to nearest power of 2 divisions.
+  // More description below in function roundup_power2_next_division
+  // As ane example, if we want 4 divisions between 2's power, this can be done
+  // using env variable: PYTORCH_CUDA_ALLOC_CONF=roundup_power2_divisions:4
+  static size_t roundup_power2_divisions(size_t size) {
+    size_t log_size = (63 - gcpool::countLeadingZeros(size));
+
+    // Our intervals start at 1MB and end at 64GB
+    const size_t interval_start =
+        63 - gcpool::countLeadingZeros(static_cast<size_t>(1048576));
+    const size_t interval_end =
+        63 - gcpool::countLeadingZeros(static_cast<size_t>(68719476736));
+    GCPOOL_CHECK(
+        (interval_end - interval_start == Native::kRoundUpPowerOfTwoIntervals),
+        "kRoundUpPowerOfTwoIntervals mismatch");
+
+    int index = static_cast<int>(log_size) - static_cast<int>(interval_start);
+
+    index = std::max(0, index);
+    index = std::min(
+        index, static_cast<int>(Native::kRoundUpPowerOfTwoIntervals) - 1);
+    return instance().m_roundup_power2_divisions[index];
+  }
+
+  static CachingAllocatorConfig& instance() {
+    static CachingAllocatorConfig* s_instance = ([]() {
+      auto inst = new CachingAllocatorConfig();
+      const char* env = getenv("PYTORCH_CUDA_ALLOC_CONF");
+      inst->parseArgs(env);
+      return inst;
+    })();
+    return *s_instance;
+  }
+
+  void parseArgs(const char* env);
+
+ private:
+  CachingAllocatorConfig()
+      : m_max_split_size(std::numeric_limits<size_t>::max()),
+        m_garbage_collection_threshold(0) {
+    m_roundup_power2_divisions.assign(Native::kRoundUpPowerOfTwoIntervals, 0);
+  }
+
+  void lexArgs(const char* env, std::vector<std::string>& config);
+  void consumeToken(
+      const std::vector<std::string>& config,
+      size_t i,
+      const char c);
+  size_t parseMaxSplitSize(const std::vector<std::string>& config, size_t i);
+  size_t parseGarbageCollectionThreshold(
+      const std::vector<std::string>& config,
+      size_t i);
+  size_t parseRoundUpPower2Divisions(
+      const std::vector<std::string>& config,
+      size_t i);
+  size_t parseAllocatorConfig(
+      const std::vector<std::string>& config,
+      size_t i,
+      bool& used_cudaMallocAsync);
+
+  std::atomic<size_t> m_max_split_size;
+  std::vector<size_t> m_roundup_power2_divisions;
+  std::atomic<double> m_garbage_collection_threshold;
+};
+
+void CachingAllocatorConfig::lexArgs(
+    const char* env,
+    std::vector<std::string>& config) {
+  std::vector<char> buf;
+
+  size_t env_length = strlen(env);
+  for (size_t i = 0; i < env_length; i++) {
+    if (env[i] == ',' || env[i] == ':' || env[i] == '[' || env[i] == ']') {
+      if (buf.size() != 0) {
+        config.emplace_back(buf.begin(), buf.end());
+        buf.clear();
+      }
+      config.emplace_back(1, env[i]);
+    } else if (env[i] != ' ') {
+      buf.emplace_back(static_cast<char>(env[i]));
+    }
+  }
+  if (!buf.empty()) {
+    config.emplace_back(buf.begin(), buf.end());
+  }
+}
+
+void CachingAllocatorConfig::consumeToken(
+    const std::vector<std::string>& config,
+    size_t i,
+    const char c) {
+  GCPOOL_CHECK(
+      i < config.size() && config[i].compare(std::string(1, c)) == 0,
+      "Error parsing CachingAllocator settings, expected ",
+      c,
+      "");
+}
+
+size_t CachingAllocatorConfig::parseMaxSplitSize(
+    const std::vector<std::string>& config,
+    size_t i) {
+  consumeToken(config, ++i, ':');
+  if (++i < config.size()) {
+    size_t val1 = stoi(config[i]);
+    GCPOOL_CHECK(
+        val1 > Native::kLargeBuffer / (1024 * 1024),
+        "CachingAllocator option max_split_size_mb too small, must be > ",
+        Native::kLargeBuffer / (1024 * 1024),
+        "");
+    val1 = std::max(val1, Native::kLargeBuffer / (1024 * 1024));
+    val1 = std::min(val1, (std::numeric_limits<size_t>::max() / (1024 * 1024)));
+    m_max_split_size = val1 * 1024 * 1024;
+  } else {
+    GCPOOL_CHECK(false, "Error, expecting max_split_size_mb value", "");
+  }
+  return i;
+}
+
+size_t CachingAllocatorConfig::parseGarbageCollectionThreshold(
+    const std::vector<std::string>& config,
+    size_t i) {
+  consumeToken(config, ++i, ':');
+  if (++i < config.size()) {
+    double val1 = stod(config[i]);
+    GCPOOL_CHECK(
+        val1 > 0, "garbage_collect_threshold too small, set it 0.0~1.0", "");
+    GCPOOL_CHECK(
+        val1 < 1.0, "garbage_collect_threshold too big, set it 0.0~1.0", "");
+    m_garbage_collection_threshold = val1;
+  } else {
+    GCPOOL_CHECK(
+        false, "Error, expecting garbage_collection_threshold value", "");
+  }
+  return i;
+}
+
+size_t CachingAllocatorConfig::parseRoundUpPower2Divisions(
+    const std::vector<std::string>& config,
+    size_t i) {
+  consumeToken(config, ++i, ':');
+  bool first_value = true;
+
+  if (++i < config.size()) {
+    if (config[i].compare("[") == 0) {
+      size_t last_index = 0;
+      while (++i < config.size() && config[i].compare("]") != 0) {
+        std::string val1 = config[i];
+        size_t val2 = 0;
+
+        consumeToken(config, ++i, ':');
+        if (++i < config.size()) {
+          val2 = stoi(config[i]);
+        } else {
+          GCPOOL_CHECK(
+              false, "Error parsing roundup_power2_divisions value", "");
+        }
+        GCPOOL_CHECK(
+            gcpool::isPowerOf2_64(val2),
+            "For roundups, the divisons has to be power of 2 ",
+            "");
+
+        if (val1.compare(">") == 0) {
+          std::fill(
+              std::next(
+                  m_roundup_power2_divisions.begin(),
+                  static_cast<std::vector<unsigned long>::difference_type>(
+                      last_index)),
+              m_roundup_power2_divisions.end(),
+              val2);
+        } else {
+          size_t val1_long = stoul(val1);
+          GCPOOL_CHECK(
+              gcpool::isPowerOf2_64(val1_long),
+              "For roundups, the intervals have to be power of 2 ",
+              "");
+
+          size_t index = 63 - gcpool::countLeadingZeros(val1_long);
+          index = std::max((size_t)0, index);
+          index = std::min(index, m_roundup_power2_divisions.size() - 1);
+
+          if (first_value) {
+            std::fill(
+                m_roundup_power2_divisions.begin(),
+                std::next(
+                    m_roundup_power2_divisions.begin(),
+                    static_cast<std::vector<unsigned long>::difference_type>(
+                        index)),
+                val2);
+            first_value = false;
+          }
+          if (index < m_roundup_power2_divisions.size()) {
+            m_roundup_power2_divisions[index] = val2;
+          }
+          last_index = index;
+        }
+
+        if (config[i + 1].compare("]") != 0) {
+          consumeToken(config, ++i, ',');
+        }
+      }
+    } else { // Keep this for backwards compatibility
+      size_t val1 = stoi(config[i]);
+      GCPOOL_CHECK(
+          gcpool::isPowerOf2_64(val1),
+          "For roundups, the divisons has to be power of 2 ",
+          "");
+      std::fill(
+          m_roundup_power2_divisions.begin(),
+          m_roundup_power2_divisions.end(),
+          val1);
+    }
+  } else {
+    GCPOOL_CHECK(false, "Error, expecting roundup_power2_divisions value", "");
+  }
+  return i;
+}
+
+size_t CachingAllocatorConfig::parseAllocatorConfig(
+    const std::vector<std::string>& config,
+    size_t i,
+    bool& used_cudaMallocAsync) {
+  consumeToken(config, ++i, ':');
+  if (++i < config.size()) {
+    GCPOOL_CHECK(
+        ((config[i] == "native") || (config[i] == "cudaMallocAsync")),
+        "Unknown allocator backend, "
+        "options are native and cudaMallocAsync");
+    used_cudaMallocAsync = (config[i] == "cudaMallocAsync");
+    if (used_cudaMallocAsync) {
+#if CUDA_VERSION >= 11040
+      int version;
+      GCPOOL_CUDA_CHECK(cudaDriverGetVersion(&version));
+      GCPOOL_CHECK(
+          version >= 11040,
+          "backend:cudaMallocAsync requires CUDA runtime "
+          "11.4 or newer, but cudaDriverGetVersion returned ",
+          version);
+#else
+      GCPOOL_CHECK(
+          false,
+          "backend:cudaMallocAsync requires PyTorch to be built with "
+          "CUDA 11.4 or newer, but CUDA_VERSION is ",
+          CUDA_VERSION);
+#endif
+    }
+    // the embedding framework picks the backend when it loads, see
+    // BackendStaticInitializer in CUDACachingAllocator.cpp
+  } else {
+    GCPOOL_CHECK(false, "Error parsing backend value", "");
+  }
+  return i;
+}
+
+void CachingAllocatorConfig::parseArgs(const char* env) {
+  // If empty, set the default values
+  m_max_split_size = std::numeric_limits<size_t>::max();
+  m_roundup_power2_divisions.assign(Native::kRoundUpPowerOfTwoIntervals, 0);
+  m_garbage_collection_threshold = 0;
+  bool used_cudaMallocAsync = false;
+  bool used_native_specific_option = false;
+
+  if (env == nullptr) {
+    return;
+  }
+
+  std::vector<std::string> config;
+  lexArgs(env, config);
+
+  for (size_t i = 0; i < config.size(); i++) {
+    if (config[i].compare("max_split_size_mb") == 0) {
+      i = parseMaxSplitSize(config, i);
+      used_native_specific_option = true;
+    } else if (config[i].compare("garbage_collection_threshold") == 0) {
+      i = parseGarbageCollectionThreshold(config, i);
+      used_native_specific_option = true;
+    } else if (config[i].compare("roundup_power2_divisions") == 0) {
+      i = parseRoundUpPower2Divisions(config, i);
+      used_native_specific_option = true;
+    } else if (config[i].compare("backend") == 0) {
+      i = parseAllocatorConfig(config, i, used_cudaMallocAsync);
+    } else {
+      GCPOOL_CHECK(false, "Unrecognized CachingAllocator option: ", config[i]);
+    }
+
+    if (i + 1 < config.size()) {
+      consumeToken(config, ++i, ',');
+    }
+  }
+
+  if (used_cudaMallocAsync && used_native_specific_option) {
+    GCPOOL_WARN(
+        "backend:cudaMallocAsync ignores max_split_size_mb, roundup_bypass_threshold_mb,"
+        "roundup_power2_divisions, and garbage_collect_threshold.");
+  }
+}
+
+namespace Native {
+
+// Small blocks recently freed by one thread, cached for one device allocator
+// by (stream, size) so the thread can hand them out again without the
+// allocator lock; see DeviceCachingAllocator::try_malloc_magazine. The
+// owning thread touches the magazines and the stat deltas only between
+// enter() and leave(). Other threads reach them under the allocator lock
+// through pause(), which waits for that window to close and keeps the owner
+// out until resume().
+struct MagazineSet {
+  static constexpr size_t kSlots = 32;
+  static constexpr size_t kCapacity = 16;
+  // blocks moved per refill or flush
+  static constexpr size_t kBatch = kCapacity / 2;
+
+  struct Magazine {
+    size_t size = 0; // 0 while the slot holds no size class
+    uint32_t stream_id = 0;
+    uint32_t count = 0;
+    Block* blocks[kCapacity]; // oldest first
+
+    bool holds(uint32_t id, size_t block_size) const {
+      return size == block_size && stream_id == id;
+    }
+  };
+
+  // direct mapped; a different class in the slot is flushed to make room
+  Magazine& slot(uint32_t stream_id, size_t size) {
+    return magazines[(size / kMinBlockSize + stream_id * 7) % kSlots];
+  }
+
+  bool enter(const std::atomic<bool>& enabled) {
+    active.store(true, std::memory_order_seq_cst);
+    if (paused.load(std::memory_order_seq_cst) ||
+        !enabled.load(std::memory_order_seq_cst)) {
+      active.store(false, std::memory_order_release);
+      return false;
+    }
+    return true;
+  }
+
+  void leave() {
+    active.store(false, std::memory_order_release);
+  }
+
+  void pause() {
+    paused.store(true, std::memory_order_seq_cst);
+    while (active.load(std::memory_order_seq_cst)) {
+      std::this_thread::yield();
+    }
+  }
+
+  void resume() {
+    paused.store(false, std::memory_order_release);
+  }
+
+  Magazine magazines[kSlots];
+  // changes to the small pool stats not yet merged into DeviceStats; cached
+  // blocks count as active, so only these three move on a hit or a free
+  StatDelta allocation;
+  StatDelta allocated_bytes;
+  StatDelta requested_bytes;
+  int64_t hits = 0;
+
+  std::atomic<bool> active{false};
+  std::atomic<bool> paused{false};
+};
+
+// Shared by a DeviceCachingAllocator and every thread holding one of its
+// MagazineSets, so a thread exiting after the allocator is gone skips them.
+struct MagazineOwner {
+  // held by the allocator's destructor while it clears alive, and by an
+  // exiting thread while it releases its set
+  std::mutex mutex;
+  bool alive = true;
+};
+
+class DeviceCachingAllocator {
+ private:
+  // lock around all operations but the same-stream fast paths, always taken
+  // through ExclusiveLock
+  mutable std::recursive_mutex mutex;
+
+  // Held shared by try_malloc_same_stream and try_free_same_stream, and
+  // exclusively by ExclusiveLock, so everything that walks more than one
+  // stream (stitching, GC, release_cached_blocks, captures, stats readers)
+  // sees no fast path in flight.
+  mutable std::shared_mutex shard_gate;
+  // ExclusiveLocks held by the thread that owns mutex
+  mutable int exclusive_depth = 0;
+
+  // Under a shared shard_gate, the free blocks of a stream in small_blocks
+  // and large_blocks belong to stream_shards[stream_id % kStreamShards], and
+  // stats, active_blocks and malloc_path_stats to stats_mutex (taken after
+  // the shard).
+  static constexpr size_t kStreamShards = 64;
+  struct alignas(64) StreamShard {
+    std::mutex mutex;
+  };
+  std::array<StreamShard, kStreamShards> stream_shards;
+  std::mutex stats_mutex;
+
+  // What getStats, getGCPoolStats and cacheInfo return, read without any
+  // lock. Republished by ExclusiveLock as it is released, if the operation
+  // changed any stat, and by the same-stream fast paths under stats_mutex;
+  // both keep other writers out.
+  struct PublishedStats {
+    DeviceStats stats;
+    GCPoolStats gcpool;
+    size_t largest_cached_block;
+  };
+  mutable Seqlock<PublishedStats> published_stats;
+  // as of the last locked operation, raised by fast-path frees; a fast-path
+  // malloc of the largest block leaves it stale until the next locked one
+  mutable size_t largest_cached_block = 0;
+  // set by every stat update, see update_stat; cleared as the stats are
+  // republished
+  mutable bool stats_changed = false;
+
+  // Blocks whose free was deferred (deferredFree > 0), returned to the pools
+  // in batches by free_deferred_blocks.
+  MpscQueue<Block, &Block::deferred_next> deferred_frees;
+  // drains deferred_frees and merges the magazine stats in the background
+  // with deferredFree=2 or threadMagazines=1, see drain_loop
+  std::thread drain_thread;
+  std::mutex drain_mutex;
+  std::condition_variable drain_cv;
+  bool drain_stop = false;
+
+  // per-thread caches of small blocks, see try_malloc_magazine
+  std::vector<std::unique_ptr<MagazineSet>> magazine_sets;
+  // guards magazine_sets, so a thread registers its set without
+  // ExclusiveLock; taken after ExclusiveLock, never before
+  std::mutex magazine_sets_mutex;
+  std::shared_ptr<MagazineOwner> magazine_owner =
+      std::make_shared<MagazineOwner>();
+  // cleared while captures, history or garbage collection need every small
+  // malloc and free to go through the pools
+  std::atomic<bool> magazines_enabled{true};
+  // set by magazine hits and frees, cleared by collect_magazines; tells stats
+  // readers that some MagazineSet may hold unmerged deltas
+  std::atomic<bool> magazine_stats_pending{false};
+
+  // mutex, then shard_gate exclusively; reentrant like mutex
+  class ExclusiveLock {
+   public:
+    explicit ExclusiveLock(const DeviceCachingAllocator& allocator)
+        : allocator_(allocator), lock_(allocator.mutex) {
+      if (allocator_.exclusive_depth++ == 0) {
+        allocator_.shard_gate.lock();
+      }
+    }
+
+    // takes neither lock if either is held elsewhere, see owns_lock()
+    ExclusiveLock(const DeviceCachingAllocator& allocator, std::try_to_lock_t)
+        : allocator_(allocator), lock_(allocator.mutex, std::try_to_lock) {
+      if (!lock_.owns_lock()) {
+        return;
+      }
+      if (allocator_.exclusive_depth == 0 && !allocator_.shard_gate.try_lock()) {
+        lock_.unlock();
+        return;
+      }
+      allocator_.exclusive_depth++;
+    }
+
+    ~ExclusiveLock() {
+      if (!lock_.owns_lock()) {
+        return;
+      }
+      if (--allocator_.exclusive_depth == 0) {
+        allocator_.publish_locked_stats();
+        allocator_.shard_gate.unlock();
+      }
+    }
+
+    ExclusiveLock(const ExclusiveLock&) = delete;
+    ExclusiveLock& operator=(const ExclusiveLock&) = delete;
+
+    bool owns_lock() const {
+      return lock_.owns_lock();
+    }
+
+   private:
+    const DeviceCachingAllocator& allocator_;
+    std::unique_lock<std::recursive_mutex> lock_;
+  };
+
+  // device statistics
+  DeviceStats stats;
+
+  // unallocated cached blocks larger than 1 MB
+  BlockPool large_blocks;
+
+    
+  // unallocated cached blocks larger than 64 MB
+  //BlockPool huge_blocks;
+
+  // fused blocks that has been mapped to fragment blocks in size order
+  BlockPool free_fused_blocks;
+  
+  // fused blocks that has been mapped to fragment blocks in release order
+  PerStream<BlockEventOrderPool<&BlockCold::release_order>> free_fused_blocks_in_release_order;
+  
+  // fused blocks which is free, but it's phy_blocks are used by other block of my stream
+  PerStream<BlockEventOrderPool<&BlockCold::fragmented>> fragmented_free_fused_blocks;
+
+  // unallocated cached blocks 1 MB or smaller
+  BlockPool small_blocks;
+
+  // storage of every Block of this device; search keys live on the stack
+  SlabAllocator<Block> block_slab;
+
+  // allocated or in use by a stream. Holds all active allocations,
+  // whether they came from graph_pools or one of the BlockPools above.
+  flat_hash_set<Block*> active_blocks;
+  
+    //active fused blocks
+  flat_hash_set<Block*> active_fused_blocks;
+  
+  //active fused blocks to be garbage collected
+  flat_hash_set<Block*> active_fused_blocks_to_gc;
+
+  // captures_underway tracks if a capture might be underway on any stream.
+  // Most of the time it's zero, in which case malloc can avoid calling
+  // cudaStreamGetCaptureInfo in the hot path.
+  int captures_underway = 0;
+  // See free() for this thing's purpose
+  std::vector<Block*> needs_events_deferred_until_no_capture;
+  // outstanding cuda events
+  flat_hash_map<
+      StreamUse,
+      std::deque<std::pair<EventPool::Event, Block*>>,
+      StreamUseHash>
+      cuda_events;
+
+  // record used memory.
+  size_t total_allocated_memory = 0;
+
+  size_t total_fuse_size = 0;
+
+  // stitching / garbage collection counters, see GCPoolStats
+  GCPoolStats gcpool_stats;
+
+  // per-strategy hits and latency of malloc, see MallocPathStats
+  MallocPathStats malloc_path_stats;
+
+  size_t allowed_memory_maximum = 0;
+
+  bool set_fraction = false;
+
+  bool record_history = false;
+  std::atomic<CreateContextFn> context_recorder_;
+  HistoryArena*
+      history_arena; // pointer because we need to intentionally leak this on
+                     // deallocation it can hold references to Python state
+                     // which will already be destroyed when we are in exit
+                     // handlers
+  // The trace is a ring of alloc_trace_max_entries_ records, allocated up
+  // front by recordHistory; recording an entry stores one record and swaps
+  // the context reference of the entry it overwrites.
+  struct TraceRecord {
+    int64_t time_ns; // steady_clock
+    int64_t addr;
+    int64_t size;
+    cudaStream_t stream;
+    uint32_t context_id; // in history_arena->contexts
+    TraceEntry::Action action;
+  };
+  size_t alloc_trace_max_entries_ = 1;
+  bool alloc_trace_record_context_ = false;
+  std::vector<TraceRecord> alloc_trace;
+  size_t alloc_trace_next = 0;
+  size_t alloc_trace_size = 0;
+  // timed spans of the expensive paths, a ring like alloc_trace
+  std::vector<TimelineEvent> timeline_spans;
+  size_t timeline_spans_next = 0;
+
+  // Members specific to CUDA graphs
+
+  // Private pools for CUDA graphs
+  flat_hash_map<MempoolId_t, std::unique_ptr<PrivatePool>, MempoolIdHash>
+      graph_pools;
+  // Pools no longer referenced by any graph. Their BlockPools are eligible for
+  // free_blocks. Can't be a vector or deque because we might erase entries in
+  // any order. Could be an std::list, but we don't care much, access and
+  // insert/erase are rare.
+  flat_hash_map<MempoolId_t, PrivatePool*, MempoolIdHash>
+      graph_pools_freeable;
+
+  // Maps a capturing stream to its assigned private pool,
+  // in case we want multiple captures to share the same pool
+  flat_hash_map<CaptureId_t, MempoolId_t> capture_to_pool_map;
+
+  // XXX - maybe we should generalize and have multiple events
+  std::vector<OutOfMemoryObserver> oom_observers_;
+
+ public:
+  DeviceCachingAllocator()
+      : large_blocks(BlockComparator, /*is_small=*/false),
+        free_fused_blocks(BlockComparator, /*is_small=*/false),
+        small_blocks(BlockComparator, /*is_small=*/true),
+        history_arena(new HistoryArena()),
+        alloc_trace(alloc_trace_max_entries_) {
+    stats.max_split_size = CachingAllocatorConfig::max_split_size();
+    publish_stats();
+    context_recorder_.store(nullptr);
+    if (deferred_free_mode() > 1 || use_magazines()) {
+      drain_thread = std::thread([this]() { drain_loop(); });
+    }
+  }
+
+  ~DeviceCachingAllocator() {
+    {
+      std::lock_guard<std::mutex> guard(magazine_owner->mutex);
+      magazine_owner->alive = false;
+    }
+    if (drain_thread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        drain_stop = true;
+      }
+      drain_cv.notify_one();
+      drain_thread.join();
+    }
+    // blocks still queued are left to the process exit with the rest of the
+    // cache: freeing them would record CUDA events, which can throw once the
+    // runtime is shutting down
+  }
+
+  void recordHistory(
+      bool enabled,
+      CreateContextFn context_recorder,
+      size_t alloc_trace_max_entries,
+      bool alloc_trace_record_context) {
+    ExclusiveLock lock(*this);
+    record_history = enabled;
+    context_recorder_.store(enabled ? context_recorder : nullptr);
+    alloc_trace_max_entries_ = std::max(size_t(1), alloc_trace_max_entries);
+    alloc_trace_record_context_ = alloc_trace_record_context;
+    clear_trace();
+    alloc_trace.assign(alloc_trace_max_entries_, TraceRecord{});
+    timeline_spans_next = 0;
+    timeline_spans.clear();
+    update_magazines_enabled();
+  }
+
+  void attachOutOfMemoryObserver(OutOfMemoryObserver observer) {
+    oom_observers_.emplace_back(std::move(observer));
+  }
+
+  // All public methods (except the above) acquire the allocator mutex.
+  // Thus, do not call a public method from another public method.
+
+  Block* malloc(int device, size_t orig_size, cudaStream_t stream) {
+    drain_deferred_frees();
+    if (Block* block = try_malloc_magazine(orig_size, stream)) {
+      return block;
+    }
+    // done outside the lock because we don't know what locks the recorder needs
+    // to have...
+    std::shared_ptr<Context> context = capture_context();
+    if (Block* block =
+            try_malloc_same_stream(device, orig_size, stream, context)) {
+      return block;
+    }
+
+    ExclusiveLock lock(*this);
+    // the lookups missed and the lock is ours anyway
+    free_deferred_blocks();
+    const auto malloc_start = std::chrono::steady_clock::now();
+
+    if (GCPOOL_LIKELY(captures_underway == 0)) {
+      // Processes end-of-life events for outstanding allocations used on
+      // multiple streams (checks if their GPU-side uses are complete and
+      // recycles their memory if so)
+      //
+      // Q. Why skip process_events if a capture might be underway?
+      // A. process_events involves cudaEventQueries, illegal during CUDA graph
+      //    capture.
+      //    Dumb simple solution: defer reclaiming these allocations until after
+      //    capture. Cross-stream memory use is uncommon, so the deferral's
+      //    effect on memory use during capture should be small.
+      process_events();
+    }
+    size_t size = round_size(orig_size);
+    auto& pool = get_pool(size, stream);
+    const size_t alloc_size = get_allocation_size(size);
+    AllocParams params(device, size, stream, &pool, alloc_size, stats);
+    params.stat_types[static_cast<size_t>(StatType::AGGREGATE)] = true;
+    params.stat_types[static_cast<size_t>(get_stat_type_for_pool(pool))] = true;
+
+    // First, try to get a block from the existing pool.
+    MallocPath path = MallocPath::FAILED;
+    if (get_free_block(params)) {
+      path = MallocPath::CACHED_BLOCK;
+    } else if (trigger_free_memory_callbacks(params) && get_free_block(params)) {
+      path = MallocPath::CACHED_AFTER_CALLBACKS;
+    }
+    bool block_found = (path != MallocPath::FAILED);
+
+    if (!block_found) {
+        // Do garbage collection if the flag is set.
+        if (GCPOOL_UNLIKELY(
+                set_fraction &&
+                CachingAllocatorConfig::garbage_collection_threshold() > 0.0)) {
+            garbage_collect_cached_blocks();
+        }
+
+        // Attempt allocate
+        if (realloc_block(params, false)) {
+          path = MallocPath::NEW_SEGMENT;
+        } else if (release_available_cached_blocks(params) &&
+                   realloc_block(params, false)) {
+          path = MallocPath::NEW_SEGMENT_AFTER_RELEASE;
+        } else if (get_fused_fragmented_blocks(params, 1)) {
+          path = MallocPath::FUSED_BLOCKS;
+        } else if (GCPOOL_LIKELY(captures_underway == 0) && release_cached_blocks() &&
+                   realloc_block(params, true)) {
+          path = MallocPath::NEW_SEGMENT_AFTER_FLUSH;
+        } else if (get_fused_fragmented_blocks(params, 2)) {
+          path = MallocPath::FUSED_AFTER_FLUSH;
+        }
+        block_found = (path != MallocPath::FAILED);
+
+        if (record_history && block_found) {
+            const uint32_t context_id = history_arena->contexts.intern(context);
+            record_trace(
+                TraceEntry::SEGMENT_ALLOC,
+                int64_t(params.block->ptr),
+                params.block->size,
+                params.stream(),
+                context_id);
+            history_arena->contexts.release(context_id);
+        }
+    }
+
+
+    if (!block_found) {
+      record_malloc_path(MallocPath::FAILED, malloc_start, params);
+
+      size_t device_free;
+      size_t device_total;
+      GCPOOL_CUDA_CHECK(cudaMemGetInfo(&device_free, &device_total));
+      std::string allowed_info;
+
+      if (set_fraction) {
+        allowed_info = format_size(allowed_memory_maximum) + " allowed; ";
+      }
+
+      if (record_history) {
+        const uint32_t context_id = history_arena->contexts.intern(context);
+        record_trace(
+            TraceEntry::OOM,
+            device_free,
+            params.size(),
+            params.stream(),
+            context_id);
+        history_arena->contexts.release(context_id);
+      }
+      stats.num_ooms += 1;
+      stats_changed = true;
+      GCPOOL_INFO(" current memory info: device_total: %luMB, device_free: %luMB, request size: %luMB",
+                                                                      device_total/(1024*1024), device_free/(1024*1024), size/(1024*1024));
+
+      const int64_t allocated_bytes =
+          stats.allocated_bytes[static_cast<size_t>(StatType::AGGREGATE)].current;
+      const int64_t reserved_bytes =
+          stats.reserved_bytes[static_cast<size_t>(StatType::AGGREGATE)].current;
+      if (allocator_hooks.report_out_of_memory) {
+        allocator_hooks.report_out_of_memory(
+            size, allocated_bytes, reserved_bytes, device);
+      }
+      for (const auto& obs : oom_observers_) {
+        obs(device,
+            alloc_size,
+            set_fraction ? allowed_memory_maximum : device_total,
+            device_free);
+      }
+      // "allowed": memory is allowed to use, which set by fraction.
+      // "already allocated": memory allocated through the allocator.
+      // "reserved": segments the allocator holds, allocated or cached.
+      GCPOOL_CHECK_WITH(
+          OutOfMemoryError,
+          false,
+          "CUDA out of memory. Tried to allocate ",
+          format_size(alloc_size),
+          " (GPU ",
+          device,
+          "; ",
+          format_size(device_total),
+          " total capacity; ",
+          format_size(allocated_bytes),
+          " already allocated; ",
+          format_size(device_free),
+          " free; ",
+          allowed_info,
+          format_size(reserved_bytes),
+          " reserved in total by the allocator)",
+          " If reserved memory is >> allocated memory try setting max_split_size_mb to avoid"
+          " fragmentation.");
+    }
+
+    GCPOOL_ASSERT(
+        params.err == cudaSuccess && params.block != nullptr &&
+        params.block->ptr != nullptr);
+    Block* block = params.block;
+    Block* remaining = nullptr;
+
+    static const int vmmDefragment = ([]()->int{
+      const char* env = getenv("vmmDefragment");
+      if(env) return atoi(env);
+      else return 1;
+    })();
+
+    const bool already_split = block->is_split();
+    if (should_split(block, size)) {
+      if(pool.is_small || vmmDefragment <= 0 || (block->vmm_segment && !block->vmm_segment->fused)) {
+        
+        remaining = block;
+          
+        block = block_slab.create(device, stream, size, &pool, block->ptr);
+        block->prev = remaining->prev;
+        if (block->prev) {
+          block->prev->next = block;
+        }
+        block->next = remaining;
+          
+        remaining->prev = block;
+        remaining->ptr = static_cast<char*>(remaining->ptr) + size;
+        remaining->size -= size;
+          
+        if(vmmDefragment > 0 && remaining->vmm_segment) {
+              
+          auto remaining_segment = split_granules(*remaining->vmm_segment, size/kGranularity);
+          block->vmm_segment = std::move(remaining->vmm_segment);
+          remaining->vmm_segment =  std::move(remaining_segment);
+          
+              
+          size_t offset = 0;
+          for(auto& phy_block : block->vmm_segment->phy_blocks) {
+            phy_block->mapped_blocks[0].block = block;
+            phy_block->mapped_blocks[0].offset = offset;
+            phy_block->free = false;
+            offset++;
+          }
+          mark_all_granules(*block->vmm_segment, false);
+          block->vmm_segment->used_blocks = block->vmm_segment->phy_blocks.size();
+              
+              
+          offset = 0;
+          for(auto& phy_block : remaining->vmm_segment->phy_blocks) {
+            phy_block->mapped_blocks[0].block = remaining;
+            phy_block->mapped_blocks[0].offset = offset;
+                  
+            bool is_prev_free = phy_block->free;
+            phy_block->free = true;
+                  
+            //neglect the the first block, since it is the remaining block
+            for(int i=1; i<phy_block->mapped_blocks.size(); i++) {
+              Block* other_block = phy_block->mapped_blocks[i].block;
+                      
+                      
+              if(!is_prev_free) {
+                mark_granule(*other_block->vmm_segment, phy_block->mapped_blocks[i].offset, true);
+                        
+                if(other_block->vmm_segment->fused) {
+                  if(other_block->vmm_segment->free_blocks == other_block->vmm_segment->phy_blocks.size()) {
+                    if(other_block->stream == block->stream &&
+                      fragmented_free_fused_blocks[other_block->stream_id].contains(other_block)) {
+                      fragmented_free_fused_blocks[other_block->stream_id].erase(other_block);
+                                      
+                      free_fused_blocks.insert(other_block);
+                      free_fused_blocks_in_release_order[other_block->stream_id].insert(other_block);
+                    }
+                  }
+                }           
+              }            
+            }
+                  
+            offset++;
+          }
+          mark_all_granules(*remaining->vmm_segment, true);
+          remaining->vmm_segment->used_blocks = 0;
+        }
+          
+        bool inserted = pool.insert(remaining).second;
+        GCPOOL_ASSERT_DEBUG_ONLY(inserted);
+          
+        if (record_history) {
+          trimHistoryBefore(*history_arena, remaining, (char*)block->ptr + size);
+        }
+          
+        if (already_split) {
+          // An already-split inactive block is being shrunk by size bytes.
+          update_stat_array(
+            stats.inactive_split_bytes, -block->size, params.stat_types);
+        } else {
+          // A new split inactive block is being created from a previously unsplit
+          // block, size remaining->size bytes.
+          for_each_selected_stat_type(params.stat_types, [&](size_t stat_type) {
+            update_stat(stats.inactive_split_bytes[stat_type], remaining->size);
+            update_stat(stats.inactive_split[stat_type], 1);
+          });
+        }
+      }
+      else if(vmmDefragment > 0 && block->vmm_segment) {
+        size_t keep_blocks = size/kGranularity;
+          
+        if(block->vmm_segment->used_blocks > keep_blocks) {
+          mark_granules(*block->vmm_segment, keep_blocks, block->vmm_segment->phy_blocks.size(), true);
+          block->vmm_segment->used_blocks = keep_blocks;
+              
+          if(block->vmm_segment->free_map.any(0, keep_blocks)) {
+            GCPOOL_INFO(" warning for malloc fused blocks has free phy_block, something wrong happended");
+            exit(-1);
+          }
+              
+          std::unordered_set<Block*> blocks2split;
+          for(size_t i = keep_blocks; i < block->vmm_segment->phy_blocks.size(); i++) {
+            auto& phy_block = block->vmm_segment->phy_blocks[i];
+                  
+            bool is_prev_free = phy_block->free;
+            phy_block->free = true;
+                  
+            for(auto& block_segment : phy_block->mapped_blocks) {
+              Block* other_block = block_segment.block;
+              
+              if(other_block == block) continue;
+                      
+              if(!is_prev_free) {
+                mark_granule(*other_block->vmm_segment, block_segment.offset, true);
+                if(other_block->vmm_segment->fused) {
+                  if(other_block->vmm_segment->free_blocks == other_block->vmm_segment->phy_blocks.size()) {
+                    if(other_block->stream == block->stream &&
+                      fragmented_free_fused_blocks[other_block->stream_id].contains(other_block)) {
+                      fragmented_free_fused_blocks[other_block->stream_id].erase(other_block);
+                                      
+                      free_fused_blocks.insert(other_block);
+                      free_fused_blocks_in_release_order[other_block->stream_id].insert(other_block);
+                    }
+                  }
+                } else {
+                  if(other_block->vmm_segment->free_blocks == other_block->vmm_segment->phy_blocks.size()) {
+                    large_blocks.insert(other_block);
+                                  
+                    blocks2split.erase(other_block);
+                    
+                    if(other_block->is_split()) {
+                      update_stat_array(stats.inactive_split, 1, params.stat_types);
+                      update_stat_array(stats.inactive_split_bytes, other_block->size, params.stat_types);
+                    }
+                  } else {
+                    if(blocks2split.count(other_block) == 0) {
+                      blocks2split.insert(other_block);
+                    }
+                  }
+                } 
+              }
+            }
+          }
+    
+          for(auto& block2split : blocks2split) {
+            if(block2split->vmm_segment->fused || 
+               block2split->vmm_segment->free_blocks == 0 || 
+               block2split->vmm_segment->free_blocks == block2split->vmm_segment->phy_blocks.size()) continue;
+                  
+                  
+            if(active_blocks.count(block2split)) {
+              block2split->allocated = false;
+              active_blocks.erase(block2split);
+                    
+              update_stat_array(stats.active, -1, params.stat_types);
+              update_stat_array(stats.active_bytes, -block2split->size, params.stat_types);
+            }
+                  
+                  
+            // each run of free or of used granules becomes a block of its own
+            const GranuleBitmap free_map = block2split->vmm_segment->free_map;
+            bool block_free = free_map.test(0);
+            size_t last_offset = 0;
+            Block* prev_block = block2split->prev;
+                  
+            auto run_segments = split_granule_runs(std::move(block2split->vmm_segment), free_map);
+            size_t run = 0;
+                  
+            while(last_offset < free_map.size()) {
+              size_t i = free_map.findNext(last_offset, !block_free);
+              size_t block_size = (i - last_offset)*kGranularity;
+                        
+              char* block_ptr = (char*)block2split->ptr + last_offset*kGranularity;
+              Block* split_block = block_slab.create(device, stream, block_size, &pool, block_ptr);
+                        
+                        
+              split_block->prev = prev_block;
+              if(prev_block) prev_block->next = split_block;
+            
+              split_block->self_last_event = block2split->self_last_event;
+                        
+                        
+              split_block->vmm_segment = std::move(run_segments[run++]);
+                        
+                        
+              size_t offset = 0;
+              for(auto& phy_block : split_block->vmm_segment->phy_blocks) {
+                phy_block->mapped_blocks[0].block = split_block;
+                phy_block->mapped_blocks[0].offset = offset;
+                offset++;
+              }
+                        
+            
+              // a used run is used by the fused blocks mapped over it, not by
+              // split_block, so freeing split_block must not release it
+              split_block->vmm_segment->used_blocks = 0;
+              if(block_free) {
+                large_blocks.insert(split_block);
+              
+                update_stat_array(stats.inactive_split, 1, params.stat_types);
+                update_stat_array(stats.inactive_split_bytes, split_block->size, params.stat_types);
+              } else {
+                split_block->allocated = true;
+                active_blocks.insert(split_block);
+                            
+                            
+                update_stat_array(stats.active, 1, params.stat_types);
+                update_stat_array(stats.active_bytes, split_block->size, params.stat_types);
+              }
+                 
+
+              block_free = !block_free;
+              last_offset = i;
+              prev_block = split_block;
+            }
+                  
+                  
+            if(prev_block) {
+              prev_block->next = block2split->next;
+            }
+                  
+            if(block2split->next) {
+              block2split->next->prev = prev_block;
+            }
+                  
+                  
+            destroy_block(block2split);
+          }
+        }
+      }
+
+
+      if (record_history) {
+        trimHistoryBefore(*history_arena, remaining, (char*)block->ptr + size);
+      }
+
+    } else if (already_split) {
+      // An already-split block is becoming active
+      for_each_selected_stat_type(params.stat_types, [&](size_t stat_type) {
+        update_stat(
+            stats.inactive_split_bytes[stat_type],
+            -static_cast<std::int64_t>(block->size));
+        update_stat(stats.inactive_split[stat_type], -1);
+      });
+    }
+
+    block->allocated = true;
+    block->requested_size = orig_size;
+    block->actual_size = size;
+    if (record_history) {
+      record_alloc_history(block, orig_size, context);
+    }
+
+    bool inserted = false;
+    if(block->vmm_segment && block->vmm_segment->fused) {
+        active_fused_blocks.insert(block);
+    } else {
+        inserted = active_blocks.insert(block).second;
+        GCPOOL_ASSERT_DEBUG_ONLY(inserted);
+    }
+
+    for_each_selected_stat_type(params.stat_types, [&](size_t stat_type) {
+      update_stat(stats.allocation[stat_type], 1);
+      update_stat(
+          stats.allocated_bytes[stat_type],
+          static_cast<std::int64_t>(block->actual_size));
+      update_stat(
+          stats.requested_bytes[stat_type],
+          static_cast<std::int64_t>(block->requested_size));
+          if (inserted)
+          {
+              update_stat(stats.active[stat_type], 1);
+              update_stat(stats.active_bytes[stat_type], block->size);
+          }
+    });
+    if (block->size >= CachingAllocatorConfig::max_split_size())
+      update_stat(stats.oversize_allocations, 1);
+
+    report_memory_usage(
+        block->ptr,
+        block->size,
+        stats.allocated_bytes[static_cast<size_t>(StatType::AGGREGATE)].current,
+        stats.reserved_bytes[static_cast<size_t>(StatType::AGGREGATE)].current,
+        device);
+
+    record_malloc_path(path, malloc_start, params);
+    return block;
+  }
+
+  void free(Block* block) {
+    if (try_free_magazine(block)) {
+      return;
+    }
+    if (deferred_free_mode() > 0) {
+      deferred_frees.push(block);
+      return;
+    }
+    if (try_free_same_stream(block)) {
+      return;
+    }
+    ExclusiveLock lock(*this);
+    free_locked(block);
+  }
+
+  // Returns the blocks of deferred_frees to the pools under one lock.
+  // before the lookups of a malloc, once deferred_free_batch() blocks are
+  // queued and the lock is free
+  void drain_deferred_frees() {
+    if (deferred_frees.size() < deferred_free_batch()) {
+      return;
+    }
+    ExclusiveLock lock(*this, std::try_to_lock);
+    if (lock.owns_lock()) {
+      free_deferred_blocks();
+    }
+  }
+
+  // free() with the allocator locked
+  void free_locked(Block* block) {
+    block->allocated = false;
+
+    // following logic might modifying underlaying Block, causing the size
+    // changed. We store ahead for reporting
+    auto orig_block_ptr = block->ptr;
+    auto orig_block_size = block->size;
+
+    StatTypes stat_types = {false};
+    stat_types[static_cast<size_t>(StatType::AGGREGATE)] = true;
+    stat_types[static_cast<size_t>(get_stat_type_for_pool(*(block->pool)))] =
+        true;
+    for_each_selected_stat_type(stat_types, [&](size_t stat_type) {
+      update_stat(stats.allocation[stat_type], -1);
+      update_stat(
+          stats.allocated_bytes[stat_type],
+          -static_cast<std::int64_t>(block->actual_size));
+    });
+    if (HistoryChain* h = block->history()) {
+      record_trace(
+          TraceEntry::FREE_REQUESTED,
+          int64_t(block->ptr),
+          h->real_size,
+          block->stream,
+          h->context_id);
+    }
+    if (block->size >= CachingAllocatorConfig::max_split_size())
+      update_stat(stats.oversize_allocations, -1);
+
+    if (block->has_stream_uses()) {
+      if (GCPOOL_UNLIKELY(captures_underway)) {
+        // It's forbidden to cudaEventQuery an event recorded during CUDA graph
+        // capture. We conservatively defer recording end-of-life events until
+        // the next call to process_events() (which won't happen until no
+        // captures are underway)
+        needs_events_deferred_until_no_capture.push_back(block);
+      } else {
+        insert_events(block);
+      }
+    } else {
+      // free_block(block);
+      insert_free_event_into_alloc_stream(block);   
+      update_block(block);
+    }
+
+    report_memory_usage(
+        orig_block_ptr,
+        -orig_block_size,
+        stats.allocated_bytes[static_cast<size_t>(StatType::AGGREGATE)].current,
+        stats.reserved_bytes[static_cast<size_t>(StatType::AGGREGATE)].current,
+        block->device);
+  }
+
+  // called with the allocator locked, from free and the event processing
+  void update_block(Block* block) {
+    bool flag = false;
+      
+    std::unordered_set<Block*> blocks2free;
+    if(block->vmm_segment) {
+          
+      for(size_t i=0; i<block->vmm_segment->phy_blocks.size(); i++) {
+              
+        if(i < block->vmm_segment->used_blocks) {
+          auto& phy_block = block->vmm_segment->phy_blocks[i];
+              
+          bool is_prev_free = phy_block->free;
+          if(!is_prev_free) {
+            mark_granule(*block->vmm_segment, i, true);
+            phy_block->free = true;
+          } else {
+            GCPOOL_INFO(" warning used blocks is free");
+            exit(-1);
+          }
+                  
+          for(auto& block_segment : phy_block->mapped_blocks) {
+            Block* other_block = block_segment.block;
+                      
+            if(other_block == block) continue;
+                      
+            if(!is_prev_free) {
+              mark_granule(*other_block->vmm_segment, block_segment.offset, true);
+                          
+              if(other_block->vmm_segment->fused) {
+                if(other_block->vmm_segment->free_blocks == other_block->vmm_segment->phy_blocks.size()) {
+                  if(other_block->stream == block->stream &&
+                    fragmented_free_fused_blocks[other_block->stream_id].contains(other_block)) {
+                    fragmented_free_fused_blocks[other_block->stream_id].erase(other_block);
+                                      
+                    free_fused_blocks.insert(other_block);
+                    free_fused_blocks_in_release_order[other_block->stream_id].insert(other_block);
+                  }
+                }
+              } else {
+                if(!other_block->self_last_event ||
+                    other_block->self_last_event->event_id < block->self_last_event->event_id) {
+                    other_block->self_last_event = block->self_last_event;
+                }
+                              
+                if(other_block->vmm_segment->free_blocks == other_block->vmm_segment->phy_blocks.size()) {
+                  blocks2free.insert(other_block);
+                }
+              }
+                          
+            }
+          }
+        }
+      }
+          
+      block->vmm_segment->used_blocks = 0;
+          
+    }
+      
+      
+    if(block->vmm_segment && block->vmm_segment->fused) {
+      if(active_fused_blocks_to_gc.count(block) == 0) {
+        if(block->vmm_segment->free_blocks == block->vmm_segment->phy_blocks.size()) {
+          if(fragmented_free_fused_blocks[block->stream_id].contains(block)) {
+            fragmented_free_fused_blocks[block->stream_id].erase(block);
+          }
+                  
+          free_fused_blocks.insert(block);
+          free_fused_blocks_in_release_order[block->stream_id].insert(block);
+        } else {
+          fragmented_free_fused_blocks[block->stream_id].insert(block);
+        }
+      }
+
+          
+      if(active_fused_blocks.count(block)) {
+        block->allocated = false;
+        active_fused_blocks.erase(block);
+        flag = true;
+        size_t requested_size = block->requested_size;
+        StatTypes stat_types = {false};
+        stat_types[static_cast<size_t>(StatType::AGGREGATE)] = true;
+        stat_types[static_cast<size_t>(get_stat_type_for_pool(large_blocks))] = true;
+        for_each_selected_stat_type(stat_types, [&](size_t stat_type) {
+          update_stat(
+            stats.requested_bytes[stat_type],
+            -static_cast<std::int64_t>(requested_size));
+        });
+              
+        if(active_fused_blocks_to_gc.count(block)) {
+          unmap_fused_block(block);
+                  
+          active_fused_blocks_to_gc.erase(block);
+          destroy_block(block);
+        }
+      }
+    } else {
+      free_block(block, flag);
+    }
+      
+      
+    for(auto& block2free : blocks2free) {
+          
+      block2free->allocated = false;
+      free_block(block2free, flag);
+    }
+      
+  }
+
+  void* getBaseAllocation(Block* block, size_t* outSize) {
+    ExclusiveLock lock(*this);
+    while (block->prev) {
+      block = block->prev;
+    }
+    void* basePtr = block->ptr;
+    if (outSize) {
+      size_t size = 0;
+      while (block) {
+        size += block->size;
+        block = block->next;
+      }
+      *outSize = size;
+    }
+    return basePtr;
+  }
+
+  void recordStream(Block* block, cudaStream_t stream, int device) {
+    ExclusiveLock lock(*this);
+    if (stream == block->stream) {
+      // ignore uses on the allocation stream, since those don't require any
+      // special synchronization
+      return;
+    }
+    block->cold_ext().stream_uses.insert(StreamUse{stream, device});
+  }
+
+  /** set memory fraction to limit maximum allocated memory **/
+  void setMemoryFraction(double fraction) {
+    ExclusiveLock lock(*this);
+    size_t device_free;
+    size_t device_total;
+    GCPOOL_CUDA_CHECK(cudaMemGetInfo(&device_free, &device_total));
+    allowed_memory_maximum = static_cast<size_t>(fraction * device_total);
+    set_fraction = true;
+    update_magazines_enabled();
+  }
+
+  /** returns cached blocks to the system allocator **/
+  void emptyCache() {
+    ExclusiveLock lock(*this);
+    release_cached_blocks();
+
+    size_t garbage_size = garbage_collect_fused_blocks(2, 0);
+    total_fuse_size -= garbage_size;
+    stats_changed = true;
+	
+	  GCPOOL_INFO(" garbage_collect_fused_blocks() return %luMB garbage memory", garbage_size/(1024*1024));
+  }
+
+  /** Retrieves size of largest unused block held by the memory cache **/
+  void cacheInfo(size_t* largest) {
+    if (*largest ==
+        0) { // make an initial guess if a zero *largest is passed in
+      size_t tmp_bytes;
+      GCPOOL_CUDA_CHECK(cudaMemGetInfo(
+          largest, // Use free memory as an optimistic initial guess of *largest
+          &tmp_bytes));
+    }
+    *largest =
+        std::max(*largest, published_stats.load().largest_cached_block);
+  }
+
+  /** Returns a copy of the memory allocator stats **/
+  // As of the last completed operation, without taking any lock. Magazine
+  // hits and frees and queued deferred frees show up once they are merged or
+  // drained, by the next locked operation that does so or by drain_loop.
+  DeviceStats getStats() {
+    return published_stats.load().stats;
+  }
+
+  /** Returns a copy of the stitching and fused-block GC counters **/
+  GCPoolStats getGCPoolStats() {
+    return published_stats.load().gcpool;
+  }
+
+  /** Returns a copy of the per-strategy malloc hits and latencies **/
+  MallocPathStats getMallocPathStats() {
+    ExclusiveLock lock(*this);
+    collect_magazines(/*flush=*/false);
+    return malloc_path_stats;
+  }
+
+  void resetMallocPathStats() {
+    ExclusiveLock lock(*this);
+    collect_magazines(/*flush=*/false);
+    malloc_path_stats = MallocPathStats();
+  }
+
+  /** Resets the historical accumulation stats for the device **/
+  void resetAccumulatedStats() {
+    ExclusiveLock lock(*this);
+    stats_changed = true;
+    collect_magazines(/*flush=*/false);
+
+    for (size_t statType = 0;
+         statType < static_cast<size_t>(StatType::NUM_TYPES);
+         ++statType) {
+      reset_accumulated_stat(stats.allocation[statType]);
+      reset_accumulated_stat(stats.segment[statType]);
+      reset_accumulated_stat(stats.active[statType]);
+      reset_accumulated_stat(stats.inactive_split[statType]);
+      reset_accumulated_stat(stats.allocated_bytes[statType]);
+      reset_accumulated_stat(stats.reserved_bytes[statType]);
+      reset_accumulated_stat(stats.active_bytes[statType]);
+      reset_accumulated_stat(stats.inactive_split_bytes[statType]);
+      reset_accumulated_stat(stats.requested_bytes[statType]);
+    }
+
+    stats.num_alloc_retries = 0;
+    stats.num_ooms = 0;
+    reset_accumulated_stat(stats.oversize_allocations);
+    reset_accumulated_stat(stats.oversize_segments);
+
+    gcpool_stats = GCPoolStats();
+    malloc_path_stats = MallocPathStats();
+  }
+
+  /** Resets the historical peak stats for the device **/
+  void resetPeakStats() {
+    ExclusiveLock lock(*this);
+    stats_changed = true;
+    collect_magazines(/*flush=*/false);
+
+    for (size_t statType = 0;
+         statType < static_cast<size_t>(StatType::NUM_TYPES);
+         ++statType) {
+      reset_peak_stat(stats.allocation[statType]);
+      reset_peak_stat(stats.segment[statType]);
+      reset_peak_stat(stats.active[statType]);
+      reset_peak_stat(stats.inactive_split[statType]);
+      reset_peak_stat(stats.allocated_bytes[statType]);
+      reset_peak_stat(stats.reserved_bytes[statType]);
+      reset_peak_stat(stats.active_bytes[statType]);
+      reset_peak_stat(stats.inactive_split_bytes[statType]);
+      reset_peak_stat(stats.requested_bytes[statType]);
+    }
+    reset_peak_stat(stats.oversize_allocations);
+    reset_peak_stat(stats.oversize_segments);
+  }
+
+  /** Dump a complete snapshot of the memory held by the allocator. Potentially
+   * VERY expensive. **/
+  std::vector<SegmentInfo> snapshot() {
+    ExclusiveLock lock(*this);
+    // cached blocks and deferred frees would show up as allocated
+    free_deferred_blocks();
+    collect_magazines(/*flush=*/true);
+
+    size_t total_active = 0;
+    std::vector<SegmentInfo> result;
+    const auto all_blocks = get_all_blocks();
+    for (const Block* const head_block : all_blocks) {
+      if (head_block->prev != nullptr) {
+        continue;
+      }
+      result.emplace_back();
+      SegmentInfo& segment_info = result.back();
+      segment_info.device = head_block->device;
+      segment_info.address = reinterpret_cast<int64_t>(head_block->ptr);
+      segment_info.stream = head_block->stream;
+      segment_info.is_large = (!head_block->pool->is_small);
+
+      const Block* block = head_block;
+      while (block != nullptr) {
+        segment_info.blocks.emplace_back();
+        BlockInfo& block_info = segment_info.blocks.back();
+
+        block_info.size = block->size;
+        block_info.requested_size = block->requested_size;
+        block_info.allocated = block->allocated;
+        block_info.active = block->allocated || (block->event_count > 0) ||
+            block->has_stream_uses();
+
+        segment_info.total_size += block_info.size;
+        if (block_info.allocated) {
+          segment_info.allocated_size += block_info.size;
+        }
+        if (block_info.active) {
+          segment_info.active_size += block_info.size;
+          segment_info.requested_size += block_info.requested_size;
+        }
+        HistoryChain* h = block->history();
+        while (h) {
+          block_info.history.push_back(History{
+              h->addr, h->real_size, history_arena->contexts.get(h->context_id)});
+          h = h->next;
+        }
+        block = block->next;
+      }
+      total_active += segment_info.active_size;
+    }
+
+    std::sort(
+        result.begin(),
+        result.end(),
+        [](const SegmentInfo& a, const SegmentInfo& b) {
+          return a.address < b.address;
+        });
+
+    if (record_history) {
+      record_trace(TraceEntry::SNAPSHOT, 0, total_active, 0, 0);
+    }
+    return result;
+  }
+
+  std::vector<TraceEntry> trace() {
+    ExclusiveLock lock(*this);
+    // queued frees have happened as far as the caller is concerned
+    free_deferred_blocks();
+    std::vector<TraceEntry> result;
+    result.reserve(alloc_trace_size);
+    for_each_trace_record([&](const TraceRecord& record) {
+      result.emplace_back(
+          record.action,
+          record.addr,
+          record.size,
+          record.stream,
+          history_arena->contexts.get(record.context_id));
+    });
+    return result;
+  }
+
+  /** Returns the trace ring with timestamps merged with the timed spans **/
+  std::vector<TimelineEvent> timeline() {
+    ExclusiveLock lock(*this);
+    std::vector<TimelineEvent> result;
+    result.reserve(alloc_trace_size + timeline_spans.size());
+    for_each_trace_record([&](const TraceRecord& record) {
+      result.push_back(TimelineEvent{
+          TimelineEvent::TRACE, record.action, MallocPath::FAILED,
+          record.time_ns, 0, record.addr, record.size, record.stream});
+    });
+    result.insert(result.end(), timeline_spans.begin(), timeline_spans.end());
+    std::stable_sort(
+        result.begin(),
+        result.end(),
+        [](const TimelineEvent& a, const TimelineEvent& b) {
+          return a.start_ns < b.start_ns;
+        });
+    return result;
+  }
+
+  void print_snapshot()
+  {
+    auto memory_snapshot = snapshot();
+      
+    for(auto& segment_info : memory_snapshot) {
+      if(segment_info.is_large) {
+        GCPOOL_INFO(" segment: %p, size: %luMB", (void*)segment_info.address, segment_info.total_size/(1024*1024));
+                    
+        for(auto& block_info : segment_info.blocks) {
+          GCPOOL_INFO(" %s %s block, size: %luMB", 
+                     (block_info.allocated? "allocated" : "unallocated"), 
+                     (block_info.active? "active" : "inactive"),
+                     block_info.size/(1024*1024) );
+        }
+      }
+    }
+  }
+
+  // This function takes the size and number of divisions argument and rounds
+  // up the size argument for the nearest power-of-2 division.
+  // For example, if we need to round-up 1200 and number of divisions is 4,
+  // the size 1200 lies between 1024 and 2048 and if we do 4 divisions between
+  // them, the values are 1024, 1280, 1536, and 1792. So the function will
+  // return 1280 as the nearest ceiling of power-2 divison.
+  static size_t roundup_power2_next_division(size_t size, size_t divisions) {
+    if (GCPOOL_UNLIKELY(size <= 4 || divisions <= 1)) {
+      return size;
+    }
+    if (gcpool::isPowerOf2_64(size)) {
+      return size;
+    }
+
+    // divide the space between these 2's power into equal divisions
+    // If division is zero, return the power-of-2 ceiling.
+    size_t power2_floor = gcpool::PowerOf2Floor(size);
+    size_t power2_divison =
+        power2_floor >> (63 - gcpool::countLeadingZeros(divisions));
+    if (GCPOOL_UNLIKELY(power2_divison == 0)) {
+      return (power2_floor << 1);
+    }
+    size_t round_size_floor = size & (~(power2_divison - 1));
+    return (round_size_floor == size) ? size
+                                      : round_size_floor + power2_divison;
+  }
+
+  static size_t round_size(size_t size) {
+    if (size < kMinBlockSize) {
+      return kMinBlockSize;
+    } else {
+      auto divisions = CachingAllocatorConfig::roundup_power2_divisions(size);
+      if (divisions > 0 && size > (kMinBlockSize * divisions)) {
+        return roundup_power2_next_division(size, divisions);
+      } else {
+        // return kMinBlockSize * ((size + kMinBlockSize - 1) / kMinBlockSize);
+        size_t block_round_size = kMinBlockSize * ((size + kMinBlockSize - 1) / kMinBlockSize);
+        if(block_round_size > kSmallSize) //if block will alloc from large_blocks, round to 2M
+        {
+            block_round_size = kGranularity * ((size + kGranularity - 1) / kGranularity);
+        }
+        return block_round_size;
+      }
+    }
+  }
+
+  // See Note [Interaction with CUDA graph capture]
+
+  // Called by CUDAGraph::capture_begin
+  void notifyCaptureBegin(CaptureId_t graph_id, MempoolId_t mempool_id) {
+    ExclusiveLock lock(*this);
+    captures_underway++;
+    update_magazines_enabled();
+    auto it = graph_pools.find(mempool_id);
+    if (it == graph_pools.end()) {
+      // mempool_id does not reference an existing pool. Make a new pool for
+      // this capture.
+      graph_pools.emplace(mempool_id, std::make_unique<PrivatePool>());
+    } else {
+      // mempool_id references an existing pool, which the current capture will
+      // share. Check this pool is live (at least one other capture already
+      // references it).
+      GCPOOL_ASSERT(it->second->use_count > 0);
+      it->second->use_count++;
+    }
+    // Maps this graph_id to mempool_id and makes sure this graph_id wasn't
+    // somehow assigned a mempool_id already. Keeps essential effect (insert)
+    // out of macro.
+    bool inserted = capture_to_pool_map.insert({graph_id, mempool_id}).second;
+    GCPOOL_ASSERT(inserted);
+  }
+
+  // Called by CUDAGraph::capture_end
+  void notifyCaptureAboutToEnd(CaptureId_t graph_id) {
+    ExclusiveLock lock(*this);
+    captures_underway--;
+    update_magazines_enabled();
+    auto it = capture_to_pool_map.find(graph_id);
+    GCPOOL_ASSERT(it != capture_to_pool_map.end());
+    capture_to_pool_map.erase(it);
+  }
+
+  // Called by CUDAGraph::reset
+  void notifyCaptureDestroy(MempoolId_t mempool_id) {
+    ExclusiveLock lock(*this);
+    // The instantiated cudaGraphExec_t has been destroyed. We can't blindly
+    // delete and cudaFree the mempool its capture used, because
+    //  1. other graph(s) might share the same pool
+    //  2. the user might still hold references to output tensors allocated
+    //  during capture.
+    // To handle 1 and 2, we track the number of graphs using this particular
+    // mempool. When the count reaches 0, we tell free_cached_blocks it may now
+    // cudaFree blocks from this graph's pool when it discovers they're unused
+    // (unsplit).
+    auto it = graph_pools.find(mempool_id);
+    GCPOOL_ASSERT(it != graph_pools.end());
+    auto uc = --(it->second->use_count);
+    GCPOOL_ASSERT(uc >= 0);
+    if (uc == 0) {
+      // Allows free_cached_blocks to begin cudaFreeing this pool's memory,
+      // and makes sure this pool wasn't somehow made freeable already.
+      bool inserted =
+          graph_pools_freeable.insert({mempool_id, it->second.get()}).second;
+      GCPOOL_ASSERT(inserted);
+    }
+  }
+
+ private:
+  // All private methods do not acquire the allocator mutex.
+
+  std::vector<const Block*> get_all_blocks() const {
+    std::vector<const Block*> blocks;
+    auto add_pool = [&](const BlockPool& pool) {
+      for (const auto& stream_blocks : pool.streams) {
+        blocks.insert(blocks.end(), stream_blocks.begin(), stream_blocks.end());
+      }
+    };
+    add_pool(small_blocks);
+    add_pool(large_blocks);
+    for (const auto& gp : graph_pools) {
+      add_pool(gp.second->small_blocks);
+      add_pool(gp.second->large_blocks);
+    }
+    blocks.insert(blocks.end(), active_blocks.begin(), active_blocks.end());
+    return blocks;
+  }
+
+  /** moves a block into a pool of cached free blocks */
+  void free_block(Block* block, bool flag) {
+    GCPOOL_ASSERT(
+        !block->allocated && block->event_count == 0 &&
+        !block->has_stream_uses());
+    if (HistoryChain* h = block->history()) {
+      record_trace(
+          TraceEntry::FREE_COMPLETED,
+          int64_t(block->ptr),
+          h->real_size,
+          block->stream,
+          h->context_id);
+    }
+    static const int vmmDefragment = ([]()->int{
+        const char* env = getenv("vmmDefragment");
+        if(env) return atoi(env);
+        else return 1;
+    })();
+
+    size_t original_block_size = block->size;
+    size_t requested_size = block->requested_size;
+
+    auto& pool = *block->pool;
+    int64_t net_change_inactive_split_blocks = 0;
+    int64_t net_change_inactive_split_size = 0;
+
+    const std::array<Block*, 2> merge_candidates = {block->prev, block->next};
+    for (Block* merge_candidate : merge_candidates) {
+      const int64_t subsumed_size =
+          try_merge_blocks(block, merge_candidate, pool);
+      if (subsumed_size > 0) {
+        net_change_inactive_split_blocks -= 1;
+        net_change_inactive_split_size -= subsumed_size;
+      }
+    }
+
+    active_blocks.erase(block);
+    // Makes sure the Block* isn't already present in the pool we're freeing it
+    // back into.
+    bool inserted = pool.insert(block).second;
+    GCPOOL_ASSERT(inserted);
+
+    if(vmmDefragment > 0 && block->vmm_segment/*!pool.is_small*/) {
+      mark_all_granules(*block->vmm_segment, true);
+      block->vmm_segment->used_blocks = 0;
+
+    }
+
+    if (block->is_split()) {
+      net_change_inactive_split_blocks += 1;
+      net_change_inactive_split_size += block->size;
+    }
+
+    StatTypes stat_types = {false};
+    stat_types[static_cast<size_t>(StatType::AGGREGATE)] = true;
+    stat_types[static_cast<size_t>(get_stat_type_for_pool(pool))] = true;
+    for_each_selected_stat_type(stat_types, [&](size_t stat_type) {
+      update_stat(
+          stats.inactive_split[stat_type], net_change_inactive_split_blocks);
+      update_stat(
+          stats.inactive_split_bytes[stat_type],
+          net_change_inactive_split_size);
+      update_stat(stats.active[stat_type], -1);
+      update_stat(
+          stats.active_bytes[stat_type],
+          -static_cast<std::int64_t>(original_block_size));
+      if (!flag) {
+      update_stat(
+          stats.requested_bytes[stat_type],
+          -static_cast<std::int64_t>(requested_size));
+      }
+    });
+  }
+
+  /** combine previously split blocks. returns the size of the subsumed block,
+   * or 0 on failure. */
+  size_t try_merge_blocks(Block* dst, Block* src, BlockPool& pool) {
+    if (!src || src->allocated || src->event_count > 0 ||
+        src->has_stream_uses()) {
+      return 0;
+    }
+
+    GCPOOL_ASSERT(dst->is_split() && src->is_split());
+
+    if (dst->prev == src) { // [src dst]
+      dst->ptr = src->ptr;
+      dst->prev = src->prev;
+      if (dst->prev) {
+        dst->prev->next = dst;
+      }
+      if (src->history()) {
+        BlockCold& d = dst->cold_ext();
+        BlockCold& s = *src->cold;
+        if (!d.history) {
+          d.history = s.history;
+          d.history_last = s.history_last;
+        } else {
+          s.history_last->next = d.history;
+          d.history = s.history;
+        }
+        s.history = nullptr;
+        s.history_last = nullptr;
+      }
+    } else { // [dest src]
+      dst->next = src->next;
+      if (dst->next) {
+        dst->next->prev = dst;
+      }
+
+      if (src->history()) {
+        BlockCold& d = dst->cold_ext();
+        BlockCold& s = *src->cold;
+        if (!d.history) {
+          d.history = s.history;
+          d.history_last = s.history_last;
+        } else {
+          d.history_last->next = s.history;
+          d.history_last = s.history_last;
+        }
+        s.history = nullptr;
+        s.history_last = nullptr;
+      }
+    }
+
+    BlockEventPtr current_self_last_event = src->self_last_event;
+    if(!current_self_last_event || (dst->self_last_event && dst->self_last_event->event_id > current_self_last_event->event_id)) {
+      current_self_last_event = dst->self_last_event;
+    }
+
+    const size_t subsumed_size = src->size;
+    dst->size += subsumed_size;
+    dst->self_last_event = current_self_last_event;
+    auto erased = pool.erase(src);
+    GCPOOL_ASSERT_DEBUG_ONLY(erased == 1);
+    static const int vmmDefragment = ([]()->int{
+        const char* env = getenv("vmmDefragment");
+        if(env) return atoi(env);
+        else return 1;
+    })();
+
+
+    if(vmmDefragment > 0 && dst->vmm_segment) {
+      bool ret = merge_granules(*dst->vmm_segment, *src->vmm_segment);
+      if(!ret) {
+        GCPOOL_INFO(" merge block %p, ptr %p of size %fMB into block %p, ptr %p of size %fMB failed", 
+                    src, src->ptr, src->size/(1024.f*1024.f), dst, dst->ptr, dst->size/(1024.f*1024.f));
+      }
+      
+      // the granules of src moved into dst, point them at dst
+      size_t offset = 0;
+      for(auto& phy_block : dst->vmm_segment->phy_blocks) {
+          phy_block->mapped_blocks[0].block = dst;
+          phy_block->mapped_blocks[0].offset = offset;
+          offset++;
+      }
+    }
+
+    destroy_block(src);
+
+    return subsumed_size;
+  }
+
+  BlockPool& get_pool(size_t size, cudaStream_t stream) {
+#if !defined(USE_ROCM) || ROCM_VERSION >= 50300
+    // captures_underway is a conservative guess that the current stream may be
+    // capturing. It's only > 0 if some thread has begun and not yet ended a
+    // capture, so it's usually 0, and we can short-circuit
+    // cudaStreamCaptureStatus (which does a TLS lookup).
+    if (GCPOOL_UNLIKELY(captures_underway)) {
+      CaptureId_t id;
+      cudaStreamCaptureStatus status;
+      GCPOOL_CUDA_CHECK(cudaStreamGetCaptureInfo(stream, &status, &id));
+      if (status != cudaStreamCaptureStatus::cudaStreamCaptureStatusNone) {
+        GCPOOL_ASSERT(
+            status !=
+            cudaStreamCaptureStatus::cudaStreamCaptureStatusInvalidated);
+        // Retrieves the private pool assigned to this capture.
+        auto it0 = capture_to_pool_map.find(id);
+        GCPOOL_ASSERT(it0 != capture_to_pool_map.end());
+        auto it1 = graph_pools.find(it0->second);
+        GCPOOL_ASSERT(it1 != graph_pools.end());
+        if (size <= kSmallSize) {
+          return it1->second->small_blocks;
+        } else {
+          return it1->second->large_blocks;
+        }
+      }
+    }
+#endif
+    if (size <= kSmallSize) {
+      return small_blocks;
+    } else {
+      return large_blocks;
+    }
+  }
+
+  StatType get_stat_type_for_pool(const BlockPool& pool) {
+    return pool.is_small ? StatType::SMALL_POOL : StatType::LARGE_POOL;
+  }
+
+  bool should_split(const Block* block, size_t size) {
+    size_t remaining = block->size - size;
+    if (block->pool->is_small) {
+      return remaining >= kMinBlockSize;
+    } else {
+      return (size < CachingAllocatorConfig::max_split_size()) &&
+             (remaining >= kGranularity);
+    }
+  }
+
+  // Same-stream fast paths. Without captures, outstanding cross-stream
+  // events or garbage collection, a malloc served by a cached block that
+  // needs no split, and a free that can merge with nothing, only touch the
+  // free blocks of their own stream; they run under that stream's shard
+  // instead of ExclusiveLock. Anything else is left to the locked path. With
+  // history on they record into the history arena and the trace under
+  // stats_mutex, which serializes them with each other, while ExclusiveLock
+  // keeps them out of the locked paths that record or read the same state.
+  bool same_stream_fast_paths_enabled() const {
+    return captures_underway == 0 && cuda_events.empty() &&
+        needs_events_deferred_until_no_capture.empty() &&
+        !(set_fraction &&
+          CachingAllocatorConfig::garbage_collection_threshold() > 0.0);
+  }
+
+  // The stat updates of the allocator go through these instead of the free
+  // functions, so that publish_locked_stats sees what changed. Fields set
+  // directly (the counters of DeviceStats and GCPoolStats, total_fuse_size)
+  // set stats_changed themselves.
+  void update_stat(Stat& stat, int64_t amount) {
+    stats_changed = true;
+    Native::update_stat(stat, amount);
+  }
+
+  void update_stat_array(
+      StatArray& stat_array,
+      int64_t amount,
+      const StatTypes& stat_types) {
+    stats_changed = true;
+    Native::update_stat_array(stat_array, amount, stat_types);
+  }
+
+  void merge_stat(Stat& stat, const StatDelta& delta) {
+    stats_changed = true;
+    Native::merge_stat(stat, delta);
+  }
+
+  // with ExclusiveLock held, or a shared shard_gate and stats_mutex
+  void publish_stats() const {
+    PublishedStats published;
+    published.stats = stats;
+    published.gcpool = gcpool_stats;
+    published.gcpool.total_fuse_size = static_cast<int64_t>(total_fuse_size);
+    published.largest_cached_block = largest_cached_block;
+    published_stats.store(published);
+  }
+
+  // by the outermost ExclusiveLock, before it lets the fast paths back in;
+  // an operation that changed no stat (a trace or snapshot read, a capture
+  // notification, recordStream) leaves the published copy as it is
+  void publish_locked_stats() const {
+    if (!stats_changed) {
+      return;
+    }
+    stats_changed = false;
+    largest_cached_block = 0;
+    cache_info_aux(large_blocks, &largest_cached_block);
+    cache_info_aux(small_blocks, &largest_cached_block);
+    for (const auto& gp : graph_pools) {
+      cache_info_aux(gp.second->large_blocks, &largest_cached_block);
+      cache_info_aux(gp.second->small_blocks, &largest_cached_block);
+    }
+    publish_stats();
+  }
+
+  std::mutex& stream_shard(uint32_t stream_id) {
+    return stream_shards[stream_id % kStreamShards].mutex;
+  }
+
+  // nullptr if the request needs the locked path
+  Block* try_malloc_same_stream(
+      int device,
+      size_t orig_size,
+      cudaStream_t stream,
+      const std::shared_ptr<Context>& context) {
+    const auto malloc_start = std::chrono::steady_clock::now();
+    const size_t size = round_size(orig_size);
+    BlockPool& pool = (size <= kSmallSize) ? small_blocks : large_blocks;
+    Block search_key(stream, get_stream_id(stream), size);
+
+    std::shared_lock<std::shared_mutex> gate(shard_gate);
+    // pool.streams only grows under ExclusiveLock
+    if (!same_stream_fast_paths_enabled() ||
+        search_key.stream_id >= pool.streams.size()) {
+      return nullptr;
+    }
+
+    Block* block = nullptr;
+    {
+      std::lock_guard<std::mutex> shard(stream_shard(search_key.stream_id));
+      BlockSet& stream_blocks = pool.streams[search_key.stream_id];
+      auto it = stream_blocks.lower_bound(&search_key);
+      if (it == stream_blocks.end()) {
+        return nullptr;
+      }
+      // the checks of get_free_block, plus no split and no VMM remapping
+      const size_t max_split_size = CachingAllocatorConfig::max_split_size();
+      if ((*it)->vmm_segment || should_split(*it, size) ||
+          (size < max_split_size && (*it)->size >= max_split_size) ||
+          (size >= max_split_size && (*it)->size >= size + kLargeBuffer)) {
+        return nullptr;
+      }
+      block = *it;
+      block->gc_count = 0;
+      stream_blocks.erase(it);
+      // try_free_same_stream reads the flag of a neighbour under this shard
+      block->allocated = true;
+      block->requested_size = orig_size;
+      block->actual_size = size;
+    }
+
+    // the block is ours now; only the device-wide state needs a lock
+    const bool already_split = block->is_split();
+
+    int64_t allocated_bytes = 0;
+    int64_t reserved_bytes = 0;
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      const bool inserted = active_blocks.insert(block).second;
+      GCPOOL_ASSERT_DEBUG_ONLY(inserted);
+
+      StatTypes stat_types = {false};
+      stat_types[static_cast<size_t>(StatType::AGGREGATE)] = true;
+      stat_types[static_cast<size_t>(get_stat_type_for_pool(pool))] = true;
+      for_each_selected_stat_type(stat_types, [&](size_t stat_type) {
+        if (already_split) {
+          update_stat(
+              stats.inactive_split_bytes[stat_type],
+              -static_cast<std::int64_t>(block->size));
+          update_stat(stats.inactive_split[stat_type], -1);
+        }
+        update_stat(stats.allocation[stat_type], 1);
+        update_stat(
+            stats.allocated_bytes[stat_type],
+            static_cast<std::int64_t>(block->actual_size));
+        update_stat(
+            stats.requested_bytes[stat_type],
+            static_cast<std::int64_t>(block->requested_size));
+        if (inserted) {
+          update_stat(stats.active[stat_type], 1);
+          update_stat(stats.active_bytes[stat_type], block->size);
+        }
+      });
+      if (block->size >= CachingAllocatorConfig::max_split_size())
+        update_stat(stats.oversize_allocations, 1);
+
+      const auto elapsed = std::chrono::steady_clock::now() - malloc_start;
+      const size_t index = static_cast<size_t>(MallocPath::CACHED_BLOCK);
+      malloc_path_stats.hits[index] += 1;
+      malloc_path_stats.latency[index].record(static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count()));
+      if (record_history) {
+        record_alloc_history(block, orig_size, context);
+        record_span(
+            TimelineEvent::MALLOC,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                malloc_start.time_since_epoch())
+                .count(),
+            int64_t(block->ptr),
+            size,
+            stream,
+            MallocPath::CACHED_BLOCK);
+      }
+
+      allocated_bytes =
+          stats.allocated_bytes[static_cast<size_t>(StatType::AGGREGATE)]
+              .current;
+      reserved_bytes =
+          stats.reserved_bytes[static_cast<size_t>(StatType::AGGREGATE)]
+              .current;
+      publish_stats();
+    }
+    gate.unlock();
+
+    report_memory_usage(
+        block->ptr,
+        block->size,
+        allocated_bytes,
+        reserved_bytes,
+        device);
+    return block;
+  }
+
+  // false if the free needs the locked path
+  bool try_free_same_stream(Block* block) {
+    BlockPool& pool = *block->pool;
+    if ((&pool != &small_blocks && &pool != &large_blocks) ||
+        block->vmm_segment || block->has_stream_uses()) {
+      return false;
+    }
+
+    std::shared_lock<std::shared_mutex> gate(shard_gate);
+    if (!same_stream_fast_paths_enabled() ||
+        block->stream_id >= pool.streams.size()) {
+      return false;
+    }
+
+    void* ptr = block->ptr;
+    const size_t size = block->size;
+    int64_t allocated_bytes = 0;
+    int64_t reserved_bytes = 0;
+    {
+      std::lock_guard<std::mutex> shard(stream_shard(block->stream_id));
+      // free_block would merge a free neighbour; split blocks of one segment
+      // share its stream, so their flags are guarded by this shard too
+      for (Block* neighbour : {block->prev, block->next}) {
+        if (neighbour &&
+            (!neighbour->allocated ||
+             neighbour->stream_id != block->stream_id)) {
+          return false;
+        }
+      }
+      // insert_free_event_into_alloc_stream then records the event in place
+      // instead of creating one from the slab
+      const BlockEventPtr& event = block->self_last_event;
+      if (!event || !event.unique() || event->stream != block->stream ||
+          event->ref_as_sync) {
+        return false;
+      }
+
+      block->allocated = false;
+      insert_free_event_into_alloc_stream(block);
+
+      {
+        // before the block is visible in the pool, where a malloc on this
+        // stream may take it again
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        active_blocks.erase(block);
+        if (HistoryChain* h = block->history()) {
+          // the free completes at once: the block's last use is on its stream
+          record_trace(
+              TraceEntry::FREE_REQUESTED,
+              int64_t(ptr),
+              h->real_size,
+              block->stream,
+              h->context_id);
+          record_trace(
+              TraceEntry::FREE_COMPLETED,
+              int64_t(ptr),
+              h->real_size,
+              block->stream,
+              h->context_id);
+        }
+
+        StatTypes stat_types = {false};
+        stat_types[static_cast<size_t>(StatType::AGGREGATE)] = true;
+        stat_types[static_cast<size_t>(get_stat_type_for_pool(pool))] = true;
+        for_each_selected_stat_type(stat_types, [&](size_t stat_type) {
+          update_stat(stats.allocation[stat_type], -1);
+          update_stat(
+              stats.allocated_bytes[stat_type],
+              -static_cast<std::int64_t>(block->actual_size));
+          if (block->is_split()) {
+            update_stat(stats.inactive_split[stat_type], 1);
+            update_stat(
+                stats.inactive_split_bytes[stat_type],
+                static_cast<std::int64_t>(size));
+          }
+          update_stat(stats.active[stat_type], -1);
+          update_stat(
+              stats.active_bytes[stat_type],
+              -static_cast<std::int64_t>(size));
+          update_stat(
+              stats.requested_bytes[stat_type],
+              -static_cast<std::int64_t>(block->requested_size));
+        });
+        if (size >= CachingAllocatorConfig::max_split_size())
+          update_stat(stats.oversize_allocations, -1);
+
+        allocated_bytes =
+            stats.allocated_bytes[static_cast<size_t>(StatType::AGGREGATE)]
+                .current;
+        reserved_bytes =
+            stats.reserved_bytes[static_cast<size_t>(StatType::AGGREGATE)]
+                .current;
+        largest_cached_block = std::max(largest_cached_block, size);
+        publish_stats();
+      }
+
+      bool inserted = pool.insert(block).second;
+      GCPOOL_ASSERT(inserted);
+    }
+    gate.unlock();
+
+    report_memory_usage(
+        ptr,
+        -size,
+        allocated_bytes,
+        reserved_bytes,
+        block->device);
+    return true;
+  }
+
+  // Deferred frees (deferredFree=1): free() only pushes the block onto
+  // deferred_frees and returns, leaving the stats, the free event and
+  // update_block to a later malloc, which drains the whole queue under one
+  // lock. A malloc whose lookups miss drains it after taking the lock it
+  // needs anyway; one served without the lock only drains it once
+  // deferredFreeBatch blocks are queued and the lock is free, so the queue
+  // never adds a lock to the fast paths. deferredFree=2 also drains it from
+  // a thread per device every millisecond. Until then the block stays
+  // allocated for the allocator, so nothing can merge with it; snapshots,
+  // traces and cache flushes drain the queue first.
+  static int deferred_free_mode() {
+    static const int deferredFree = ([]()->int{
+        const char* env = getenv("deferredFree");
+        if(env) return atoi(env);
+        else return 0;
+    })();
+    return deferredFree;
+  }
+
+  static size_t deferred_free_batch() {
+    static const size_t deferredFreeBatch = ([]()->size_t{
+        const char* env = getenv("deferredFreeBatch");
+        if(env) return std::max<size_t>(std::strtoull(env, nullptr, 10), 1);
+        else return 64;
+    })();
+    return deferredFreeBatch;
+  }
+
+  // called with the allocator locked
+  void free_deferred_blocks() {
+    Block* block = deferred_frees.popAll();
+    while (block) {
+      Block* next = block->deferred_next;
+      block->deferred_next = nullptr;
+      free_locked(block);
+      block = next;
+    }
+  }
+
+  // Every millisecond, drains the deferred frees and merges the magazine
+  // stats, so that the published stats settle once the device goes idle
+  // without the stats readers ever taking the allocator lock.
+  void drain_loop() {
+    std::unique_lock<std::mutex> lock(drain_mutex);
+    while (!drain_cv.wait_for(
+        lock, std::chrono::milliseconds(1), [this]() { return drain_stop; })) {
+      if (!deferred_frees.empty() ||
+          magazine_stats_pending.load(std::memory_order_relaxed)) {
+        lock.unlock();
+        {
+          ExclusiveLock allocator_lock(*this);
+          free_deferred_blocks();
+          collect_magazines(/*flush=*/false);
+        }
+        lock.lock();
+      }
+    }
+  }
+
+  // Thread magazines (threadMagazines=1). A small block freed by a thread
+  // goes into that thread's magazine for its stream and size instead of the
+  // pool, and the thread's next malloc of that size on that stream takes it
+  // back, neither touching the allocator lock. An empty magazine is refilled
+  // from the pool and a full one flushed to it kBatch blocks at a time. The
+  // cached blocks stay allocated and active as far as the pools and merges
+  // are concerned; the allocation, allocated and requested stats moved by
+  // hits and frees collect in the MagazineSet until the next refill, flush
+  // or stats reset, or the next pass of drain_loop, which runs with the
+  // magazines on. A hit
+  // takes no lock at all, so it could not record into the history or the
+  // trace; with history on the magazines are off and small blocks take the
+  // same-stream fast paths instead.
+
+  // Largest block size kept in magazines: magazineMaxSize bytes, 64 KiB by
+  // default and at most kSmallSize. A thread holds up to kCapacity blocks in
+  // each of kSlots magazines, so with 1 MB blocks up to 512 MiB per thread
+  // would sit where no other thread can reuse it, and a small segment only
+  // holds two blocks of that size, so batches of kBatch rarely fill anyway.
+  static size_t magazine_max_size() {
+    static const size_t magazineMaxSize = ([]()->size_t{
+        const char* env = getenv("magazineMaxSize");
+        if(env) return std::min<size_t>(std::strtoull(env, nullptr, 10), kSmallSize);
+        else return 65536;
+    })();
+    return magazineMaxSize;
+  }
+
+  static bool use_magazines() {
+    static const int threadMagazines = ([]()->int{
+        const char* env = getenv("threadMagazines");
+        if(env) return atoi(env);
+        else return 0;
+    })();
+    return threadMagazines > 0;
+  }
+
+  // the MagazineSet of the calling thread, created on first use
+  MagazineSet* thread_magazines() {
+    struct Entry {
+      DeviceCachingAllocator* allocator;
+      MagazineSet* set;
+      // also tells a later allocator at the same address from this one
+      std::shared_ptr<MagazineOwner> owner;
+    };
+    struct ThreadMagazines {
+      std::vector<Entry> sets;
+
+      ~ThreadMagazines() {
+        for (auto& entry : sets) {
+          std::lock_guard<std::mutex> guard(entry.owner->mutex);
+          if (entry.owner->alive) {
+            entry.allocator->release_magazines(entry.set);
+          }
+        }
+      }
+    };
+    static thread_local ThreadMagazines local;
+    for (auto& entry : local.sets) {
+      if (entry.owner == magazine_owner) {
+        return entry.set;
+      }
+    }
+    MagazineSet* set = nullptr;
+    {
+      std::lock_guard<std::mutex> guard(magazine_sets_mutex);
+      magazine_sets.emplace_back(std::make_unique<MagazineSet>());
+      set = magazine_sets.back().get();
+    }
+    local.sets.push_back(Entry{this, set, magazine_owner});
+    return set;
+  }
+
+  // nullptr if the request needs the pools
+  Block* try_malloc_magazine(size_t orig_size, cudaStream_t stream) {
+    const size_t size = round_size(orig_size);
+    if (size > magazine_max_size() || !use_magazines() ||
+        memory_profiling_enabled()) {
+      return nullptr;
+    }
+    const uint32_t stream_id = get_stream_id(stream);
+    MagazineSet* set = thread_magazines();
+    if (!set->enter(magazines_enabled)) {
+      return nullptr;
+    }
+    MagazineSet::Magazine& magazine = set->slot(stream_id, size);
+    if (!magazine.holds(stream_id, size) || magazine.count == 0) {
+      set->leave();
+      if (!refill_magazine(*set, stream, stream_id, size) ||
+          !set->enter(magazines_enabled)) {
+        return nullptr;
+      }
+      if (!magazine.holds(stream_id, size) || magazine.count == 0) {
+        set->leave();
+        return nullptr;
+      }
+    }
+
+    Block* block = magazine.blocks[--magazine.count];
+    block->gc_count = 0;
+    block->requested_size = orig_size;
+    block->actual_size = size;
+    set->allocation.update(1);
+    set->allocated_bytes.update(static_cast<int64_t>(size));
+    set->requested_bytes.update(static_cast<int64_t>(orig_size));
+    set->hits += 1;
+    mark_magazine_stats_pending();
+    set->leave();
+    return block;
+  }
+
+  // false if the free needs the pools
+  bool try_free_magazine(Block* block) {
+    if (block->pool != &small_blocks || block->size > magazine_max_size() ||
+        !use_magazines() || memory_profiling_enabled() ||
+        block->vmm_segment || block->has_stream_uses() || block->history()) {
+      return false;
+    }
+    MagazineSet* set = thread_magazines();
+    if (!set->enter(magazines_enabled)) {
+      return false;
+    }
+    MagazineSet::Magazine& magazine = set->slot(block->stream_id, block->size);
+    if (magazine.count == 0) {
+      magazine.size = block->size;
+      magazine.stream_id = block->stream_id;
+    } else if (
+        !magazine.holds(block->stream_id, block->size) ||
+        magazine.count == MagazineSet::kCapacity) {
+      set->leave();
+      ExclusiveLock lock(*this);
+      if (!magazines_enabled.load()) {
+        return false;
+      }
+      flush_magazine(
+          magazine,
+          magazine.holds(block->stream_id, block->size) ? MagazineSet::kBatch
+                                                        : magazine.count);
+      magazine.size = block->size;
+      magazine.stream_id = block->stream_id;
+      push_to_magazine(*set, magazine, block);
+      merge_magazine_stats(*set);
+      return true;
+    }
+    push_to_magazine(*set, magazine, block);
+    set->leave();
+    return true;
+  }
+
+  void push_to_magazine(
+      MagazineSet& set,
+      MagazineSet::Magazine& magazine,
+      Block* block) {
+    magazine.blocks[magazine.count++] = block;
+    set.allocation.update(-1);
+    set.allocated_bytes.update(-static_cast<int64_t>(block->actual_size));
+    set.requested_bytes.update(-static_cast<int64_t>(block->requested_size));
+    mark_magazine_stats_pending();
+  }
+
+  // inside the owner's enter/leave window, after the deltas moved
+  void mark_magazine_stats_pending() {
+    // read first so that the flag's line is only written once per collection
+    if (!magazine_stats_pending.load(std::memory_order_relaxed)) {
+      magazine_stats_pending.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  // Whether the small pool of the stream has a free block of exactly size.
+  // Looked up under the stream's shard, so that a miss with nothing to
+  // refill from leaves ExclusiveLock, and the same-stream fast paths, alone.
+  bool has_small_block_of_size(
+      cudaStream_t stream,
+      uint32_t stream_id,
+      size_t size) {
+    std::shared_lock<std::shared_mutex> gate(shard_gate);
+    // small_blocks.streams only grows under ExclusiveLock
+    if (stream_id >= small_blocks.streams.size()) {
+      return false;
+    }
+    std::lock_guard<std::mutex> shard(stream_shard(stream_id));
+    const BlockSet& stream_blocks = small_blocks.streams[stream_id];
+    Block search_key(stream, stream_id, size);
+    auto it = stream_blocks.lower_bound(&search_key);
+    return it != stream_blocks.end() && (*it)->size == size;
+  }
+
+  // Moves up to kBatch free blocks of exactly size from the small pool of the
+  // stream into the magazine; false if it is still empty. A magazine holding
+  // another class is only flushed once there is something to replace it with.
+  bool refill_magazine(
+      MagazineSet& set,
+      cudaStream_t stream,
+      uint32_t stream_id,
+      size_t size) {
+    if (!has_small_block_of_size(stream, stream_id, size)) {
+      return false;
+    }
+    ExclusiveLock lock(*this);
+    merge_magazine_stats(set);
+    if (!magazines_enabled.load()) {
+      return false;
+    }
+    MagazineSet::Magazine& magazine = set.slot(stream_id, size);
+    if (magazine.holds(stream_id, size) && magazine.count > 0) {
+      return true;
+    }
+    if (stream_id >= small_blocks.streams.size()) {
+      return false;
+    }
+
+    StatTypes stat_types = {false};
+    stat_types[static_cast<size_t>(StatType::AGGREGATE)] = true;
+    stat_types[static_cast<size_t>(StatType::SMALL_POOL)] = true;
+    BlockSet& stream_blocks = small_blocks.streams[stream_id];
+    Block search_key(stream, stream_id, size);
+    auto it = stream_blocks.lower_bound(&search_key);
+    // taken out of the pool, and marked allocated, before the flush below
+    // can merge its blocks with them
+    Block* batch[MagazineSet::kBatch];
+    size_t batch_count = 0;
+    while (batch_count < MagazineSet::kBatch && it != stream_blocks.end() &&
+           (*it)->size == size) {
+      Block* block = *it;
+      it = stream_blocks.erase(it);
+      block->allocated = true;
+      active_blocks.insert(block);
+      for_each_selected_stat_type(stat_types, [&](size_t stat_type) {
+        if (block->is_split()) {
+          update_stat(stats.inactive_split[stat_type], -1);
+          update_stat(
+              stats.inactive_split_bytes[stat_type],
+              -static_cast<std::int64_t>(block->size));
+        }
+        update_stat(stats.active[stat_type], 1);
+        update_stat(stats.active_bytes[stat_type], block->size);
+      });
+      batch[batch_count++] = block;
+    }
+    if (batch_count == 0) {
+      // taken by another thread since the check
+      return false;
+    }
+
+    flush_magazine(magazine, magazine.count);
+    magazine.size = size;
+    magazine.stream_id = stream_id;
+    std::copy(batch, batch + batch_count, magazine.blocks);
+    magazine.count = static_cast<uint32_t>(batch_count);
+    return true;
+  }
+
+  // Returns the count oldest blocks of the magazine to the small pool, as
+  // free() would have. Called with the allocator locked, by the owner or
+  // with the set paused.
+  void flush_magazine(MagazineSet::Magazine& magazine, size_t count) {
+    count = std::min<size_t>(count, magazine.count);
+    for (size_t i = 0; i < count; i++) {
+      Block* block = magazine.blocks[i];
+      block->allocated = false;
+      insert_free_event_into_alloc_stream(block);
+      // requested_bytes already left with the free into the magazine
+      free_block(block, /*flag=*/true);
+    }
+    std::move(
+        magazine.blocks + count,
+        magazine.blocks + magazine.count,
+        magazine.blocks);
+    magazine.count -= count;
+    if (magazine.count == 0) {
+      magazine.size = 0;
+    }
+  }
+
+  void merge_magazine_stats(MagazineSet& set) {
+    for (const StatType stat_type : {StatType::AGGREGATE, StatType::SMALL_POOL}) {
+      const size_t i = static_cast<size_t>(stat_type);
+      merge_stat(stats.allocation[i], set.allocation);
+      merge_stat(stats.allocated_bytes[i], set.allocated_bytes);
+      merge_stat(stats.requested_bytes[i], set.requested_bytes);
+    }
+    malloc_path_stats.hits[static_cast<size_t>(MallocPath::THREAD_MAGAZINE)] +=
+        set.hits;
+    set.allocation = StatDelta();
+    set.allocated_bytes = StatDelta();
+    set.requested_bytes = StatDelta();
+    set.hits = 0;
+  }
+
+  // Merges the stats of every thread's magazines and, with flush, returns
+  // their blocks to the pool. Called with the allocator locked.
+  void collect_magazines(bool flush) {
+    // before the pauses: a delta that misses its set's merge sets it again
+    magazine_stats_pending.store(false, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> guard(magazine_sets_mutex);
+    for (auto& set : magazine_sets) {
+      set->pause();
+      merge_magazine_stats(*set);
+      if (flush) {
+        for (auto& magazine : set->magazines) {
+          flush_magazine(magazine, magazine.count);
+        }
+      }
+      set->resume();
+    }
+  }
+
+  // Called with the allocator locked whenever one of the conditions changes.
+  void update_magazines_enabled() {
+    const bool enabled = captures_underway == 0 && !record_history &&
+        !(set_fraction &&
+          CachingAllocatorConfig::garbage_collection_threshold() > 0.0);
+    if (magazines_enabled.exchange(enabled) && !enabled) {
+      collect_magazines(/*flush=*/true);
+    }
+  }
+
+  // at the exit of the thread owning set, with magazine_owner->mutex held
+  void release_magazines(MagazineSet* set) {
+    ExclusiveLock lock(*this);
+    merge_magazine_stats(*set);
+    for (auto& magazine : set->magazines) {
+      flush_magazine(magazine, magazine.count);
+    }
+    std::lock_guard<std::mutex> guard(magazine_sets_mutex);
+    auto it = std::find_if(
+        magazine_sets.begin(),
+        magazine_sets.end(),
+        [set](const std::unique_ptr<MagazineSet>& s) { return s.get() == set; });
+    if (it != magazine_sets.end()) {
+      magazine_sets.erase(it);
+    }
+  }
+
+  static size_t get_allocation_size(size_t size) {
+    if (size <= kSmallSize) {
+      return kSmallBuffer;
+    } else if (size < kMinLargeAlloc) {
+      return kLargeBuffer;
+    } else {
+      return kRoundLarge * ((size + kRoundLarge - 1) / kRoundLarge);
+    }
+  }
+
+  void record_malloc_path(
+      MallocPath path,
+      std::chrono::steady_clock::time_point start,
+      const AllocParams& params) {
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const size_t index = static_cast<size_t>(path);
+    malloc_path_stats.hits[index] += 1;
+    malloc_path_stats.latency[index].record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+
+    if (record_history) {
+      const int64_t start_ns =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              start.time_since_epoch())
+              .count();
+      Block* block = params.block;
+      record_span(
+          TimelineEvent::MALLOC,
+          start_ns,
+          block ? int64_t(block->ptr) : 0,
+          params.size(),
+          params.stream(),
+          path);
+    }
+  }
+
+  bool get_free_block(AllocParams& p) {
+
+    static const int vmmDefragment = ([]()->int{
+        const char* env = getenv("vmmDefragment");
+        if(env) return atoi(env);
+        else return 1;
+    })();
+
+    static const double reuseLimit = ([]()->double{
+        const char* env = getenv("reuseLimit");
+        if(env) return atof(env);
+        else return 10.0f;
+    })();
+
+    
+    
+    int64_t net_change_inactive_split_blocks = 0;
+    int64_t net_change_inactive_split_size = 0;  
+
+    BlockPool& pool = *p.pool;
+
+    if (GCPOOL_UNLIKELY(
+            set_fraction &&
+            CachingAllocatorConfig::garbage_collection_threshold() > 0.0)) {
+      // Track block reuse interval only when garbage collection is enabled.
+      for (auto& stream_blocks : pool.streams) {
+        for (auto& b : stream_blocks) {
+          ++b->gc_count;
+        }
+      }
+    }
+    BlockSet& stream_blocks = pool.blocks(p.search_key.stream_id);
+    auto it = stream_blocks.lower_bound(&p.search_key);
+    if (it == stream_blocks.end()) {
+      if(vmmDefragment > 0 && !pool.is_small) {
+        BlockSet& fused_blocks = free_fused_blocks.blocks(p.search_key.stream_id);
+        auto block_it = fused_blocks.lower_bound(&p.search_key);
+        if (block_it == fused_blocks.end() 
+            || (*block_it)->size > (p.search_key.size*reuseLimit))
+        {
+          return false;
+        }
+                              
+            
+        p.block = *block_it;
+            
+            
+        size_t keep_blocks = p.search_key.size/kGranularity;
+           
+        if(!p.block->vmm_segment->free_map.all(0, keep_blocks)) {
+          GCPOOL_INFO(" warning for fused blocks not free, something wrong happended");
+          exit(-1);
+        }
+
+        std::unordered_set<Block*> blocks2split;
+        for(size_t i=0; i < keep_blocks; i++) {
+          auto& phy_block = p.block->vmm_segment->phy_blocks[i];
+                
+          phy_block->free = false;
+
+          for(auto& block_segment : phy_block->mapped_blocks) {
+            Block* other_block = block_segment.block;
+                    
+            if(other_block == p.block) continue;
+                    
+            if(other_block->vmm_segment->fused) {
+              if(other_block->vmm_segment->free_blocks == other_block->vmm_segment->phy_blocks.size() && 
+                free_fused_blocks.count(other_block)) {
+                  free_fused_blocks.erase(other_block);
+                  free_fused_blocks_in_release_order[other_block->stream_id].erase(other_block);
+
+                            
+                  fragmented_free_fused_blocks[other_block->stream_id].insert(other_block);
+              } else if(active_fused_blocks.count(other_block) == 0) {
+                if(!fragmented_free_fused_blocks[other_block->stream_id].contains(other_block)) {
+                  fragmented_free_fused_blocks[other_block->stream_id].insert(other_block);
+                }
+              }
+                        
+                        
+              mark_granule(*other_block->vmm_segment, block_segment.offset, false);
+            } else {
+              if(other_block->vmm_segment->free_blocks == other_block->vmm_segment->phy_blocks.size()) {
+                if(large_blocks.count(other_block)) {
+                  large_blocks.erase(other_block);
+                                 
+                  blocks2split.insert(other_block);
+               
+                  if(other_block->is_split()) {
+                    net_change_inactive_split_blocks -= 1;
+                    net_change_inactive_split_size -= other_block->size;
+                  }
+                }
+              }
+                        
+                        
+              mark_granule(*other_block->vmm_segment, block_segment.offset, false);
+                        
+                        
+              if(other_block->vmm_segment->free_blocks == 0) {
+                blocks2split.erase(other_block);
+                            
+                other_block->allocated = true;
+                active_blocks.insert(other_block);
+                            
+                            
+                update_stat_array(stats.active, 1, p.stat_types);
+                update_stat_array(stats.active_bytes, other_block->size, p.stat_types);
+              }
+            }
+          }
+        }
+            
+            
+        for(auto& block2split : blocks2split) {      
+          if(block2split->vmm_segment->fused || 
+            block2split->vmm_segment->free_blocks == 0 || 
+            block2split->vmm_segment->free_blocks == block2split->vmm_segment->phy_blocks.size()) {
+                    continue;
+          }
+                
+                
+          // each run of free or of used granules becomes a block of its own
+          const GranuleBitmap free_map = block2split->vmm_segment->free_map;
+          bool block_free = free_map.test(0);
+          size_t last_offset = 0;
+          Block* prev_block = block2split->prev;
+                
+          auto run_segments = split_granule_runs(std::move(block2split->vmm_segment), free_map);
+          size_t run = 0;
+                
+          while(last_offset < free_map.size()) {
+            size_t i = free_map.findNext(last_offset, !block_free);
+            size_t block_size = (i - last_offset)*kGranularity;
+                      
+            char* block_ptr = (char*)block2split->ptr + last_offset*kGranularity;
+            Block* split_block = block_slab.create(p.device(), p.stream(), block_size, p.pool, block_ptr);
+                      
+                      
+            split_block->prev = prev_block;
+            if(prev_block) {
+              prev_block->next = split_block;
+            }
+            split_block->self_last_event = block2split->self_last_event;
+                      
+                      
+            split_block->vmm_segment = std::move(run_segments[run++]);
+                      
+                      
+            size_t offset = 0;
+            for(auto& phy_block : split_block->vmm_segment->phy_blocks) {
+              phy_block->mapped_blocks[0].block = split_block;
+              phy_block->mapped_blocks[0].offset = offset;
+              offset++;
+            }
+
+
+            // a used run is used by the fused blocks mapped over it, not by
+            // split_block, so freeing split_block must not release it
+            split_block->vmm_segment->used_blocks = 0;
+            if(block_free) {
+              large_blocks.insert(split_block);
+                          
+                          
+              net_change_inactive_split_blocks += 1;
+              net_change_inactive_split_size += split_block->size;
+            } else {
+              split_block->allocated = true;
+              active_blocks.insert(split_block);
+                          
+                          
+              update_stat_array(stats.active, 1, p.stat_types);
+              update_stat_array(stats.active_bytes, split_block->size, p.stat_types);
+            }
+          
+
+            block_free = !block_free;
+            last_offset = i;
+            prev_block = split_block;
+          }
+                
+                
+          if(prev_block) {
+            prev_block->next = block2split->next;
+          }
+                
+          if(block2split->next) {
+            block2split->next->prev = prev_block;
+          }
+                
+          destroy_block(block2split);
+        }
+            
+        mark_granules(*p.block->vmm_segment, 0, keep_blocks, false);
+        p.block->vmm_segment->used_blocks = keep_blocks;
+
+              
+        fused_blocks.erase(block_it);
+        free_fused_blocks_in_release_order[p.block->stream_id].erase(p.block);
+    
+        p.err = cudaSuccess;
+    
+        update_stat_array(stats.inactive_split, net_change_inactive_split_blocks, p.stat_types);
+        update_stat_array(stats.inactive_split_bytes, net_change_inactive_split_size, p.stat_types);
+    
+        return true;
+      }
+        
+      return false;
+    }
+    // Do not return an oversized block for a large request
+    if ((p.size() < CachingAllocatorConfig::max_split_size()) &&
+        ((*it)->size >= CachingAllocatorConfig::max_split_size()))
+      return false;
+    // Allow oversized block size to be rounded up but within a limit
+    if ((p.size() >= CachingAllocatorConfig::max_split_size()) &&
+        ((*it)->size >= p.size() + kLargeBuffer))
+      return false;
+    p.block = *it;
+    (*it)->gc_count = 0; // Denote this block has been used
+    stream_blocks.erase(it);
+    if (vmmDefragment > 0 && p.block->vmm_segment) {
+      for(size_t i=0; i < p.block->vmm_segment->phy_blocks.size(); i++) {
+        auto& phy_block = p.block->vmm_segment->phy_blocks[i];
+        if(!phy_block->free) {
+          GCPOOL_INFO(" warning for non fused blocks has non free phy_block: %lu, something wrong happended, block %p, block->ptr %p, block->size %fMB, free_blocks %lu, used_blocks %lu, event_id: %lu",
+                      i, p.block, p.block->ptr, p.block->size/(1024.f*1024.f), p.block->vmm_segment->free_blocks, p.block->vmm_segment->used_blocks, p.block->self_last_event->event_id);
+            
+              
+          for(auto& block_segment : phy_block->mapped_blocks) {
+            Block* other_block = block_segment.block;
+                  
+            if(other_block == p.block) continue;
+              
+            GCPOOL_INFO(" warning for non fused blocks has non free phy_block: %lu, something wrong happended, co-ref block %p, block->ptr %p, block->size %fMB, free_blocks %lu, used_blocks %lu, event_id: %lu",
+                        i, other_block, other_block->ptr, other_block->size/(1024.f*1024.f), other_block->vmm_segment->free_blocks, other_block->vmm_segment->used_blocks, other_block->self_last_event->event_id);
+          }
+      
+          exit(-1);
+        }
+          
+        phy_block->free = false;
+          
+        for(auto& block_segment : phy_block->mapped_blocks) {
+          Block* other_block = block_segment.block;
+              
+          if(other_block == p.block) continue;
+              
+          if(other_block->vmm_segment->fused) {
+            if(other_block->vmm_segment->free_blocks == other_block->vmm_segment->phy_blocks.size() && 
+              free_fused_blocks.count(other_block)) {
+              free_fused_blocks.erase(other_block);
+              free_fused_blocks_in_release_order[other_block->stream_id].erase(other_block);
+
+              fragmented_free_fused_blocks[other_block->stream_id].insert(other_block);
+            } else if(active_fused_blocks.count(other_block) == 0) {
+              if(!fragmented_free_fused_blocks[other_block->stream_id].contains(other_block)) {
+                fragmented_free_fused_blocks[other_block->stream_id].insert(other_block);
+              }
+            }
+                                
+                  
+            mark_granule(*other_block->vmm_segment, block_segment.offset, false);
+          } else {
+            GCPOOL_INFO(" warning for non fused blocks has phy_block mapped to other non fused blocks");
+            exit(-1);
+          }
+        }
+                        
+      }
+      mark_all_granules(*p.block->vmm_segment, false);
+      p.block->vmm_segment->used_blocks = p.block->vmm_segment->phy_blocks.size();
+
+      
+    }
+    
+    
+    
+    p.err = cudaSuccess;
+    
+    
+    update_stat_array(stats.inactive_split, net_change_inactive_split_blocks, p.stat_types);
+    update_stat_array(stats.inactive_split_bytes, net_change_inactive_split_size, p.stat_types);
+    return true;
+  }
+
+  size_t garbage_collect_fused_blocks(int time, size_t require_size = 0) {
+    ExclusiveLock lock(*this);
+    TimelineSpanGuard span(*this, TimelineEvent::GC_PASS);
+      
+    size_t garbage_size = 0;
+    size_t garbage_blocks = 0;
+    for(auto& stream_pool : fragmented_free_fused_blocks) {
+      while(!stream_pool.empty()) {
+        Block* block = stream_pool.front();
+      
+        cudaError_t err = cudaSuccess;
+        if(block->self_last_event) {
+          err = DRV_TIMED(DriverApi::EVENT_QUERY, cudaEventQuery(block->self_last_event->event));
+        }
+              
+        if(err == cudaSuccess) {
+          unmap_fused_block(block);
+                  
+          garbage_blocks++;
+          garbage_size += block->size;
+                  
+          //free_fused_blocks.erase(block);
+          stream_pool.pop_front();
+                  
+                  
+          if(!block->vmm_segment.unique()) {
+            GCPOOL_INFO(" warning block is not unique, ref_count: %lu, block %p, block->ptr %p, block->size %fMB, phy_blocks %lu, free_blocks %lu, used_blocks %lu, event_id: %lu", 
+                        block->vmm_segment.use_count(), block, block->ptr, block->size/(1024.f*1024.f), block->vmm_segment->phy_blocks.size(), block->vmm_segment->free_blocks, block->vmm_segment->used_blocks, block->self_last_event->event_id);
+            exit(-1);
+          }
+                  
+                  
+          if(block->vmm_segment->vir_blocks[0]->vir_dev_ptr.use_count() != block->vmm_segment->vir_blocks.size()) {
+            GCPOOL_INFO(" warning vir_blocks vir_dev_ptr use_count %lu != vir_blocks.size() %lu, block %p, block->ptr %p, block->size %fMB, phy_blocks %lu, free_blocks %lu, used_blocks %lu, event_id: %lu", 
+                        block->vmm_segment->vir_blocks[0]->vir_dev_ptr.use_count(), block->vmm_segment->vir_blocks.size(),
+                        block, block->ptr, block->size/(1024.f*1024.f), block->vmm_segment->phy_blocks.size(), block->vmm_segment->free_blocks, block->vmm_segment->used_blocks, block->self_last_event->event_id);
+            exit(-1);
+          }
+                  
+          {
+            //block->vmm_segment.reset();
+            auto tmp = std::move(block->vmm_segment);
+          }
+                  
+          destroy_block(block);
+                  
+          if(require_size > 0 && time <= 1 && garbage_size >= (require_size << (2*(time + 1))) ) break;
+          
+        } else if(err == cudaErrorNotReady) {
+                  
+          GCPOOL_INFO(" fragmented_free_fused_blocks: block self_last_event NotReady %p, block->ptr %p, block->size %fMB, phy_blocks %lu, free_blocks %lu, used_blocks %lu, event_id: %lu", 
+                      block, block->ptr, block->size/(1024.f*1024.f), block->vmm_segment->phy_blocks.size(), block->vmm_segment->free_blocks, block->vmm_segment->used_blocks, block->self_last_event->event_id);
+                  
+                  
+          cudaGetLastError();
+          break;
+        } else {
+          GCPOOL_CUDA_CHECK(err);
+          cudaGetLastError();
+          break;
+        }
+      }
+    }
+      
+      
+    GCPOOL_INFO(" gc from fragmented_free_fused_blocks: blocks %lu, size %fMB", garbage_blocks, garbage_size/(1024.f*1024.f));
+      
+      
+    if(time > 0) {
+      for(auto& stream_pool : free_fused_blocks_in_release_order) {
+        while(!stream_pool.empty()) {
+          Block* block = stream_pool.front();
+      
+          cudaError_t err = cudaSuccess;
+          if(block->self_last_event) {
+            err = DRV_TIMED(DriverApi::EVENT_QUERY, cudaEventQuery(block->self_last_event->event));
+          }
+                
+          if(err == cudaSuccess) {
+            unmap_fused_block(block);
+                    
+            garbage_blocks++;
+            garbage_size += block->size;
+                    
+            free_fused_blocks.erase(block);
+            stream_pool.pop_front();
+                  
+                            
+            if(!block->vmm_segment.unique()) {
+              GCPOOL_INFO(" warning block is not unique, ref_count %lu, block %p, block->ptr %p, block->size %fMB, phy_blocks %lu, free_blocks %lu, used_blocks %lu, event_id: %lu", 
+                          block->vmm_segment.use_count(), block, block->ptr, block->size/(1024.f*1024.f), block->vmm_segment->phy_blocks.size(), block->vmm_segment->free_blocks, block->vmm_segment->used_blocks, block->self_last_event->event_id);
+              exit(-1);
+            }
+                    
+                    
+                  
+            if(block->vmm_segment->vir_blocks[0]->vir_dev_ptr.use_count() != block->vmm_segment->vir_blocks.size()) {
+              GCPOOL_INFO(" warning vir_blocks vir_dev_ptr use_count %lu != vir_blocks.size() %lu, block %p, block->ptr %p, block->size %fMB, phy_blocks %lu, free_blocks %lu, used_blocks %lu, event_id: %lu", 
+                          block->vmm_segment->vir_blocks[0]->vir_dev_ptr.use_count(), block->vmm_segment->vir_blocks.size(),
+                          block, block->ptr, block->size/(1024.f*1024.f), block->vmm_segment->phy_blocks.size(), block->vmm_segment->free_blocks, block->vmm_segment->used_blocks, block->self_last_event->event_id);
+              exit(-1);
+            }
+                    
+            destroy_block(block);
+          } else if(err == cudaErrorNotReady) {
+            GCPOOL_INFO(" free_fused_blocks_in_release_order: block self_last_event NotReady %p, block->ptr %p, block->size %fMB, phy_blocks %lu, free_blocks %lu, used_blocks %lu, event_id: %lu", 
+                        block, block->ptr, block->size/(1024.f*1024.f), block->vmm_segment->phy_blocks.size(), block->vmm_segment->free_blocks, block->vmm_segment->used_blocks, block->self_last_event->event_id);
+                    
+            cudaGetLastError();
+            break;
+          } else {
+            GCPOOL_CUDA_CHECK(err);
+            cudaGetLastError();
+            break;
+          }
+        }
+      }   
+    }
+      
+      //cudaDeviceSynchronize();
+      
+    GCPOOL_INFO(" gc from free_fused_blocks_in_release_order: blocks %lu, size %fMB", garbage_blocks, garbage_size/(1024.f*1024.f));
+
+    gcpool_stats.num_gc_passes += 1;
+    gcpool_stats.gc_blocks += garbage_blocks;
+    gcpool_stats.gc_bytes += garbage_size;
+    stats_changed = true;
+    span.set_size(garbage_size);
+
+    return garbage_size;
+  }
+
+  bool get_fused_fragmented_blocks(AllocParams& p, int time) {
+    TimelineSpanGuard span(*this, TimelineEvent::FUSION, &p);
+    static const int vmmDefragment = ([]()->int{
+        const char* env = getenv("vmmDefragment");
+        if(env) return atoi(env);
+        else return 1;
+    })();
+    
+    
+    static const size_t fragment_limit = ([]()->size_t{
+        const char* env = getenv("fragLimit");
+        if(env) return (size_t)std::stoll(env);
+        else return (size_t)(512*1024*1024);
+    })();
+    
+    
+    static const int defragment_level = ([]()->int{
+        const char* env = getenv("defragLevel");
+        if(env) return (int)std::atoi(env);
+        else return (int)0;
+    })();
+    
+    
+    static const int auto_gc_limits = ([]()->int{
+        const char* env = getenv("autoGC");
+        if(env) return (int)std::atoi(env);
+        else return (int)1000;
+    })();
+    
+    
+    if (vmmDefragment <= 0) {
+      return false;
+    }
+    
+    
+    if(time < defragment_level) {
+        return false;
+    }
+    
+    
+    if (p.pool->is_small || p.search_key.size < fragment_limit) {
+      return false;
+    } else {
+      Block left_search_key(p.search_key.device, p.search_key.stream, p.search_key.size, p.search_key.pool, p.search_key.ptr);
+      Block right_search_key(p.search_key.device, p.search_key.stream, p.search_key.size, p.search_key.pool, p.search_key.ptr);
+
+      left_search_key.size = 0;
+      right_search_key.size = std::numeric_limits<size_t>::max();
+
+      BlockSet& stream_blocks = large_blocks.blocks(p.search_key.stream_id);
+      auto it_begin = stream_blocks.lower_bound(&left_search_key);
+      if (it_begin == stream_blocks.end())
+        return false;
+      
+      auto it_end = stream_blocks.lower_bound(&right_search_key);
+      if (it_end == stream_blocks.begin())
+        return false;
+      
+      
+      if(std::prev(it_end) == it_begin) return false;
+      
+      size_t fuse_size = 0;
+      std::vector<Block*> blocks2fuse;
+      
+      auto it = it_end;
+      while(it != it_begin && fuse_size < p.search_key.size) {
+        it = std::prev(it);
+        blocks2fuse.push_back((*it));
+        fuse_size += (*it)->size;
+      }
+      
+      
+      if(fuse_size < p.search_key.size) {
+          return false;
+      }
+            
+      
+      int64_t net_change_segments = 0;
+      int64_t net_change_inactive_split_blocks = 0;
+      int64_t net_change_inactive_split_size = 0;
+      
+      
+      BlockEventPtr current_self_last_event;
+      std::vector<std::shared_ptr<PhyBlock>> phy_blocks2glue;
+      int index = 0;  
+      for(auto& block : blocks2fuse) {
+        for(auto& phy_block : block->vmm_segment->phy_blocks) {
+          phy_block->free = false;
+          phy_blocks2glue.push_back(phy_block);
+        }
+        mark_all_granules(*block->vmm_segment, false);
+        block->vmm_segment->used_blocks = 0;
+
+        
+        if(!current_self_last_event || 
+          (block->self_last_event && block->self_last_event->event_id > current_self_last_event->event_id)) {
+          current_self_last_event = block->self_last_event;
+        }
+        
+        large_blocks.erase(block);
+        
+        
+        if(block->is_split()) {
+          net_change_inactive_split_blocks -= 1;
+          net_change_inactive_split_size -= block->size;
+        }
+        
+        
+        
+        block->allocated = true;
+        active_blocks.insert(block);
+        
+        if (index == blocks2fuse.size() - 1 && (fuse_size - p.search_key.size) >= kGranularity) continue;
+        update_stat_array(stats.active, 1, p.stat_types);
+        update_stat_array(stats.active_bytes, block->size, p.stat_types);
+        index++;
+      }
+
+      if(fuse_size > p.search_key.size && (fuse_size - p.search_key.size) >= kGranularity) {
+        Block* last_block = blocks2fuse.back();
+          
+          
+        last_block->allocated = false;
+        if(active_blocks.count(last_block)) {
+          active_blocks.erase(last_block);
+        }
+                      
+          
+        Block* remaining = last_block;
+      
+        size_t original_size = remaining->size;
+        size_t remain_size = (fuse_size - p.search_key.size);
+        size_t keep_size = original_size - remain_size;
+  
+        last_block = block_slab.create(p.device(), p.stream(), keep_size, p.pool, last_block->ptr);
+        last_block->prev = remaining->prev;
+        if (last_block->prev) {
+            last_block->prev->next = last_block;
+        }
+        last_block->next = remaining;
+        last_block->self_last_event = remaining->self_last_event;
+          
+        remaining->prev = last_block;
+        remaining->ptr = static_cast<char*>(remaining->ptr) + keep_size;
+        remaining->size = remain_size;
+          
+        auto remaining_segment = split_granules(*remaining->vmm_segment, keep_size/kGranularity);
+        last_block->vmm_segment = std::move(remaining->vmm_segment);
+        remaining->vmm_segment =  std::move(remaining_segment);
+          
+        for(size_t i=0; i<last_block->vmm_segment->phy_blocks.size(); i++) {
+          last_block->vmm_segment->phy_blocks[i]->mapped_blocks[0].block = last_block;
+          last_block->vmm_segment->phy_blocks[i]->mapped_blocks[0].offset = i;
+          last_block->vmm_segment->phy_blocks[i]->free = false;
+        }
+        mark_all_granules(*last_block->vmm_segment, false);
+        last_block->vmm_segment->used_blocks = 0;
+        last_block->allocated = true;
+                    
+        active_blocks.insert(last_block);
+
+        update_stat_array(stats.active, 1, p.stat_types);
+        update_stat_array(stats.active_bytes, last_block->size, p.stat_types);
+          
+        for(size_t i=0; i<remaining->vmm_segment->phy_blocks.size(); i++) {
+          remaining->vmm_segment->phy_blocks[i]->mapped_blocks[0].block = remaining;
+          remaining->vmm_segment->phy_blocks[i]->mapped_blocks[0].offset = i;
+          remaining->vmm_segment->phy_blocks[i]->free = true;
+        }
+        mark_all_granules(*remaining->vmm_segment, true);
+        remaining->vmm_segment->used_blocks = 0;
+        remaining->allocated = false;
+          
+        large_blocks.insert(remaining);
+          
+        fuse_size -= remaining->size;
+  
+        size_t keep_blocks = p.search_key.size/kGranularity;
+        phy_blocks2glue.resize(keep_blocks);
+            
+        net_change_inactive_split_blocks += 1;
+        net_change_inactive_split_size += remaining->size;
+      }
+      
+      static constexpr size_t G=1024*1024*1024;
+      
+      using Ms = std::chrono::duration<double, std::milli>;
+      Ms fuse_time = Ms{0};
+      
+      std::shared_ptr<VmmSegment> vmm_segment;
+      int gc_time = 0;
+      do
+      {
+        auto t0 = std::chrono::steady_clock::now();
+          
+        vmm_segment = std::make_shared<VmmSegment>(std::move(phy_blocks2glue));
+          
+        auto t1 = std::chrono::steady_clock::now();
+        fuse_time = (t1-t0);
+          
+        if(vmm_segment->status == CUDA_SUCCESS && vmm_segment->segment_ptr) {
+          break;
+        } else {
+          cudaGetLastError();
+              
+          phy_blocks2glue = std::move(vmm_segment->phy_blocks);
+              
+          GCPOOL_INFO(" allocate virtual address for %lu phy_blocks the %dth time failed, try to garbage_collect_fused_blocks", phy_blocks2glue.size(), gc_time);
+              
+          size_t garbage_size = garbage_collect_fused_blocks(gc_time, p.search_key.size);
+          gc_time++;
+              
+          total_fuse_size -= garbage_size;
+          stats_changed = true;
+              
+          cudaGetLastError();
+        }
+      } while(gc_time < 3);
+      
+      if(!vmm_segment || vmm_segment->status != CUDA_SUCCESS || !vmm_segment->segment_ptr) {
+          return false;
+      }
+      
+      void* block_ptr = vmm_segment->segment_ptr;
+      Block* fused_block = block_slab.create(p.device(), p.stream(), fuse_size, p.pool, (char*)block_ptr);
+
+      fused_block->vmm_segment = std::move(vmm_segment);
+      fused_block->self_last_event = current_self_last_event;
+
+      for(auto& phy_block : fused_block->vmm_segment->phy_blocks) {
+        for(auto& block_segment : phy_block->mapped_blocks) {
+          Block* other_block = block_segment.block;
+              
+          //since the non fused blocks has already been processed, we only need to process fused blocks 
+          if(other_block->vmm_segment->fused) {
+            if(other_block->vmm_segment->free_blocks == other_block->vmm_segment->phy_blocks.size() && 
+              free_fused_blocks.count(other_block)) {
+              free_fused_blocks.erase(other_block);
+              free_fused_blocks_in_release_order[other_block->stream_id].erase(other_block);
+        
+              fragmented_free_fused_blocks[other_block->stream_id].insert(other_block);
+            } else if(active_fused_blocks.count(other_block) == 0) {
+              if(!fragmented_free_fused_blocks[other_block->stream_id].contains(other_block)) {
+                fragmented_free_fused_blocks[other_block->stream_id].insert(other_block);
+              }
+            }
+                  
+
+            mark_granule(*other_block->vmm_segment, block_segment.offset, false);
+          }
+        }
+      }
+
+      map_fused_block(fused_block);
+      mark_all_granules(*fused_block->vmm_segment, false);
+      fused_block->vmm_segment->used_blocks = fused_block->vmm_segment->phy_blocks.size();
+
+      p.block = fused_block;
+      p.err = cudaSuccess;
+
+      GCPOOL_INFO(" fused block %p, ptr %p of size %fMB", 
+			            fused_block, fused_block->ptr, fused_block->size/(1024.f*1024.f));
+      
+      net_change_segments += 1;
+
+
+      update_stat_array(stats.segment, net_change_segments, p.stat_types);
+      update_stat_array(stats.inactive_split, net_change_inactive_split_blocks, p.stat_types);
+      update_stat_array(stats.inactive_split_bytes, net_change_inactive_split_size, p.stat_types);
+
+      if(fuse_size >= p.search_key.size) {
+        total_fuse_size += fuse_size;
+        gcpool_stats.num_fusions += 1;
+        gcpool_stats.fused_bytes += fuse_size;
+        stats_changed = true;
+        GCPOOL_INFO(" try %d: fuse %lu physical blocks to ptr %p of size %fMB for allocate size %fMB succeeded, takes %fms, total_fuse_size %fMB", 
+                   time, fused_block->vmm_segment->phy_blocks.size(), fused_block->vmm_segment->segment_ptr, fuse_size/(1024.f*1024.f), p.search_key.size/(1024.f*1024.f), fuse_time.count(), total_fuse_size/(1024.f*1024.f));
+        
+        if(total_fuse_size > auto_gc_limits*G) {
+            GCPOOL_INFO(" virtual address larger than %luG, do garbage_collect_fused_blocks() ", auto_gc_limits);
+            
+            size_t garbage_size = garbage_collect_fused_blocks(2, 0);
+            
+            total_fuse_size -= garbage_size;
+            stats_changed = true;
+        }
+      }
+
+      return fuse_size >= p.search_key.size;
+    } 
+    
+    return false;
+  }
+
+  bool trigger_free_memory_callbacks(AllocParams& p) {
+    bool freed_memory = false;
+    if (allocator_hooks.free_memory_callbacks) {
+      freed_memory = allocator_hooks.free_memory_callbacks();
+    }
+    return freed_memory;
+  }
+
+  void garbage_collect_cached_blocks() {
+    // Free unused cached blocks to reclaim GPU memory.
+    // Unlike release_cached_blocks(), this does not enforce synchronization and
+    // therefore should be of less overheads.
+
+    size_t gc_threshold = static_cast<size_t>(
+        CachingAllocatorConfig::garbage_collection_threshold() *
+        allowed_memory_maximum);
+    // No need to trigger GC yet
+    if (total_allocated_memory <= gc_threshold) {
+      return;
+    }
+    const auto target_size = total_allocated_memory - gc_threshold;
+    size_t gc_reclaimed = 0;
+
+    // Calculate the total age of the free-able blocks. We'll use it later to
+    // get "avg age" threshold.
+    double total_age = 0.0;
+    int freeable_block_count = 0;
+    for (auto& stream_blocks : large_blocks.streams) {
+      for (auto& b : stream_blocks) {
+        if (!b->is_split()) {
+          total_age += b->gc_count;
+          ++freeable_block_count;
+        }
+      }
+    }
+    // No free-able blocks?
+    if (freeable_block_count == 0) {
+      return;
+    }
+
+    // Repeat GC until we reach reclaim > target size.
+    bool block_freed = true;
+    while (gc_reclaimed < target_size && block_freed == true &&
+           freeable_block_count > 0) {
+      // Free blocks exceeding this age threshold first.
+      double age_threshold = total_age / freeable_block_count;
+      // Stop iteration if we can no longer free a block.
+      block_freed = false;
+
+      // Free blocks of > avg age. Don't stop upon reaching the target_size,
+      // we don't want this GC to be triggered frequently.
+      for (auto& stream_blocks : large_blocks.streams) {
+        auto it = stream_blocks.begin();
+        while (it != stream_blocks.end()) {
+          Block* block = *it;
+          ++it;
+          if (!block->is_split() && block->gc_count >= age_threshold) {
+            block_freed = true;
+            gc_reclaimed += block->size;
+            total_age -= block->gc_count; // Decrement the age
+            freeable_block_count--; // One less block that can be freed
+            release_block(block);
+          }
+        }
+      }
+    }
+  }
+
+  bool realloc_block(AllocParams& p, bool isRetry) {
+    // Defensively checks for preexisting CUDA error state.
+    GCPOOL_CUDA_CHECK(cudaGetLastError());
+    TimelineSpanGuard span(*this, TimelineEvent::NEW_SEGMENT, &p);
+
+    
+    static const int vmmDefragment = ([]()->int{
+        const char* env = getenv("vmmDefragment");
+        if(env) return atoi(env);
+        else return 1;
+    })();
+
+
+    static const int reAlloc = ([]()->int{
+        const char* env = getenv("reAlloc");
+        if(env) return atoi(env);
+        else return 0;
+    })();
+
+
+
+    size_t size = p.alloc_size;
+    size_t free_block_size = 0;
+    void* ptr;
+
+    if (isRetry) {
+      stats.num_alloc_retries += 1;
+      stats_changed = true;
+    }
+
+    std::shared_ptr<VmmSegment> vmm_segment;
+    if (set_fraction &&
+        total_allocated_memory + size > allowed_memory_maximum) {
+      p.err = cudaErrorMemoryAllocation;
+      return false;
+    } else {
+      if(vmmDefragment <= 0 || p.pool->is_small) {
+        p.err = cudaMallocMaybeCapturing(&ptr, size, p.stream());
+        if (p.err != cudaSuccess) {
+          if (p.err == cudaErrorMemoryAllocation) {
+            // If this is the first attempt (!isRetry), we can forgive and clear CUDA's
+            //   internal error state.
+            // If this is the second attempt (isRetry), malloc's GCPOOL_CHECK_WITH will take
+            //   over to throw a helpful exception. The user can choose to catch the exception,
+            //   free some stuff in their script, and attempt their allocation again.
+            //   In this case, we can also forgive and clear CUDA's internal error state.
+            cudaGetLastError();
+          } else {
+            // If the error's unrelated to memory allocation, we should throw immediately.
+            GCPOOL_CUDA_CHECK(p.err);
+          }
+          return false;
+        }
+      } else {
+        if(reAlloc > 0) {
+          //Block left_search_key = p.search_key;
+          //Block right_search_key = p.search_key;
+                
+          Block left_search_key(p.search_key.device, p.search_key.stream, p.search_key.size, p.search_key.pool, p.search_key.ptr);
+          Block right_search_key(p.search_key.device, p.search_key.stream, p.search_key.size, p.search_key.pool, p.search_key.ptr);
+      
+          left_search_key.size = 0;
+          right_search_key.size = std::numeric_limits<size_t>::max();
+                      
+          BlockSet& stream_blocks = large_blocks.blocks(p.search_key.stream_id);
+          auto it_begin = stream_blocks.lower_bound(&left_search_key);
+          auto it_end = stream_blocks.lower_bound(&right_search_key);
+                
+          if(it_begin != stream_blocks.end() && it_end != stream_blocks.begin()) {
+            auto it = it_begin;
+            while(it != it_end) {
+              free_block_size += (*it)->size;
+              it++;
+            }
+          }
+                
+                
+          size_t request_size = p.search_key.size;
+                
+          if(free_block_size >= request_size) {
+            GCPOOL_INFO(" free_block_size %fMB is larger than allocation size %fMB, something weired happended", 
+                       free_block_size/(1024.f*1024.f), size/(1024.f*1024.f));
+            return false;
+          }
+                
+          if(free_block_size > 0) {
+            request_size -= free_block_size;
+            size = get_allocation_size(request_size);
+          }
+        }
+               
+        using Ms = std::chrono::duration<double, std::milli>;
+        Ms fuse_time = Ms{0};
+            
+        int gc_time = 0;
+        do
+        {
+          auto t0 = std::chrono::steady_clock::now();
+                
+          vmm_segment = std::make_shared<VmmSegment>(size/kGranularity, kGranularity, p.device());
+                
+          auto t1 = std::chrono::steady_clock::now();
+          fuse_time = (t1-t0);
+                
+          if(vmm_segment->status == CUDA_SUCCESS && vmm_segment->segment_ptr) {
+            break;
+          } else {
+            cudaGetLastError();
+                            
+            size_t device_free;
+            size_t device_total;
+            cudaMemGetInfo(&device_free, &device_total);
+                            
+            size_t total_garbage_size = fragmented_free_fused_blocks[p.search_key.stream_id].pool_size + free_fused_blocks_in_release_order[p.search_key.stream_id].pool_size;
+                  
+                    
+            if(device_free > size && total_garbage_size >= size) {
+              GCPOOL_INFO(" allocate size %luMB memory by vmm the %dth time failed, try to garbage_collect_fused_blocks", size/(1024*1024), gc_time);
+                        
+              vmm_segment.reset();
+              size_t garbage_size = garbage_collect_fused_blocks(gc_time, p.alloc_size);
+              total_fuse_size -= garbage_size;
+              stats_changed = true;
+                        
+              gc_time++;
+                       
+              cudaGetLastError();
+            } else {
+              break;
+            }
+          }
+        } while(gc_time < 3);
+            
+        if(!vmm_segment || vmm_segment->status != CUDA_SUCCESS || !vmm_segment->segment_ptr) {           
+          p.err = cudaErrorMemoryAllocation;
+          cudaGetLastError();
+          vmm_segment.reset();
+                
+          GCPOOL_INFO(" allocate size %fMB memory by vmm failed", size/(1024.f*1024.f));
+            
+          return false;
+        }
+            
+            
+        ptr = vmm_segment->segment_ptr;
+      }
+    }
+
+    if (p.pool->owner_PrivatePool) {
+      // The block is for a CUDA graph's PrivatePool.
+      p.pool->owner_PrivatePool->cudaMalloc_count++;
+    }
+
+    total_allocated_memory += size;
+    Block* new_block = block_slab.create(p.device(), p.stream(), size, p.pool, (char*)ptr);
+    new_block->vmm_segment = std::move(vmm_segment);
+    
+    for_each_selected_stat_type(p.stat_types, [&](size_t stat_type) {
+      update_stat(stats.segment[stat_type], 1);
+      update_stat(stats.reserved_bytes[stat_type], size);
+    });
+    if (size >= CachingAllocatorConfig::max_split_size())
+      update_stat(stats.oversize_segments, 1);
+
+    // p.block came from new, not cudaMalloc. It should not be nullptr here.
+    //GCPOOL_ASSERT(p.block != nullptr && p.block->ptr != nullptr);
+    GCPOOL_ASSERT(new_block != nullptr && new_block->ptr != nullptr);
+    
+    
+    if(new_block->vmm_segment) {
+      if(new_block->size < p.search_key.size) {
+        for(size_t i = 0; i < new_block->vmm_segment->phy_blocks.size(); i++) {
+          new_block->vmm_segment->phy_blocks[i]->mapped_blocks.emplace_back(new_block, i);
+          new_block->vmm_segment->phy_blocks[i]->free = true;
+        }
+            
+        mark_all_granules(*new_block->vmm_segment, true);
+        new_block->vmm_segment->used_blocks = 0;
+
+        large_blocks.insert(new_block);
+            
+        if(!get_fused_fragmented_blocks(p, 4)) {
+          GCPOOL_INFO(" call get_fused_fragmented_blocks failed");
+          return false;
+        }
+      } else {
+        for(size_t i = 0; i < new_block->vmm_segment->phy_blocks.size(); i++) {
+          new_block->vmm_segment->phy_blocks[i]->mapped_blocks.emplace_back(new_block, i);
+          new_block->vmm_segment->phy_blocks[i]->free = false;
+        }
+            
+        mark_all_granules(*new_block->vmm_segment, false);
+        new_block->vmm_segment->used_blocks = new_block->vmm_segment->phy_blocks.size();
+            
+        p.block = new_block;
+        p.err = cudaSuccess;
+      }
+    } else {
+      p.block = new_block;
+      p.err = cudaSuccess;
+    }
+    
+    return true;
+  }
+
+
+
+  bool alloc_block(AllocParams& p, bool isRetry) {
+    // Defensively checks for preexisting CUDA error state.
+    GCPOOL_CUDA_CHECK(cudaGetLastError());
+
+    size_t size = p.alloc_size;
+    void* ptr;
+
+    if (isRetry) {
+      stats.num_alloc_retries += 1;
+      stats_changed = true;
+    }
+
+    if (set_fraction &&
+        total_allocated_memory + size > allowed_memory_maximum) {
+      p.err = cudaErrorMemoryAllocation;
+      return false;
+    } else {
+      p.err = cudaMallocMaybeCapturing(&ptr, size, p.stream());
+      if (p.err != cudaSuccess) {
+        if (p.err == cudaErrorMemoryAllocation) {
+          // If this is the first attempt (!isRetry), we can forgive and clear
+          // CUDA's internal error state.
+          //
+          // If this is the second attempt (isRetry), malloc's GCPOOL_CHECK_WITH
+          // will take over to throw a helpful exception. The user can choose
+          // to catch the exception, free some stuff in their script, and
+          // attempt the allocation again. In this case, we can also forgive and
+          // clear CUDA's internal error state.
+          cudaGetLastError();
+        } else {
+          // If the error's unrelated to memory allocation, we should throw
+          // immediately.
+          GCPOOL_CUDA_CHECK(p.err);
+        }
+        return false;
+      }
+    }
+
+    if (p.pool->owner_PrivatePool) {
+      // The block is for a CUDA graph's PrivatePool.
+      p.pool->owner_PrivatePool->cudaMalloc_count++;
+    }
+
+    total_allocated_memory += size;
+    p.block = block_slab.create(p.device(), p.stream(), size, p.pool, (char*)ptr);
+    for_each_selected_stat_type(p.stat_types, [&](size_t stat_type) {
+      update_stat(stats.segment[stat_type], 1);
+      update_stat(stats.reserved_bytes[stat_type], size);
+    });
+    if (size >= CachingAllocatorConfig::max_split_size())
+      update_stat(stats.oversize_segments, 1);
+
+    // p.block came from new, not cudaMalloc. It should not be nullptr here.
+    GCPOOL_ASSERT(p.block != nullptr && p.block->ptr != nullptr);
+    return true;
+  }
+
+  /** Free one or more oversize blocks to the system allocator.  But only enough
+   * **/
+  /** to satisfy the target size **/
+  bool release_available_cached_blocks(const AllocParams& p) {
+    if (CachingAllocatorConfig::max_split_size() ==
+        std::numeric_limits<size_t>::max())
+      return false;
+    BlockPool& pool = *p.pool;
+
+    // because of std::unique_ptr, block cannot be trivially copied
+    Block key(
+        p.search_key.device,
+        p.search_key.stream,
+        p.search_key.size,
+        p.search_key.pool,
+        p.search_key.ptr);
+    key.size = (key.size < CachingAllocatorConfig::max_split_size())
+        ? CachingAllocatorConfig::max_split_size()
+        : key.size;
+    BlockSet& stream_blocks = pool.blocks(key.stream_id);
+    auto it = stream_blocks.lower_bound(&key);
+    if (it == stream_blocks.end()) {
+      // No single block is large enough; free multiple oversize blocks,
+      // starting with the largest
+      if (it == stream_blocks.begin())
+        return false;
+      size_t totalReleased = 0;
+      --it; // Back up one item.  Now on the largest block of the stream
+      while ((totalReleased < key.size) &&
+             ((*it)->size >= CachingAllocatorConfig::max_split_size())) {
+        auto cur = it;
+        totalReleased += (*it)->size;
+        if (it != stream_blocks.begin()) {
+          --it;
+          release_block(*cur);
+        } else {
+          release_block(*cur);
+          break;
+        }
+      }
+      if (totalReleased < key.size)
+        return false;
+    } else {
+      release_block(*it);
+    }
+    return true;
+  }
+
+  bool release_cached_blocks() {
+    TimelineSpanGuard span(*this, TimelineEvent::CACHE_FLUSH);
+    // Deferred frees and blocks cached in thread magazines hold on to their
+    // segments.
+    free_deferred_blocks();
+    collect_magazines(/*flush=*/true);
+    // First ensure that all blocks that can't currently be allocated due to
+    // outstanding events are returned to the pool.
+    synchronize_and_free_events();
+
+    // Free all non-split cached blocks to system allocator
+    release_blocks(large_blocks);
+    release_blocks(small_blocks);
+
+    for (auto it = graph_pools_freeable.begin();
+         it != graph_pools_freeable.end();) {
+      // See notifyCaptureDestroy for the strategy here.
+      GCPOOL_ASSERT(it->second->use_count == 0);
+      release_blocks(it->second->small_blocks);
+      release_blocks(it->second->large_blocks);
+      if (it->second->cudaMalloc_count == 0) {
+        auto erase_count = graph_pools.erase(it->first);
+        GCPOOL_ASSERT(erase_count == 1);
+        it = graph_pools_freeable.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    return true;
+  }
+
+  void release_block(Block* block) {
+    static const int vmmDefragment = ([]()->int{
+        const char* env = getenv("vmmDefragment");
+        if(env) return atoi(env);
+        else return 1;
+    })();
+
+
+
+    if (vmmDefragment > 0 && block->vmm_segment) {
+      for(size_t i=0; i < block->vmm_segment->phy_blocks.size(); i++) {
+        auto& phy_block = block->vmm_segment->phy_blocks[i];
+        if(!phy_block->free) {
+          GCPOOL_INFO(" warning for non fused blocks has non free phy_block: %lu, something wrong happended, block %p, block->ptr %p, block->size %fMB, free_blocks %lu, used_blocks %lu, event_id: %lu",
+                                               i, block, block->ptr, block->size/(1024.f*1024.f), block->vmm_segment->free_blocks, block->vmm_segment->used_blocks, block->self_last_event->event_id);
+        }
+
+        // unmapping a fused block moves the last entry into its slot, so
+        // the slot is looked at again instead of advancing
+        for(size_t slot = 0; slot < phy_block->mapped_blocks.size();) {
+          BlockSegment block_segment = phy_block->mapped_blocks[slot];
+          Block* other_block = block_segment.block;
+              
+          if(other_block == block) {
+            slot++;
+            continue;
+          }
+              
+          if(other_block->vmm_segment->fused) {
+            if(active_fused_blocks.count(other_block) && 
+              active_fused_blocks_to_gc.count(other_block) == 0) {
+              unmap_slot(*phy_block, slot);
+              {
+                auto tmp1 = std::move(other_block->vmm_segment->vir_blocks[block_segment.offset]);
+                auto tmp2 = std::move(other_block->vmm_segment->phy_blocks[block_segment.offset]);
+              }
+                      
+              //active_fused_blocks.erase(other_block);
+              active_fused_blocks_to_gc.insert(other_block);
+            } else if(free_fused_blocks.count(other_block) || 
+                          fragmented_free_fused_blocks[other_block->stream_id].contains(other_block)) {
+              if(free_fused_blocks.count(other_block)) {
+                free_fused_blocks.erase(other_block);
+                free_fused_blocks_in_release_order[other_block->stream_id].erase(other_block);
+              } else if(fragmented_free_fused_blocks[other_block->stream_id].contains(other_block)) {
+                fragmented_free_fused_blocks[other_block->stream_id].erase(other_block);
+              }
+       
+              unmap_fused_block(other_block);
+                      
+                      
+              destroy_block(other_block);
+            } else {
+              slot++;
+            }
+          } else {
+            GCPOOL_INFO(" warning for non fused blocks has phy_block mapped to other non fused blocks");
+            exit(-1);
+          }
+        }
+                        
+      }
+      
+      
+    }
+    
+    
+
+    
+    if(block->vmm_segment){
+      block->vmm_segment.reset();
+    } else {
+      GCPOOL_CUDA_CHECK(DRV_TIMED(DriverApi::FREE, cudaFree((void*)block->ptr)));
+    }
+    total_allocated_memory -= block->size;
+
+    auto* pool = block->pool;
+    if (pool->owner_PrivatePool) {
+      // The cudaFreed block belonged to a CUDA graph's PrivatePool.
+      GCPOOL_ASSERT(pool->owner_PrivatePool->cudaMalloc_count > 0);
+      pool->owner_PrivatePool->cudaMalloc_count--;
+    }
+
+    StatTypes stat_types = {false};
+    stat_types[static_cast<size_t>(StatType::AGGREGATE)] = true;
+    stat_types[static_cast<size_t>(get_stat_type_for_pool(*pool))] = true;
+    for_each_selected_stat_type(stat_types, [&](size_t stat_type) {
+      update_stat(stats.segment[stat_type], -1);
+      update_stat(
+          stats.reserved_bytes[stat_type],
+          -static_cast<std::int64_t>(block->size));
+    });
+    if (block->size >= CachingAllocatorConfig::max_split_size())
+      update_stat(stats.oversize_segments, -1);
+    if (HistoryChain* h = block->history()) {
+      record_trace(
+          TraceEntry::SEGMENT_FREE,
+          int64_t(block->ptr),
+          block->size,
+          block->stream,
+          h->context_id);
+    }
+    pool->erase(block);
+    destroy_block(block);
+  }
+
+  void release_blocks(BlockPool& pool) {
+    // Frees all non-split blocks
+    for (auto& stream_blocks : pool.streams) {
+      auto it = stream_blocks.begin();
+      while (it != stream_blocks.end()) {
+        Block* block = *it;
+        ++it;
+        if (!block->prev && !block->next) {
+          release_block(block);
+        }
+      }
+    }
+  }
+
+  EventPool::Event create_event_internal(int idx) {
+    // Leak the event pool to avoid shutdown issues.
+    static auto* event_pool = new EventPool();
+    return event_pool->get(idx);
+  }
+
+  void synchronize_and_free_events() {
+    // Synchronize on outstanding events and then free associated blocks.
+
+    // This function syncs, so capture should not be underway. Might as well
+    // make sure capture-deferred end of life events get processed too.
+    GCPOOL_ASSERT(captures_underway == 0);
+    insert_events_deferred_until_no_capture();
+
+    for (auto& st : cuda_events) {
+      for (auto& e : st.second) {
+        EventPool::Event event = std::move(e.first);
+        Block* block = e.second;
+
+        GCPOOL_CUDA_CHECK(DRV_TIMED(DriverApi::EVENT_SYNCHRONIZE, cudaEventSynchronize(*event)));
+
+        block->event_count--;
+        if (block->event_count == 0) {
+          // free_block(block);
+          update_block(block);
+        }
+      }
+    }
+
+    cuda_events.clear();
+  }
+
+  void insert_events(Block* block) {
+    int prev_device;
+    GCPOOL_CUDA_CHECK(cudaGetDevice(&prev_device));
+
+    stream_set streams(std::move(block->cold_ext().stream_uses));
+    GCPOOL_ASSERT(!block->has_stream_uses());
+    for (auto& stream : streams) {
+      GCPOOL_CUDA_CHECK(cudaSetDevice(stream.device));
+
+      EventPool::Event event = create_event_internal(stream.device);
+      GCPOOL_CUDA_CHECK(DRV_TIMED(DriverApi::EVENT_RECORD, cudaEventRecord(*event, stream.stream)));
+
+      block->event_count++;
+      cuda_events[stream].emplace_back(std::move(event), block);
+    }
+
+    GCPOOL_CUDA_CHECK(cudaSetDevice(prev_device));
+  }
+
+  void insert_free_event_into_alloc_stream(Block* block)
+  {
+    int prev_device = -1;
+    GCPOOL_CUDA_CHECK(cudaGetDevice(&prev_device));
+    if(prev_device != block->device)
+    {
+      GCPOOL_CUDA_CHECK(cudaSetDevice(block->device));
+    }
+  
+
+    
+    if( block->self_last_event && 
+        block->self_last_event.unique() && 
+        block->self_last_event->stream == block->stream && 
+        !block->self_last_event->ref_as_sync) {
+      block->self_last_event->record(block->stream);
+    } else {
+      block->self_last_event = BlockEvent::create(block->device, block->stream, true);
+    }
+
+    if(prev_device != block->device) {
+      GCPOOL_CUDA_CHECK(cudaSetDevice(prev_device));
+    }
+  }
+
+  void insert_events_deferred_until_no_capture() {
+    if (GCPOOL_UNLIKELY(needs_events_deferred_until_no_capture.size() > 0)) {
+      for (auto* block : needs_events_deferred_until_no_capture) {
+        GCPOOL_ASSERT(block->has_stream_uses());
+        insert_events(block);
+      }
+      needs_events_deferred_until_no_capture.clear();
+    }
+  }
+
+  void process_events() {
+    insert_events_deferred_until_no_capture();
+
+    // Process outstanding cudaEvents. Events that are completed are
+    // removed from the queue, and the 'event_count' for the
+    // corresponding allocation is decremented. We maintain a separate
+    // list of events per stream to avoid head-of-line delays if one
+    // or more streams has long-running operations.
+
+    // Iterate over different streams.
+    for (auto it = cuda_events.begin(); it != cuda_events.end();) {
+      // Iterate over this stream's (event, block) pairs.
+      while (!it->second.empty()) {
+        auto& e = it->second.front();
+        EventPool::Event event = std::move(e.first);
+        Block* block = e.second;
+
+        cudaError_t err = DRV_TIMED(DriverApi::EVENT_QUERY, cudaEventQuery(*event));
+        if (err == cudaErrorNotReady) {
+          // ignore and clear the error if not ready
+          cudaGetLastError();
+          // Return the ownership of the Event (unique ptr)
+          e.first = std::move(event);
+          break;
+        } else if (err != cudaSuccess) {
+          GCPOOL_CUDA_CHECK(err);
+        }
+
+        block->event_count--;
+        if (block->event_count == 0) {
+          // free_block(block);
+          update_block(block);
+        }
+        it->second.pop_front();
+      }
+
+      if (it->second.empty()) {
+        it = cuda_events.erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+
+  // Iterates over sizes of all memory blocks for given device in given pool
+  void cache_info_aux(const BlockPool& pool, size_t* largest) const {
+    for (const auto& stream_blocks : pool.streams) {
+      // the last block of a stream is its largest
+      if (!stream_blocks.empty()) {
+        *largest = std::max(*largest, (*std::prev(stream_blocks.end()))->size);
+      }
+    }
+  }
+
+  // The context of a malloc, null while history is off. Capturing one (a
+  // Python stack) costs more than the malloc itself, so with
+  // historyContextInterval=N only every Nth malloc of a thread captures it;
+  // the others are still traced and kept in the history, without frames.
+  std::shared_ptr<Context> capture_context() {
+    static const int historyContextInterval = ([]()->int{
+        const char* env = getenv("historyContextInterval");
+        if(env) return atoi(env);
+        else return 1;
+    })();
+    CreateContextFn context_recorder = context_recorder_.load();
+    if (!context_recorder) {
+      return nullptr;
+    }
+    if (historyContextInterval > 1) {
+      thread_local uint64_t mallocs = 0;
+      if (mallocs++ % historyContextInterval != 0) {
+        return nullptr;
+      }
+    }
+    return context_recorder();
+  }
+
+  // Records the allocation of block in its history and the trace, with
+  // ExclusiveLock held or a shared shard_gate and stats_mutex.
+  void record_alloc_history(
+      Block* block,
+      size_t orig_size,
+      const std::shared_ptr<Context>& context) {
+    trimHistoryBefore(*history_arena, block, (char*)block->ptr + block->actual_size);
+    BlockCold& cold = block->cold_ext();
+    cold.history = history_arena->create(
+        block->ptr,
+        orig_size,
+        history_arena->contexts.intern(context),
+        cold.history);
+    if (!cold.history_last) {
+      cold.history_last = cold.history;
+    }
+    record_trace(
+        TraceEntry::ALLOC,
+        int64_t(block->ptr),
+        orig_size,
+        block->stream,
+        cold.history->context_id);
+  }
+
+  void record_trace(
+      TraceEntry::Action action,
+      int64_t addr,
+      size_t size,
+      cudaStream_t stream,
+      uint32_t context_id) {
+    ContextTable& contexts = history_arena->contexts;
+    TraceRecord& record = alloc_trace[alloc_trace_next];
+    if (alloc_trace_size == alloc_trace.size()) {
+      contexts.release(record.context_id);
+    } else {
+      alloc_trace_size += 1;
+    }
+    if (!alloc_trace_record_context_) {
+      context_id = 0;
+    }
+    contexts.retain(context_id);
+    record = TraceRecord{
+        timeline_now_ns(), addr, int64_t(size), stream, context_id, action};
+    if (++alloc_trace_next == alloc_trace.size()) {
+      alloc_trace_next = 0;
+    }
+  }
+
+  // oldest first
+  template <typename F>
+  void for_each_trace_record(F f) const {
+    const size_t first = alloc_trace_size < alloc_trace.size() ? 0 : alloc_trace_next;
+    for (size_t i = 0; i < alloc_trace_size; i++) {
+      f(alloc_trace[(first + i) % alloc_trace.size()]);
+    }
+  }
+
+  void clear_trace() {
+    for_each_trace_record([&](const TraceRecord& record) {
+      history_arena->contexts.release(record.context_id);
+    });
+    alloc_trace_next = 0;
+    alloc_trace_size = 0;
+  }
+
+  // returns the history of the block to the arena before the block itself
+  void destroy_block(Block* block) {
+    if (block->cold) {
+      history_arena->destroy_chain(block->cold->history);
+    }
+    block_slab.destroy(block);
+  }
+
+  static int64_t timeline_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  void record_span(
+      TimelineEvent::Kind kind,
+      int64_t start_ns,
+      int64_t addr,
+      int64_t size,
+      cudaStream_t stream,
+      MallocPath path = MallocPath::FAILED) {
+    TimelineEvent ev{kind, TraceEntry::ALLOC, path, start_ns,
+                     timeline_now_ns() - start_ns, addr, size, stream};
+    if (timeline_spans.size() < alloc_trace_max_entries_) {
+      timeline_spans.push_back(ev);
+    } else {
+      timeline_spans[timeline_spans_next++] = ev;
+      if (timeline_spans_next == alloc_trace_max_entries_) {
+        timeline_spans_next = 0;
+      }
+    }
+  }
+
+  // Records a timeline span covering its lifetime when history is on. With
+  // params, only if the guarded call produced a block.
+  class TimelineSpanGuard {
+   public:
+    TimelineSpanGuard(
+        DeviceCachingAllocator& allocator,
+        TimelineEvent::Kind kind,
+        const AllocParams* params = nullptr)
+        : allocator_(allocator),
+          kind_(kind),
+          params_(params),
+          block_at_start_(params ? params->block : nullptr),
+          start_ns_(allocator.record_history ? timeline_now_ns() : 0) {}
+
+    ~TimelineSpanGuard() {
+      if (!allocator_.record_history || start_ns_ == 0) {
+        return;
+      }
+      if (params_) {
+        Block* block = params_->block;
+        if (block && block != block_at_start_) {
+          allocator_.record_span(
+              kind_, start_ns_, int64_t(block->ptr), block->size, params_->stream());
+        }
+      } else {
+        allocator_.record_span(kind_, start_ns_, 0, size_, nullptr);
+      }
+    }
+
+    void set_size(size_t size) {
+      size_ = static_cast<int64_t>(size);
+    }
+
+   private:
+    DeviceCachingAllocator& allocator_;
+    TimelineEvent::Kind kind_;
+    const AllocParams* params_;
+    Block* block_at_start_;
+    int64_t start_ns_;
+    int64_t size_ = 0;
+  };
+};
+
+class NativeCachingAllocator {
+ private:
+  // allocated blocks of all devices by device pointer; free, recordStream
+  // and getBaseAllocation look blocks up without taking a lock
+  AddressRangeIndex<Block> allocated_blocks;
+  static_assert(
+      decltype(allocated_blocks)::kAlignment == kMinBlockSize,
+      "block pointers are multiples of kMinBlockSize");
+
+  void add_allocated_block(Block* block) {
+    GCPOOL_ASSERT(
+        allocated_blocks.insert(block),
+        "device pointer outside the range of the allocated block index: ",
+        block->ptr);
+  }
+
+ public:
+  std::vector<std::unique_ptr<DeviceCachingAllocator>> device_allocator;
+
+  Block* get_allocated_block(void* ptr, bool remove = false) {
+    if (remove) {
+      return allocated_blocks.erase(ptr);
+    }
+    return allocated_blocks.find(ptr);
+  }
+
+  void init(int device_count) {
+    const auto size = static_cast<int64_t>(device_allocator.size());
+    static const int vmmDefragment = ([]()->int{
+        const char* env = getenv("vmmDefragment");
+        if(env) return atoi(env);
+        else return 1;
+    })();
+    if (vmmDefragment) {
+        GCPOOL_INFO(" GCPOOL initialized");
+    }
+    if (size < device_count) {
+      device_allocator.resize(device_count);
+      for (int64_t i = size; i < device_count; ++i) {
+        device_allocator[i] = std::make_unique<DeviceCachingAllocator>();
+      }
+    }
+  }
+
+  bool initialized() {
+    return device_allocator.size() > 0;
+  }
+
+  /** allocates a block which is safe to use from the provided stream */
+  void malloc(void** devPtr, int device, size_t size, cudaStream_t stream) {
+    GCPOOL_ASSERT(
+        0 <= device && static_cast<size_t>(device) < device_allocator.size(),
+        "Allocator not initialized for device ",
+        device,
+        ": did you call init?");
+    Block* block = device_allocator[device]->malloc(device, size, stream);
+    add_allocated_block(block);
+    *devPtr = (void*)block->ptr;
+  }
+
+  void free(void* ptr) {
+    if (!ptr) {
+      return;
+    }
+    Block* block = get_allocated_block(ptr, true /* remove */);
+    if (!block) {
+      GCPOOL_CHECK(false, "invalid device pointer: ", ptr);
+    }
+    device_allocator[block->device]->free(block);
+  }
+
+  void setMemoryFraction(double fraction, int device) {
+    GCPOOL_ASSERT(
+        0 <= device && static_cast<size_t>(device) < device_allocator.size(),
+        "Allocator not initialized for device ",
+        device,
+        ": did you call init?");
+    GCPOOL_ASSERT(
+        0 <= fraction && fraction <= 1,
+        "invalid fraction:",
+        fraction,
+        ". Please set within (0, 1).");
+    int activated_device;
+    GCPOOL_CUDA_CHECK(cudaGetDevice(&activated_device));
+    if (activated_device != device) {
+      GCPOOL_CUDA_CHECK(cudaSetDevice(device));
+    }
+    device_allocator[device]->setMemoryFraction(fraction);
+  }
+
+  void recordHistory(
+      bool enabled,
+      CreateContextFn context_recorder,
+      size_t alloc_trace_max_entries,
+      bool alloc_trace_record_context) {
+    int device;
+    GCPOOL_CUDA_CHECK(cudaGetDevice(&device));
+    device_allocator[device]->recordHistory(
+        enabled,
+        std::move(context_recorder),
+        alloc_trace_max_entries,
+        alloc_trace_record_context);
+  }
+
+  void attachOutOfMemoryObserver(OutOfMemoryObserver observer) {
+    int device;
+    GCPOOL_CUDA_CHECK(cudaGetDevice(&device));
+    device_allocator[device]->attachOutOfMemoryObserver(std::move(observer));
+  }
+
+  void emptyCache() {
+    for (auto& da : device_allocator)
+      da->emptyCache();
+  }
+
+  void* getBaseAllocation(void* ptr, size_t* outSize) {
+    // also resolves pointers into the middle of an allocation
+    Block* block = allocated_blocks.findContaining(ptr);
+    if (!block) {
+      GCPOOL_CHECK(false, "invalid device pointer: ", ptr);
+    }
+    return device_allocator[block->device]->getBaseAllocation(block, outSize);
+  }
+
+  void recordStream(void* ptr, cudaStream_t stream, int device) {
+    // Empty tensor's storage().data() might be a null ptr. As there is no
+    // blocks associated with those tensors, it is fine to do nothing here.
+    if (!ptr) {
+      return;
+    }
+    Block* block = get_allocated_block(ptr);
+    // block must not be null reaching here
+    GCPOOL_ASSERT(block != nullptr, "No allocated block can be found");
+    device_allocator[block->device]->recordStream(block, stream, device);
+  }
+
+  SnapshotInfo snapshot() {
+    SnapshotInfo result;
+    for (auto& da : device_allocator) {
+      result.device_traces.emplace_back(da->trace());
+      auto snap = da->snapshot();
+      result.segments.insert(result.segments.end(), snap.begin(), snap.end());
+    }
+    return result;
+  }
+
+  void cacheInfo(int dev_id, size_t* largestBlock) {
+    assertValidDevice(dev_id);
+    device_allocator[dev_id]->cacheInfo(largestBlock);
+  }
+
+  void assertValidDevice(int device) {
+    const auto device_num = device_allocator.size();
+    GCPOOL_CHECK(
+        0 <= device && device < static_cast<int64_t>(device_num),
+        "Invalid device argument ",
+        device,
+        ": did you call init?");
+  }
+
+  DeviceStats getDeviceStats(int device) {
+    assertValidDevice(device);
+    return device_allocator[device]->getStats();
+  }
+
+  GCPoolStats getGCPoolStats(int device) {
+    assertValidDevice(device);
+    return device_allocator[device]->getGCPoolStats();
+  }
+
+  MallocPathStats getMallocPathStats(int device) {
+    assertValidDevice(device);
+    return device_allocator[device]->getMallocPathStats();
+  }
+
+  std::vector<TimelineEvent> getTimeline(int device) {
+    assertValidDevice(device);
+    return device_allocator[device]->timeline();
+  }
+
+  void resetMallocPathStats(int device) {
+    assertValidDevice(device);
+    device_allocator[device]->resetMallocPathStats();
+  }
+
+  void resetAccumulatedStats(int device) {
+    assertValidDevice(device);
+    device_allocator[device]->resetAccumulatedStats();
+  }
+
+  void resetPeakStats(int device) {
+    assertValidDevice(device);
+    device_allocator[device]->resetPeakStats();
+  }
+  // CUDAGraph interactions
+  void notifyCaptureBegin(
+      int device,
+      CaptureId_t graph_id,
+      MempoolId_t mempool_id) {
+    assertValidDevice(device);
+    device_allocator[device]->notifyCaptureBegin(
+        graph_id, std::move(mempool_id));
+  }
+
+  void notifyCaptureAboutToEnd(int device, CaptureId_t graph_id) {
+    assertValidDevice(device);
+    device_allocator[device]->notifyCaptureAboutToEnd(graph_id);
+  }
+
+  void notifyCaptureDestroy(int device, MempoolId_t mempool_id) {
+    assertValidDevice(device);
+    device_allocator[device]->notifyCaptureDestroy(std::move(mempool_id));
+  }
+
+  void* raw_alloc_with_stream(size_t nbytes, cudaStream_t stream) {
+    if (nbytes == 0) {
+      return nullptr;
+    }
+    int device;
+    GCPOOL_CUDA_CHECK(cudaGetDevice(&device));
+    void* r = nullptr;
+    malloc(&r, device, nbytes, stream);
+    return r;
+  }
+};
+
+NativeCachingAllocator allocator;
+
+} // namespace Native
+
+void init(int device_count) {
+  Native::allocator.init(device_count);
+}
+
+bool initialized() {
+  return Native::allocator.initialized();
+}
+
+void* raw_alloc_with_stream(size_t nbytes, cudaStream_t stream) {
+  return Native::allocator.raw_alloc_with_stream(nbytes, stream);
+}
+
+void raw_delete(void* ptr) {
+  Native::allocator.free(ptr);
+}
+
+void recordStream(void* ptr, cudaStream_t stream, int device) {
+  Native::allocator.recordStream(ptr, stream, device);
+}
+
+void* getBaseAllocation(void* ptr, size_t* size) {
+  return Native::allocator.getBaseAllocation(ptr, size);
+}
+
+void emptyCache() {
+  Native::allocator.emptyCache();
+}
+
+void cacheInfo(int device, size_t* largestBlock) {
+  Native::allocator.cacheInfo(device, largestBlock);
+}
+
+void setMemoryFraction(double fraction, int device) {
+  Native::allocator.setMemoryFraction(fraction, device);
+}
+
+void recordHistory(
+    bool enabled,
+    CreateContextFn context_recorder,
+    size_t alloc_trace_max_entries,
+    bool alloc_trace_record_context) {
+  Native::allocator.recordHistory(
+      enabled,
+      context_recorder,
+      alloc_trace_max_entries,
+      alloc_trace_record_context);
+}
+
+void attachOutOfMemoryObserver(OutOfMemoryObserver observer) {
+  Native::allocator.attachOutOfMemoryObserver(std::move(observer));
+}
+
+DeviceStats getDeviceStats(int device) {
+  return Native::allocator.getDeviceStats(device);
+}
+
+void resetAccumulatedStats(int device) {
+  Native::allocator.resetAccumulatedStats(device);
+}
+
+void resetPeakStats(int device) {
+  Native::allocator.resetPeakStats(device);
+}
+
+SnapshotInfo snapshot() {
+  return Native::allocator.snapshot();
+}
+
+void notifyCaptureBegin(int device, CaptureId_t graph_id, MempoolId_t mempool_id) {
+  Native::allocator.notifyCaptureBegin(device, graph_id, std::move(mempool_id));
+}
+
+void notifyCaptureAboutToEnd(int device, CaptureId_t graph_id) {
+  Native::allocator.notifyCaptureAboutToEnd(device, graph_id);
+}
+
+void notifyCaptureEnded(int device, CaptureId_t graph_id) {} // no-op
+
+void notifyCaptureDestroy(int device, MempoolId_t mempool_id) {
+  Native::allocator.notifyCaptureDestroy(device, std::move(mempool_id));
+}
+
+void setAllocatorSettings(const std::string& env) {
+  CachingAllocatorConfig::instance().parseArgs(env.c_str());
+}
+
+void setAllocatorHooks(const AllocatorHooks& hooks) {
+  allocator_hooks = hooks;
+}
+
+GCPoolStats getGCPoolStats(int device) {
+  return Native::allocator.getGCPoolStats(device);
+}
+
+MallocPathStats getMallocPathStats(int device) {
+  return Native::allocator.getMallocPathStats(device);
+}
+
+void resetMallocPathStats(int device) {
+  Native::allocator.resetMallocPathStats(device);
+}
+
+std::vector<TimelineEvent> getTimeline(int device) {
+  return Native::allocator.getTimeline(device);
+}
+
+const char* mallocPathName(MallocPath path) {
+  switch (path) {
+    case MallocPath::THREAD_MAGAZINE:
+      return "thread_magazine";
+    case MallocPath::CACHED_BLOCK:
+      return "cached_block";
+    case MallocPath::CACHED_AFTER_CALLBACKS:
+      return "cached_after_callbacks";
+    case MallocPath::NEW_SEGMENT:
+      return "new_segment";
+    case MallocPath::NEW_SEGMENT_AFTER_RELEASE:
+      return "new_segment_after_release";
+    case MallocPath::FUSED_BLOCKS:
+      return "fused_blocks";
+    case MallocPath::NEW_SEGMENT_AFTER_FLUSH:
+      return "new_segment_after_flush";
+    case MallocPath::FUSED_AFTER_FLUSH:
+      return "fused_after_flush";
+    case MallocPath::FAILED:
+      return "failed";
+    default:
+      return "unknown";
+  }
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t ns) {
+  if (ns < kSubBuckets) {
+    return static_cast<size_t>(ns);
+  }
+  size_t exponent = 63 - gcpool::countLeadingZeros(ns);
+  if (exponent > kMaxExponent) {
+    return kBuckets - 1;
+  }
+  size_t sub = (ns >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+  return (exponent - kSubBucketBits + 1) * kSubBuckets + sub;
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  size_t exponent = index / kSubBuckets + kSubBucketBits - 1;
+  uint64_t sub = index % kSubBuckets;
+  return ((kSubBuckets + sub + 1) << (exponent - kSubBucketBits)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+  count += 1;
+  total_ns += static_cast<int64_t>(ns);
+  max_ns = std::max(max_ns, static_cast<int64_t>(ns));
+  buckets[bucketIndex(ns)] += 1;
+}
+
+uint64_t LatencyHistogram::percentile(double q) const {
+  if (count == 0) {
+    return 0;
+  }
+  int64_t rank = std::max<int64_t>(1, static_cast<int64_t>(q * count + 0.5));
+  int64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; i++) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return std::min(bucketUpperBound(i), static_cast<uint64_t>(max_ns));
+    }
+  }
+  return static_cast<uint64_t>(max_ns);
+}
+
+namespace detail {
+
+void warn(const char* file, int line, const std::string& msg) {
+  fprintf(stderr, "Warning: %s (%s:%d)\n", msg.c_str(), file, line);
+}
+
+} // namespace detail
+
+} // namespace gcpool
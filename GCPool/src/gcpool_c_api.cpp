@@ -0,0 +1,214 @@
+#include "gcpool.h"
+
+#include "cuda_gcpool_allocator.h"
+#include "gcpool_compat.h"
+
+#include <atomic>
+#include <exception>
+#include <string>
+
+namespace alloc = gcpool;
+
+namespace {
+
+thread_local std::string last_error;
+std::atomic<int> num_devices{0};
+
+gcpoolStatus fail(gcpoolStatus status, const char* msg) {
+  last_error = msg;
+  return status;
+}
+
+gcpoolStatus check_device(int device) {
+  if (num_devices.load() == 0) {
+    return fail(GCPOOL_ERROR_NOT_INITIALIZED, "gcpoolInit has not been called");
+  }
+  if (device < 0 || device >= num_devices.load()) {
+    return fail(GCPOOL_ERROR_INVALID_VALUE, "invalid device index");
+  }
+  return GCPOOL_SUCCESS;
+}
+
+// Runs fn on device and turns allocator exceptions into a status: on_error
+// for gcpool::Error, GCPOOL_ERROR_OUT_OF_MEMORY when no block could be found
+// or mapped.
+template <typename Fn>
+gcpoolStatus on_device(int device, gcpoolStatus on_error, Fn&& fn) {
+  int prev_device = 0;
+  if (cudaGetDevice(&prev_device) != cudaSuccess) {
+    cudaGetLastError();
+    return fail(GCPOOL_ERROR_INTERNAL, "cudaGetDevice failed");
+  }
+  if (prev_device != device && cudaSetDevice(device) != cudaSuccess) {
+    cudaGetLastError();
+    return fail(GCPOOL_ERROR_INVALID_VALUE, "cudaSetDevice failed");
+  }
+
+  gcpoolStatus status = GCPOOL_SUCCESS;
+  try {
+    fn();
+  } catch (const gcpool::OutOfMemoryError& e) {
+    status = fail(GCPOOL_ERROR_OUT_OF_MEMORY, e.what());
+  } catch (const gcpool::Error& e) {
+    status = fail(on_error, e.what());
+  } catch (const std::exception& e) {
+    status = fail(GCPOOL_ERROR_INTERNAL, e.what());
+  }
+
+  if (prev_device != device) {
+    cudaSetDevice(prev_device);
+  }
+  return status;
+}
+
+} // anonymous namespace
+
+extern "C" {
+
+gcpoolStatus gcpoolInit(int device_count) {
+  if (device_count <= 0) {
+    return fail(GCPOOL_ERROR_INVALID_VALUE, "device_count must be positive");
+  }
+  try {
+    alloc::init(device_count);
+  } catch (const std::exception& e) {
+    return fail(GCPOOL_ERROR_INTERNAL, e.what());
+  }
+
+  int prev = num_devices.load();
+  while (prev < device_count && !num_devices.compare_exchange_weak(prev, device_count)) {
+  }
+  return GCPOOL_SUCCESS;
+}
+
+gcpoolStatus gcpoolMalloc(void** ptr, size_t size, int device, cudaStream_t stream) {
+  if (ptr == nullptr) {
+    return fail(GCPOOL_ERROR_INVALID_VALUE, "ptr is NULL");
+  }
+  *ptr = nullptr;
+  gcpoolStatus status = check_device(device);
+  if (status != GCPOOL_SUCCESS) {
+    return status;
+  }
+  if (size == 0) {
+    return GCPOOL_SUCCESS;
+  }
+  return on_device(device, GCPOOL_ERROR_INTERNAL, [&]() {
+    *ptr = alloc::raw_alloc_with_stream(size, stream);
+  });
+}
+
+gcpoolStatus gcpoolFree(void* ptr) {
+  if (ptr == nullptr) {
+    return GCPOOL_SUCCESS;
+  }
+  if (num_devices.load() == 0) {
+    return fail(GCPOOL_ERROR_NOT_INITIALIZED, "gcpoolInit has not been called");
+  }
+  try {
+    alloc::raw_delete(ptr);
+  } catch (const std::exception& e) {
+    return fail(GCPOOL_ERROR_INVALID_VALUE, e.what());
+  }
+  return GCPOOL_SUCCESS;
+}
+
+gcpoolStatus gcpoolEmptyCache(void) {
+  if (num_devices.load() == 0) {
+    return fail(GCPOOL_ERROR_NOT_INITIALIZED, "gcpoolInit has not been called");
+  }
+  try {
+    alloc::emptyCache();
+  } catch (const std::exception& e) {
+    return fail(GCPOOL_ERROR_INTERNAL, e.what());
+  }
+  return GCPOOL_SUCCESS;
+}
+
+gcpoolStatus gcpoolSetMemoryFraction(double fraction, int device) {
+  gcpoolStatus status = check_device(device);
+  if (status != GCPOOL_SUCCESS) {
+    return status;
+  }
+  if (fraction < 0.0 || fraction > 1.0) {
+    return fail(GCPOOL_ERROR_INVALID_VALUE, "fraction must be within [0, 1]");
+  }
+  return on_device(device, GCPOOL_ERROR_INTERNAL, [&]() {
+    alloc::setMemoryFraction(fraction, device);
+  });
+}
+
+gcpoolStatus gcpoolGetStats(int device, gcpoolStats* stats) {
+  if (stats == nullptr) {
+    return fail(GCPOOL_ERROR_INVALID_VALUE, "stats is NULL");
+  }
+  gcpoolStatus status = check_device(device);
+  if (status != GCPOOL_SUCCESS) {
+    return status;
+  }
+
+  return on_device(device, GCPOOL_ERROR_INTERNAL, [&]() {
+    const size_t aggregate = static_cast<size_t>(alloc::StatType::AGGREGATE);
+    auto s = alloc::getDeviceStats(device);
+    auto g = alloc::getGCPoolStats(device);
+
+    stats->allocated_bytes = s.allocated_bytes[aggregate].current;
+    stats->peak_allocated_bytes = s.allocated_bytes[aggregate].peak;
+    stats->reserved_bytes = s.reserved_bytes[aggregate].current;
+    stats->peak_reserved_bytes = s.reserved_bytes[aggregate].peak;
+    stats->active_bytes = s.active_bytes[aggregate].current;
+    stats->num_allocations = s.allocation[aggregate].current;
+    stats->num_segments = s.segment[aggregate].current;
+    stats->num_alloc_retries = s.num_alloc_retries;
+    stats->num_ooms = s.num_ooms;
+    stats->num_fusions = g.num_fusions;
+    stats->fused_bytes = g.fused_bytes;
+    stats->num_gc_passes = g.num_gc_passes;
+    stats->gc_bytes = g.gc_bytes;
+  });
+}
+
+gcpoolStatus gcpoolResetPeakStats(int device) {
+  gcpoolStatus status = check_device(device);
+  if (status != GCPOOL_SUCCESS) {
+    return status;
+  }
+  return on_device(device, GCPOOL_ERROR_INTERNAL, [&]() {
+    alloc::resetPeakStats(device);
+  });
+}
+
+gcpoolStatus gcpoolSnapshot(gcpoolSegment* segments, size_t capacity, size_t* count) {
+  if (count == nullptr || (segments == nullptr && capacity > 0)) {
+    return fail(GCPOOL_ERROR_INVALID_VALUE, "invalid snapshot buffer");
+  }
+  if (num_devices.load() == 0) {
+    return fail(GCPOOL_ERROR_NOT_INITIALIZED, "gcpoolInit has not been called");
+  }
+
+  try {
+    auto snap = alloc::snapshot();
+    *count = snap.segments.size();
+    for (size_t i = 0; i < snap.segments.size() && i < capacity; i++) {
+      const auto& seg = snap.segments[i];
+      gcpoolSegment& out = segments[i];
+      out.address = static_cast<uint64_t>(seg.address);
+      out.total_size = static_cast<uint64_t>(seg.total_size);
+      out.allocated_size = static_cast<uint64_t>(seg.allocated_size);
+      out.active_size = static_cast<uint64_t>(seg.active_size);
+      out.stream = seg.stream;
+      out.device = static_cast<int>(seg.device);
+      out.is_large = seg.is_large ? 1 : 0;
+      out.num_blocks = static_cast<int>(seg.blocks.size());
+    }
+  } catch (const std::exception& e) {
+    return fail(GCPOOL_ERROR_INTERNAL, e.what());
+  }
+  return GCPOOL_SUCCESS;
+}
+
+const char* gcpoolGetLastError(void) {
+  return last_error.c_str();
+}
+
+} // extern "C"
@@ -0,0 +1,805 @@
+// Host-memory implementation of the CUDA driver/runtime entry points used by
+// the GCPool allocator. See host_vmm_backend.h for the model.
+//
+// Build this translation unit against the CUDA headers, or against host/ on
+// a machine without the toolkit, and link it instead of
+// libcuda.so/libcudart.so; every symbol below has the exact signature of the
+// real API so the allocator sources do not change.
+
+#include "host_vmm_backend.h"
+#include "utils.h"
+
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct CUstream_st {
+  int device;
+  unsigned int flags;
+  int priority;
+};
+
+struct CUevent_st {
+  cudaStream_t stream;
+  int pending_queries;
+};
+
+namespace {
+
+constexpr size_t kDefaultDeviceMemory = size_t(16) << 30;
+
+struct HostPhyAlloc {
+  size_t offset;
+  size_t size;
+  int device;
+  // live cuMemMap ranges backed by this allocation
+  size_t map_count;
+  bool released;
+};
+
+struct HostMapping {
+  size_t size;
+  int device;
+  CUmemGenericAllocationHandle handle;
+};
+
+// All physical allocations of a device live in one sparse memfd, so pools
+// with tens of thousands of granules do not need one descriptor each.
+// Released ranges are hole-punched and recycled by size.
+struct HostDeviceArena {
+  int fd = -1;
+  size_t file_size = 0;
+  size_t top = 0;
+  std::map<size_t, std::vector<size_t>> free_offsets;
+
+  bool allocate(size_t size, size_t* offset) {
+    if (fd < 0) {
+      fd = memfd_create("gcpool_device_memory", MFD_CLOEXEC);
+      if (fd < 0) {
+        return false;
+      }
+    }
+    auto it = free_offsets.find(size);
+    if (it != free_offsets.end() && !it->second.empty()) {
+      *offset = it->second.back();
+      it->second.pop_back();
+      return true;
+    }
+    if (top + size > file_size) {
+      size_t new_size = std::max(top + size, file_size * 2);
+      if (ftruncate(fd, (off_t)new_size) != 0) {
+        return false;
+      }
+      file_size = new_size;
+    }
+    *offset = top;
+    top += size;
+    return true;
+  }
+
+  void recycle(size_t offset, size_t size) {
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)size);
+    free_offsets[size].push_back(offset);
+  }
+};
+
+// cudaMalloc allocations come from the device arena too, so that
+// cudaIpcGetMemHandle can hand out the arena range to another process.
+struct HostRuntimeAlloc {
+  size_t offset;
+  size_t size;
+  int device;
+};
+
+// Contents of a cudaIpcMemHandle_t: the exporting process reaches the arena
+// memfd through /proc/<pid>/fd/<fd> and maps the range of the allocation.
+struct HostIpcHandle {
+  uint64_t magic;
+  int32_t pid;
+  int32_t fd;
+  uint64_t offset;
+  uint64_t size;
+  int32_t device;
+};
+
+static_assert(sizeof(HostIpcHandle) <= sizeof(cudaIpcMemHandle_t),
+              "HostIpcHandle must fit into cudaIpcMemHandle_t");
+
+constexpr uint64_t kIpcHandleMagic = 0x6763706f6f6c6970ULL; // "gcpoolip"
+
+struct HostBackend {
+  HostBackend() {
+    const char* count_env = getenv("hostDeviceCount");
+    const char* memory_env = getenv("hostDeviceMemory");
+    const char* latency_env = getenv("hostEventLatency");
+
+    int device_count = count_env ? std::max(1, atoi(count_env)) : 1;
+    size_t device_memory = memory_env ? (size_t)std::stoull(memory_env) : kDefaultDeviceMemory;
+    event_latency = latency_env ? std::max(0, atoi(latency_env)) : 0;
+
+    devices.assign(device_count, HostBackendDeviceInfo{device_memory, 0, 0, 0, 0});
+    arenas.resize(device_count);
+  }
+
+  bool valid_device(int device) const {
+    return device >= 0 && device < static_cast<int>(devices.size());
+  }
+
+  bool charge(int device, size_t size) {
+    auto& info = devices[device];
+    if (info.used_bytes + size > info.total_bytes) {
+      return false;
+    }
+    info.used_bytes += size;
+    info.peak_used_bytes = std::max(info.peak_used_bytes, info.used_bytes);
+    return true;
+  }
+
+  void uncharge(int device, size_t size) {
+    devices[device].used_bytes -= size;
+  }
+
+  // Returns the range to the arena once it is neither held nor mapped.
+  void maybe_recycle(std::unordered_map<CUmemGenericAllocationHandle, HostPhyAlloc>::iterator it) {
+    const HostPhyAlloc& phy = it->second;
+    if (phy.released && phy.map_count == 0) {
+      arenas[phy.device].recycle(phy.offset, phy.size);
+      handles.erase(it);
+    }
+  }
+
+  std::mutex mutex;
+  std::vector<HostBackendDeviceInfo> devices;
+  std::vector<HostDeviceArena> arenas;
+  int event_latency;
+  HostBackendCallCounts calls{};
+
+  CUmemGenericAllocationHandle next_handle = 1;
+  std::unordered_map<CUmemGenericAllocationHandle, HostPhyAlloc> handles;
+  // reserved virtual ranges, keyed by start address
+  std::map<CUdeviceptr, HostMapping> reservations;
+  // live cuMemMap ranges, keyed by start address
+  std::map<CUdeviceptr, HostMapping> mappings;
+  std::unordered_map<void*, HostRuntimeAlloc> runtime_allocs;
+  // ranges mapped by cudaIpcOpenMemHandle, keyed by start address
+  std::unordered_map<void*, size_t> ipc_mappings;
+};
+
+HostBackend& backend() {
+  // Leaked on purpose: allocator singletons free memory from exit handlers.
+  static HostBackend* instance = new HostBackend();
+  return *instance;
+}
+
+thread_local int current_device = 0;
+thread_local cudaError_t last_error = cudaSuccess;
+thread_local cudaStreamCaptureMode capture_mode = cudaStreamCaptureModeGlobal;
+
+cudaError_t set_error(cudaError_t err) {
+  if (err != cudaSuccess && err != cudaErrorNotReady) {
+    last_error = err;
+  }
+  return err;
+}
+
+size_t page_round(size_t size) {
+  static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
+
+// Returns the reservation containing [ptr, ptr + size), or end().
+std::map<CUdeviceptr, HostMapping>::iterator find_reservation(HostBackend& b, CUdeviceptr ptr, size_t size) {
+  auto it = b.reservations.upper_bound(ptr);
+  if (it == b.reservations.begin()) {
+    return b.reservations.end();
+  }
+  --it;
+  if (ptr + size > it->first + it->second.size) {
+    return b.reservations.end();
+  }
+  return it;
+}
+
+} // anonymous namespace
+
+void hostBackendConfigure(int device_count, size_t device_memory, int event_latency) {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.devices.assign(std::max(1, device_count), HostBackendDeviceInfo{device_memory, 0, 0, 0, 0});
+  b.arenas.resize(b.devices.size());
+  b.event_latency = std::max(0, event_latency);
+}
+
+HostBackendDeviceInfo hostBackendDeviceInfo(int device) {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  if (!b.valid_device(device)) {
+    return HostBackendDeviceInfo{0, 0, 0, 0, 0};
+  }
+  return b.devices[device];
+}
+
+void hostBackendResetPeak(int device) {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  if (b.valid_device(device)) {
+    b.devices[device].peak_used_bytes = b.devices[device].used_bytes;
+  }
+}
+
+HostBackendCallCounts hostBackendCallCounts() {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  return b.calls;
+}
+
+void hostBackendResetCallCounts() {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.calls = HostBackendCallCounts{};
+}
+
+extern "C" {
+
+// ---------------------------------------------------------------------------
+// Driver API
+// ---------------------------------------------------------------------------
+
+CUresult cuInit(unsigned int flags) {
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGet(CUdevice* device, int ordinal) {
+  if (!backend().valid_device(ordinal)) {
+    return CUDA_ERROR_INVALID_DEVICE;
+  }
+  *device = ordinal;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuCtxGetDevice(CUdevice* device) {
+  *device = current_device;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuCtxGetCurrent(CUcontext* ctx) {
+  // any non-null value: the allocator only checks that a context exists
+  *ctx = reinterpret_cast<CUcontext>(static_cast<uintptr_t>(current_device) + 1);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuCtxSetCurrent(CUcontext ctx) {
+  if (ctx) {
+    current_device = static_cast<int>(reinterpret_cast<uintptr_t>(ctx) - 1);
+  }
+  return CUDA_SUCCESS;
+}
+
+CUresult cuGetErrorString(CUresult error, const char** str) {
+  switch (error) {
+    case CUDA_SUCCESS: *str = "no error"; break;
+    case CUDA_ERROR_INVALID_VALUE: *str = "invalid argument"; break;
+    case CUDA_ERROR_OUT_OF_MEMORY: *str = "out of memory"; break;
+    case CUDA_ERROR_INVALID_DEVICE: *str = "invalid device ordinal"; break;
+    case CUDA_ERROR_NOT_MAPPED: *str = "mapping of buffer object failed"; break;
+    case CUDA_ERROR_ALREADY_MAPPED: *str = "resource already mapped"; break;
+    default: *str = "unknown error"; break;
+  }
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemGetInfo(size_t* free, size_t* total) {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  const auto& info = b.devices[current_device];
+  *free = info.total_bytes - info.used_bytes;
+  *total = info.total_bytes;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemGetAllocationGranularity(size_t* granularity,
+                                       const CUmemAllocationProp* prop,
+                                       CUmemAllocationGranularity_flags option) {
+  *granularity = granularitySize;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemCreate(CUmemGenericAllocationHandle* handle,
+                     size_t size,
+                     const CUmemAllocationProp* prop,
+                     unsigned long long flags) {
+  auto& b = backend();
+  int device = prop ? prop->location.id : current_device;
+  if (size == 0 || size % granularitySize != 0) {
+    return CUDA_ERROR_INVALID_VALUE;
+  }
+
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.calls.mem_create++;
+  if (!b.valid_device(device)) {
+    return CUDA_ERROR_INVALID_DEVICE;
+  }
+  if (!b.charge(device, size)) {
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  }
+
+  size_t offset;
+  if (!b.arenas[device].allocate(size, &offset)) {
+    b.uncharge(device, size);
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  }
+
+  *handle = b.next_handle++;
+  b.handles.emplace(*handle, HostPhyAlloc{offset, size, device, 0, false});
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemRelease(CUmemGenericAllocationHandle handle) {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.calls.mem_release++;
+  auto it = b.handles.find(handle);
+  if (it == b.handles.end() || it->second.released) {
+    return CUDA_ERROR_INVALID_VALUE;
+  }
+  // Like the driver, pages stay alive while a mapping still references them;
+  // the arena range is recycled on the last cuMemUnmap.
+  it->second.released = true;
+  b.uncharge(it->second.device, it->second.size);
+  b.maybe_recycle(it);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemAddressReserve(CUdeviceptr* ptr,
+                             size_t size,
+                             size_t alignment,
+                             CUdeviceptr addr,
+                             unsigned long long flags) {
+  if (size == 0) {
+    return CUDA_ERROR_INVALID_VALUE;
+  }
+  alignment = std::max(alignment, granularitySize);
+
+  // over-reserve so that the aligned start fits, then trim head and tail
+  size_t span = size + alignment;
+  void* base = mmap(reinterpret_cast<void*>(addr), span, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  }
+
+  uintptr_t start = reinterpret_cast<uintptr_t>(base);
+  uintptr_t aligned = (start + alignment - 1) / alignment * alignment;
+  if (aligned > start) {
+    munmap(base, aligned - start);
+  }
+  uintptr_t tail = aligned + size;
+  uintptr_t end = start + span;
+  if (end > tail) {
+    munmap(reinterpret_cast<void*>(tail), end - tail);
+  }
+
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.calls.address_reserve++;
+  b.reservations.emplace((CUdeviceptr)aligned, HostMapping{size, current_device, 0});
+  b.devices[current_device].reserved_va_bytes += size;
+  *ptr = (CUdeviceptr)aligned;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemAddressFree(CUdeviceptr ptr, size_t size) {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.calls.address_free++;
+  auto it = b.reservations.find(ptr);
+  if (it == b.reservations.end() || it->second.size != size) {
+    return CUDA_ERROR_INVALID_VALUE;
+  }
+  munmap(reinterpret_cast<void*>(ptr), size);
+  b.devices[it->second.device].reserved_va_bytes -= size;
+  b.reservations.erase(it);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemMap(CUdeviceptr ptr,
+                  size_t size,
+                  size_t offset,
+                  CUmemGenericAllocationHandle handle,
+                  unsigned long long flags) {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.calls.mem_map++;
+  auto h = b.handles.find(handle);
+  if (h == b.handles.end() || h->second.released || offset + size > h->second.size) {
+    return CUDA_ERROR_INVALID_VALUE;
+  }
+  if (find_reservation(b, ptr, size) == b.reservations.end()) {
+    return CUDA_ERROR_INVALID_VALUE;
+  }
+  // the driver refuses to map over a live mapping, even partially
+  auto next = b.mappings.lower_bound(ptr);
+  if (next != b.mappings.end() && next->first < ptr + size) {
+    return CUDA_ERROR_ALREADY_MAPPED;
+  }
+  if (next != b.mappings.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second.size > ptr) {
+      return CUDA_ERROR_ALREADY_MAPPED;
+    }
+  }
+
+  void* mapped = mmap(reinterpret_cast<void*>(ptr), size, PROT_NONE,
+                      MAP_SHARED | MAP_FIXED, b.arenas[h->second.device].fd,
+                      (off_t)(h->second.offset + offset));
+  if (mapped == MAP_FAILED) {
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  }
+
+  h->second.map_count++;
+  b.mappings[ptr] = HostMapping{size, h->second.device, handle};
+  b.devices[h->second.device].mapped_bytes += size;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemUnmap(CUdeviceptr ptr, size_t size) {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.calls.mem_unmap++;
+
+  // the range may cover several consecutive cuMemMap calls
+  auto it = b.mappings.lower_bound(ptr);
+  if (it == b.mappings.end() || it->first != ptr) {
+    return CUDA_ERROR_NOT_MAPPED;
+  }
+  while (it != b.mappings.end() && it->first < ptr + size) {
+    b.devices[it->second.device].mapped_bytes -= it->second.size;
+    auto h = b.handles.find(it->second.handle);
+    if (h != b.handles.end()) {
+      h->second.map_count--;
+      b.maybe_recycle(h);
+    }
+    it = b.mappings.erase(it);
+  }
+
+  // keep the range reserved: replace the file mapping with PROT_NONE
+  void* reset = mmap(reinterpret_cast<void*>(ptr), size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  return reset == MAP_FAILED ? CUDA_ERROR_INVALID_VALUE : CUDA_SUCCESS;
+}
+
+CUresult cuMemSetAccess(CUdeviceptr ptr,
+                        size_t size,
+                        const CUmemAccessDesc* desc,
+                        size_t count) {
+  {
+    auto& b = backend();
+    std::lock_guard<std::mutex> lock(b.mutex);
+    b.calls.set_access++;
+  }
+  int prot = PROT_NONE;
+  for (size_t i = 0; i < count; i++) {
+    if (desc[i].flags == CU_MEM_ACCESS_FLAGS_PROT_READWRITE) {
+      prot = PROT_READ | PROT_WRITE;
+    } else if (desc[i].flags == CU_MEM_ACCESS_FLAGS_PROT_READ && prot == PROT_NONE) {
+      prot = PROT_READ;
+    }
+  }
+  if (mprotect(reinterpret_cast<void*>(ptr), size, prot) != 0) {
+    return CUDA_ERROR_INVALID_VALUE;
+  }
+  return CUDA_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+// Runtime API
+// ---------------------------------------------------------------------------
+
+const char* cudaGetErrorString(cudaError_t error) {
+  switch (error) {
+    case cudaSuccess: return "no error";
+    case cudaErrorInvalidValue: return "invalid argument";
+    case cudaErrorMemoryAllocation: return "out of memory";
+    case cudaErrorInvalidDevice: return "invalid device ordinal";
+    case cudaErrorInvalidResourceHandle: return "invalid resource handle";
+    case cudaErrorNotReady: return "device not ready";
+    default: return "unknown error";
+  }
+}
+
+const char* cudaGetErrorName(cudaError_t error) {
+  return cudaGetErrorString(error);
+}
+
+cudaError_t cudaGetLastError() {
+  cudaError_t err = last_error;
+  last_error = cudaSuccess;
+  return err;
+}
+
+cudaError_t cudaPeekAtLastError() {
+  return last_error;
+}
+
+cudaError_t cudaDriverGetVersion(int* version) {
+  *version = 11080;
+  return cudaSuccess;
+}
+
+cudaError_t cudaRuntimeGetVersion(int* version) {
+  *version = 11080;
+  return cudaSuccess;
+}
+
+cudaError_t cudaGetDeviceCount(int* count) {
+  *count = static_cast<int>(backend().devices.size());
+  return cudaSuccess;
+}
+
+cudaError_t cudaGetDevice(int* device) {
+  *device = current_device;
+  return cudaSuccess;
+}
+
+cudaError_t cudaSetDevice(int device) {
+  if (!backend().valid_device(device)) {
+    return set_error(cudaErrorInvalidDevice);
+  }
+  current_device = device;
+  return cudaSuccess;
+}
+
+cudaError_t cudaDeviceSynchronize() {
+  return cudaSuccess;
+}
+
+// one priority level, like a device without stream priorities
+cudaError_t cudaDeviceGetStreamPriorityRange(int* least, int* greatest) {
+  if (least) *least = 0;
+  if (greatest) *greatest = 0;
+  return cudaSuccess;
+}
+
+cudaError_t cudaMemGetInfo(size_t* free, size_t* total) {
+  cuMemGetInfo(free, total);
+  return cudaSuccess;
+}
+
+cudaError_t cudaMalloc(void** ptr, size_t size) {
+  auto& b = backend();
+  size = page_round(std::max(size, size_t(1)));
+
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.calls.malloc++;
+  if (!b.charge(current_device, size)) {
+    *ptr = nullptr;
+    return set_error(cudaErrorMemoryAllocation);
+  }
+  size_t offset;
+  if (!b.arenas[current_device].allocate(size, &offset)) {
+    b.uncharge(current_device, size);
+    *ptr = nullptr;
+    return set_error(cudaErrorMemoryAllocation);
+  }
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 b.arenas[current_device].fd, (off_t)offset);
+  if (p == MAP_FAILED) {
+    b.arenas[current_device].recycle(offset, size);
+    b.uncharge(current_device, size);
+    *ptr = nullptr;
+    return set_error(cudaErrorMemoryAllocation);
+  }
+  b.runtime_allocs.emplace(p, HostRuntimeAlloc{offset, size, current_device});
+  *ptr = p;
+  return cudaSuccess;
+}
+
+cudaError_t cudaFree(void* ptr) {
+  if (!ptr) {
+    return cudaSuccess;
+  }
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.calls.free++;
+  auto it = b.runtime_allocs.find(ptr);
+  if (it == b.runtime_allocs.end()) {
+    return set_error(cudaErrorInvalidValue);
+  }
+  munmap(ptr, it->second.size);
+  b.arenas[it->second.device].recycle(it->second.offset, it->second.size);
+  b.uncharge(it->second.device, it->second.size);
+  b.runtime_allocs.erase(it);
+  return cudaSuccess;
+}
+
+cudaError_t cudaIpcGetMemHandle(cudaIpcMemHandle_t* handle, void* ptr) {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  auto it = b.runtime_allocs.find(ptr);
+  if (it == b.runtime_allocs.end()) {
+    return set_error(cudaErrorInvalidValue);
+  }
+  HostIpcHandle ipc{kIpcHandleMagic, (int32_t)getpid(), b.arenas[it->second.device].fd,
+                    it->second.offset, it->second.size, it->second.device};
+  memset(handle, 0, sizeof(*handle));
+  memcpy(handle, &ipc, sizeof(ipc));
+  return cudaSuccess;
+}
+
+// Unlike the driver, a handle may also be opened by the process that exported
+// it; the range is then mapped a second time at another address.
+cudaError_t cudaIpcOpenMemHandle(void** ptr, cudaIpcMemHandle_t handle, unsigned int flags) {
+  HostIpcHandle ipc;
+  memcpy(&ipc, &handle, sizeof(ipc));
+  if (ipc.magic != kIpcHandleMagic || ipc.size == 0) {
+    return set_error(cudaErrorInvalidResourceHandle);
+  }
+
+  int fd = ipc.fd;
+  bool own_fd = ipc.pid != (int32_t)getpid();
+  if (own_fd) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)ipc.pid, (int)ipc.fd);
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+      return set_error(cudaErrorMapBufferObjectFailed);
+    }
+  }
+  void* p = mmap(nullptr, ipc.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)ipc.offset);
+  if (own_fd) {
+    close(fd);
+  }
+  if (p == MAP_FAILED) {
+    return set_error(cudaErrorMapBufferObjectFailed);
+  }
+
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.ipc_mappings.emplace(p, ipc.size);
+  *ptr = p;
+  return cudaSuccess;
+}
+
+cudaError_t cudaIpcCloseMemHandle(void* ptr) {
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  auto it = b.ipc_mappings.find(ptr);
+  if (it == b.ipc_mappings.end()) {
+    return set_error(cudaErrorInvalidValue);
+  }
+  munmap(ptr, it->second);
+  b.ipc_mappings.erase(it);
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamCreateWithPriority(cudaStream_t* stream, unsigned int flags, int priority) {
+  *stream = new CUstream_st{current_device, flags, priority};
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamCreateWithFlags(cudaStream_t* stream, unsigned int flags) {
+  return cudaStreamCreateWithPriority(stream, flags, 0);
+}
+
+cudaError_t cudaStreamCreate(cudaStream_t* stream) {
+  return cudaStreamCreateWithFlags(stream, 0);
+}
+
+cudaError_t cudaStreamDestroy(cudaStream_t stream) {
+  delete stream;
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamGetFlags(cudaStream_t stream, unsigned int* flags) {
+  *flags = stream ? stream->flags : 0;
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamGetPriority(cudaStream_t stream, int* priority) {
+  *priority = stream ? stream->priority : 0;
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamQuery(cudaStream_t stream) {
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamSynchronize(cudaStream_t stream) {
+  return cudaSuccess;
+}
+
+// host work is synchronous, so the event is complete by the time it is waited on
+cudaError_t cudaStreamWaitEvent(cudaStream_t stream, cudaEvent_t event, unsigned int flags) {
+  if (!event) {
+    return set_error(cudaErrorInvalidResourceHandle);
+  }
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamGetCaptureInfo(cudaStream_t stream,
+                                     cudaStreamCaptureStatus* status,
+                                     unsigned long long* id) {
+  *status = cudaStreamCaptureStatusNone;
+  if (id) *id = 0;
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamIsCapturing(cudaStream_t stream, cudaStreamCaptureStatus* status) {
+  *status = cudaStreamCaptureStatusNone;
+  return cudaSuccess;
+}
+
+cudaError_t cudaThreadExchangeStreamCaptureMode(cudaStreamCaptureMode* mode) {
+  std::swap(*mode, capture_mode);
+  return cudaSuccess;
+}
+
+cudaError_t cudaEventCreateWithFlags(cudaEvent_t* event, unsigned int flags) {
+  *event = new CUevent_st{nullptr, 0};
+  return cudaSuccess;
+}
+
+cudaError_t cudaEventCreate(cudaEvent_t* event) {
+  return cudaEventCreateWithFlags(event, 0);
+}
+
+cudaError_t cudaEventDestroy(cudaEvent_t event) {
+  if (!event) {
+    return set_error(cudaErrorInvalidResourceHandle);
+  }
+  delete event;
+  return cudaSuccess;
+}
+
+cudaError_t cudaEventRecord(cudaEvent_t event, cudaStream_t stream) {
+  if (!event) {
+    return set_error(cudaErrorInvalidResourceHandle);
+  }
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.calls.event_record++;
+  event->stream = stream;
+  event->pending_queries = b.event_latency;
+  return cudaSuccess;
+}
+
+cudaError_t cudaEventQuery(cudaEvent_t event) {
+  if (!event) {
+    return set_error(cudaErrorInvalidResourceHandle);
+  }
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  b.calls.event_query++;
+  if (event->pending_queries > 0) {
+    event->pending_queries--;
+    return cudaErrorNotReady;
+  }
+  return cudaSuccess;
+}
+
+cudaError_t cudaEventSynchronize(cudaEvent_t event) {
+  if (!event) {
+    return set_error(cudaErrorInvalidResourceHandle);
+  }
+  auto& b = backend();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  event->pending_queries = 0;
+  return cudaSuccess;
+}
+
+} // extern "C"
@@ -0,0 +1,339 @@
+#include "policy_compare.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <type_traits>
+
+namespace {
+
+// The child hands its report back through a pipe as raw bytes; both ends are
+// the same binary, so trivially copyable parts are copied as they are.
+class ReportWriter {
+ public:
+  template <typename T>
+  void put(const T& value) {
+    static_assert(std::is_trivially_copyable<T>::value, "report field must be trivially copyable");
+    buf.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template <typename T>
+  void put_vector(const std::vector<T>& values) {
+    put(values.size());
+    for (const auto& value : values) {
+      put(value);
+    }
+  }
+
+  std::string buf;
+};
+
+class ReportReader {
+ public:
+  explicit ReportReader(const std::string& buf) : buf(buf) {}
+
+  template <typename T>
+  bool get(T& value) {
+    static_assert(std::is_trivially_copyable<T>::value, "report field must be trivially copyable");
+    if (buf.size() - pos < sizeof(T)) {
+      return false;
+    }
+    memcpy(&value, buf.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+  }
+
+  template <typename T>
+  bool get_vector(std::vector<T>& values) {
+    size_t count = 0;
+    if (!get(count) || count > (buf.size() - pos) / sizeof(T)) {
+      return false;
+    }
+    values.resize(count);
+    for (auto& value : values) {
+      get(value);
+    }
+    return true;
+  }
+
+  bool done() const { return pos == buf.size(); }
+
+ private:
+  const std::string& buf;
+  size_t pos = 0;
+};
+
+std::string serialize_report(const ReplayReport& r) {
+  ReportWriter w;
+  w.put(r.num_allocs);
+  w.put(r.num_frees);
+  w.put(r.num_ooms);
+  w.put(r.num_unmatched_frees);
+  w.put(r.peak_reserved_bytes);
+  w.put(r.peak_allocated_bytes);
+  w.put(r.max_fragmentation);
+  w.put(r.elapsed_ms);
+  w.put(r.malloc_p50_ns);
+  w.put(r.malloc_p99_ns);
+  w.put(r.malloc_max_ns);
+  w.put_vector(r.oom_steps);
+  w.put(r.device_stats);
+  w.put(r.gcpool_stats);
+  w.put(r.malloc_paths);
+  w.put(r.driver_latency);
+  w.put_vector(r.samples);
+  return w.buf;
+}
+
+bool deserialize_report(const std::string& buf, ReplayReport& r) {
+  ReportReader rd(buf);
+  return rd.get(r.num_allocs) && rd.get(r.num_frees) && rd.get(r.num_ooms) &&
+      rd.get(r.num_unmatched_frees) && rd.get(r.peak_reserved_bytes) &&
+      rd.get(r.peak_allocated_bytes) && rd.get(r.max_fragmentation) &&
+      rd.get(r.elapsed_ms) && rd.get(r.malloc_p50_ns) && rd.get(r.malloc_p99_ns) &&
+      rd.get(r.malloc_max_ns) && rd.get_vector(r.oom_steps) && rd.get(r.device_stats) &&
+      rd.get(r.gcpool_stats) && rd.get(r.malloc_paths) && rd.get(r.driver_latency) &&
+      rd.get_vector(r.samples) && rd.done();
+}
+
+bool write_all(int fd, const std::string& buf) {
+  size_t written = 0;
+  while (written < buf.size()) {
+    ssize_t n = write(fd, buf.data() + written, buf.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+std::string read_all(int fd) {
+  std::string buf;
+  char chunk[65536];
+  while (true) {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    buf.append(chunk, n);
+  }
+  return buf;
+}
+
+PolicyRun run_policy(const std::vector<ReplayEntry>& trace, const ReplayOptions& options,
+                     const AllocatorPolicy& policy, size_t device_memory) {
+  PolicyRun run;
+  run.policy = policy;
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return run;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return run;
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+    for (const auto& kv : policy.env) {
+      setenv(kv.first.c_str(), kv.second.c_str(), 1);
+    }
+    initReplayDevice(options.device, device_memory);
+    ReplayReport report = replayTrace(trace, options);
+    bool ok = write_all(fds[1], serialize_report(report));
+    close(fds[1]);
+    // skip static destructors of the allocator inherited from the parent
+    _exit(ok ? 0 : 1);
+  }
+
+  close(fds[1]);
+  std::string buf = read_all(fds[0]);
+  close(fds[0]);
+
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  run.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && deserialize_report(buf, run.report);
+  return run;
+}
+
+double max_reserved_ratio(const ReplayReport& report) {
+  double ratio = 0.0;
+  for (const auto& sample : report.samples) {
+    if (sample.allocated_bytes > 0) {
+      ratio = std::max(ratio, static_cast<double>(sample.reserved_bytes) / sample.allocated_bytes);
+    }
+  }
+  return ratio;
+}
+
+} // anonymous namespace
+
+std::vector<AllocatorPolicy> defaultComparePolicies() {
+  return {
+      {"native", {{"vmmDefragment", "0"}}},
+      {"gcpool", {{"vmmDefragment", "1"}}},
+  };
+}
+
+bool parseAllocatorPolicy(const std::string& spec, AllocatorPolicy& policy) {
+  size_t colon = spec.find(':');
+  policy.name = spec.substr(0, colon);
+  policy.env.clear();
+  if (policy.name.empty()) {
+    return false;
+  }
+  if (colon == std::string::npos) {
+    return true;
+  }
+
+  std::stringstream ss(spec.substr(colon + 1));
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    size_t eq = item.find('=');
+    if (eq == std::string::npos || eq == 0) {
+      return false;
+    }
+    policy.env.emplace_back(item.substr(0, eq), item.substr(eq + 1));
+  }
+  return true;
+}
+
+std::vector<PolicyRun> comparePolicies(const std::vector<ReplayEntry>& trace,
+                                       const ReplayOptions& options,
+                                       const std::vector<AllocatorPolicy>& policies,
+                                       size_t device_memory) {
+  std::vector<PolicyRun> runs;
+  // one policy at a time, so the latencies are not measured under contention
+  for (const auto& policy : policies) {
+    runs.push_back(run_policy(trace, options, policy, device_memory));
+  }
+  return runs;
+}
+
+void printPolicyComparison(std::ostream& out, const std::vector<PolicyRun>& runs) {
+  const double MB = 1024.0 * 1024.0;
+  const size_t kAggregate = static_cast<size_t>(gcpool::StatType::AGGREGATE);
+
+  auto row = [&](const char* label, const std::function<void(const ReplayReport&)>& cell) {
+    out << std::left << std::setw(28) << label << std::right;
+    for (const auto& run : runs) {
+      out << std::setw(16);
+      if (run.ok) {
+        cell(run.report);
+      } else {
+        out << "failed";
+      }
+    }
+    out << "\n";
+  };
+
+  out << std::fixed << std::setprecision(2);
+  out << std::left << std::setw(28) << "policy" << std::right;
+  for (const auto& run : runs) {
+    out << std::setw(16) << run.policy.name;
+  }
+  out << "\n";
+
+  row("peak reserved (MB)", [&](const ReplayReport& r) { out << r.peak_reserved_bytes / MB; });
+  row("peak allocated (MB)", [&](const ReplayReport& r) { out << r.peak_allocated_bytes / MB; });
+  row("peak reserved/allocated", [&](const ReplayReport& r) {
+    out << (r.peak_allocated_bytes > 0 ? static_cast<double>(r.peak_reserved_bytes) / r.peak_allocated_bytes : 0.0);
+  });
+  row("max reserved/allocated", [&](const ReplayReport& r) { out << max_reserved_ratio(r); });
+  row("max fragmentation (%)", [&](const ReplayReport& r) { out << r.max_fragmentation * 100.0; });
+  row("ooms", [&](const ReplayReport& r) { out << r.num_ooms; });
+  row("first oom step", [&](const ReplayReport& r) {
+    if (r.oom_steps.empty()) {
+      out << "-";
+    } else {
+      out << r.oom_steps.front();
+    }
+  });
+  row("malloc p50 (ns)", [&](const ReplayReport& r) { out << r.malloc_p50_ns; });
+  row("malloc p99 (ns)", [&](const ReplayReport& r) { out << r.malloc_p99_ns; });
+  for (size_t i = 0; i < gcpool::kNumMallocPaths; i++) {
+    bool used = std::any_of(runs.begin(), runs.end(), [&](const PolicyRun& run) {
+      return run.ok && run.report.malloc_paths.hits[i] > 0;
+    });
+    if (!used) {
+      continue;
+    }
+    auto path = static_cast<gcpool::MallocPath>(i);
+    std::string label = std::string("  ") + gcpool::mallocPathName(path);
+    row(label.c_str(), [&](const ReplayReport& r) { out << r.malloc_paths.hits[i]; });
+  }
+  row("alloc retries", [&](const ReplayReport& r) { out << r.device_stats.num_alloc_retries; });
+  row("segments allocated", [&](const ReplayReport& r) { out << r.device_stats.segment[kAggregate].allocated; });
+  row("fusions", [&](const ReplayReport& r) { out << r.gcpool_stats.num_fusions; });
+  row("gc passes", [&](const ReplayReport& r) { out << r.gcpool_stats.num_gc_passes; });
+  row("driver calls", [&](const ReplayReport& r) { out << driverMemoryCalls(r.driver_latency); });
+  for (size_t i = 0; i <= static_cast<size_t>(DriverApi::FREE); i++) {
+    DriverApi api = static_cast<DriverApi>(i);
+    bool used = std::any_of(runs.begin(), runs.end(), [&](const PolicyRun& run) {
+      return run.ok && run.report.driver_latency[api].count > 0;
+    });
+    if (!used) {
+      continue;
+    }
+    std::string label = std::string("  ") + driverApiName(api);
+    row(label.c_str(), [&](const ReplayReport& r) { out << r.driver_latency[api].count; });
+  }
+  row("replay time (ms)", [&](const ReplayReport& r) { out << r.elapsed_ms; });
+}
+
+void writePolicySamplesCsv(std::ostream& out, const std::vector<PolicyRun>& runs) {
+  size_t rows = 0;
+  out << "step";
+  for (const auto& run : runs) {
+    const auto& name = run.policy.name;
+    out << ',' << name << "_reserved_bytes," << name << "_allocated_bytes," << name << "_ratio";
+    rows = std::max(rows, run.report.samples.size());
+  }
+  out << '\n';
+
+  // every policy replays the same trace with the same interval, so sample i
+  // is taken at the same step in every run
+  for (size_t i = 0; i < rows; i++) {
+    bool have_step = false;
+    for (const auto& run : runs) {
+      if (i < run.report.samples.size()) {
+        out << run.report.samples[i].step;
+        have_step = true;
+        break;
+      }
+    }
+    if (!have_step) {
+      continue;
+    }
+    for (const auto& run : runs) {
+      if (i < run.report.samples.size()) {
+        const auto& s = run.report.samples[i];
+        double ratio = s.allocated_bytes > 0 ? static_cast<double>(s.reserved_bytes) / s.allocated_bytes : 0.0;
+        out << ',' << s.reserved_bytes << ',' << s.allocated_bytes << ',' << ratio;
+      } else {
+        out << ",,,";
+      }
+    }
+    out << '\n';
+  }
+}
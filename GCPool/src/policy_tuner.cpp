@@ -0,0 +1,153 @@
+#include "policy_tuner.h"
+
+#include <iomanip>
+#include <map>
+#include <ostream>
+
+namespace {
+
+const double MB = 1024.0 * 1024.0;
+
+AllocatorPolicy make_policy(const std::vector<TunerKnob>& knobs, const std::vector<size_t>& choice) {
+  AllocatorPolicy policy;
+  policy.env.emplace_back("vmmDefragment", "1");
+  for (size_t k = 0; k < knobs.size(); k++) {
+    policy.env.emplace_back(knobs[k].env, knobs[k].values[choice[k]]);
+  }
+  for (size_t i = 1; i < policy.env.size(); i++) {
+    policy.name += (i > 1 ? "," : "") + policy.env[i].first + "=" + policy.env[i].second;
+  }
+  return policy;
+}
+
+bool feasible(const PolicyRun& run, const PolicyRun& baseline, uint64_t budget_ns) {
+  return run.ok && run.report.num_ooms <= baseline.report.num_ooms &&
+      run.report.malloc_p99_ns <= budget_ns;
+}
+
+bool better(const PolicyRun& a, const PolicyRun& b) {
+  if (a.report.peak_reserved_bytes != b.report.peak_reserved_bytes) {
+    return a.report.peak_reserved_bytes < b.report.peak_reserved_bytes;
+  }
+  return a.report.malloc_p99_ns < b.report.malloc_p99_ns;
+}
+
+} // anonymous namespace
+
+std::vector<TunerKnob> defaultTunerKnobs() {
+  return {
+      {"fragLimit", "536870912",
+       {"67108864", "134217728", "268435456", "536870912", "1073741824", "2147483648"}},
+      {"reuseLimit", "10", {"1.5", "2", "4", "10", "20"}},
+      {"defragLevel", "0", {"0", "2", "3"}},
+      {"autoGC", "1000", {"16", "64", "256", "1000"}},
+  };
+}
+
+TunerResult tuneAllocatorKnobs(const std::vector<ReplayEntry>& trace,
+                               const TunerOptions& options,
+                               const std::vector<TunerKnob>& knobs) {
+  TunerResult result;
+
+  std::vector<size_t> current(knobs.size(), 0);
+  for (size_t k = 0; k < knobs.size(); k++) {
+    for (size_t v = 0; v < knobs[k].values.size(); v++) {
+      if (knobs[k].values[v] == knobs[k].default_value) {
+        current[k] = v;
+      }
+    }
+  }
+
+  // configurations already replayed, keyed by policy name
+  std::map<std::string, size_t> seen;
+  auto evaluate = [&](const std::vector<size_t>& choice) -> const PolicyRun& {
+    AllocatorPolicy policy = make_policy(knobs, choice);
+    auto it = seen.find(policy.name);
+    if (it == seen.end()) {
+      auto runs = comparePolicies(trace, options.replay, {policy}, options.device_memory);
+      result.evaluated.push_back(runs.front());
+      it = seen.emplace(policy.name, result.evaluated.size() - 1).first;
+    }
+    return result.evaluated[it->second];
+  };
+
+  result.baseline = evaluate(current);
+  if (!result.baseline.ok) {
+    return result;
+  }
+  result.latency_budget_ns = options.max_p99_ns > 0
+      ? options.max_p99_ns
+      : static_cast<uint64_t>(result.baseline.report.malloc_p99_ns * options.max_p99_ratio);
+
+  PolicyRun best = result.baseline;
+  bool best_feasible = feasible(best, result.baseline, result.latency_budget_ns);
+
+  // coordinate descent: move one knob at a time to its best value
+  for (size_t round = 0; round < options.max_rounds; round++) {
+    bool improved = false;
+    for (size_t k = 0; k < knobs.size(); k++) {
+      size_t best_value = current[k];
+      for (size_t v = 0; v < knobs[k].values.size(); v++) {
+        if (v == current[k]) {
+          continue;
+        }
+        std::vector<size_t> choice = current;
+        choice[k] = v;
+        const PolicyRun& run = evaluate(choice);
+        if (feasible(run, result.baseline, result.latency_budget_ns) &&
+            (!best_feasible || better(run, best))) {
+          best = run;
+          best_feasible = true;
+          best_value = v;
+        }
+      }
+      if (best_value != current[k]) {
+        current[k] = best_value;
+        improved = true;
+      }
+    }
+    if (!improved) {
+      break;
+    }
+  }
+
+  result.ok = best_feasible;
+  result.best = best.policy;
+  result.best_run = best;
+  return result;
+}
+
+void printTunerResult(std::ostream& out, const TunerResult& result) {
+  out << std::fixed << std::setprecision(2);
+  out << "evaluated configurations: " << result.evaluated.size() << "\n";
+  for (const auto& run : result.evaluated) {
+    out << "  " << std::left << std::setw(80) << run.policy.name << std::right;
+    if (run.ok) {
+      out << std::setw(12) << run.report.peak_reserved_bytes / MB << " MB"
+          << std::setw(12) << run.report.malloc_p99_ns << " ns p99"
+          << std::setw(6) << run.report.num_ooms << " ooms\n";
+    } else {
+      out << "  failed\n";
+    }
+  }
+
+  if (!result.baseline.ok) {
+    out << "baseline replay failed\n";
+    return;
+  }
+  out << "malloc p99 budget:        " << result.latency_budget_ns << " ns\n"
+      << "default peak reserved:    " << result.baseline.report.peak_reserved_bytes / MB << " MB\n";
+  if (!result.ok) {
+    out << "no configuration met the latency budget\n";
+    return;
+  }
+  out << "best peak reserved:       " << result.best_run.report.peak_reserved_bytes / MB << " MB\n"
+      << "best malloc p99:          " << result.best_run.report.malloc_p99_ns << " ns\n"
+      << "best configuration:       " << result.best.name << "\n";
+}
+
+void writeTunerConfig(std::ostream& out, const TunerResult& result) {
+  for (const auto& kv : result.best.env) {
+    out << "export " << kv.first << "=" << kv.second << "\n";
+  }
+}
@@ -0,0 +1,343 @@
+#include "trace_replay.h"
+
+#include "gcpool_compat.h"
+#ifdef GCPOOL_HOST_BACKEND
+#include "host_vmm_backend.h"
+#endif
+
+#include <cuda_runtime_api.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <unordered_map>
+
+namespace {
+
+using gcpool::MallocPath;
+using gcpool::StatType;
+using gcpool::TraceEntry;
+
+constexpr size_t kAggregate = static_cast<size_t>(StatType::AGGREGATE);
+constexpr size_t kMallocPaths = gcpool::kNumMallocPaths;
+
+struct ActionName {
+  ReplayAction action;
+  const char* name;
+};
+
+const ActionName kActionNames[] = {
+    {TraceEntry::ALLOC, "alloc"},
+    {TraceEntry::FREE_REQUESTED, "free_requested"},
+    {TraceEntry::FREE_COMPLETED, "free_completed"},
+    {TraceEntry::SEGMENT_ALLOC, "segment_alloc"},
+    {TraceEntry::SEGMENT_FREE, "segment_free"},
+    {TraceEntry::SNAPSHOT, "snapshot"},
+    {TraceEntry::OOM, "oom"},
+};
+
+uint64_t percentile(std::vector<uint64_t>& values, double q) {
+  if (values.empty()) {
+    return 0;
+  }
+  size_t idx = std::min(values.size() - 1, static_cast<size_t>(q * values.size()));
+  std::nth_element(values.begin(), values.begin() + idx, values.end());
+  return values[idx];
+}
+
+ReplaySample take_sample(size_t step, int device) {
+  auto stats = gcpool::getDeviceStats(device);
+  ReplaySample sample;
+  sample.step = step;
+  sample.reserved_bytes = stats.reserved_bytes[kAggregate].current;
+  sample.allocated_bytes = stats.allocated_bytes[kAggregate].current;
+  sample.fragmentation = sample.reserved_bytes > 0
+      ? 1.0 - static_cast<double>(sample.allocated_bytes) / sample.reserved_bytes
+      : 0.0;
+  return sample;
+}
+
+} // anonymous namespace
+
+const char* replayActionName(ReplayAction action) {
+  for (const auto& entry : kActionNames) {
+    if (entry.action == action) {
+      return entry.name;
+    }
+  }
+  return "unknown";
+}
+
+bool parseReplayAction(const std::string& name, ReplayAction* action) {
+  for (const auto& entry : kActionNames) {
+    if (name == entry.name) {
+      *action = entry.action;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool loadTrace(const std::string& path, std::vector<ReplayEntry>& trace) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    std::string name;
+    ReplayEntry entry;
+    if (!(fields >> name >> entry.addr >> entry.size >> entry.stream) ||
+        !parseReplayAction(name, &entry.action)) {
+      return false;
+    }
+    trace.push_back(entry);
+  }
+  return true;
+}
+
+std::vector<ReplayEntry> replayEntriesFromTrace(const std::vector<TraceEntry>& trace) {
+  std::vector<ReplayEntry> entries;
+  entries.reserve(trace.size());
+  for (const auto& te : trace) {
+    entries.push_back(ReplayEntry{te.action_, te.addr_, static_cast<size_t>(te.size_),
+                                  reinterpret_cast<uintptr_t>(te.stream_)});
+  }
+  return entries;
+}
+
+void saveTrace(std::ostream& out, const std::vector<TraceEntry>& trace) {
+  out << "# gcpool trace: action addr size stream\n";
+  for (const auto& te : trace) {
+    out << replayActionName(te.action_) << ' ' << te.addr_ << ' ' << te.size_
+        << ' ' << reinterpret_cast<uintptr_t>(te.stream_) << '\n';
+  }
+}
+
+void saveTrace(std::ostream& out, const std::vector<ReplayEntry>& trace) {
+  out << "# gcpool trace: action addr size stream\n";
+  for (const auto& entry : trace) {
+    out << replayActionName(entry.action) << ' ' << entry.addr << ' '
+        << entry.size << ' ' << entry.stream << '\n';
+  }
+}
+
+template <typename Entry>
+static bool save_trace_file(const std::string& path, const std::vector<Entry>& trace) {
+  std::ofstream out(path);
+  if (!out) {
+    return false;
+  }
+  saveTrace(out, trace);
+  return static_cast<bool>(out);
+}
+
+bool saveTrace(const std::string& path, const std::vector<TraceEntry>& trace) {
+  return save_trace_file(path, trace);
+}
+
+bool saveTrace(const std::string& path, const std::vector<ReplayEntry>& trace) {
+  return save_trace_file(path, trace);
+}
+
+void initReplayDevice(int device, size_t device_memory) {
+#ifdef GCPOOL_HOST_BACKEND
+  if (device_memory > 0) {
+    hostBackendConfigure(device + 1, device_memory);
+  }
+  gcpool::init(device + 1);
+#else
+  gcpool::init(device + 1);
+  if (device_memory > 0) {
+    int prev_device = 0;
+    cudaGetDevice(&prev_device);
+    cudaSetDevice(device);
+    size_t device_free = 0;
+    size_t device_total = 0;
+    GCPOOL_CUDA_CHECK(cudaMemGetInfo(&device_free, &device_total));
+    cudaSetDevice(prev_device);
+    gcpool::setMemoryFraction(std::min(1.0, static_cast<double>(device_memory) / device_total), device);
+  }
+#endif
+}
+
+ReplayReport replayTrace(const std::vector<ReplayEntry>& trace, const ReplayOptions& options) {
+  namespace alloc = gcpool;
+
+  ReplayReport report;
+  const size_t interval = std::max(size_t(1), options.sample_interval);
+
+  int prev_device = 0;
+  cudaGetDevice(&prev_device);
+  cudaSetDevice(options.device);
+
+  alloc::resetPeakStats(options.device);
+  alloc::resetAccumulatedStats(options.device);
+  resetDriverCallStats();
+
+  // recorded stream handle -> stream in this process (0 stays the default stream)
+  std::unordered_map<uint64_t, cudaStream_t> streams;
+  auto get_stream = [&streams](uint64_t recorded) -> cudaStream_t {
+    if (recorded == 0) {
+      return nullptr;
+    }
+    auto it = streams.find(recorded);
+    if (it == streams.end()) {
+      cudaStream_t stream;
+      cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking);
+      it = streams.emplace(recorded, stream).first;
+    }
+    return it->second;
+  };
+
+  // recorded address -> replayed address
+  std::unordered_map<int64_t, void*> live;
+  std::vector<uint64_t> malloc_ns;
+  malloc_ns.reserve(trace.size() / 2);
+  report.samples.push_back(take_sample(0, options.device));
+
+  auto t0 = std::chrono::steady_clock::now();
+  size_t step = 0;
+  for (const auto& entry : trace) {
+    if (entry.action == TraceEntry::ALLOC) {
+      cudaStream_t stream = get_stream(entry.stream);
+      auto m0 = std::chrono::steady_clock::now();
+      try {
+        void* ptr = alloc::raw_alloc_with_stream(entry.size, stream);
+        live[entry.addr] = ptr;
+        report.num_allocs++;
+      } catch (const gcpool::OutOfMemoryError&) {
+        report.num_ooms++;
+        report.oom_steps.push_back(step + 1);
+      }
+      auto m1 = std::chrono::steady_clock::now();
+      malloc_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(m1 - m0).count());
+    } else if (entry.action == TraceEntry::FREE_REQUESTED) {
+      auto it = live.find(entry.addr);
+      if (it == live.end()) {
+        report.num_unmatched_frees++;
+      } else {
+        alloc::raw_delete(it->second);
+        live.erase(it);
+        report.num_frees++;
+      }
+    } else {
+      continue;
+    }
+
+    if (++step % interval == 0) {
+      report.samples.push_back(take_sample(step, options.device));
+    }
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  report.elapsed_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+  if (step % interval != 0) {
+    report.samples.push_back(take_sample(step, options.device));
+  }
+
+  report.device_stats = alloc::getDeviceStats(options.device);
+  report.gcpool_stats = alloc::getGCPoolStats(options.device);
+  report.malloc_paths = alloc::getMallocPathStats(options.device);
+  report.driver_latency = getDriverCallStats();
+  report.peak_reserved_bytes = report.device_stats.reserved_bytes[kAggregate].peak;
+  report.peak_allocated_bytes = report.device_stats.allocated_bytes[kAggregate].peak;
+  for (const auto& sample : report.samples) {
+    report.max_fragmentation = std::max(report.max_fragmentation, sample.fragmentation);
+  }
+  report.malloc_p50_ns = percentile(malloc_ns, 0.50);
+  report.malloc_p99_ns = percentile(malloc_ns, 0.99);
+  report.malloc_max_ns = percentile(malloc_ns, 1.0);
+
+  if (options.release_at_end) {
+    for (auto& kv : live) {
+      alloc::raw_delete(kv.second);
+    }
+    alloc::emptyCache();
+  }
+  for (auto& kv : streams) {
+    cudaStreamDestroy(kv.second);
+  }
+  cudaSetDevice(prev_device);
+
+  return report;
+}
+
+void printReplayReport(std::ostream& out, const ReplayReport& report) {
+  const double MB = 1024.0 * 1024.0;
+  const auto& s = report.device_stats;
+
+  out << std::fixed << std::setprecision(2);
+  out << "replayed allocs:        " << report.num_allocs << "\n"
+      << "replayed frees:         " << report.num_frees << "\n"
+      << "unmatched frees:        " << report.num_unmatched_frees << "\n"
+      << "ooms:                   " << report.num_ooms << "\n"
+      << "malloc p50/p99/max:     " << report.malloc_p50_ns << " / " << report.malloc_p99_ns
+      << " / " << report.malloc_max_ns << " ns\n"
+      << "peak reserved:          " << report.peak_reserved_bytes / MB << " MB\n"
+      << "peak allocated:         " << report.peak_allocated_bytes / MB << " MB\n"
+      << "max fragmentation:      " << report.max_fragmentation * 100.0 << " %\n"
+      << "segments allocated:     " << s.segment[kAggregate].allocated << "\n"
+      << "alloc retries:          " << s.num_alloc_retries << "\n"
+      << "fusions:                " << report.gcpool_stats.num_fusions
+      << " (" << report.gcpool_stats.fused_bytes / MB << " MB)\n"
+      << "gc passes:              " << report.gcpool_stats.num_gc_passes
+      << " (" << report.gcpool_stats.gc_blocks << " blocks, "
+      << report.gcpool_stats.gc_bytes / MB << " MB)\n"
+      << "driver calls:           " << driverMemoryCalls(report.driver_latency) << "\n"
+      << "  cuMemCreate           " << report.driver_latency[DriverApi::MEM_CREATE].count << "\n"
+      << "  cuMemRelease          " << report.driver_latency[DriverApi::MEM_RELEASE].count << "\n"
+      << "  cuMemAddressReserve   " << report.driver_latency[DriverApi::MEM_ADDRESS_RESERVE].count << "\n"
+      << "  cuMemAddressFree      " << report.driver_latency[DriverApi::MEM_ADDRESS_FREE].count << "\n"
+      << "  cuMemMap              " << report.driver_latency[DriverApi::MEM_MAP].count << "\n"
+      << "  cuMemUnmap            " << report.driver_latency[DriverApi::MEM_UNMAP].count << "\n"
+      << "  cuMemSetAccess        " << report.driver_latency[DriverApi::MEM_SET_ACCESS].count << "\n"
+      << "  cudaMalloc            " << report.driver_latency[DriverApi::MALLOC].count << "\n"
+      << "  cudaFree              " << report.driver_latency[DriverApi::FREE].count << "\n"
+      << "replay time:            " << report.elapsed_ms << " ms\n";
+
+  out << "malloc path (ns):       hits      mean      p50       p99       max\n";
+  for (size_t i = 0; i < kMallocPaths; i++) {
+    const auto& hist = report.malloc_paths.latency[i];
+    if (hist.count == 0) {
+      continue;
+    }
+    out << "  " << std::left << std::setw(24) << mallocPathName(static_cast<MallocPath>(i)) << std::right
+        << std::setw(8) << report.malloc_paths.hits[i] << "  "
+        << std::setw(8) << hist.total_ns / hist.count << "  "
+        << std::setw(8) << hist.percentile(0.50) << "  "
+        << std::setw(8) << hist.percentile(0.99) << "  "
+        << std::setw(8) << hist.max_ns << "\n";
+  }
+
+  out << "driver latency (ns):    calls     errors    mean      p50       p99       max\n";
+  for (size_t i = 0; i < kNumDriverApis; i++) {
+    const auto& stat = report.driver_latency.apis[i];
+    if (stat.count == 0) {
+      continue;
+    }
+    out << "  " << std::left << std::setw(24) << driverApiName(static_cast<DriverApi>(i)) << std::right
+        << std::setw(8) << stat.count << "  "
+        << std::setw(8) << stat.errors << "  "
+        << std::setw(8) << stat.total_ns / stat.count << "  "
+        << std::setw(8) << driverCallPercentileNs(stat, 0.50) << "  "
+        << std::setw(8) << driverCallPercentileNs(stat, 0.99) << "  "
+        << std::setw(8) << stat.max_ns << "\n";
+  }
+}
+
+void writeReplaySamplesCsv(std::ostream& out, const ReplayReport& report) {
+  out << "step,reserved_bytes,allocated_bytes,fragmentation\n";
+  for (const auto& sample : report.samples) {
+    out << sample.step << ',' << sample.reserved_bytes << ','
+        << sample.allocated_bytes << ',' << sample.fragmentation << '\n';
+  }
+}
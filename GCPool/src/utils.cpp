@@ -0,0 +1,123 @@
+#include "utils.h"
+
+#include <limits.h>
+#include <string.h>
+
+#include <algorithm>
+
+int gcpoolInfoLevel = -1;
+pthread_mutex_t gcpoolInfoLock = PTHREAD_MUTEX_INITIALIZER;
+FILE* gcpoolInfoFile = stdout;
+
+size_t getGranularitySize() {
+    static size_t granularity = ([]()->size_t{
+        int device;
+        size_t size = 0;
+        cudaGetDevice(&device);
+
+        CUmemAllocationProp prop = {};
+        prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+        prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+        prop.location.id = device;
+        DRV_CALL(cuMemGetAllocationGranularity(&size, &prop, CU_MEM_ALLOC_GRANULARITY_MINIMUM));
+        return size;
+    })();
+    return granularity;
+}
+
+CUresult setMemAccess(void* ptr, size_t size, int current_device_in) {
+    int current_device = current_device_in;
+    if (current_device < 0) {
+        cudaGetDevice(&current_device);
+    }
+
+    CUmemAccessDesc accessDesc = {};
+    accessDesc.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+    accessDesc.location.id = current_device;
+    accessDesc.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+
+    CUresult result = CUDA_SUCCESS;
+    DRV_CALL_RET(cuMemSetAccess((CUdeviceptr)ptr, size, &accessDesc, 1), result);
+    return result;
+}
+
+void getHostName(char* hostname, int maxlen, const char delim) {
+    if (gethostname(hostname, maxlen) != 0) {
+        strncpy(hostname, "unknown", maxlen);
+        return;
+    }
+    int i = 0;
+    while ((hostname[i] != delim) && (hostname[i] != '\0') && (i < maxlen - 1)) i++;
+    hostname[i] = '\0';
+}
+
+// GCPOOL_INFO=1 turns the log on; GCPOOL_INFO_FILE redirects it, with %h
+// replaced by the host name and %p by the pid.
+void gcpoolInfoInit() {
+    pthread_mutex_lock(&gcpoolInfoLock);
+    if (gcpoolInfoLevel != -1) {
+        pthread_mutex_unlock(&gcpoolInfoLock);
+        return;
+    }
+
+    const char* level_env = getenv("GCPOOL_INFO");
+    int level = level_env ? atoi(level_env) : GCPOOL_LOG_NONE;
+
+    const char* file_env = getenv("GCPOOL_INFO_FILE");
+    if (level > GCPOOL_LOG_NONE && file_env) {
+        char path[PATH_MAX + 1] = "";
+        char* out = path;
+        char* const end = path + PATH_MAX;
+        for (const char* in = file_env; *in && out < end; in++) {
+            if (in[0] == '%' && in[1] == 'h') {
+                char hostname[1024];
+                getHostName(hostname, sizeof(hostname), '.');
+                out += snprintf(out, end - out, "%s", hostname);
+                in++;
+            } else if (in[0] == '%' && in[1] == 'p') {
+                out += snprintf(out, end - out, "%d", getpid());
+                in++;
+            } else {
+                *out++ = *in;
+            }
+        }
+        *std::min(out, end) = '\0';
+        FILE* file = fopen(path, "w");
+        if (file) {
+            setbuf(file, nullptr);
+            gcpoolInfoFile = file;
+        }
+    }
+
+    __atomic_store_n(&gcpoolInfoLevel, level, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&gcpoolInfoLock);
+}
+
+void gcpoolInfoLog(const char* filefunc, int line, const char* fmt, ...) {
+    if (__atomic_load_n(&gcpoolInfoLevel, __ATOMIC_ACQUIRE) == -1) {
+        gcpoolInfoInit();
+    }
+    if (gcpoolInfoLevel < GCPOOL_LOG_INFO) {
+        return;
+    }
+
+    static char hostname[1024] = "";
+    if (hostname[0] == '\0') {
+        getHostName(hostname, sizeof(hostname), '.');
+    }
+
+    char buffer[1024];
+    int len = snprintf(buffer, sizeof(buffer), "%s:%d:%d [%s:%d]", hostname, getpid(), gettid(), filefunc, line);
+    if (len >= 0 && len < (int)sizeof(buffer)) {
+        va_list vargs;
+        va_start(vargs, fmt);
+        len += vsnprintf(buffer + len, sizeof(buffer) - len, fmt, vargs);
+        va_end(vargs);
+    }
+    len = std::min(len, (int)sizeof(buffer) - 2);
+
+    pthread_mutex_lock(&gcpoolInfoLock);
+    fprintf(gcpoolInfoFile, "%.*s\n", len, buffer);
+    fflush(gcpoolInfoFile);
+    pthread_mutex_unlock(&gcpoolInfoLock);
+}
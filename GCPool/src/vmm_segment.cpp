@@ -0,0 +1,308 @@
+#include "vmm_segment.h"
+
+#include <iterator>
+
+PhyBlock::PhyBlock(int device_id_in, size_t block_size_in):
+    device_id(device_id_in),
+    block_size(block_size_in),
+    status(CUDA_SUCCESS),
+    free(true),
+    owner_stream(nullptr),
+    released(false) {
+    if (device_id == -1) {
+        cudaGetDevice(&device_id);
+    }
+
+    CUmemAllocationProp prop = {};
+    prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+    prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+    prop.location.id = device_id;
+
+    DRV_CALL_RET(cuMemCreate(&alloc_handle, block_size, &prop, 0ULL), status);
+}
+
+PhyBlock::~PhyBlock() {
+    if (!released) {
+        release_resources();
+    }
+}
+
+void PhyBlock::release_resources() {
+    if (status == CUDA_SUCCESS) {
+        DRV_CALL(cuMemRelease(alloc_handle));
+    }
+    released = true;
+}
+
+VirDevPtr::VirDevPtr(CUdeviceptr addr_in, size_t allocSize_in, int device_id_in):
+    virAddr(nullptr),
+    allocSize(allocSize_in),
+    mapped(false),
+    device_id(device_id_in),
+    status(CUDA_SUCCESS),
+    released(false) {
+    if (device_id == -1) {
+        cudaGetDevice(&device_id);
+    }
+
+    CUdeviceptr device_ptr = 0ULL;
+    DRV_CALL_RET(cuMemAddressReserve(&device_ptr, allocSize, 0ULL, addr_in, 0ULL), status);
+    if (status != CUDA_SUCCESS) {
+        return;
+    }
+    // the address is only a hint to the driver
+    if (addr_in && device_ptr != addr_in) {
+        DRV_CALL(cuMemAddressFree(device_ptr, allocSize));
+        status = CUDA_ERROR_INVALID_VALUE;
+        return;
+    }
+    virAddr = reinterpret_cast<void*>(device_ptr);
+}
+
+VirDevPtr::~VirDevPtr() {
+    if (!released) {
+        release_resources();
+    }
+}
+
+// The VirBlocks unmap their granules before the last of them drops the
+// range, so only a range mapped as a whole (mapped) is unmapped here.
+void VirDevPtr::release_resources() {
+    if (virAddr) {
+        if (mapped) {
+            DRV_CALL(cuMemUnmap(reinterpret_cast<CUdeviceptr>(virAddr), allocSize));
+        }
+        DRV_CALL(cuMemAddressFree(reinterpret_cast<CUdeviceptr>(virAddr), allocSize));
+    }
+    released = true;
+}
+
+// Maps the physical block at vir_dev_ptr + offset. Access is granted by the
+// owner of the range once all its granules are mapped, see
+// VmmSegment::mapVirAddr.
+VirBlock::VirBlock(std::shared_ptr<VirDevPtr> vir_dev_ptr_in, size_t offset_in, size_t blockSize_in,
+                   std::shared_ptr<PhyBlock> phy_block_in, int device_id_in):
+    vir_dev_ptr(std::move(vir_dev_ptr_in)),
+    offset(offset_in),
+    blockSize(blockSize_in),
+    block_ptr(static_cast<char*>(vir_dev_ptr->virAddr) + offset),
+    phy_block(std::move(phy_block_in)),
+    device_id(device_id_in),
+    status(CUDA_SUCCESS),
+    released(false) {
+    if (device_id == -1) {
+        cudaGetDevice(&device_id);
+    }
+
+    DRV_CALL_RET(cuMemMap(reinterpret_cast<CUdeviceptr>(block_ptr), blockSize, 0ULL, phy_block->alloc_handle, 0ULL), status);
+}
+
+VirBlock::~VirBlock() {
+    if (!released) {
+        release_resources();
+    }
+}
+
+void VirBlock::release_resources() {
+    if (status == CUDA_SUCCESS) {
+        DRV_CALL(cuMemUnmap(reinterpret_cast<CUdeviceptr>(block_ptr), blockSize));
+    }
+    released = true;
+}
+
+VmmSegment::VmmSegment():
+    granul_size(granularitySize),
+    segment_ptr(nullptr),
+    device_id(-1),
+    status(CUDA_SUCCESS),
+    free_blocks(0),
+    used_blocks(0),
+    fused(false),
+    released(false) {}
+
+VmmSegment::VmmSegment(size_t blocks, size_t block_size_in, int device_id_in):
+    granul_size(block_size_in),
+    segment_ptr(nullptr),
+    device_id(device_id_in),
+    status(CUDA_SUCCESS),
+    free_blocks(0),
+    used_blocks(0),
+    fused(false),
+    released(false) {
+    if (device_id == -1) {
+        cudaGetDevice(&device_id);
+    }
+    allocate_phy_blocks(blocks, block_size_in, device_id);
+    if (status == CUDA_SUCCESS) {
+        mapVirAddr();
+    }
+}
+
+// Stitches physical blocks owned by other segments into one new range.
+VmmSegment::VmmSegment(std::vector<std::shared_ptr<PhyBlock>>&& phy_blocks_in):
+    phy_blocks(std::move(phy_blocks_in)),
+    granul_size(phy_blocks[0]->block_size),
+    segment_ptr(nullptr),
+    device_id(phy_blocks[0]->device_id),
+    status(CUDA_SUCCESS),
+    free_blocks(0),
+    used_blocks(0),
+    mapped_slots(phy_blocks.size(), 0),
+    fused(true),
+    released(false) {
+    init_free_map();
+    mapVirAddr();
+}
+
+// Takes over granules that are already mapped, the tail of a split.
+VmmSegment::VmmSegment(std::vector<std::shared_ptr<PhyBlock>> phy_blocks_in,
+                       std::vector<std::shared_ptr<VirBlock>> vir_blocks_in):
+    phy_blocks(std::move(phy_blocks_in)),
+    vir_blocks(std::move(vir_blocks_in)),
+    granul_size(phy_blocks.empty() ? granularitySize : phy_blocks[0]->block_size),
+    segment_ptr(vir_blocks.empty() ? nullptr : vir_blocks[0]->block_ptr),
+    device_id(phy_blocks.empty() ? -1 : phy_blocks[0]->device_id),
+    status(CUDA_SUCCESS),
+    free_blocks(0),
+    used_blocks(0),
+    fused(false),
+    released(false) {
+    init_free_map();
+}
+
+VmmSegment::~VmmSegment() {
+    if (!released) {
+        release_resources();
+    }
+}
+
+void VmmSegment::init_free_map() {
+    free_map.assign(phy_blocks.size(), false);
+    for (size_t i = 0; i < phy_blocks.size(); i++) {
+        if (phy_blocks[i]->free) {
+            free_map.set(i, true);
+        }
+    }
+    free_blocks = free_map.count();
+}
+
+void VmmSegment::allocate_phy_blocks(size_t blocks, size_t block_size_in, int device_id_in) {
+    phy_blocks.reserve(blocks);
+    for (size_t i = 0; i < blocks; i++) {
+        auto phy_block = std::make_shared<PhyBlock>(device_id_in, block_size_in);
+        if (phy_block->status != CUDA_SUCCESS) {
+            status = phy_block->status;
+            phy_blocks.clear();
+            break;
+        }
+        phy_blocks.emplace_back(std::move(phy_block));
+    }
+    init_free_map();
+}
+
+void VmmSegment::release_resources() {
+    // unmap first: a PhyBlock may outlive this segment in a fused one
+    vir_blocks.clear();
+    phy_blocks.clear();
+    free_map.assign(0, false);
+    mapped_slots.clear();
+    free_blocks = 0;
+    used_blocks = 0;
+    released = true;
+}
+
+// Reserves one range for all phy_blocks, maps them in order and grants
+// access to the whole range with a single cuMemSetAccess.
+void* VmmSegment::mapVirAddr() {
+    const size_t alloc_size = phy_blocks.size() * granul_size;
+    auto vir_dev_ptr = std::make_shared<VirDevPtr>(0ULL, alloc_size, device_id);
+    if (vir_dev_ptr->status != CUDA_SUCCESS) {
+        status = vir_dev_ptr->status;
+        return nullptr;
+    }
+
+    vir_blocks.reserve(phy_blocks.size());
+    size_t offset = 0;
+    for (auto& phy_block : phy_blocks) {
+        auto vir_block = std::make_shared<VirBlock>(vir_dev_ptr, offset, granul_size, phy_block, device_id);
+        if (vir_block->status != CUDA_SUCCESS) {
+            status = vir_block->status;
+            vir_blocks.clear();
+            return nullptr;
+        }
+        vir_blocks.emplace_back(std::move(vir_block));
+        offset += granul_size;
+    }
+
+    status = setMemAccess(vir_dev_ptr->virAddr, alloc_size, device_id);
+    if (status != CUDA_SUCCESS) {
+        vir_blocks.clear();
+        return nullptr;
+    }
+
+    segment_ptr = vir_dev_ptr->virAddr;
+    return segment_ptr;
+}
+
+// Moves the granules from keep_size on into a new segment that starts where
+// this one now ends. The handles move, so no granule is remapped.
+std::shared_ptr<VmmSegment> VmmSegment::split(size_t keep_size) {
+    ASSERT(!fused, "fused segments are not split");
+    const size_t keep = keep_size / granul_size;
+    auto remaining = std::make_shared<VmmSegment>(
+        std::vector<std::shared_ptr<PhyBlock>>(
+            std::make_move_iterator(phy_blocks.begin() + keep),
+            std::make_move_iterator(phy_blocks.end())),
+        std::vector<std::shared_ptr<VirBlock>>(
+            std::make_move_iterator(vir_blocks.begin() + keep),
+            std::make_move_iterator(vir_blocks.end())));
+    phy_blocks.resize(keep);
+    vir_blocks.resize(keep);
+
+    remaining->free_map = free_map.slice(keep, free_map.size());
+    remaining->free_blocks = remaining->free_map.count();
+    remaining->used_blocks = used_blocks > keep ? used_blocks - keep : 0;
+    free_map.resize(keep);
+    free_blocks -= remaining->free_blocks;
+    used_blocks -= remaining->used_blocks;
+    return remaining;
+}
+
+// Moves the granules of segment onto this one if it directly follows or
+// precedes it in the address space; false otherwise.
+bool VmmSegment::remerge(VmmSegment& segment) {
+    ASSERT(!fused && !segment.fused, "fused segments are not merged");
+    char* ptr = static_cast<char*>(segment_ptr);
+    char* other_ptr = static_cast<char*>(segment.segment_ptr);
+    if (other_ptr == ptr + phy_blocks.size() * granul_size) {
+        phy_blocks.insert(phy_blocks.end(),
+                          std::make_move_iterator(segment.phy_blocks.begin()),
+                          std::make_move_iterator(segment.phy_blocks.end()));
+        vir_blocks.insert(vir_blocks.end(),
+                          std::make_move_iterator(segment.vir_blocks.begin()),
+                          std::make_move_iterator(segment.vir_blocks.end()));
+        free_map.append(segment.free_map);
+    } else if (ptr == other_ptr + segment.phy_blocks.size() * segment.granul_size) {
+        phy_blocks.insert(phy_blocks.begin(),
+                          std::make_move_iterator(segment.phy_blocks.begin()),
+                          std::make_move_iterator(segment.phy_blocks.end()));
+        vir_blocks.insert(vir_blocks.begin(),
+                          std::make_move_iterator(segment.vir_blocks.begin()),
+                          std::make_move_iterator(segment.vir_blocks.end()));
+        GranuleBitmap merged = segment.free_map;
+        merged.append(free_map);
+        free_map = std::move(merged);
+        segment_ptr = segment.segment_ptr;
+    } else {
+        return false;
+    }
+
+    free_blocks += segment.free_blocks;
+    used_blocks += segment.used_blocks;
+    segment.phy_blocks.clear();
+    segment.vir_blocks.clear();
+    segment.free_map.assign(0, false);
+    segment.free_blocks = 0;
+    segment.used_blocks = 0;
+    return true;
+}
@@ -0,0 +1,430 @@
+#include "workload_generator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <numeric>
+
+namespace {
+
+using gcpool::TraceEntry;
+
+size_t round_up(size_t size, size_t multiple) {
+  return (size + multiple - 1) / multiple * multiple;
+}
+
+// log-normal sample with the given mean, clamped to [lo, hi]
+size_t lognormal_length(std::mt19937_64& rng, double mean, double sigma, size_t lo, size_t hi) {
+  std::lognormal_distribution<double> dist(std::log(mean) - sigma * sigma / 2.0, sigma);
+  double value = dist(rng);
+  return std::min(hi, std::max(lo, static_cast<size_t>(value)));
+}
+
+} // anonymous namespace
+
+int64_t WorkloadBuilder::alloc(size_t size, uint64_t stream) {
+  // spread fake addresses so they never collide with each other
+  int64_t addr = (next_addr++) << 12;
+  live.emplace(addr, LiveAlloc{size, stream});
+  live_bytes += size;
+  entries.push_back(ReplayEntry{TraceEntry::ALLOC, addr, size, stream});
+  return addr;
+}
+
+void WorkloadBuilder::free(int64_t addr) {
+  auto it = live.find(addr);
+  if (it == live.end()) {
+    return;
+  }
+  entries.push_back(ReplayEntry{TraceEntry::FREE_REQUESTED, addr, it->second.size, it->second.stream});
+  live_bytes -= it->second.size;
+  live.erase(it);
+}
+
+void WorkloadBuilder::freeAll() {
+  std::vector<int64_t> addrs;
+  addrs.reserve(live.size());
+  for (const auto& kv : live) {
+    addrs.push_back(kv.first);
+  }
+  std::sort(addrs.begin(), addrs.end());
+  for (int64_t addr : addrs) {
+    free(addr);
+  }
+}
+
+std::vector<ReplayEntry> WorkloadBuilder::take() {
+  std::vector<ReplayEntry> result;
+  result.swap(entries);
+  return result;
+}
+
+std::vector<ReplayEntry> generateTransformerTraining(const TransformerTrainingOptions& o) {
+  WorkloadBuilder w;
+  std::mt19937_64 rng(o.seed);
+  std::uniform_real_distribution<double> jitter(-o.seq_jitter, o.seq_jitter);
+
+  const size_t h = o.hidden;
+  // qkv, attention projection, fc1, fc2
+  const std::vector<size_t> weight_elems = {3 * h * h, h * h, 4 * h * h, 4 * h * h};
+
+  std::vector<int64_t> weights, grads, optimizer_state;
+  for (size_t l = 0; l < o.layers; l++) {
+    for (size_t elems : weight_elems) {
+      weights.push_back(w.alloc(elems * o.dtype_bytes));
+    }
+  }
+
+  for (size_t step = 0; step < o.steps; step++) {
+    size_t seq = o.seq_len;
+    if (o.seq_jitter > 0.0) {
+      seq = round_up(static_cast<size_t>(o.seq_len * (1.0 + jitter(rng))), 8);
+      seq = std::max<size_t>(seq, 8);
+    }
+    const size_t act = o.batch * seq * h * o.dtype_bytes;
+    const size_t scores = o.batch * o.heads * seq * seq * o.dtype_bytes;
+
+    // Runs one layer forward. With save, everything backward needs is
+    // appended to saved; otherwise intermediates die with the layer.
+    auto forward_layer = [&](bool save, std::vector<int64_t>& saved) {
+      std::vector<int64_t> temps;
+      auto keep = [&](int64_t t) { (save ? saved : temps).push_back(t); };
+
+      keep(w.alloc(act));                 // ln1
+      keep(w.alloc(3 * act));             // qkv
+      int64_t s = w.alloc(scores);        // attention scores
+      keep(w.alloc(scores));              // softmax probs
+      w.free(s);
+      keep(w.alloc(act));                 // attention output
+      keep(w.alloc(act));                 // ln2
+      keep(w.alloc(4 * act));             // fc1
+      keep(w.alloc(4 * act));             // gelu
+      int64_t out = w.alloc(act);         // layer output
+
+      for (int64_t t : temps) {
+        w.free(t);
+      }
+      return out;
+    };
+
+    // forward
+    std::vector<std::vector<int64_t>> saved(o.layers);
+    std::vector<int64_t> layer_inputs(o.layers, 0);
+    int64_t x = w.alloc(act); // embeddings
+    for (size_t l = 0; l < o.layers; l++) {
+      const bool save_all = (o.checkpoint_every == 0);
+      const bool checkpoint = save_all || (l % o.checkpoint_every == 0);
+      int64_t out = forward_layer(save_all, saved[l]);
+      if (checkpoint) {
+        layer_inputs[l] = x;
+      } else {
+        w.free(x);
+      }
+      x = out;
+    }
+
+    // backward
+    int64_t gy = w.alloc(act); // loss gradient
+    w.free(x);
+    for (size_t l = o.layers; l-- > 0;) {
+      if (o.checkpoint_every > 0 && saved[l].empty()) {
+        // recompute the segment that ends at this layer
+        size_t seg_start = l - (l % o.checkpoint_every);
+        int64_t rx = layer_inputs[seg_start];
+        for (size_t r = seg_start; r <= l; r++) {
+          int64_t out = forward_layer(true, saved[r]);
+          if (r != seg_start) {
+            layer_inputs[r] = rx;
+          }
+          rx = out;
+        }
+        w.free(rx);
+      }
+
+      if (step == 0) {
+        for (size_t elems : weight_elems) {
+          grads.push_back(w.alloc(elems * o.dtype_bytes));
+        }
+      }
+
+      int64_t g_scores = w.alloc(scores);
+      int64_t g_fc1 = w.alloc(4 * act);
+      int64_t g_qkv = w.alloc(3 * act);
+      int64_t gx = w.alloc(act);
+      w.free(g_fc1);
+      w.free(g_qkv);
+      w.free(g_scores);
+
+      for (int64_t t : saved[l]) {
+        w.free(t);
+      }
+      saved[l].clear();
+      if (layer_inputs[l]) {
+        w.free(layer_inputs[l]);
+        layer_inputs[l] = 0;
+      }
+      w.free(gy);
+      gy = gx;
+    }
+    w.free(gy);
+
+    // Adam: fp32 exp_avg and exp_avg_sq, created by the first step
+    if (step == 0) {
+      for (size_t l = 0; l < o.layers; l++) {
+        for (size_t elems : weight_elems) {
+          optimizer_state.push_back(w.alloc(elems * 4));
+          optimizer_state.push_back(w.alloc(elems * 4));
+        }
+      }
+    }
+  }
+
+  w.freeAll();
+  return w.take();
+}
+
+std::vector<ReplayEntry> generateLLMInference(const LLMInferenceOptions& o) {
+  WorkloadBuilder w;
+  std::mt19937_64 rng(o.seed);
+  const size_t token_bytes = o.hidden * o.dtype_bytes;
+  const size_t grow = std::max<size_t>(1, o.kv_grow_tokens);
+
+  struct Request {
+    size_t len;
+    size_t target_len;
+    size_t capacity;
+    std::vector<int64_t> kv; // K and V per layer
+  };
+
+  std::deque<Request> pending;
+  for (size_t i = 0; i < o.requests; i++) {
+    Request r;
+    size_t prompt = lognormal_length(rng, o.prompt_len_mean, o.prompt_len_sigma, 1, o.max_seq_len - 1);
+    size_t output = lognormal_length(rng, o.output_len_mean, o.output_len_sigma, 1, o.max_seq_len - prompt);
+    r.len = prompt;
+    r.target_len = prompt + output;
+    r.capacity = 0;
+    pending.push_back(std::move(r));
+  }
+
+  std::vector<Request> active;
+  while (!pending.empty() || !active.empty()) {
+    // admit and prefill
+    while (active.size() < o.max_batch && !pending.empty()) {
+      Request r = std::move(pending.front());
+      pending.pop_front();
+
+      int64_t prefill = w.alloc(4 * r.len * token_bytes);
+      r.capacity = round_up(r.len, grow);
+      for (size_t l = 0; l < 2 * o.layers; l++) {
+        r.kv.push_back(w.alloc(r.capacity * token_bytes));
+      }
+      w.free(prefill);
+      active.push_back(std::move(r));
+    }
+
+    // one decode step for the whole batch
+    int64_t hidden = w.alloc(active.size() * token_bytes);
+    int64_t logits = w.alloc(active.size() * o.vocab * 4);
+    for (auto& r : active) {
+      r.len++;
+      if (r.len > r.capacity) {
+        r.capacity = round_up(r.len, grow);
+        for (auto& t : r.kv) {
+          // torch.cat: the grown cache exists before the old one dies
+          int64_t grown = w.alloc(r.capacity * token_bytes);
+          w.free(t);
+          t = grown;
+        }
+      }
+    }
+    w.free(logits);
+    w.free(hidden);
+
+    // retire finished requests
+    for (auto it = active.begin(); it != active.end();) {
+      if (it->len >= it->target_len) {
+        for (int64_t t : it->kv) {
+          w.free(t);
+        }
+        it = active.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  w.freeAll();
+  return w.take();
+}
+
+std::vector<ReplayEntry> generateMoETraining(const MoETrainingOptions& o) {
+  WorkloadBuilder w;
+  std::mt19937_64 rng(o.seed);
+  const size_t token_bytes = o.hidden * o.dtype_bytes;
+  const size_t ffn_token_bytes = o.ffn_hidden * o.dtype_bytes;
+
+  std::vector<double> popularity(o.experts);
+  for (size_t e = 0; e < o.experts; e++) {
+    popularity[e] = 1.0 / std::pow(static_cast<double>(e + 1), o.zipf_exponent);
+  }
+
+  // expert weights: up and down projections
+  std::vector<int64_t> weights;
+  for (size_t l = 0; l < o.layers; l++) {
+    for (size_t e = 0; e < o.experts; e++) {
+      weights.push_back(w.alloc(o.hidden * o.ffn_hidden * o.dtype_bytes));
+      weights.push_back(w.alloc(o.hidden * o.ffn_hidden * o.dtype_bytes));
+    }
+  }
+
+  // multinomial draw of tokens * top_k assignments over permuted popularity
+  auto route = [&]() {
+    std::vector<double> p = popularity;
+    std::shuffle(p.begin(), p.end(), rng);
+    double remaining_mass = std::accumulate(p.begin(), p.end(), 0.0);
+    size_t remaining = o.tokens * o.top_k;
+
+    std::vector<size_t> counts(o.experts, 0);
+    for (size_t e = 0; e < o.experts && remaining > 0; e++) {
+      double prob = (e + 1 == o.experts) ? 1.0 : std::min(1.0, p[e] / remaining_mass);
+      std::binomial_distribution<size_t> dist(remaining, prob);
+      counts[e] = dist(rng);
+      remaining -= counts[e];
+      remaining_mass -= p[e];
+    }
+    return counts;
+  };
+
+  struct ExpertSaved {
+    size_t count;
+    int64_t input;
+    int64_t hidden;
+  };
+
+  for (size_t step = 0; step < o.steps; step++) {
+    std::vector<std::vector<ExpertSaved>> saved(o.layers);
+    std::vector<int64_t> dense(o.layers);
+
+    int64_t x = w.alloc(o.tokens * token_bytes);
+    for (size_t l = 0; l < o.layers; l++) {
+      dense[l] = x;
+      int64_t router = w.alloc(o.tokens * o.experts * 4);
+      auto counts = route();
+      w.free(router);
+
+      std::vector<int64_t> outputs;
+      for (size_t e = 0; e < o.experts; e++) {
+        if (counts[e] == 0) {
+          continue;
+        }
+        ExpertSaved s{counts[e], w.alloc(counts[e] * token_bytes), w.alloc(counts[e] * ffn_token_bytes)};
+        outputs.push_back(w.alloc(counts[e] * token_bytes));
+        saved[l].push_back(s);
+      }
+      x = w.alloc(o.tokens * token_bytes); // combine
+      for (int64_t t : outputs) {
+        w.free(t);
+      }
+    }
+
+    int64_t gy = w.alloc(o.tokens * token_bytes);
+    w.free(x);
+    for (size_t l = o.layers; l-- > 0;) {
+      for (auto it = saved[l].rbegin(); it != saved[l].rend(); ++it) {
+        int64_t g_hidden = w.alloc(it->count * ffn_token_bytes);
+        int64_t g_input = w.alloc(it->count * token_bytes);
+        w.free(g_hidden);
+        w.free(g_input);
+        w.free(it->hidden);
+        w.free(it->input);
+      }
+      int64_t gx = w.alloc(o.tokens * token_bytes);
+      w.free(gy);
+      w.free(dense[l]);
+      gy = gx;
+    }
+    w.free(gy);
+  }
+
+  w.freeAll();
+  return w.take();
+}
+
+std::vector<ReplayEntry> generateDataPipeline(const DataPipelineOptions& o) {
+  WorkloadBuilder w;
+  std::mt19937_64 rng(o.seed);
+  std::uniform_int_distribution<size_t> batch_size(o.min_batch_bytes, o.max_batch_bytes);
+  std::uniform_real_distribution<double> split(0.1, 0.6);
+
+  // stream ids: 1..loader_streams load, then compute, then communication
+  const uint64_t compute_stream = o.loader_streams + 1;
+  const uint64_t comm_stream = o.loader_streams + 2;
+
+  std::deque<int64_t> staged;
+  size_t loaded = 0;
+  auto load_next = [&]() {
+    uint64_t stream = 1 + loaded % std::max<size_t>(1, o.loader_streams);
+    staged.push_back(w.alloc(round_up(batch_size(rng), 512), stream));
+    loaded++;
+  };
+
+  for (size_t b = 0; b < o.batches; b++) {
+    while (loaded < o.batches && staged.size() <= o.prefetch_depth) {
+      load_next();
+    }
+    int64_t batch = staged.front();
+    staged.pop_front();
+
+    // compute temporaries: a few differently sized pieces
+    size_t budget = static_cast<size_t>(o.compute_factor * o.max_batch_bytes * split(rng));
+    std::vector<int64_t> temps;
+    while (budget > 0) {
+      size_t piece = std::max<size_t>(512, static_cast<size_t>(budget * split(rng)));
+      piece = std::min(piece, budget);
+      temps.push_back(w.alloc(round_up(piece, 512), compute_stream));
+      budget -= piece;
+    }
+
+    std::vector<int64_t> buckets;
+    for (size_t i = 0; i < o.comm_buckets; i++) {
+      buckets.push_back(w.alloc(o.comm_bucket_bytes, comm_stream));
+    }
+
+    for (int64_t t : temps) {
+      w.free(t);
+    }
+    w.free(batch);
+    for (int64_t t : buckets) {
+      w.free(t);
+    }
+  }
+
+  w.freeAll();
+  return w.take();
+}
+
+bool generateWorkload(const std::string& name, uint64_t seed, std::vector<ReplayEntry>& trace) {
+  if (name == "transformer" || name == "transformer_ckpt") {
+    TransformerTrainingOptions options;
+    options.seed = seed;
+    options.seq_jitter = 0.25;
+    options.checkpoint_every = (name == "transformer_ckpt") ? 4 : 0;
+    trace = generateTransformerTraining(options);
+  } else if (name == "llm_inference") {
+    LLMInferenceOptions options;
+    options.seed = seed;
+    trace = generateLLMInference(options);
+  } else if (name == "moe") {
+    MoETrainingOptions options;
+    options.seed = seed;
+    trace = generateMoETraining(options);
+  } else if (name == "pipeline") {
+    DataPipelineOptions options;
+    options.seed = seed;
+    trace = generateDataPipeline(options);
+  } else {
+    return false;
+  }
+  return true;
+}
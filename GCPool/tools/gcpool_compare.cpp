@@ -0,0 +1,98 @@
+// Replays one allocation sequence through the native caching path and GCPool
+// stitching side by side.
+//
+//   gcpool_compare (<trace> | --workload NAME [--seed N]) [--interval N]
+//                  [--csv samples.csv] [--device-memory BYTES]
+//                  [--policy name:KEY=VALUE,...]...
+//
+// Without --policy the default pair native (vmmDefragment=0) and gcpool
+// (vmmDefragment=1) is compared. Each --policy adds a run with the given
+// environment, e.g. --policy frag256:vmmDefragment=1,fragLimit=268435456.
+
+#include "policy_compare.h"
+#include "workload_generator.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s (<trace> | --workload NAME [--seed N]) [--interval N] [--csv samples.csv] "
+          "[--device-memory BYTES] [--policy name:KEY=VALUE,...]...\n",
+          prog);
+}
+
+int main(int argc, char** argv) {
+  std::string trace_path;
+  std::string workload;
+  uint64_t seed = 0;
+  std::string csv_path;
+  ReplayOptions options;
+  size_t device_memory = 0;
+  std::vector<AllocatorPolicy> policies;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--workload") && i + 1 < argc) {
+      workload = argv[++i];
+    } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+      seed = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--interval") && i + 1 < argc) {
+      options.sample_interval = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--csv") && i + 1 < argc) {
+      csv_path = argv[++i];
+    } else if (!strcmp(argv[i], "--device-memory") && i + 1 < argc) {
+      device_memory = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--policy") && i + 1 < argc) {
+      AllocatorPolicy policy;
+      if (!parseAllocatorPolicy(argv[++i], policy)) {
+        fprintf(stderr, "bad policy %s\n", argv[i]);
+        return 1;
+      }
+      policies.push_back(policy);
+    } else if (argv[i][0] != '-' && trace_path.empty()) {
+      trace_path = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (trace_path.empty() == workload.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<ReplayEntry> trace;
+  if (!workload.empty()) {
+    if (!generateWorkload(workload, seed, trace)) {
+      fprintf(stderr, "unknown workload %s\n", workload.c_str());
+      return 1;
+    }
+  } else if (!loadTrace(trace_path, trace)) {
+    fprintf(stderr, "failed to read trace %s\n", trace_path.c_str());
+    return 1;
+  }
+
+  if (policies.empty()) {
+    policies = defaultComparePolicies();
+  }
+
+  auto runs = comparePolicies(trace, options, policies, device_memory);
+  printPolicyComparison(std::cout, runs);
+
+  if (!csv_path.empty()) {
+    std::ofstream csv(csv_path);
+    writePolicySamplesCsv(csv, runs);
+  }
+
+  for (const auto& run : runs) {
+    if (!run.ok) {
+      return 1;
+    }
+  }
+  return 0;
+}
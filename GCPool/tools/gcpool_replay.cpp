@@ -0,0 +1,82 @@
+// Replays a recorded allocation trace through GCPool.
+//
+//   gcpool_replay <trace> [--interval N] [--csv samples.csv] [--device-memory BYTES]
+//                 [--chrome-trace timeline.json]
+//
+// Runs on a GPU, or without one when built with GCPOOL_HOST_BACKEND; on a GPU
+// --device-memory caps the caching allocator instead of resizing the device.
+// The stitching knobs (vmmDefragment, fragLimit, reuseLimit, defragLevel,
+// autoGC) are read from the environment as usual, so policies are compared by
+// running the tool with different settings. --chrome-trace records the allocator timeline during the
+// replay and writes it for chrome://tracing or ui.perfetto.dev.
+
+#include "chrome_trace.h"
+#include "trace_replay.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s <trace> [--interval N] [--csv samples.csv] [--device-memory BYTES] "
+          "[--chrome-trace timeline.json]\n",
+          prog);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::string trace_path = argv[1];
+  std::string csv_path;
+  std::string chrome_trace_path;
+  ReplayOptions options;
+  size_t device_memory = 0;
+
+  for (int i = 2; i < argc; i++) {
+    if (!strcmp(argv[i], "--interval") && i + 1 < argc) {
+      options.sample_interval = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--csv") && i + 1 < argc) {
+      csv_path = argv[++i];
+    } else if (!strcmp(argv[i], "--device-memory") && i + 1 < argc) {
+      device_memory = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--chrome-trace") && i + 1 < argc) {
+      chrome_trace_path = argv[++i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<ReplayEntry> trace;
+  if (!loadTrace(trace_path, trace)) {
+    fprintf(stderr, "failed to read trace %s\n", trace_path.c_str());
+    return 1;
+  }
+
+  initReplayDevice(options.device, device_memory);
+  if (!chrome_trace_path.empty()) {
+    // every replayed entry leaves a trace entry and a malloc span, plus
+    // segment allocs and the spans of the slow paths
+    gcpool::recordHistory(true, nullptr, 4 * trace.size() + 1024, false);
+  }
+  ReplayReport report = replayTrace(trace, options);
+  printReplayReport(std::cout, report);
+
+  if (!csv_path.empty()) {
+    std::ofstream csv(csv_path);
+    writeReplaySamplesCsv(csv, report);
+  }
+
+  if (!chrome_trace_path.empty() && !dumpChromeTrace(chrome_trace_path, {options.device})) {
+    fprintf(stderr, "failed to write %s\n", chrome_trace_path.c_str());
+    return 1;
+  }
+  return 0;
+}
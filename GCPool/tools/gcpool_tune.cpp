@@ -0,0 +1,85 @@
+// Tunes fragLimit, reuseLimit, defragLevel and autoGC against a trace.
+//
+//   gcpool_tune (<trace> | --workload NAME [--seed N]) [--max-p99-ratio R]
+//               [--max-p99-ns NS] [--rounds N] [--device-memory BYTES]
+//               [--out gcpool.env]
+//
+// Prints every configuration tried and the one with the lowest peak reserved
+// memory whose malloc p99 stays within the budget; --out writes it as
+// "export KEY=VALUE" lines to source before starting the job.
+
+#include "policy_tuner.h"
+#include "workload_generator.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s (<trace> | --workload NAME [--seed N]) [--max-p99-ratio R] [--max-p99-ns NS] "
+          "[--rounds N] [--device-memory BYTES] [--out gcpool.env]\n",
+          prog);
+}
+
+int main(int argc, char** argv) {
+  std::string trace_path;
+  std::string workload;
+  uint64_t seed = 0;
+  std::string out_path;
+  TunerOptions options;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--workload") && i + 1 < argc) {
+      workload = argv[++i];
+    } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+      seed = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--max-p99-ratio") && i + 1 < argc) {
+      options.max_p99_ratio = std::atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--max-p99-ns") && i + 1 < argc) {
+      options.max_p99_ns = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--rounds") && i + 1 < argc) {
+      options.max_rounds = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--device-memory") && i + 1 < argc) {
+      options.device_memory = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+      out_path = argv[++i];
+    } else if (argv[i][0] != '-' && trace_path.empty()) {
+      trace_path = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (trace_path.empty() == workload.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<ReplayEntry> trace;
+  if (!workload.empty()) {
+    if (!generateWorkload(workload, seed, trace)) {
+      fprintf(stderr, "unknown workload %s\n", workload.c_str());
+      return 1;
+    }
+  } else if (!loadTrace(trace_path, trace)) {
+    fprintf(stderr, "failed to read trace %s\n", trace_path.c_str());
+    return 1;
+  }
+
+  TunerResult result = tuneAllocatorKnobs(trace, options);
+  printTunerResult(std::cout, result);
+  if (!result.ok) {
+    return 1;
+  }
+
+  if (!out_path.empty()) {
+    std::ofstream out(out_path);
+    writeTunerConfig(out, result);
+  }
+  return 0;
+}
@@ -0,0 +1,80 @@
+// Generates a synthetic allocation workload and saves it or replays it.
+//
+//   gcpool_workload <name> [--seed N] [--out trace.txt] [--interval N]
+//                   [--csv samples.csv] [--device-memory BYTES]
+//
+// name is one of transformer, transformer_ckpt, llm_inference, moe, pipeline.
+// With --out the trace is written in the gcpool_replay format and nothing is
+// replayed; otherwise it is fed straight through the allocator.
+
+#include "workload_generator.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s <transformer|transformer_ckpt|llm_inference|moe|pipeline> [--seed N] "
+          "[--out trace.txt] [--interval N] [--csv samples.csv] [--device-memory BYTES]\n",
+          prog);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::string name = argv[1];
+  uint64_t seed = 0;
+  std::string out_path;
+  std::string csv_path;
+  ReplayOptions options;
+  size_t device_memory = 0;
+
+  for (int i = 2; i < argc; i++) {
+    if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+      seed = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+      out_path = argv[++i];
+    } else if (!strcmp(argv[i], "--interval") && i + 1 < argc) {
+      options.sample_interval = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--csv") && i + 1 < argc) {
+      csv_path = argv[++i];
+    } else if (!strcmp(argv[i], "--device-memory") && i + 1 < argc) {
+      device_memory = std::strtoull(argv[++i], nullptr, 10);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<ReplayEntry> trace;
+  if (!generateWorkload(name, seed, trace)) {
+    fprintf(stderr, "unknown workload %s\n", name.c_str());
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (!out_path.empty()) {
+    if (!saveTrace(out_path, trace)) {
+      fprintf(stderr, "failed to write %s\n", out_path.c_str());
+      return 1;
+    }
+    return 0;
+  }
+
+  initReplayDevice(options.device, device_memory);
+  ReplayReport report = replayTrace(trace, options);
+  printReplayReport(std::cout, report);
+
+  if (!csv_path.empty()) {
+    std::ofstream csv(csv_path);
+    writeReplaySamplesCsv(csv, report);
+  }
+  return 0;
+}
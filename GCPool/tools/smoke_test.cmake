@@ -0,0 +1,11 @@
+# Runs by ctest: gcpool_workload writes a trace, gcpool_replay replays it.
+execute_process(COMMAND ${WORKLOAD} transformer --seed 1 --out ${TRACE}
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "gcpool_workload failed: ${result}")
+endif()
+execute_process(COMMAND ${REPLAY} ${TRACE} --interval 1000
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "gcpool_replay failed: ${result}")
+endif()